@@ -0,0 +1,97 @@
+#!/usr/bin/perl
+# Converts dircproxy internal log files between the text and binary formats.
+#
+# To use, stop dircproxy (or detach and wait for it to close the log) and
+# run:
+#   logconv.pl --to-binary < channel.log > channel.log.new
+#   logconv.pl --to-text < channel.log > channel.log.new
+#
+# then move the new file into place and set log_format to match.
+#
+
+use vars qw/@events %codes/;
+use strict;
+
+# Event names, in order of their code in the binary format
+@events = qw/message notice action ctcp join part kick quit nick mode topic
+             client server error/;
+
+
+#------------------------------------------------------------------------------#
+
+# Text lines are:
+#   <time> <event> <destination> <source> <text>
+#
+# Binary records are:
+#   varint time, byte event code, then destination, source and text each as
+#   a varint length followed by the bytes
+
+for (my $i = 0; $i < @events; $i++) {
+  $codes{$events[$i]} = $i;
+}
+
+my $mode = shift @ARGV || '';
+binmode STDIN;
+binmode STDOUT;
+
+if ($mode eq '--to-binary') {
+  while (<STDIN>) {
+    chomp;
+    my ($when, $event, $dest, $from, $text) = split / /, $_, 5;
+    next unless defined $text;
+
+    my $code = exists $codes{$event} ? $codes{$event} : 16;
+    print putvarint($when), chr($code);
+    foreach my $str ($dest, $from, $text) {
+      print putvarint(length($str)), $str;
+    }
+  }
+
+} elsif ($mode eq '--to-text') {
+  while (defined(my $when = getvarint())) {
+    my $code = getc(STDIN);
+    last unless defined $code;
+    $code = ord($code);
+
+    my @str;
+    for (1..3) {
+      my $len = getvarint();
+      die "Truncated record\n" unless defined $len;
+
+      my $str = '';
+      die "Truncated record\n" if $len && read(STDIN, $str, $len) != $len;
+      push @str, $str;
+    }
+
+    my $event = $code < @events ? $events[$code] : 'none';
+    print join(' ', $when, $event, @str), "\n";
+  }
+
+} else {
+  die "Usage: $0 --to-binary|--to-text < input > output\n";
+}
+
+# Encode a number as a little-endian base-128 varint
+sub putvarint {
+  my $val = shift;
+  my $out = '';
+
+  while ($val >= 0x80) {
+    $out .= chr(($val & 0x7f) | 0x80);
+    $val >>= 7;
+  }
+  return $out . chr($val);
+}
+
+# Read a varint from standard input, undef at the end of the file
+sub getvarint {
+  my ($val, $shift) = (0, 0);
+
+  while (defined(my $c = getc(STDIN))) {
+    $c = ord($c);
+    $val |= ($c & 0x7f) << $shift;
+    return $val unless $c & 0x80;
+    $shift += 7;
+  }
+  return undef;
+}
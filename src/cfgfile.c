@@ -27,6 +27,7 @@
 #include "sprintf.h"
 #include "cfgfile.h"
 #include "irc_log.h"
+#include "irc_logdb.h"
 
 /* forward declaration */
 static int _cfg_read_bool(char **, int *);
@@ -46,7 +47,7 @@ static int _cfg_read_pair(char **, long **);
 int cfg_read(const char *filename, char **listen_port, char **pid_file,
              struct globalvars *globals) {
   struct ircconnclass defaults, *def, *class;
-  int valid;
+  int valid, nclasses;
   long line;
   FILE *fd;
 
@@ -54,6 +55,7 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
   memset(globals, 0, sizeof(struct globalvars));
   memset(def, 0, sizeof(struct ircconnclass));
   class = 0;
+  nclasses = 0;
   line = 0;
   valid = 1;
   fd = fopen(filename, "r");
@@ -62,14 +64,23 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
 
   /* Initialise globals */
   globals->client_timeout = DEFAULT_CLIENT_TIMEOUT;
+  globals->client_lookup = DEFAULT_CLIENT_LOOKUP;
   globals->connect_timeout = DEFAULT_CONNECT_TIMEOUT;
   globals->dns_timeout = DEFAULT_DNS_TIMEOUT;
+  globals->dns_cache_size = DEFAULT_DNS_CACHE_SIZE;
+  globals->dns_cache_negative = DEFAULT_DNS_CACHE_NEGATIVE;
+  globals->dns_threads = DEFAULT_DNS_THREADS;
+  globals->dns_queue_max = DEFAULT_DNS_QUEUE_MAX;
+  globals->server_connect_gap = DEFAULT_SERVER_CONNECT_GAP;
 
   /* Initialise using defaults */
   def->server_port = x_strdup(DEFAULT_SERVER_PORT ? DEFAULT_SERVER_PORT : "0");
   def->server_retry = DEFAULT_SERVER_RETRY;
+  def->server_retry_max = DEFAULT_SERVER_RETRY_MAX;
+  def->server_retry_jitter = DEFAULT_SERVER_RETRY_JITTER;
   def->server_maxattempts = DEFAULT_SERVER_MAXATTEMPTS;
   def->server_maxinitattempts = DEFAULT_SERVER_MAXINITATTEMPTS;
+  def->server_attempt_delay = DEFAULT_SERVER_ATTEMPT_DELAY;
   def->server_keepalive = DEFAULT_SERVER_KEEPALIVE;
   def->server_pingtimeout = DEFAULT_SERVER_PINGTIMEOUT;
   if (DEFAULT_SERVER_THROTTLE_BYTES || DEFAULT_SERVER_THROTTLE_PERIOD) {
@@ -108,8 +119,19 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
   def->log_relativetime = DEFAULT_LOG_RELATIVETIME;
   def->log_timeoffset = DEFAULT_LOG_TIMEOFFSET;
   def->log_events = DEFAULT_LOG_EVENTS;
+  def->log_digest = DEFAULT_LOG_DIGEST;
+  def->log_recall_unread = DEFAULT_LOG_RECALL_UNREAD;
   def->log_dir = (DEFAULT_LOG_DIR ? x_strdup(DEFAULT_LOG_DIR) : 0);
+  def->log_dir_maxsize = DEFAULT_LOG_DIR_MAXSIZE;
+  def->log_dir_daily = DEFAULT_LOG_DIR_DAILY;
+  def->log_dir_keep = DEFAULT_LOG_DIR_KEEP;
+  def->log_dir_compress = (DEFAULT_LOG_DIR_COMPRESS
+                           ? x_strdup(DEFAULT_LOG_DIR_COMPRESS) : 0);
   def->log_program = (DEFAULT_LOG_PROGRAM ? x_strdup(DEFAULT_LOG_PROGRAM) : 0);
+  def->log_format = DEFAULT_LOG_FORMAT;
+  def->log_state_dir = (DEFAULT_LOG_STATE_DIR
+                        ? x_strdup(DEFAULT_LOG_STATE_DIR) : 0);
+  def->log_compress_size = DEFAULT_LOG_COMPRESS_SIZE;
   def->chan_log_enabled = DEFAULT_CHAN_LOG_ENABLED;
   def->chan_log_always = DEFAULT_CHAN_LOG_ALWAYS;
   def->chan_log_maxsize = DEFAULT_CHAN_LOG_MAXSIZE;
@@ -259,6 +281,11 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         /* client_timeout 60 */
         _cfg_read_numeric(&buf, &globals->client_timeout);
 
+      } else if (!class && !strcasecmp(key, "client_lookup")) {
+        /* client_lookup yes
+           client_lookup no */
+        _cfg_read_bool(&buf, &globals->client_lookup);
+
       } else if (!class && !strcasecmp(key, "connect_timeout")) {
         /* connect_timeout 60 */
         _cfg_read_numeric(&buf, &globals->connect_timeout);
@@ -267,6 +294,26 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         /* dns_timeout 60 */
         _cfg_read_numeric(&buf, &globals->dns_timeout);
 
+      } else if (!class && !strcasecmp(key, "dns_cache_size")) {
+        /* dns_cache_size 256 */
+        _cfg_read_numeric(&buf, &globals->dns_cache_size);
+
+      } else if (!class && !strcasecmp(key, "dns_cache_negative")) {
+        /* dns_cache_negative 60 */
+        _cfg_read_numeric(&buf, &globals->dns_cache_negative);
+
+      } else if (!class && !strcasecmp(key, "dns_threads")) {
+        /* dns_threads 4 */
+        _cfg_read_numeric(&buf, &globals->dns_threads);
+
+      } else if (!class && !strcasecmp(key, "dns_queue_max")) {
+        /* dns_queue_max 64 */
+        _cfg_read_numeric(&buf, &globals->dns_queue_max);
+
+      } else if (!class && !strcasecmp(key, "server_connect_gap")) {
+        /* server_connect_gap 500 */
+        _cfg_read_numeric(&buf, &globals->server_connect_gap);
+
       } else if (!strcasecmp(key, "server_port")) {
         /* server_port 6667
            server_port "irc"    # From /etc/services */
@@ -282,6 +329,14 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         /* server_retry 15 */
         _cfg_read_numeric(&buf, &(class ? class : def)->server_retry);
 
+      } else if (!strcasecmp(key, "server_retry_max")) {
+        /* server_retry_max 300 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->server_retry_max);
+
+      } else if (!strcasecmp(key, "server_retry_jitter")) {
+        /* server_retry_jitter 20 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->server_retry_jitter);
+
       } else if (!strcasecmp(key, "server_maxattempts")) {
         /* server_maxattempts 0 */
         _cfg_read_numeric(&buf, &(class ? class : def)->server_maxattempts);
@@ -290,6 +345,10 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         /* server_maxinitattempts 5 */
         _cfg_read_numeric(&buf, &(class ? class : def)->server_maxinitattempts);
 
+      } else if (!strcasecmp(key, "server_attempt_delay")) {
+        /* server_attempt_delay 250 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->server_attempt_delay);
+
       } else if (!strcasecmp(key, "server_keepalive")) {
         /* server_keepalive yes
            server_keepalive no */
@@ -632,6 +691,16 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         if (!valid)
           break;
 
+      } else if (!strcasecmp(key, "log_digest")) {
+        /* log_digest yes
+           log_digest no */
+        _cfg_read_bool(&buf, &(class ? class : def)->log_digest);
+
+      } else if (!strcasecmp(key, "log_recall_unread")) {
+        /* log_recall_unread yes
+           log_recall_unread no */
+        _cfg_read_bool(&buf, &(class ? class : def)->log_recall_unread);
+
       } else if (!strcasecmp(key, "log_dir")) {
         /* log_dir none
            log_dir ""    # same as none
@@ -665,6 +734,54 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         free((class ? class : def)->log_dir);
         (class ? class : def)->log_dir = str;
 
+      } else if (!strcasecmp(key, "log_dir_maxsize")) {
+        /* log_dir_maxsize 1024
+           log_dir_maxsize 0 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->log_dir_maxsize);
+
+      } else if (!strcasecmp(key, "log_dir_daily")) {
+        /* log_dir_daily yes
+           log_dir_daily no */
+        _cfg_read_bool(&buf, &(class ? class : def)->log_dir_daily);
+
+      } else if (!strcasecmp(key, "log_dir_keep")) {
+        /* log_dir_keep 7
+           log_dir_keep 0 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->log_dir_keep);
+
+      } else if (!strcasecmp(key, "log_dir_compress")) {
+        /* log_dir_compress none
+           log_dir_compress ""    # same as none
+           log_dir_compress "gzip"
+           log_dir_compress "~/bin/squash" */
+        char *str;
+
+        if (_cfg_read_string(&buf, &str))
+          UNMATCHED_QUOTE;
+
+        if (!strcasecmp(str, "none") || !strlen(str)) {
+          free(str);
+          str = 0;
+
+        } else if (!strncmp(str, "~/", 2)) {
+          char *home;
+
+          home = getenv("HOME");
+          if (home) {
+            char *tmp;
+
+            tmp = x_sprintf("%s%s", home, str + 1);
+            free(str);
+            str = tmp;
+          } else {
+            /* Best we can do */
+            *str = '.';
+          }
+        }
+
+        free((class ? class : def)->log_dir_compress);
+        (class ? class : def)->log_dir_compress = str;
+
       } else if (!strcasecmp(key, "log_program")) {
         /* log_program none
            log_program ""    # same as none
@@ -698,6 +815,74 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         free((class ? class : def)->log_program);
         (class ? class : def)->log_program = str;
 
+      } else if (!strcasecmp(key, "log_format")) {
+        /* log_format text
+           log_format binary
+           log_format sqlite */
+        char *str;
+
+        if (_cfg_read_string(&buf, &str))
+          UNMATCHED_QUOTE;
+
+        if (!strcasecmp(str, "text")) {
+          (class ? class : def)->log_format = IRC_LOGFORMAT_TEXT;
+        } else if (!strcasecmp(str, "binary")) {
+          (class ? class : def)->log_format = IRC_LOGFORMAT_BINARY;
+        } else if (!strcasecmp(str, "sqlite") && logdb_available()) {
+          (class ? class : def)->log_format = IRC_LOGFORMAT_SQLITE;
+        } else if (!strcasecmp(str, "sqlite")) {
+          error("Log format 'sqlite' in 'log_format' at line %ld of %s "
+                "needs dircproxy to be built with SQLite", line, filename);
+          free(str);
+          valid = 0;
+          break;
+        } else {
+          error("Unknown log format '%s' in 'log_format' at line %ld of %s",
+                str, line, filename);
+          free(str);
+          valid = 0;
+          break;
+        }
+        free(str);
+
+      } else if (!strcasecmp(key, "log_state_dir")) {
+        /* log_state_dir none
+           log_state_dir ""    # same as none
+           log_state_dir "/var/lib/dircproxy"
+           log_state_dir "~/.dircproxy/logs" */
+        char *str;
+
+        if (_cfg_read_string(&buf, &str))
+          UNMATCHED_QUOTE;
+
+        if (!strcasecmp(str, "none") || !strlen(str)) {
+          free(str);
+          str = 0;
+
+        } else if (!strncmp(str, "~/", 2)) {
+          char *home;
+
+          home = getenv("HOME");
+          if (home) {
+            char *tmp;
+
+            tmp = x_sprintf("%s%s", home, str + 1);
+            free(str);
+            str = tmp;
+          } else {
+            /* Best we can do */
+            *str = '.';
+          }
+        }
+
+        free((class ? class : def)->log_state_dir);
+        (class ? class : def)->log_state_dir = str;
+
+      } else if (!strcasecmp(key, "log_compress_size")) {
+        /* log_compress_size 1024
+           log_compress_size 0 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->log_compress_size);
+
       } else if (!strcasecmp(key, "chan_log_enabled")) {
         /* chan_log_enabled yes
            chan_log_disabled no */
@@ -1069,6 +1254,7 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         /* Allocate memory, it'll be filled later */
         class = (struct ircconnclass *)malloc(sizeof(struct ircconnclass));
         memcpy(class, def, sizeof(struct ircconnclass));
+        nclasses++;
         class->server_port = (def->server_port
                               ? x_strdup(def->server_port) : 0);
         if (def->server_throttle) {
@@ -1095,8 +1281,12 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         class->detach_nickname = (def->detach_nickname
                                   ? x_strdup(def->detach_nickname) : 0);
         class->log_dir = (def->log_dir ? x_strdup(def->log_dir) : 0);
+        class->log_dir_compress = (def->log_dir_compress
+                                   ? x_strdup(def->log_dir_compress) : 0);
         class->log_program = (def->log_program 
                               ? x_strdup(def->log_program) : 0);
+        class->log_state_dir = (def->log_state_dir
+                                ? x_strdup(def->log_state_dir) : 0);
         if (def->dcc_proxy_ports) {
           class->dcc_proxy_ports = (int *)malloc(sizeof(int)
                                                  * def->dcc_proxy_ports_sz);
@@ -1114,6 +1304,29 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
                               ? x_strdup(def->switch_user) : 0);
         class->motd_file = (def->motd_file ? x_strdup(def->motd_file) : 0);
 
+      } else if (class && !strcasecmp(key, "name")) {
+        /* connection {
+             :
+             name "foo"
+             :
+           } */
+        char *str;
+
+        if (_cfg_read_string(&buf, &str))
+          UNMATCHED_QUOTE;
+
+        /* It names a directory, so it can't go anywhere else */
+        if (!strlen(str) || (*str == '.') || strchr(str, '/')) {
+          error("Bad connection class name '%s' at line %ld of %s",
+                str, line, filename);
+          free(str);
+          valid = 0;
+          break;
+        }
+
+        free(class->name);
+        class->name = str;
+
       } else if (class && !strcasecmp(key, "password")) {
         /* connection {
              :
@@ -1244,6 +1457,26 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
           error("Connection class defined without a server "
                 "before line %ld of %s", line, filename);
           valid = 0;
+        } else if (!class->name && class->log_state_dir) {
+          /* Unnamed classes are known by their number, but that changes if
+             they're reordered, so it can't pick a state directory */
+          error("Connection class with a log_state_dir needs a name "
+                "before line %ld of %s", line, filename);
+          valid = 0;
+        } else {
+          struct ircconnclass *c;
+
+          if (!class->name)
+            class->name = x_sprintf("%d", nclasses);
+
+          for (c = connclasses; c; c = c->next) {
+            if (!strcmp(c->name, class->name)) {
+              error("Connection class name '%s' used twice "
+                    "before line %ld of %s", class->name, line, filename);
+              valid = 0;
+              break;
+            }
+          }
         }
 
         /* Add to the list of servers if valid, otherwise free it */
@@ -1302,7 +1535,9 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
   free(def->detach_message);
   free(def->detach_nickname);
   free(def->log_dir);
+  free(def->log_dir_compress);
   free(def->log_program);
+  free(def->log_state_dir);
   free(def->dcc_proxy_ports);
   free(def->dcc_capture_directory);
   free(def->dcc_tunnel_incoming);
@@ -35,6 +35,7 @@
 #include "net.h"
 #include "dns.h"
 #include "timers.h"
+#include "diskio.h"
 #include "sprintf.h"
 #include "stringex.h"
 #include "dcc_chat.h"
@@ -65,6 +66,7 @@ int dccnet_new(int type, long timeout, int *range, size_t range_sz,
   memset(p, 0, sizeof(struct dccproxy));
   p->type = type;
   p->bytes_rcvd = resume_from;
+  p->cap_fd = -1;
   /* If we're capturing, we do not need to listen for the client connecting
      because its not going to! */
   if (p->type & DCC_SEND_CAPTURE) {
@@ -79,9 +81,9 @@ int dccnet_new(int type, long timeout, int *range, size_t range_sz,
      }
 
     /* Open for writing */
-    p->cap_file = fopen(filename, "a");
-    if (!p->cap_file) {
-      syscall_fail("fopen", filename, 0);
+    p->cap_fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (p->cap_fd == -1) {
+      syscall_fail("open", filename, 0);
       free(p);
       return -1;
     }
@@ -91,7 +93,7 @@ int dccnet_new(int type, long timeout, int *range, size_t range_sz,
 
     /* Connect to the sender */
     if (_dccnet_connect(p, addr, port, range, range_sz, lport)) {
-      fclose(p->cap_file);
+      close(p->cap_fd);
       free(p->cap_filename);
       free(p);
       return -1;
@@ -121,7 +123,9 @@ int dccnet_new(int type, long timeout, int *range, size_t range_sz,
   p->next = proxies;
   proxies = p;
 
-  timer_new((void *)p, "timeout", timeout, TIMER_FUNCTION(_dccnet_timedout), 0);
+  timer_set(&(p->timeout_timer), (void *)p, "dcc_timeout",
+            TIMER_SECONDS(timeout),
+            TIMER_FUNCTION(_dccnet_timedout), 0);
 
   return 0;
 }
@@ -348,8 +352,8 @@ static void _dccnet_free(struct dccproxy *p) {
     unlink(p->cap_filename);
     free(p->cap_filename);
   }
-  if (p->cap_file)
-    fclose(p->cap_file);
+  if (p->cap_fd != -1)
+    diskio_close(p->cap_fd);
   free(p->notify_msg);
   free(p->buf);
 
@@ -24,6 +24,8 @@
 #include <arpa/inet.h>
 #include <time.h>
 
+#include "timers.h"
+
 /* Always included after dircproxy.h, so we can do this here. */
 #ifdef HAVE_INTTYPES_H
 #include <inttypes.h>
@@ -36,6 +38,7 @@ struct dccproxy {
   int dead;
   int type;
   time_t start;
+  struct timer *timeout_timer;
 
   int sender_sock;
   int sender_status;
@@ -56,7 +59,7 @@ struct dccproxy {
 
   /* DCC SEND (Capture) only */
   char *cap_filename;
-  FILE *cap_file;
+  int cap_fd;
   uint32_t bytes_max;
 
   struct dccproxy *next;
@@ -26,6 +26,7 @@
 #include "net.h"
 #include "dns.h"
 #include "timers.h"
+#include "diskio.h"
 #include "dcc_net.h"
 #include "dcc_send.h"
 
@@ -132,13 +133,12 @@ static void _dccsend_data(struct dccproxy *p, int sock) {
                    (p->bytes_ackd >= p->bytes_sent))) {
     /* Capturing?  Just eat the buffer right here, right now */
     if (p->type & DCC_SEND_CAPTURE) {
-      /* Write it to the file */
-      fwrite((void *)p->buf, 1, p->bufsz, p->cap_file);
+      /* Hand the buffer over to be written to the file */
+      diskio_write(p->cap_fd, p->buf, p->bufsz);
 
       /* Sent the whole thing */
       p->bytes_sent += p->bufsz;
       p->bufsz = 0;
-      free(p->buf);
       p->buf = 0;
 
       /* Check we haven't exceeded the maximum size */
@@ -191,9 +191,9 @@ static void _dccsend_error(struct dccproxy *p, int sock, int bad) {
     if (p->type & DCC_SEND_CAPTURE) {
       debug("%s closed", p->cap_filename);
       free(p->cap_filename);
-      fclose(p->cap_file);
+      diskio_close(p->cap_fd);
       p->cap_filename = 0;
-      p->cap_file = 0;
+      p->cap_fd = -1;
     }
   }
 }
@@ -60,6 +60,14 @@
  */
 #define NET_LINGER_TIME 5
 
+/* SERVER_HEARTBEAT_TICK
+ * Each proxied connection's pings, stoned server checks and anti-idle
+ * messages are done together by one timer.  It's triggered on a whole
+ * multiple of this many milliseconds, so that the timers of all the
+ * connections are triggered together rather than spread out.
+ */
+#define SERVER_HEARTBEAT_TICK 1000
+
 /* DCC_BLOCK_SIZE
  * Size of the block we use when DCC proxying.  Should never really need to
  * change it, as its not strictly honored anyway.
@@ -131,6 +139,15 @@
  */
 #define DEFAULT_CLIENT_TIMEOUT 60
 
+/* DEFAULT_CLIENT_LOOKUP
+ * Look up the hostname of clients connecting to the listening port?  This
+ * is only done when a connection class has a 'from' hostname to match, and
+ * clients that can be told apart by their address aren't kept waiting.
+ *  1 = Yes
+ *  0 = No, only match 'from' against their address
+ */
+#define DEFAULT_CLIENT_LOOKUP 1
+
 /* DEFAULT_CONNECT_TIMEOUT
  * Maxmimum amount of time (in seconds) to allow a client to choose the
  * server to connect to if server_autoconnect is no.  This starts counting
@@ -143,6 +160,55 @@
  */
 #define DEFAULT_DNS_TIMEOUT 20
 
+/* DEFAULT_DNS_CACHE_SIZE
+ * Number of DNS answers to remember, for as long as the nameserver said
+ * they can be kept.  The least recently used are forgotten first.
+ * 0 = don't remember answers
+ */
+#define DEFAULT_DNS_CACHE_SIZE 256
+
+/* DEFAULT_DNS_CACHE_NEGATIVE
+ * Amount of time (in seconds) to remember that a name or address doesn't
+ * exist, if the nameserver doesn't say.
+ */
+#define DEFAULT_DNS_CACHE_NEGATIVE 60
+
+/* DEFAULT_DNS_THREADS
+ * Number of threads to hand DNS lookups to, which use the system resolver
+ * library rather than asking the nameservers ourselves.
+ * 0 = don't use threads
+ */
+#define DEFAULT_DNS_THREADS 0
+
+/* DEFAULT_DNS_QUEUE_MAX
+ * Most DNS lookups that can be waiting for a thread, any more fail.
+ * 0 = no limit
+ */
+#define DEFAULT_DNS_QUEUE_MAX 64
+
+/* DNS_RESOLV_CONF
+ * Resolver configuration file listing the nameservers to ask and the
+ * domains to search.  The resolver tests give their own.
+ */
+#ifndef DNS_RESOLV_CONF
+#define DNS_RESOLV_CONF "/etc/resolv.conf"
+#endif /* DNS_RESOLV_CONF */
+
+/* DNS_HOSTS_FILE
+ * File of names to look up without asking a nameserver.
+ */
+#ifndef DNS_HOSTS_FILE
+#define DNS_HOSTS_FILE "/etc/hosts"
+#endif /* DNS_HOSTS_FILE */
+
+/* DEFAULT_SERVER_CONNECT_GAP
+ * Least amount of time (in milliseconds) to leave between connection
+ * attempts to the same server host, by all the proxied connections
+ * together.
+ * 0 = no limit
+ */
+#define DEFAULT_SERVER_CONNECT_GAP 500
+
 /* DEFAULT_SERVER_PORT
  * What port do we connect to IRC servers on if the server string doesn't
  * explicitly set one
@@ -155,6 +221,18 @@
  */
 #define DEFAULT_SERVER_RETRY 15
 
+/* DEFAULT_SERVER_RETRY_MAX
+ * Each connection attempt that fails doubles the time waited before the
+ * next, up to this many seconds.
+ */
+#define DEFAULT_SERVER_RETRY_MAX 300
+
+/* DEFAULT_SERVER_RETRY_JITTER
+ * How far (as a percentage) to randomly move each retry either way, so
+ * proxied connections that lost the same server don't all retry together.
+ */
+#define DEFAULT_SERVER_RETRY_JITTER 20
+
 /* DEFAULT_SERVER_MAXATTEMPTS
  * If we are disconnected from the server, how many times should we iterate
  * the server list before giving up and declaring the proxied connection
@@ -170,6 +248,14 @@
  */
 #define DEFAULT_SERVER_MAXINITATTEMPTS 5
 
+/* DEFAULT_SERVER_ATTEMPT_DELAY
+ * When a server has more than one address, how long (in milliseconds) to
+ * wait for a connection to one before also trying the next.  The first to
+ * connect is used.
+ * 0 = try each address only after the last has failed
+ */
+#define DEFAULT_SERVER_ATTEMPT_DELAY 250
+
 /* DEFAULT_SERVER_KEEPALIVE
  * Set the SO_KEEPALIVE socket option?
  *  1 = Yes
@@ -347,6 +433,22 @@
  */
 #define DEFAULT_LOG_EVENTS 0xffff
 
+/* DEFAULT_LOG_DIGEST
+ * Whether joins, parts, quits, nick and mode changes logged while detached
+ * are summarised when recalled on attach, rather than recalled in full.
+ * 1 = Yes
+ * 0 = No
+ */
+#define DEFAULT_LOG_DIGEST 0
+
+/* DEFAULT_LOG_RECALL_UNREAD
+ * Whether lines the client already saw before it detached are left out
+ * when recalling on attach.
+ * 1 = Yes
+ * 0 = No
+ */
+#define DEFAULT_LOG_RECALL_UNREAD 0
+
 /* DEFAULT_LOG_DIR
  * Directory to store user's log files in.
  * 0 = don't do this
@@ -359,6 +461,50 @@
  */
 #define DEFAULT_LOG_PROGRAM 0
 
+/* DEFAULT_LOG_DIR_MAXSIZE
+ * Size in kilobytes a file in log_dir may reach before it's rotated.
+ * 0 = No limit
+ */
+#define DEFAULT_LOG_DIR_MAXSIZE 0
+
+/* DEFAULT_LOG_DIR_DAILY
+ * Whether to rotate the files in log_dir when the day changes.
+ * 1 = Yes
+ * 0 = No
+ */
+#define DEFAULT_LOG_DIR_DAILY 0
+
+/* DEFAULT_LOG_DIR_KEEP
+ * Number of rotated files to keep for each file in log_dir.
+ * 0 = Keep them all
+ */
+#define DEFAULT_LOG_DIR_KEEP 0
+
+/* DEFAULT_LOG_DIR_COMPRESS
+ * Program to compress the rotated files in log_dir with.
+ * 0 = don't do this
+ */
+#define DEFAULT_LOG_DIR_COMPRESS 0
+
+/* DEFAULT_LOG_STATE_DIR
+ * Directory to keep the internal log files in, so they survive restarts.
+ * 0 = use a temporary directory
+ */
+#define DEFAULT_LOG_STATE_DIR 0
+
+/* DEFAULT_LOG_COMPRESS_SIZE
+ * Size in kilobytes the uncompressed end of an internal log file with no
+ * maximum size may reach before it's compressed.
+ * 0 = Don't compress them
+ */
+#define DEFAULT_LOG_COMPRESS_SIZE 0
+
+/* DEFAULT_LOG_FORMAT
+ * Format of the internal log files used for recall.
+ * 0 = text, 1 = binary
+ */
+#define DEFAULT_LOG_FORMAT 0
+
 /* DEFAULT_CHAN_LOG_ENABLED
  * Whether to log channel text
  * 1 = Yes
@@ -624,8 +770,14 @@
 /* Global variables */
 struct globalvars {
   long client_timeout;
+  int client_lookup;
   long connect_timeout;
   long dns_timeout;
+  long dns_cache_size;
+  long dns_cache_negative;
+  long dns_threads;
+  long dns_queue_max;
+  long server_connect_gap;
 };
 
 /* global variables */
@@ -0,0 +1,744 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ *
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ *
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ *
+ *
+ * diskio.c
+ *  - Background thread that writes user log files and DCC captures
+ *  - Queueing writes for it and collecting the results
+ * --
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include "dircproxy.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif /* HAVE_PTHREAD */
+
+#include "sprintf.h"
+
+#include "diskio.h"
+
+
+/* Kinds of request */
+#define DISKIO_APPEND 0		/* Append to a named regular file */
+#define DISKIO_WRITE  1		/* Write to an open descriptor */
+#define DISKIO_CLOSE  2		/* Close an open descriptor */
+
+/* Requests that wait longer than this (usec) in the queue get mentioned */
+#define DISKIO_SLOW 1000000
+
+/* Room after a filename for the suffix given to a rotated copy; that's
+ * the ".YYYYMMDD-HHMMSS" stamp, and a "-N" if there's more than one */
+#define DISKIO_SUFFIXLEN 32
+#define DISKIO_STAMPLEN  16
+
+
+/* A queued write.  Everything in here is allocated and freed by the main
+ * thread; the I/O thread only makes system calls and fills in the results.
+ */
+typedef struct _diskio_req {
+	int		    op;
+	int		    fd;
+	char		   *filename;
+	char		   *data;
+	size_t		    len;
+
+	struct diskio_rotate rotate;	/* compress is our own copy */
+	char		   *dirname;	/* Directory the file is in */
+	const char	   *basename;	/* Name of the file within it */
+	char		   *rotated;	/* Name it was rotated to, if it was */
+
+	struct timeval	    queued;	/* When it entered the queue */
+	unsigned long	    wait;	/* How long it stayed there (usec) */
+
+	const char	   *func;	/* System call that failed, if any */
+	int		    error;
+
+	struct _diskio_req *next;
+} DiskReq;
+
+
+/* Submitted and completed requests.  Both are lock-free stacks, newest
+ * first; a producer pushes one request at a time and the consumer takes
+ * the whole stack in one go, reversing it back into order.
+ */
+static DiskReq *volatile _diskio_queue = NULL;
+static DiskReq *volatile _diskio_done = NULL;
+
+static struct diskio_stats _diskio_stats;
+
+#ifdef HAVE_PTHREAD
+/* The I/O thread, and the pipe used to wake it when it's idle */
+static pthread_t     _diskio_thread;
+static int	     _diskio_running = 0;
+static volatile int  _diskio_stopping = 0;
+static int	     _diskio_wake[2] = { -1, -1 };
+static int	     _diskio_atfork = 0;
+#endif /* HAVE_PTHREAD */
+
+
+/* Forward prototypes for internal functions */
+static DiskReq *_diskio_new(int, int, const char *, char *, size_t);
+static int	_diskio_submit(DiskReq *);
+static void	_diskio_push(DiskReq *volatile *, DiskReq *);
+static DiskReq *_diskio_take(DiskReq *volatile *);
+static void	_diskio_run(DiskReq *);
+static int	_diskio_writeall(int, const char *, size_t);
+static int	_diskio_mustrotate(DiskReq *, struct stat *);
+static void	_diskio_rotate(DiskReq *, struct stat *);
+static int	_diskio_issegment(const char *, const char *, long *);
+static int	_diskio_taken(DiskReq *, const char *);
+static void	_diskio_expire(DiskReq *);
+static void	_diskio_compress(const char *, const char *);
+#ifdef HAVE_PTHREAD
+static int	_diskio_start(void);
+static void *	_diskio_main(void *);
+static void	_diskio_forked(void);
+#endif /* HAVE_PTHREAD */
+
+
+/* diskio_append
+ * Queue data to be appended to the named file, which is created if it
+ * doesn't exist but left alone if it isn't a regular file.  If rotation
+ * is asked for, the file is first renamed aside once it's too big or
+ * from another day, and the old ones beyond the number to keep removed.
+ */
+int
+diskio_append(const char *filename, char *data, size_t len,
+	      const struct diskio_rotate *rotate)
+{
+	DiskReq *req;
+	char	*ptr;
+
+	req = _diskio_new(DISKIO_APPEND, -1, filename, data, len);
+	if (rotate && (rotate->maxsize || rotate->daily)) {
+		memcpy(&req->rotate, rotate, sizeof(struct diskio_rotate));
+		req->rotate.compress = (rotate->compress
+					? x_strdup(rotate->compress) : NULL);
+
+		/* The I/O thread can't use our allocator, which isn't
+		 * thread-safe when debugging memory, so everything it'll
+		 * need to name and find the old files is made here */
+		ptr = strrchr(req->filename, '/');
+		if (ptr) {
+			req->dirname = x_strdup(req->filename);
+			req->dirname[ptr - req->filename] = '\0';
+			req->basename = ptr + 1;
+		} else {
+			req->dirname = x_strdup(".");
+			req->basename = req->filename;
+		}
+
+		req->rotated = (char *)malloc(strlen(req->filename)
+					      + DISKIO_SUFFIXLEN);
+		req->rotated[0] = '\0';
+	}
+
+	return _diskio_submit(req);
+}
+
+/* diskio_write
+ * Queue data to be written to an open file descriptor.
+ */
+int
+diskio_write(int fd, char *data, size_t len)
+{
+	return _diskio_submit(_diskio_new(DISKIO_WRITE, fd, NULL, data, len));
+}
+
+/* diskio_close
+ * Queue an open file descriptor to be closed once any writes queued
+ * before it have been done.
+ */
+int
+diskio_close(int fd)
+{
+	return _diskio_submit(_diskio_new(DISKIO_CLOSE, fd, NULL, NULL, 0));
+}
+
+/* diskio_poll
+ * Collect the requests the I/O thread has finished with, report any
+ * failures and free them.  Returns the number collected.
+ */
+int
+diskio_poll(void)
+{
+	DiskReq *req, *next;
+	int	 count;
+
+	count = 0;
+	req = _diskio_take(&_diskio_done);
+	while (req) {
+		next = req->next;
+
+		_diskio_stats.done++;
+		_diskio_stats.pending--;
+		_diskio_stats.wait_total += req->wait;
+		if (req->wait > _diskio_stats.wait_max)
+			_diskio_stats.wait_max = req->wait;
+		if (req->wait >= DISKIO_SLOW)
+			debug("Disk write waited %lu ms in the queue",
+			      req->wait / 1000);
+
+		if (req->func) {
+			_diskio_stats.failed++;
+			errno = req->error;
+			syscall_fail(req->func, req->filename, 0);
+		} else if (req->error) {
+			_diskio_stats.failed++;
+			debug("File '%s' existed, but wasn't a file",
+			      req->filename);
+		}
+
+		if (req->rotated && req->rotated[0]) {
+			debug("Rotated '%s' to '%s'", req->filename,
+			      req->rotated);
+			if (req->rotate.compress)
+				_diskio_compress(req->rotate.compress,
+						 req->rotated);
+		}
+
+		free((char *)req->rotate.compress);
+		free(req->dirname);
+		free(req->rotated);
+		free(req->filename);
+		free(req->data);
+		free(req);
+
+		req = next;
+		count++;
+	}
+
+	return count;
+}
+
+/* diskio_flush
+ * Wait for every queued request to be done, stop the I/O thread and
+ * collect what's left.
+ */
+void
+diskio_flush(void)
+{
+#ifdef HAVE_PTHREAD
+	if (_diskio_running) {
+		_diskio_stopping = 1;
+		if (write(_diskio_wake[1], "", 1) < 0)
+			debug("Couldn't wake the I/O thread: %s",
+			      strerror(errno));
+		pthread_join(_diskio_thread, NULL);
+
+		close(_diskio_wake[0]);
+		close(_diskio_wake[1]);
+		_diskio_wake[0] = _diskio_wake[1] = -1;
+		_diskio_running = _diskio_stopping = 0;
+	}
+#endif /* HAVE_PTHREAD */
+
+	diskio_poll();
+}
+
+/* diskio_getstats
+ * Fill in the queue statistics.
+ */
+void
+diskio_getstats(struct diskio_stats *stats)
+{
+	memcpy(stats, &_diskio_stats, sizeof(struct diskio_stats));
+}
+
+
+/* _diskio_new
+ * Create a new request, taking ownership of the data.
+ */
+static DiskReq *
+_diskio_new(int op, int fd, const char *filename, char *data, size_t len)
+{
+	DiskReq *req;
+
+	req = (DiskReq *)malloc(sizeof(DiskReq));
+	memset(req, 0, sizeof(DiskReq));
+	req->op = op;
+	req->fd = fd;
+	req->filename = (filename ? x_strdup(filename) : NULL);
+	req->data = data;
+	req->len = len;
+
+	return req;
+}
+
+/* _diskio_submit
+ * Stamp a request with the time and hand it to the I/O thread.  If there
+ * isn't one, and can't be, it's simply done here and now.
+ */
+static int
+_diskio_submit(DiskReq *req)
+{
+	gettimeofday(&req->queued, NULL);
+	_diskio_stats.pending++;
+
+#ifdef HAVE_PTHREAD
+	if (_diskio_running || !_diskio_start()) {
+		_diskio_push(&_diskio_queue, req);
+
+		/* If the pipe's full the thread has plenty to wake it */
+		if ((write(_diskio_wake[1], "", 1) < 0) && (errno != EAGAIN))
+			debug("Couldn't wake the I/O thread: %s",
+			      strerror(errno));
+		return 0;
+	}
+#endif /* HAVE_PTHREAD */
+
+	_diskio_run(req);
+	_diskio_push(&_diskio_done, req);
+	return 0;
+}
+
+/* _diskio_push
+ * Push a request onto one of the stacks.
+ */
+static void
+_diskio_push(DiskReq *volatile *stack, DiskReq *req)
+{
+	DiskReq *head;
+
+	do {
+		head = *stack;
+		req->next = head;
+	} while (!__sync_bool_compare_and_swap(stack, head, req));
+}
+
+/* _diskio_take
+ * Take everything off one of the stacks, returning it oldest first.
+ */
+static DiskReq *
+_diskio_take(DiskReq *volatile *stack)
+{
+	DiskReq *req, *next, *list;
+
+	req = __sync_lock_test_and_set(stack, NULL);
+	__sync_synchronize();
+
+	list = NULL;
+	while (req) {
+		next = req->next;
+		req->next = list;
+		list = req;
+		req = next;
+	}
+
+	return list;
+}
+
+/* _diskio_run
+ * Carry out a request.  This is called from the I/O thread, so must not
+ * allocate or free memory through malloc() and free(), which may be our
+ * own debugging versions, or report anything; it just records what
+ * happened for diskio_poll().  The C library allocating for itself, as
+ * opendir() does, is fine.
+ */
+static void
+_diskio_run(DiskReq *req)
+{
+	struct timeval now;
+	struct stat    statinfo;
+	int	       fd;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&now, &req->queued, >))
+		req->wait = (now.tv_sec - req->queued.tv_sec) * 1000000
+			+ (now.tv_usec - req->queued.tv_usec);
+
+	switch (req->op) {
+	case DISKIO_APPEND:
+		/* Make sure it's safe to use */
+		if (lstat(req->filename, &statinfo)) {
+			if (errno != ENOENT) {
+				req->func = "lstat";
+				req->error = errno;
+				return;
+			}
+		} else if (!S_ISREG(statinfo.st_mode)) {
+			req->error = EINVAL;
+			return;
+		} else if (_diskio_mustrotate(req, &statinfo)) {
+			_diskio_rotate(req, &statinfo);
+		}
+
+		fd = open(req->filename, O_WRONLY | O_APPEND | O_CREAT, 0666);
+		if (fd == -1) {
+			req->func = "open";
+			req->error = errno;
+			return;
+		}
+
+		if (_diskio_writeall(fd, req->data, req->len)) {
+			req->func = "write";
+			req->error = errno;
+		}
+		close(fd);
+		break;
+
+	case DISKIO_WRITE:
+		if (_diskio_writeall(req->fd, req->data, req->len)) {
+			req->func = "write";
+			req->error = errno;
+		}
+		break;
+
+	case DISKIO_CLOSE:
+		if (close(req->fd)) {
+			req->func = "close";
+			req->error = errno;
+		}
+		break;
+	}
+}
+
+/* _diskio_writeall
+ * Write the whole of a buffer to a file descriptor.
+ */
+static int
+_diskio_writeall(int fd, const char *data, size_t len)
+{
+	ssize_t written;
+
+	while (len) {
+		written = write(fd, data, len);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		data += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+/* _diskio_mustrotate
+ * Decide whether a file should be rotated before it's appended to.  Empty
+ * files never are.
+ */
+static int
+_diskio_mustrotate(DiskReq *req, struct stat *statinfo)
+{
+	struct tm then, today;
+	time_t	  now;
+
+	if (!req->rotated || !statinfo->st_size)
+		return 0;
+
+	if (req->rotate.maxsize
+	    && ((unsigned long)statinfo->st_size + req->len
+		> req->rotate.maxsize))
+		return 1;
+
+	if (req->rotate.daily) {
+		now = time(NULL);
+		localtime_r(&statinfo->st_mtime, &then);
+		localtime_r(&now, &today);
+		if ((then.tm_yday != today.tm_yday)
+		    || (then.tm_year != today.tm_year))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* _diskio_rotate
+ * Rename a file aside, naming it after the last time it was written to,
+ * then remove the oldest ones we were asked not to keep.  A failure to
+ * rename is recorded, but the append still goes ahead.
+ */
+static void
+_diskio_rotate(DiskReq *req, struct stat *statinfo)
+{
+	struct tm  then;
+	char	  *suffix;
+	int	   n;
+
+	strcpy(req->rotated, req->filename);
+	suffix = req->rotated + strlen(req->rotated);
+	localtime_r(&statinfo->st_mtime, &then);
+	strftime(suffix, DISKIO_SUFFIXLEN, ".%Y%m%d-%H%M%S", &then);
+
+	/* Two in the same second get numbered; compressing one leaves a
+	 * differently named file, so it's the directory that's checked */
+	suffix += DISKIO_STAMPLEN;
+	for (n = 1; _diskio_taken(req, req->rotated + (req->basename
+						      - req->filename)); n++)
+		snprintf(suffix, DISKIO_SUFFIXLEN - DISKIO_STAMPLEN, "-%d", n);
+
+	if (rename(req->filename, req->rotated)) {
+		req->func = "rename";
+		req->error = errno;
+		req->rotated[0] = '\0';
+		return;
+	}
+
+	if (req->rotate.keep > 0)
+		_diskio_expire(req);
+}
+
+/* _diskio_issegment
+ * Check whether a directory entry is a rotated copy of a file, and which
+ * of those from the same second it is.
+ */
+static int
+_diskio_issegment(const char *name, const char *basename, long *seq)
+{
+	size_t len;
+	int    i;
+
+	len = strlen(basename);
+	if (strncmp(name, basename, len) || (name[len] != '.'))
+		return 0;
+
+	/* .YYYYMMDD-HHMMSS */
+	for (i = 1; i < DISKIO_STAMPLEN; i++) {
+		if (i == 9) {
+			if (name[len + i] != '-')
+				return 0;
+		} else if ((name[len + i] < '0') || (name[len + i] > '9')) {
+			return 0;
+		}
+	}
+	len += DISKIO_STAMPLEN;
+
+	/* -N */
+	*seq = 0;
+	if (name[len] == '-') {
+		for (len++; (name[len] >= '0') && (name[len] <= '9'); len++)
+			*seq = *seq * 10 + name[len] - '0';
+	}
+
+	return ((name[len] == '\0') || (name[len] == '.'));
+}
+
+/* _diskio_taken
+ * Check whether a name for a rotated file is already used, either as it
+ * is or with something added by the compression program.
+ */
+static int
+_diskio_taken(DiskReq *req, const char *name)
+{
+	struct dirent *ent;
+	DIR	      *dir;
+	size_t	       len;
+	int	       taken;
+
+	dir = opendir(req->dirname);
+	if (!dir)
+		return 0;
+
+	taken = 0;
+	len = strlen(name);
+	while (!taken && (ent = readdir(dir))) {
+		if (!strncmp(ent->d_name, name, len)
+		    && ((ent->d_name[len] == '\0')
+			|| (ent->d_name[len] == '.')))
+			taken = 1;
+	}
+
+	closedir(dir);
+	return taken;
+}
+
+/* _diskio_expire
+ * Remove the oldest rotated copies of a file until only the number we
+ * were asked to keep are left.  They're ordered by the time in their
+ * names, then by their number within that second.
+ */
+static void
+_diskio_expire(DiskReq *req)
+{
+	struct dirent *ent;
+	char	       oldest[sizeof(ent->d_name)];
+	DIR	      *dir;
+	size_t	       len;
+	long	       seq, oldseq;
+	int	       count, cmp;
+
+	dir = opendir(req->dirname);
+	if (!dir)
+		return;
+
+	/* Removing one and looking again is simple, and there's rarely more
+	 * than one to go */
+	len = strlen(req->basename) + DISKIO_STAMPLEN;
+	for (;;) {
+		count = 0;
+		oldseq = 0;
+		rewinddir(dir);
+		while ((ent = readdir(dir))) {
+			if (!_diskio_issegment(ent->d_name, req->basename,
+					       &seq))
+				continue;
+
+			cmp = (count++ ? strncmp(ent->d_name, oldest, len) : -1);
+			if ((cmp < 0) || (!cmp && (seq < oldseq))) {
+				strcpy(oldest, ent->d_name);
+				oldseq = seq;
+			}
+		}
+
+		if ((count <= req->rotate.keep)
+		    || unlinkat(dirfd(dir), oldest, 0))
+			break;
+	}
+
+	closedir(dir);
+}
+
+/* _diskio_compress
+ * Start the compression program on a rotated file, leaving it to run on
+ * its own.  It's reaped along with every other child.
+ */
+static void
+_diskio_compress(const char *program, const char *filename)
+{
+	switch (fork()) {
+	case -1:
+		syscall_fail("fork", program, 0);
+		break;
+
+	case 0:
+		execlp(program, program, filename, NULL);
+
+		syscall_fail("execlp", program, 0);
+		exit(10);
+	}
+}
+
+#ifdef HAVE_PTHREAD
+/* _diskio_start
+ * Start the I/O thread.  It doesn't take any signals, they're all left for
+ * the main thread to deal with.
+ */
+static int
+_diskio_start(void)
+{
+	sigset_t all, old;
+	int	 ret;
+
+	if (pipe(_diskio_wake)) {
+		syscall_fail("pipe", "diskio", 0);
+		return -1;
+	}
+	fcntl(_diskio_wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(_diskio_wake[1], F_SETFD, FD_CLOEXEC);
+	fcntl(_diskio_wake[1], F_SETFL, O_NONBLOCK);
+
+	if (!_diskio_atfork) {
+		pthread_atfork(NULL, NULL, _diskio_forked);
+		_diskio_atfork = 1;
+	}
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&_diskio_thread, NULL, _diskio_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		errno = ret;
+		syscall_fail("pthread_create", "diskio", 0);
+		close(_diskio_wake[0]);
+		close(_diskio_wake[1]);
+		_diskio_wake[0] = _diskio_wake[1] = -1;
+		return -1;
+	}
+
+	debug("Started I/O thread");
+	_diskio_running = 1;
+	return 0;
+}
+
+/* _diskio_main
+ * The I/O thread, carries out requests in the order they were submitted
+ * and hands them back.  Once asked to stop, it finishes what's queued
+ * first.
+ */
+static void *
+_diskio_main(void *arg)
+{
+	DiskReq *req, *next;
+	char	 buf[64];
+
+	for (;;) {
+		req = _diskio_take(&_diskio_queue);
+		if (!req) {
+			if (_diskio_stopping)
+				break;
+			if ((read(_diskio_wake[0], buf, sizeof(buf)) == -1)
+			    && (errno != EINTR))
+				break;
+			continue;
+		}
+
+		while (req) {
+			next = req->next;
+			_diskio_run(req);
+			_diskio_push(&_diskio_done, req);
+			req = next;
+		}
+	}
+
+	return NULL;
+}
+
+/* _diskio_forked
+ * Called in the child after a fork(), which doesn't get a copy of the I/O
+ * thread.  Anything still queued is the parent's business; a new thread is
+ * started if the child needs one.
+ */
+static void
+_diskio_forked(void)
+{
+	if (!_diskio_running)
+		return;
+
+	close(_diskio_wake[0]);
+	close(_diskio_wake[1]);
+	_diskio_wake[0] = _diskio_wake[1] = -1;
+	_diskio_running = _diskio_stopping = 0;
+
+	_diskio_queue = _diskio_done = NULL;
+	_diskio_stats.pending = 0;
+}
+#endif /* HAVE_PTHREAD */
@@ -0,0 +1,65 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ *
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ *
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ *
+ *
+ * diskio.h
+ * --
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DIRCPROXY_DISKIO_H
+#define DIRCPROXY_DISKIO_H
+
+/* Required includes */
+#include <stdlib.h>
+
+/* Statistics about the writes that have passed through the queue */
+struct diskio_stats {
+	unsigned long	done;		/* Requests completed */
+	unsigned long	pending;	/* Requests still queued */
+	unsigned long	failed;		/* Requests that failed */
+
+	unsigned long	wait_total;	/* Total time spent queued (usec) */
+	unsigned long	wait_max;	/* Longest time spent queued (usec) */
+};
+
+/* How a file written with diskio_append() is rotated */
+struct diskio_rotate {
+	unsigned long	maxsize;	/* Rotate before passing this (bytes) */
+	int		daily;		/* Rotate when the day changes */
+	int		keep;		/* Rotated files to keep, 0 for all */
+	const char     *compress;	/* Program to compress rotated files */
+};
+
+/* Functions to queue writes; the data must be malloc()d and is freed
+ * once the write completes */
+int  diskio_append(const char *, char *, size_t,
+		   const struct diskio_rotate *);
+int  diskio_write(int, char *, size_t);
+int  diskio_close(int);
+
+/* Functions to collect completed writes, and to wait for all of them */
+int  diskio_poll(void);
+void diskio_flush(void);
+
+/* Function to get the queue statistics */
+void diskio_getstats(struct diskio_stats *);
+
+#endif /* !DIRCPROXY_DISKIO_H */
@@ -12,9 +12,13 @@
  *  - wrappers around /etc/services lookup functions
  *
  * The non-blocking stuff is a little complex, but it means that the main
- * loop can continue while waiting for DNS requests to complete.  Completion
- * of a DNS request is notified by the child death signal, so it will
- * interrupt the main loop to continue where you left off.
+ * loop can continue while waiting for DNS requests to complete.  Names are
+ * looked up in the hosts file first, otherwise we ask the nameservers in the
+ * resolver configuration ourselves, by UDP (or TCP if the answer is too big),
+ * using sockets and timers hooked into the main loop.  If resolver threads
+ * are configured, lookups are instead queued for them to do with the system
+ * resolver library, and they send the results back over a socketpair.
+ * Completion of a DNS request is notified by calling the function given.
  * --
  * @(#) $Id: dns.c,v 1.15 2002/12/29 21:30:11 scott Exp $
  *
@@ -26,335 +30,2011 @@
 #include <stdio.h>
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/wait.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <netdb.h>
 
 #include <dircproxy.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif /* HAVE_PTHREAD */
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif /* HAVE_SYS_RANDOM_H */
 #include "sprintf.h"
+#include "net.h"
+#include "timers.h"
 #include "dns.h"
 
-/* Structure used to hold information about a dns child */
-struct dnschild {
-  pid_t pid;
-  int pipe;
+/* Define MIN() */
+#ifndef MIN
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#endif /* MIN */
 
-  const char *ip;
+/* Nameservers and search rules from the resolver configuration */
+#define DNS_MAX_SERVERS 3
+#define DNS_MAX_SEARCH 6
 
+/* Defaults for when the resolver configuration doesn't say */
+#define DNS_DEFAULT_NDOTS 1
+#define DNS_DEFAULT_TRY_TIMEOUT 5
+#define DNS_DEFAULT_ATTEMPTS 2
+
+/* Answers aren't kept longer than this (in seconds), whatever we're told */
+#define DNS_CACHE_MAX_TTL 86400
+
+/* Number of hash buckets for the cache, always a power of two */
+#define DNS_CACHE_BUCKETS 256
+
+/* Most addresses of each family we'll find when looking up all of a
+   name's, and so most of all of them */
+#define DNS_MAX_FAMILY_ADDRS 4
+#define DNS_MAX_ADDRS (DNS_MAX_FAMILY_ADDRS * 2)
+
+/* Kinds of answer we remember */
+#define DNS_CACHE_ADDR 0
+#define DNS_CACHE_NAME 1
+#define DNS_CACHE_ADDRS 2
+
+/* Most resolver threads we'll start, whatever we're told */
+#define DNS_MAX_THREADS 32
+
+/* Bits of the DNS protocol we need; the tests run a nameserver elsewhere */
+#ifndef DNS_PORT
+#define DNS_PORT 53
+#endif /* DNS_PORT */
+#define DNS_HEADER_LEN 12
+#define DNS_UDP_MAX 512
+#define DNS_PACKET_MAX 65535
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_RCODE(x) ((x) & 0x000f)
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+/* Settings read from the resolver configuration file */
+struct dnsresolv {
+  int loaded;
+  time_t mtime;
+
+  SOCKADDR servers[DNS_MAX_SERVERS];
+  int numservers;
+
+  char *search[DNS_MAX_SEARCH];
+  int numsearch;
+
+  int ndots;
+  int timeout;
+  int attempts;
+};
+
+/* An address and name from the hosts file */
+struct dnshost {
+  int family;
+  unsigned char addr[16];
+  char *ip;
+  char *name;
+
+  struct dnshost *next;
+};
+
+/* An answer remembered in the cache, negative ones have no result */
+struct dnscache {
+  int kind;
+  unsigned long hash;
+  char *key;
+  char *result;
+  unsigned long long expires;
+
+  struct dnscache *chain;
+  struct dnscache *prev, *next;
+};
+
+#ifdef HAVE_PTHREAD
+/* A lookup handed to the resolver threads.  They only read the query,
+   everything else belongs to the main thread */
+struct dnsjob {
+  int reverse;
+  int all;
+  char query[DNS_MAX_HOSTLEN];
+
+  struct dnsrequest *req;
+  struct dnsjob *next;
+};
+
+/* Reply from a resolver thread, sent back over the socketpair */
+struct dnsresult {
+  struct dnsjob *job;
+  int success;
+  char ip[40];
+  char name[DNS_MAX_HOSTLEN];
+  char addrs[DNS_MAX_ADDRS * 40];
+};
+#endif /* HAVE_PTHREAD */
+
+/* Structure used to hold information about a dns request */
+struct dnsrequest {
   dns_fun_t function;
+  dns_addrs_fun_t addrsfunction;
   void *boundto;
   void *data;
 
-  struct dnschild *next;
-};
+  int reverse;
+  int all;
+  char ip[40];
+  char *addrs;
+  int numaddrs4, numaddrs6;
+  char *name;
+  char *result;
+  int success;
+  int cacheable;
+  unsigned long ttl;
+  unsigned long negttl;
+
+  char *qname;
+  int type;
+  int candidate;
+  int server;
+  int tries;
+  unsigned short id;
+
+  int sock;
+  int tcp;
+  unsigned long tcplen;
+
+  struct timer *timer;
+  struct timer *deadline;
+#ifdef HAVE_PTHREAD
+  struct dnsjob *job;
+#endif /* HAVE_PTHREAD */
+
+  struct dnsrequest *next;
+};
+
+/* forward declarations */
+static void _dns_readresolv(void);
+static void _dns_freeresolv(void);
+static void _dns_readhosts(void);
+static void _dns_freehosts(void);
+static int _dns_isip(const char *, int *, unsigned char *);
+static char *_dns_ptrname(const char *);
+static char *_dns_candidate(const char *, int);
+static size_t _dns_mkquery(unsigned char *, size_t, unsigned short,
+                           const char *, int);
+static int _dns_readname(const unsigned char *, size_t, size_t *,
+                         char *, size_t);
+static int _dns_startrequest(void *, dns_fun_t, dns_addrs_fun_t, void *,
+                             const char *, const char *);
+static int _dns_firsttype(struct dnsrequest *);
+static void _dns_addaddr(struct dnsrequest *, const char *);
+static void _dns_splithost(const char *, const char *, char *, int *);
+static void _dns_answer(struct dnsrequest *, int);
+static void _dns_answered(void *, void *);
+static void _dns_expired(void *, void *);
+static void _dns_timedout(void *, void *);
+static void _dns_query(struct dnsrequest *);
+static void _dns_nextname(struct dnsrequest *);
+static void _dns_send(struct dnsrequest *);
+static unsigned int _dns_randomid(void);
+static int _dns_sendudp(struct dnsrequest *);
+static void _dns_sendtcp(struct dnsrequest *);
+static void _dns_udpdata(void *, int);
+static void _dns_tcpconnected(void *, int);
+static void _dns_tcpdata(void *, int);
+static void _dns_tcperror(void *, int, int);
+static int _dns_reply(struct dnsrequest *, const unsigned char *, size_t);
+static unsigned long _dns_readttl(const unsigned char *);
+static void _dns_negative(struct dnsrequest *, const unsigned char *, size_t);
+static void _dns_finish(struct dnsrequest *);
+static void _dns_free(struct dnsrequest *);
+static int _dns_cachekind(struct dnsrequest *);
+static unsigned long _dns_cachehash(int, const char *);
+static int _dns_cachefind(struct dnsrequest *);
+static void _dns_cachestore(struct dnsrequest *);
+static void _dns_cachetrim(unsigned long);
+static void _dns_cachefree(struct dnscache *);
+#ifdef HAVE_PTHREAD
+static int _dns_threadsubmit(struct dnsrequest *);
+static void _dns_threadcancel(struct dnsjob *);
+static void _dns_threadwatch(void);
+static void _dns_threadreply(void *, int);
+static void _dns_threadstop(void);
+static void *_dns_threadmain(void *);
+static int _dns_getaddrs(const char *, char *, size_t);
+static void _dns_threadforked(void);
+#endif /* HAVE_PTHREAD */
+
+/* Requests waiting for an answer */
+static struct dnsrequest *dnsrequests = 0;
+
+/* Resolver configuration and hosts file */
+static struct dnsresolv resolv;
+static struct dnshost *dnshosts = 0;
+static int dnshosts_loaded = 0;
+static time_t dnshosts_mtime = 0;
+
+/* Remembered answers, hashed and in order of use (most recent first) */
+static struct dnscache *dnscache[DNS_CACHE_BUCKETS];
+static struct dnscache *dnscache_first = 0, *dnscache_last = 0;
+static struct dns_stats dnsstats;
+
+#ifdef HAVE_PTHREAD
+/* Resolver threads, the queue of lookups waiting for one and the
+   socketpair they reply on.  Only the queue is shared, under the lock */
+static pthread_t dnsthreads[DNS_MAX_THREADS];
+static int dnsthreads_running = 0;
+static int dnsthreads_stopping = 0;
+static int dnsthreads_atfork = 0;
+static pthread_mutex_t dnsjobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dnsjobs_ready = PTHREAD_COND_INITIALIZER;
+static struct dnsjob *dnsjobs_first = 0, *dnsjobs_last = 0;
+static long dnsjobs_queued = 0;
+
+/* Jobs not yet replied to, and the socket watched for replies while
+   there are any (so an idle pool doesn't keep the main loop going) */
+static long dnsjobs_outstanding = 0;
+static int dnsreply[2] = { -1, -1 };
+static int dnsreply_watch = -1;
+
+#ifndef HAVE_IPV6
+/* Without getaddrinfo(), lookups use gethostbyname() and friends, which
+   answer in static buffers; the threads and main loop take turns at them */
+static pthread_mutex_t dnsnetdb_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* !HAVE_IPV6 */
+#endif /* HAVE_PTHREAD */
+
+/* Read the nameservers and search list from the resolver configuration,
+   unless we already have and it hasn't changed since */
+static void _dns_readresolv(void) {
+  struct stat statinfo;
+  time_t mtime;
+  char buf[512];
+  FILE *fd;
+
+  mtime = (stat(DNS_RESOLV_CONF, &statinfo) ? 0 : statinfo.st_mtime);
+  if (resolv.loaded && (resolv.mtime == mtime))
+    return;
+
+  _dns_freeresolv();
+  resolv.loaded = 1;
+  resolv.mtime = mtime;
+  resolv.ndots = DNS_DEFAULT_NDOTS;
+  resolv.timeout = DNS_DEFAULT_TRY_TIMEOUT;
+  resolv.attempts = DNS_DEFAULT_ATTEMPTS;
+
+  debug("Reading resolver configuration from '%s'", DNS_RESOLV_CONF);
+  fd = fopen(DNS_RESOLV_CONF, "r");
+  while (fd && fgets(buf, sizeof(buf), fd)) {
+    char *key, *val;
+
+    key = strtok(buf, " \t\r\n");
+    if (!key || (*key == '#') || (*key == ';'))
+      continue;
+
+    if (!strcmp(key, "nameserver")) {
+      val = strtok(0, " \t\r\n");
+      if (!val || (resolv.numservers >= DNS_MAX_SERVERS))
+        continue;
+
+      if (net_filladdr(&(resolv.servers[resolv.numservers]), val,
+                       htons(DNS_PORT)))
+        resolv.numservers++;
+
+    } else if (!strcmp(key, "domain") || !strcmp(key, "search")) {
+      /* Whichever comes last wins */
+      while (resolv.numsearch)
+        free(resolv.search[--resolv.numsearch]);
+
+      while ((val = strtok(0, " \t\r\n"))
+             && (resolv.numsearch < DNS_MAX_SEARCH)) {
+        if ((*val == '#') || (*val == ';'))
+          break;
+        resolv.search[resolv.numsearch++] = x_strdup(val);
+      }
+
+    } else if (!strcmp(key, "options")) {
+      while ((val = strtok(0, " \t\r\n"))) {
+        if (!strncmp(val, "ndots:", 6)) {
+          resolv.ndots = atoi(val + 6);
+        } else if (!strncmp(val, "timeout:", 8)) {
+          resolv.timeout = atoi(val + 8);
+        } else if (!strncmp(val, "attempts:", 9)) {
+          resolv.attempts = atoi(val + 9);
+        }
+      }
+    }
+  }
+  if (fd)
+    fclose(fd);
+
+  /* No nameservers means ask the local machine */
+  if (!resolv.numservers) {
+    net_filladdr(&(resolv.servers[0]), "127.0.0.1", htons(DNS_PORT));
+    resolv.numservers = 1;
+  }
+
+  if (resolv.timeout < 1)
+    resolv.timeout = 1;
+  if (resolv.attempts < 1)
+    resolv.attempts = 1;
+  if (resolv.ndots < 0)
+    resolv.ndots = 0;
+}
+
+/* Forget the resolver configuration */
+static void _dns_freeresolv(void) {
+  while (resolv.numsearch)
+    free(resolv.search[--resolv.numsearch]);
+
+  memset(&resolv, 0, sizeof(struct dnsresolv));
+}
+
+/* Read the hosts file, unless we already have and it hasn't changed since */
+static void _dns_readhosts(void) {
+  struct stat statinfo;
+  struct dnshost **last;
+  time_t mtime;
+  char buf[1024];
+  FILE *fd;
+
+  mtime = (stat(DNS_HOSTS_FILE, &statinfo) ? 0 : statinfo.st_mtime);
+  if (dnshosts_loaded && (dnshosts_mtime == mtime))
+    return;
+
+  _dns_freehosts();
+  dnshosts_loaded = 1;
+  dnshosts_mtime = mtime;
+
+  debug("Reading hosts from '%s'", DNS_HOSTS_FILE);
+  fd = fopen(DNS_HOSTS_FILE, "r");
+  last = &dnshosts;
+  while (fd && fgets(buf, sizeof(buf), fd)) {
+    unsigned char addr[16];
+    char *ip, *name, *c;
+    int family;
+
+    c = strchr(buf, '#');
+    if (c)
+      *c = '\0';
+
+    ip = strtok(buf, " \t\r\n");
+    if (!ip || !_dns_isip(ip, &family, addr))
+      continue;
+
+    while ((name = strtok(0, " \t\r\n"))) {
+      struct dnshost *host;
+
+      host = (struct dnshost *)malloc(sizeof(struct dnshost));
+      host->family = family;
+      memcpy(host->addr, addr, sizeof(host->addr));
+      host->ip = x_strdup(ip);
+      host->name = x_strdup(name);
+      host->next = 0;
+
+      *last = host;
+      last = &(host->next);
+    }
+  }
+  if (fd)
+    fclose(fd);
+}
+
+/* Forget the hosts file */
+static void _dns_freehosts(void) {
+  while (dnshosts) {
+    struct dnshost *n;
+
+    n = dnshosts->next;
+    free(dnshosts->ip);
+    free(dnshosts->name);
+    free(dnshosts);
+    dnshosts = n;
+  }
+
+  dnshosts_loaded = 0;
+}
+
+/* Check whether a string is an IP address, and if it is get the family and
+   binary form of it (which must have room for an IPv6 address) */
+static int _dns_isip(const char *ip, int *family, unsigned char *addr) {
+  memset(addr, 0, 16);
+
+  if (net_pton(AF_INET, ip, addr) > 0) {
+    *family = AF_INET;
+    return 1;
+  }
+#ifdef HAVE_IPV6
+  if (inet_pton(AF_INET6, ip, addr) > 0) {
+    *family = AF_INET6;
+    return 1;
+  }
+#endif /* HAVE_IPV6 */
+
+  return 0;
+}
+
+/* Returns the name to look up PTR records of for an IP address */
+static char *_dns_ptrname(const char *ip) {
+  unsigned char addr[16];
+  int family;
+
+  if (!_dns_isip(ip, &family, addr))
+    return 0;
+
+#ifdef HAVE_IPV6
+  /* IPv4 clients on an IPv6 socket look like this */
+  if ((family == AF_INET6) && IN6_IS_ADDR_V4MAPPED((struct in6_addr *)addr)) {
+    memmove(addr, addr + 12, 4);
+    family = AF_INET;
+  }
+
+  if (family == AF_INET6) {
+    char name[73], *c;
+    int i;
+
+    c = name;
+    for (i = 15; i >= 0; i--) {
+      *(c++) = "0123456789abcdef"[addr[i] & 0x0f];
+      *(c++) = '.';
+      *(c++) = "0123456789abcdef"[addr[i] >> 4];
+      *(c++) = '.';
+    }
+    strcpy(c, "ip6.arpa");
+
+    return x_strdup(name);
+  }
+#endif /* HAVE_IPV6 */
+
+  return x_sprintf("%d.%d.%d.%d.in-addr.arpa",
+                   addr[3], addr[2], addr[1], addr[0]);
+}
+
+/* Returns the nth name to try when looking up a name, following the search
+   list, or 0 if there aren't any more to try */
+static char *_dns_candidate(const char *name, int n) {
+  const char *c;
+  int dots;
+
+  /* Names ending in a dot are only ever tried as they are */
+  if (strlen(name) && (name[strlen(name) - 1] == '.')) {
+    char *ret;
+
+    if (n)
+      return 0;
+
+    ret = x_strdup(name);
+    ret[strlen(ret) - 1] = '\0';
+    return ret;
+  }
+
+  dots = 0;
+  for (c = name; *c; c++)
+    if (*c == '.')
+      dots++;
+
+  /* Names with enough dots are tried as they are first, others last */
+  if (dots >= resolv.ndots) {
+    if (!n)
+      return x_strdup(name);
+    n--;
+  } else if (n == resolv.numsearch) {
+    return x_strdup(name);
+  }
+
+  if (n < resolv.numsearch)
+    return x_sprintf("%s.%s", name, resolv.search[n]);
+
+  return 0;
+}
+
+/* Build a query packet, returns its length or 0 if it wouldn't fit */
+static size_t _dns_mkquery(unsigned char *buf, size_t buflen,
+                           unsigned short id, const char *name, int type) {
+  const char *label;
+  size_t len;
+
+  if (buflen < DNS_HEADER_LEN + strlen(name) + 6)
+    return 0;
+
+  memset(buf, 0, DNS_HEADER_LEN);
+  buf[0] = id >> 8;
+  buf[1] = id & 0xff;
+  buf[2] = DNS_FLAG_RD >> 8;
+  buf[5] = 1;
+  len = DNS_HEADER_LEN;
+
+  /* Name as a list of length-prefixed labels */
+  label = name;
+  while (*label) {
+    const char *dot;
+    size_t l;
+
+    dot = strchr(label, '.');
+    l = (dot ? (size_t)(dot - label) : strlen(label));
+    if (!l || (l > 63))
+      return 0;
+
+    buf[len++] = l;
+    memcpy(buf + len, label, l);
+    len += l;
+
+    label += l;
+    if (*label)
+      label++;
+  }
+  buf[len++] = 0;
+
+  buf[len++] = type >> 8;
+  buf[len++] = type & 0xff;
+  buf[len++] = DNS_CLASS_IN >> 8;
+  buf[len++] = DNS_CLASS_IN & 0xff;
+
+  return len;
+}
+
+/* Read a (possibly compressed) name from a packet, moving pos past it.
+   Returns 0 on success */
+static int _dns_readname(const unsigned char *msg, size_t msglen, size_t *pos,
+                         char *name, size_t namelen) {
+  size_t p, len;
+  int jumps;
+
+  p = *pos;
+  len = jumps = 0;
+  while (1) {
+    unsigned char l;
+
+    if (p >= msglen)
+      return -1;
+    l = msg[p];
+
+    if ((l & 0xc0) == 0xc0) {
+      /* Pointer to elsewhere in the packet; make sure we don't loop */
+      if ((p + 1 >= msglen) || (++jumps > 32))
+        return -1;
+      if (jumps == 1)
+        *pos = p + 2;
+
+      p = ((l & 0x3f) << 8) | msg[p + 1];
+
+    } else if (l & 0xc0) {
+      return -1;
+
+    } else if (!l) {
+      if (!jumps)
+        *pos = p + 1;
+      break;
+
+    } else {
+      if ((p + 1 + l > msglen) || (len + l + 2 > namelen))
+        return -1;
+
+      if (len)
+        name[len++] = '.';
+      memcpy(name + len, msg + p + 1, l);
+      len += l;
+      p += l + 1;
+    }
+  }
+
+  name[len] = '\0';
+  return 0;
+}
+
+/* Function that starts a non-blocking DNS request. */
+static int _dns_startrequest(void *boundto, dns_fun_t function,
+                             dns_addrs_fun_t addrsfunction, void *data,
+                             const char *ip, const char *name)
+{
+  struct dnsrequest *req;
+  struct dnshost *host;
+  unsigned char addr[16];
+  int family;
+
+  req = (struct dnsrequest *)malloc(sizeof(struct dnsrequest));
+  memset(req, 0, sizeof(struct dnsrequest));
+  req->function = function;
+  req->addrsfunction = addrsfunction;
+  req->all = (addrsfunction ? 1 : 0);
+  req->boundto = boundto;
+  req->data = data;
+  req->sock = -1;
+  req->ttl = req->negttl = DNS_CACHE_MAX_TTL;
+  req->next = dnsrequests;
+  dnsrequests = req;
+
+  if (g.dns_timeout)
+    timer_set(&(req->deadline), req, "dns_timeout",
+              TIMER_SECONDS(g.dns_timeout), _dns_expired, 0);
+
+  if (name) {
+    debug("Looking up IP for '%s'", name);
+    req->name = x_strdup(name);
+
+    /* Nothing to look up? */
+    if (_dns_isip(name, &family, addr)) {
+      _dns_addaddr(req, name);
+      _dns_answer(req, 1);
+      return 0;
+    }
+
+    if (_dns_cachefind(req))
+      return 0;
+
+#ifdef HAVE_PTHREAD
+    if (!_dns_threadsubmit(req))
+      return 0;
+#endif /* HAVE_PTHREAD */
+
+    /* Prefer IPv4 from the hosts file, like we do from nameservers, unless
+       we're after all of the addresses */
+    _dns_readhosts();
+    for (host = dnshosts; host; host = host->next) {
+      if (strcasecmp(host->name, req->name))
+        continue;
+
+      if (req->all) {
+        _dns_addaddr(req, host->ip);
+        req->success = 1;
+        continue;
+      }
+
+      if (!req->success || (host->family == AF_INET)) {
+        strncpy(req->ip, host->ip, sizeof(req->ip));
+        req->ip[sizeof(req->ip) - 1] = '\0';
+        req->success = 1;
+      }
+      if (host->family == AF_INET)
+        break;
+    }
+    if (req->success) {
+      _dns_answer(req, 1);
+      return 0;
+    }
+
+    _dns_readresolv();
+    req->qname = _dns_candidate(req->name, 0);
+    req->type = _dns_firsttype(req);
+
+  } else {
+    debug("Lookup up name for '%s'", ip);
+    req->reverse = 1;
+    strncpy(req->ip, ip, sizeof(req->ip));
+    req->ip[sizeof(req->ip) - 1] = '\0';
+
+    if (!_dns_isip(req->ip, &family, addr)) {
+      _dns_answer(req, 0);
+      return 0;
+    }
+
+    if (_dns_cachefind(req))
+      return 0;
+
+#ifdef HAVE_PTHREAD
+    if (!_dns_threadsubmit(req))
+      return 0;
+#endif /* HAVE_PTHREAD */
+
+    _dns_readhosts();
+    for (host = dnshosts; host; host = host->next) {
+      if ((host->family == family) && !memcmp(host->addr, addr, 16)) {
+        req->result = x_strdup(host->name);
+        _dns_answer(req, 1);
+        return 0;
+      }
+    }
+
+    _dns_readresolv();
+    req->qname = _dns_ptrname(req->ip);
+    req->type = DNS_TYPE_PTR;
+  }
+
+  if (!req->qname) {
+    _dns_answer(req, 0);
+  } else {
+    _dns_query(req);
+  }
+
+  return 0;
+}
+
+/* We already know the answer, but callers expect to hear it later */
+static void _dns_answer(struct dnsrequest *req, int success) {
+  req->success = success;
+  timer_set(&(req->timer), req, "dns_answer", 0, _dns_answered, 0);
+}
+
+/* Give the answer we already knew */
+static void _dns_answered(void *boundto, void *data) {
+  _dns_finish((struct dnsrequest *)boundto);
+}
+
+/* Type of record to ask for first about a name */
+static int _dns_firsttype(struct dnsrequest *req) {
+  if (req->reverse)
+    return DNS_TYPE_PTR;
+
+#ifdef HAVE_IPV6
+  /* Asking for IPv6 first means those are ready to try first */
+  if (req->all)
+    return DNS_TYPE_AAAA;
+#endif /* HAVE_IPV6 */
+
+  return DNS_TYPE_A;
+}
+
+/* Add an address to those found, or if only one is wanted make it the one */
+static void _dns_addaddr(struct dnsrequest *req, const char *ip) {
+  if (!req->all) {
+    strncpy(req->ip, ip, sizeof(req->ip));
+    req->ip[sizeof(req->ip) - 1] = '\0';
+    return;
+  }
+
+  /* Keep room for the other family, so neither crowds the other out */
+  if (strchr(ip, ':')) {
+    if (req->numaddrs6++ >= DNS_MAX_FAMILY_ADDRS)
+      return;
+  } else if (req->numaddrs4++ >= DNS_MAX_FAMILY_ADDRS) {
+    return;
+  }
+
+  if (req->addrs) {
+    char *addrs;
+
+    addrs = x_sprintf("%s %s", req->addrs, ip);
+    free(req->addrs);
+    req->addrs = addrs;
+  } else {
+    req->addrs = x_strdup(ip);
+  }
+}
+
+/* Taken too long to look something up */
+static void _dns_expired(void *boundto, void *data) {
+  struct dnsrequest *req = (struct dnsrequest *)boundto;
+
+  debug("DNS lookup of '%s' timed out", (req->reverse ? req->ip : req->name));
+  _dns_finish(req);
+}
+
+/* Nameserver didn't answer in time, try the next */
+static void _dns_timedout(void *boundto, void *data) {
+  struct dnsrequest *req = (struct dnsrequest *)boundto;
+
+  debug("No reply about '%s' from nameserver %d", req->qname, req->server + 1);
+  _dns_send(req);
+}
+
+/* Start asking the nameservers about the current name and type */
+static void _dns_query(struct dnsrequest *req) {
+  req->tries = 0;
+  _dns_send(req);
+}
+
+/* Current name doesn't exist, try the next one in the search list */
+static void _dns_nextname(struct dnsrequest *req) {
+  free(req->qname);
+  req->qname = (req->reverse ? 0 : _dns_candidate(req->name,
+                                                  ++req->candidate));
+
+  if (req->qname) {
+    req->type = _dns_firsttype(req);
+    _dns_query(req);
+  } else {
+    /* Nameservers agree there's nothing, that's worth remembering */
+    req->ttl = req->negttl;
+    req->cacheable = 1;
+    _dns_finish(req);
+  }
+}
+
+/* Ask the next nameserver, or give up if we've asked them all enough */
+static void _dns_send(struct dnsrequest *req) {
+  while (req->tries < resolv.numservers * resolv.attempts) {
+    req->server = req->tries++ % resolv.numservers;
+
+    if (!_dns_sendudp(req)) {
+      timer_reset(&(req->timer), req, "dns_try",
+                  TIMER_SECONDS(resolv.timeout), _dns_timedout, 0);
+      return;
+    }
+  }
+
+  debug("Nameservers gave no answer about '%s'", req->qname);
+
+  /* Addresses of one family are better than none */
+  if (req->all) {
+#ifdef HAVE_IPV6
+    if (req->type == DNS_TYPE_AAAA) {
+      req->type = DNS_TYPE_A;
+      _dns_query(req);
+      return;
+    }
+#endif /* HAVE_IPV6 */
+
+    req->success = (req->addrs ? 1 : 0);
+  }
+
+  _dns_finish(req);
+}
+
+/* Pick the ID for a query.  Anyone who could guess it could answer for the
+   nameserver, so it comes from the system's random source rather than
+   random(), which is seeded from the time */
+static unsigned int _dns_randomid(void) {
+#ifdef HAVE_ARC4RANDOM
+  return arc4random() & 0xffff;
+#else /* HAVE_ARC4RANDOM */
+  unsigned char buf[2];
+  int fd, ok;
+
+#ifdef HAVE_GETRANDOM
+  if (getrandom(buf, sizeof(buf), 0) == sizeof(buf))
+    return (buf[0] << 8) | buf[1];
+#endif /* HAVE_GETRANDOM */
+
+  ok = 0;
+  fd = open("/dev/urandom", O_RDONLY);
+  if (fd != -1) {
+    ok = (read(fd, buf, sizeof(buf)) == sizeof(buf));
+    close(fd);
+  }
+  if (!ok) {
+    syscall_fail("read", "/dev/urandom", 0);
+    return random() & 0xffff;
+  }
+
+  return (buf[0] << 8) | buf[1];
+#endif /* HAVE_ARC4RANDOM */
+}
+
+/* Send the query to a nameserver by UDP, returns 0 on success.  Each query
+   gets a new socket, so a new port picked by the system, and it's connected
+   so only datagrams from the nameserver asked are seen */
+static int _dns_sendudp(struct dnsrequest *req) {
+  unsigned char query[DNS_UDP_MAX];
+  SOCKADDR *server;
+  size_t len;
+
+  if (req->sock != -1)
+    net_close(&(req->sock));
+  req->tcp = 0;
+
+  req->id = _dns_randomid();
+  len = _dns_mkquery(query, sizeof(query), req->id, req->qname, req->type);
+  if (!len)
+    return -1;
+
+  server = &(resolv.servers[req->server]);
+  dnsstats.queries++;
+  req->sock = socket(SOCKADDR_FAMILY(server), SOCK_DGRAM, 0);
+  if (req->sock == -1) {
+    syscall_fail("socket", "SOCK_DGRAM", 0);
+    return -1;
+  }
+  net_create(&(req->sock));
+
+  if (connect(req->sock, (struct sockaddr *)server, SOCKADDR_LEN(server))
+      || (send(req->sock, query, len, 0) != (ssize_t)len)) {
+    syscall_fail("send", 0, 0);
+    net_close(&(req->sock));
+    return -1;
+  }
+
+  net_hook(req->sock, SOCK_LISTENING, (void *)req,
+           ACTIVITY_FUNCTION(_dns_udpdata), 0);
+  return 0;
+}
+
+/* Answer didn't fit in a UDP packet, ask the same nameserver by TCP */
+static void _dns_sendtcp(struct dnsrequest *req) {
+  unsigned char query[2 + DNS_UDP_MAX];
+  SOCKADDR *server;
+  size_t len;
+
+  if (req->sock != -1)
+    net_close(&(req->sock));
+  req->tcp = 1;
+  req->tcplen = 0;
+
+  debug("Asking nameserver %d about '%s' again by TCP", req->server + 1,
+        req->qname);
+  server = &(resolv.servers[req->server]);
+  dnsstats.queries++;
+  req->sock = net_socket(SOCKADDR_FAMILY(server));
+  if (req->sock == -1) {
+    _dns_send(req);
+    return;
+  }
+
+  if (connect(req->sock, (struct sockaddr *)server, SOCKADDR_LEN(server))
+      && (errno != EINPROGRESS)) {
+    syscall_fail("connect", 0, 0);
+    _dns_send(req);
+    return;
+  }
+
+  /* Over TCP, queries go with their length in front */
+  req->id = _dns_randomid();
+  len = _dns_mkquery(query + 2, sizeof(query) - 2, req->id, req->qname,
+                     req->type);
+  query[0] = len >> 8;
+  query[1] = len & 0xff;
+  net_queue(req->sock, (void *)query, len + 2);
+
+  net_hook(req->sock, SOCK_CONNECTING, (void *)req,
+           ACTIVITY_FUNCTION(_dns_tcpconnected),
+           ERROR_FUNCTION(_dns_tcperror));
+  timer_reset(&(req->timer), req, "dns_try", TIMER_SECONDS(resolv.timeout),
+              _dns_timedout, 0);
+}
+
+/* Reply (or error) from a nameserver by UDP */
+static void _dns_udpdata(void *data, int sock) {
+  struct dnsrequest *req = (struct dnsrequest *)data;
+  unsigned char reply[DNS_UDP_MAX];
+  ssize_t len;
+
+  while (1) {
+    len = recv(sock, reply, sizeof(reply), 0);
+    if (len == -1) {
+      if ((errno == EAGAIN) || (errno == EINTR))
+        return;
+
+      /* Nothing listening there, probably */
+      debug("Nameserver %d: %s", req->server + 1, strerror(errno));
+      _dns_send(req);
+      return;
+    }
+
+    /* Anything that doesn't look like our answer is ignored */
+    if (_dns_reply(req, reply, len))
+      return;
+  }
+}
+
+/* Connected to a nameserver by TCP */
+static void _dns_tcpconnected(void *data, int sock) {
+  net_hook(sock, SOCK_NORMAL, data, ACTIVITY_FUNCTION(_dns_tcpdata),
+           ERROR_FUNCTION(_dns_tcperror));
+}
+
+/* Reply from a nameserver by TCP */
+static void _dns_tcpdata(void *data, int sock) {
+  struct dnsrequest *req = (struct dnsrequest *)data;
+  unsigned char *reply;
+
+  if (!req->tcplen) {
+    unsigned char lenbuf[2];
+
+    if (!net_read(sock, (void *)lenbuf, 2))
+      return;
+
+    req->tcplen = (lenbuf[0] << 8) | lenbuf[1];
+    if (!req->tcplen) {
+      _dns_send(req);
+      return;
+    }
+  }
+
+  if (net_read(sock, 0, 0) < req->tcplen)
+    return;
+
+  reply = (unsigned char *)malloc(req->tcplen);
+  net_read(sock, (void *)reply, req->tcplen);
+  if (!_dns_reply(req, reply, req->tcplen))
+    _dns_send(req);
+  free(reply);
+}
+
+/* Connection to a nameserver by TCP failed */
+static void _dns_tcperror(void *data, int sock, int bad) {
+  struct dnsrequest *req = (struct dnsrequest *)data;
+
+  if (bad) {
+    debug("Nameserver %d: socket error by TCP", req->server + 1);
+  } else {
+    debug("Nameserver %d: connection closed", req->server + 1);
+  }
+
+  _dns_send(req);
+}
+
+/* Deal with a reply from a nameserver.  Returns 0 if it wasn't the reply to
+   our query, otherwise the request has moved on (or finished) */
+static int _dns_reply(struct dnsrequest *req, const unsigned char *msg,
+                      size_t len) {
+  char name[DNS_MAX_HOSTLEN];
+  unsigned int flags, answers;
+  unsigned long ttl;
+  size_t pos;
+  int found;
+
+  if (len < DNS_HEADER_LEN)
+    return 0;
+
+  flags = (msg[2] << 8) | msg[3];
+  if ((((msg[0] << 8) | msg[1]) != req->id) || !(flags & DNS_FLAG_QR)
+      || (((msg[4] << 8) | msg[5]) != 1))
+    return 0;
+
+  /* The question must be the one we asked */
+  pos = DNS_HEADER_LEN;
+  if (_dns_readname(msg, len, &pos, name, sizeof(name))
+      || strcasecmp(name, req->qname) || (pos + 4 > len)
+      || (((msg[pos] << 8) | msg[pos + 1]) != req->type)
+      || (((msg[pos + 2] << 8) | msg[pos + 3]) != DNS_CLASS_IN))
+    return 0;
+  pos += 4;
+
+  if ((flags & DNS_FLAG_TC) && !req->tcp) {
+    _dns_sendtcp(req);
+    return 1;
+  }
+
+  if (DNS_RCODE(flags) == DNS_RCODE_NXDOMAIN) {
+    debug("Nameserver %d says '%s' doesn't exist", req->server + 1,
+          req->qname);
+    _dns_negative(req, msg, len);
+
+    /* Keep any IPv6 addresses we already found for it */
+    if (req->all && req->addrs) {
+      req->success = 1;
+      _dns_finish(req);
+    } else {
+      _dns_nextname(req);
+    }
+    return 1;
+  } else if (DNS_RCODE(flags)) {
+    debug("Nameserver %d failed with code %d", req->server + 1,
+          DNS_RCODE(flags));
+    _dns_send(req);
+    return 1;
+  }
+
+  /* Take the first record of the type we asked for, or all of them; they
+     can't be kept for longer than any of the aliases that led to them */
+  answers = (msg[6] << 8) | msg[7];
+  ttl = DNS_CACHE_MAX_TTL;
+  found = 0;
+  while (answers--) {
+    unsigned int type, class, rdlen;
+
+    if (_dns_readname(msg, len, &pos, name, sizeof(name))
+        || (pos + 10 > len))
+      break;
+
+    type = (msg[pos] << 8) | msg[pos + 1];
+    class = (msg[pos + 2] << 8) | msg[pos + 3];
+    rdlen = (msg[pos + 8] << 8) | msg[pos + 9];
+    ttl = MIN(ttl, _dns_readttl(msg + pos + 4));
+    pos += 10;
+    if (pos + rdlen > len)
+      break;
+
+    if ((class == DNS_CLASS_IN) && (type == req->type)) {
+      char ip[40];
+
+      ip[0] = '\0';
+      if ((type == DNS_TYPE_A) && (rdlen == 4)) {
+        SOCKADDR addr;
+
+        memset(&addr, 0, sizeof(SOCKADDR));
+        SOCKADDR_FAMILY(&addr) = AF_INET;
+        memcpy(&(((struct sockaddr_in *)&addr)->sin_addr), msg + pos, 4);
+        net_ntop(&addr, ip, sizeof(ip));
+#ifdef HAVE_IPV6
+      } else if ((type == DNS_TYPE_AAAA) && (rdlen == 16)) {
+        inet_ntop(AF_INET6, msg + pos, ip, sizeof(ip));
+#endif /* HAVE_IPV6 */
+      } else if (type == DNS_TYPE_PTR) {
+        size_t p = pos;
+
+        if (!_dns_readname(msg, len, &p, name, sizeof(name))) {
+          req->result = x_strdup(name);
+          found++;
+        }
+      }
+
+      if (strlen(ip)) {
+        _dns_addaddr(req, ip);
+        found++;
+      }
+
+      if (found && !req->all) {
+        debug("Nameserver %d says '%s' is '%s'", req->server + 1, req->qname,
+              (req->reverse ? req->result : req->ip));
+        req->ttl = MIN(req->ttl, ttl);
+        req->success = req->cacheable = 1;
+        _dns_finish(req);
+        return 1;
+      }
+    }
+
+    pos += rdlen;
+  }
+
+  if (req->all) {
+    if (found) {
+      debug("Nameserver %d says '%s' has %d addresses", req->server + 1,
+            req->qname, found);
+      req->ttl = MIN(req->ttl, ttl);
+    } else {
+      _dns_negative(req, msg, len);
+    }
+
+#ifdef HAVE_IPV6
+    /* Asked for IPv6 addresses first, now for IPv4 */
+    if (req->type == DNS_TYPE_AAAA) {
+      req->type = DNS_TYPE_A;
+      _dns_query(req);
+      return 1;
+    }
+#endif /* HAVE_IPV6 */
+
+    if (req->addrs) {
+      req->success = req->cacheable = 1;
+      _dns_finish(req);
+      return 1;
+    }
+
+    _dns_nextname(req);
+    return 1;
+  }
 
-/* Reply generated by a child */
-struct dnsresult {
-  int success;
-  char ip[40];
+  _dns_negative(req, msg, len);
+
+#ifdef HAVE_IPV6
+  /* Name exists but has no IPv4 address, it may have an IPv6 one */
+  if (req->type == DNS_TYPE_A) {
+    req->type = DNS_TYPE_AAAA;
+    _dns_query(req);
+    return 1;
+  }
+#endif /* HAVE_IPV6 */
+
+  _dns_nextname(req);
+  return 1;
+}
+
+/* Read a 32-bit TTL from a record, capped to what we'll keep */
+static unsigned long _dns_readttl(const unsigned char *p) {
+  unsigned long ttl;
+
+  ttl = ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+        | ((unsigned long)p[2] << 8) | (unsigned long)p[3];
+
+  /* Top bit set is meant to be treated as zero */
+  if (ttl & 0x80000000UL)
+    return 0;
+
+  return MIN(ttl, DNS_CACHE_MAX_TTL);
+}
+
+/* Reply says there's nothing; the SOA record in the authority section says
+   how long that can be remembered, otherwise we use the configured time */
+static void _dns_negative(struct dnsrequest *req, const unsigned char *msg,
+                          size_t len) {
   char name[DNS_MAX_HOSTLEN];
-};
+  unsigned int skip, authority;
+  size_t pos;
 
-/* forward declarations */
-static void _dns_lookup(const char *, const char *, struct dnsresult *);
-static int _dns_startrequest(void *, dns_fun_t, void *, const char *, const char *);
+  pos = DNS_HEADER_LEN;
+  skip = ((msg[4] << 8) | msg[5]) + ((msg[6] << 8) | msg[7]);
+  authority = (msg[8] << 8) | msg[9];
 
-/* Children */
-static struct dnschild *dnschildren = 0;
+  /* Question has no TTL or data */
+  if (_dns_readname(msg, len, &pos, name, sizeof(name)))
+    return;
+  pos += 4;
+  skip--;
 
-/* Function that looks up DNS request */
-static void _dns_lookup(const char *name, const char *ip, struct dnsresult *res) {
-  pid_t pid;
+  while (skip + authority) {
+    unsigned int type, rdlen;
 
-  pid = getpid();
+    if (_dns_readname(msg, len, &pos, name, sizeof(name))
+        || (pos + 10 > len))
+      break;
 
-  if (name) {
-    debug("%d: Looking up IP for '%s'", pid, name);
+    type = (msg[pos] << 8) | msg[pos + 1];
+    rdlen = (msg[pos + 8] << 8) | msg[pos + 9];
+    if (pos + 10 + rdlen > len)
+      break;
+
+    if (!skip && (type == DNS_TYPE_SOA)) {
+      size_t p = pos + 10;
 
-    if (dns_getip(name, res->ip)) {
-      strncpy(res->name, name, sizeof(res->name));
-      res->name[sizeof(res->name) - 1] = '\0';
-      res->success = 1;
+      /* Skip the two names, the minimum is the last of the five numbers */
+      if (_dns_readname(msg, len, &p, name, sizeof(name))
+          || _dns_readname(msg, len, &p, name, sizeof(name))
+          || (p + 20 > len))
+        break;
+
+      req->negttl = MIN(req->negttl, MIN(_dns_readttl(msg + pos + 4),
+                                         _dns_readttl(msg + p + 16)));
+      return;
     }
-  } else if (ip) {
-    debug("%d: Lookup up name for '%s'", pid, ip);
-    
-    if (dns_getname(ip, res->name, sizeof(res->name))) {
-      strncpy(res->ip, ip, sizeof(res->ip));
-      res->ip[sizeof(res->ip) - 1] = '\0';
-      res->success = 1;
+
+    pos += 10 + rdlen;
+    if (skip) {
+      skip--;
+    } else {
+      authority--;
     }
   }
 
-  if (res->success)
-    debug("%d: Got '%s' (%s)", pid, res->name, res->ip);
-  else
-    debug("%d: No result", pid);
+  req->negttl = MIN(req->negttl, (unsigned long)g.dns_cache_negative);
 }
 
-/* Function that starts a non-blocking DNS request. */
-static int _dns_startrequest(void *boundto, dns_fun_t function, void *data,
-                             const char *ip, const char *name)
-{
-  struct dnschild *child;
-  int p[2], wp[2];
+/* Called to end a DNS request, tells the caller what we found */
+static void _dns_finish(struct dnsrequest *req) {
+  struct dnsrequest *r, *l;
+  char *ip, *name;
 
-  /* Pipe where the result will be placed on success */
-  if (pipe(p)) {
-    syscall_fail("pipe", "p", 0);
-    function(boundto, data, 0, 0);
-    return -1;
+  /* Remove it from the list */
+  l = 0;
+  for (r = dnsrequests; r && (r != req); r = r->next)
+    l = r;
+  if (!r)
+    return;
+
+  if (l) {
+    l->next = req->next;
+  } else {
+    dnsrequests = req->next;
   }
 
-  /* Pipe to indicate the child can go */
-  if (pipe(wp)) {
-    close(p[0]);
-    close(p[1]);
-    syscall_fail("pipe", "wp", 0);
-    function(boundto, data, 0, 0);
-    return -1;
+  /* Parameters to call function with */
+  if (req->success) {
+    ip = (req->all ? req->addrs : req->ip);
+    name = (req->reverse ? req->result : req->name);
+  } else {
+    debug("DNS lookup failed");
+    ip = (req->reverse ? req->ip : 0);
+    name = 0;
   }
 
-  /* Allocate and place the child on the list now, to avoid race conditions */
-  child = (struct dnschild *)malloc(sizeof(struct dnschild));
-  child->pipe = p[0];
-  child->function = function;
-  child->boundto = boundto;
-  child->ip = ip;
-  child->data = data;
-  child->next = dnschildren;
-  dnschildren = child;
-
-  /* Fork */
-  child->pid = fork();
-  if (child->pid == -1) {
-    /* Error */
-    syscall_fail("fork", 0, 0);
-    dnschildren = child->next;
-    close(p[1]);
-    close(p[0]);
-    close(wp[1]);
-    close(wp[0]);
-    free(child);
-    function(boundto, data, 0, 0);
-    return -1;
-    
-  } else if (child->pid) {
-    /* Parent */
-    debug("New DNS process started, pid %d", child->pid);
-    close(p[1]);
-    close(wp[0]);
-
-    /* Send go signal */
-    write(wp[1], "go", 2);
-    close(wp[1]);
+  /* If DNS failed but we have an IP, fill the name with the IP */
+  if (ip && (!name || !strlen(name))) {
+    debug("Changed name to '%s'", ip);
+    name = ip;
+  }
+
+  /* Function may well start another request, or cancel some, so it needs to
+     be off the list first; it can't see this one and we can't lose it */
+  if (req->sock != -1)
+    net_close(&(req->sock));
+  timer_clear(&(req->timer));
+  timer_clear(&(req->deadline));
+
+  if (req->cacheable)
+    _dns_cachestore(req);
+
+  if (req->all) {
+    char **addrs, **v6, **v4, *list, *tok;
+    int i, num, n6, n4, j6, j4;
+
+    /* Alternate the families, IPv6 first, so that a connection can be
+       tried to one of each without waiting long for either */
+    addrs = v6 = v4 = 0;
+    list = 0;
+    if (ip) {
+      num = 1;
+      for (tok = ip; *tok; tok++)
+        if (*tok == ' ')
+          num++;
+
+      addrs = (char **)malloc(sizeof(char *) * (num + 1));
+      v6 = (char **)malloc(sizeof(char *) * num);
+      v4 = (char **)malloc(sizeof(char *) * num);
+      list = x_strdup(ip);
+
+      n6 = n4 = 0;
+      for (tok = strtok(list, " "); tok; tok = strtok(0, " ")) {
+        if (strchr(tok, ':')) {
+          v6[n6++] = tok;
+        } else {
+          v4[n4++] = tok;
+        }
+      }
+
+      i = j6 = j4 = 0;
+      while ((j6 < n6) || (j4 < n4)) {
+        if (j6 < n6)
+          addrs[i++] = v6[j6++];
+        if (j4 < n4)
+          addrs[i++] = v4[j4++];
+      }
+      addrs[i] = 0;
+    }
+
+    req->addrsfunction(req->boundto, req->data, (const char **)addrs, name);
+    free(addrs);
+    free(v6);
+    free(v4);
+    free(list);
+
+  } else {
+    req->function(req->boundto, req->data, ip, name);
+  }
+
+  _dns_free(req);
+}
+
+/* Free a request that's already off the list */
+static void _dns_free(struct dnsrequest *req) {
+#ifdef HAVE_PTHREAD
+  if (req->job)
+    _dns_threadcancel(req->job);
+#endif /* HAVE_PTHREAD */
+  if (req->sock != -1)
+    net_close(&(req->sock));
+  timer_clear(&(req->timer));
+  timer_clear(&(req->deadline));
+
+  free(req->name);
+  free(req->result);
+  free(req->addrs);
+  free(req->qname);
+  free(req);
+}
+
+/* Kind of answer a request is after */
+static int _dns_cachekind(struct dnsrequest *req) {
+  if (req->reverse)
+    return DNS_CACHE_NAME;
+
+  return (req->all ? DNS_CACHE_ADDRS : DNS_CACHE_ADDR);
+}
+
+/* Hash of a cache key */
+static unsigned long _dns_cachehash(int kind, const char *key) {
+  unsigned long hash;
+
+  hash = 2166136261UL ^ kind;
+  while (*key) {
+    hash ^= (unsigned char)tolower(*(key++));
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+/* Answer a request from the cache if we can, returns 1 if we did */
+static int _dns_cachefind(struct dnsrequest *req) {
+  struct dnscache *c, *l;
+  unsigned long hash;
+  const char *key;
+  int kind;
+
+  if (g.dns_cache_size <= 0)
+    return 0;
+
+  dnsstats.lookups++;
+  kind = _dns_cachekind(req);
+  key = (req->reverse ? req->ip : req->name);
+  hash = _dns_cachehash(kind, key);
+
+  l = 0;
+  for (c = dnscache[hash & (DNS_CACHE_BUCKETS - 1)]; c; c = c->chain) {
+    if ((c->hash == hash) && (c->kind == kind) && !strcasecmp(c->key, key))
+      break;
+    l = c;
+  }
+  if (!c)
+    return 0;
+
+  if (c->expires <= timer_now()) {
+    debug("Forgetting old DNS answer for '%s'", key);
+    if (l) {
+      l->chain = c->chain;
+    } else {
+      dnscache[hash & (DNS_CACHE_BUCKETS - 1)] = c->chain;
+    }
+    _dns_cachefree(c);
+    dnsstats.expired++;
     return 0;
+  }
+
+  /* Most recently used goes to the front */
+  if (c != dnscache_first) {
+    c->prev->next = c->next;
+    if (c->next) {
+      c->next->prev = c->prev;
+    } else {
+      dnscache_last = c->prev;
+    }
 
+    c->prev = 0;
+    c->next = dnscache_first;
+    dnscache_first->prev = c;
+    dnscache_first = c;
+  }
+
+  dnsstats.hits++;
+  if (!c->result) {
+    debug("Remembered that '%s' doesn't exist", key);
+    dnsstats.neghits++;
+    _dns_answer(req, 0);
+  } else if (req->reverse) {
+    debug("Remembered that '%s' is '%s'", key, c->result);
+    req->result = x_strdup(c->result);
+    _dns_answer(req, 1);
+  } else if (req->all) {
+    debug("Remembered that '%s' is '%s'", key, c->result);
+    req->addrs = x_strdup(c->result);
+    _dns_answer(req, 1);
   } else {
-    struct dnsresult result;
-    char gobuf[2];
+    debug("Remembered that '%s' is '%s'", key, c->result);
+    strncpy(req->ip, c->result, sizeof(req->ip));
+    req->ip[sizeof(req->ip) - 1] = '\0';
+    _dns_answer(req, 1);
+  }
 
-    close(p[0]);
-    close(wp[1]);
-    
-    /* Use ALARM to do timeouts */
-    signal(SIGALRM, SIG_DFL);
-    alarm(g.dns_timeout);
+  return 1;
+}
 
-    /* Wait for a go signal */
-    read(wp[0], gobuf, 2);
-    close(wp[0]);
-    
-    /* Do the lookup */
-    memset(&result, 0, sizeof(struct dnsresult));
-    _dns_lookup(name, ip, &result);
-    if (result.success) {
-      /* Succeded, write to our parent and die */
-      write(p[1], (void *)&result, sizeof(struct dnsresult));
-      exit(0);
+/* Remember the answer to a request for as long as we were told we could */
+static void _dns_cachestore(struct dnsrequest *req) {
+  struct dnscache *c, **l;
+  unsigned long hash;
+  const char *key;
+  int kind;
+
+  /* Caching is off, perhaps since a reload, so forget everything */
+  if (g.dns_cache_size <= 0) {
+    _dns_cachetrim(0);
+    return;
+  }
+
+  /* Not to be remembered at all */
+  if (!req->ttl)
+    return;
+
+  kind = _dns_cachekind(req);
+  key = (req->reverse ? req->ip : req->name);
+  hash = _dns_cachehash(kind, key);
+
+  /* Replace any answer we already have, another lookup may have beaten us */
+  l = &(dnscache[hash & (DNS_CACHE_BUCKETS - 1)]);
+  while (*l) {
+    c = *l;
+    if ((c->hash == hash) && (c->kind == kind) && !strcasecmp(c->key, key)) {
+      *l = c->chain;
+      _dns_cachefree(c);
     } else {
-      /* Didn't succeed */
-      exit(1);
+      l = &(c->chain);
     }
   }
+
+  c = (struct dnscache *)malloc(sizeof(struct dnscache));
+  memset(c, 0, sizeof(struct dnscache));
+  c->kind = kind;
+  c->hash = hash;
+  c->key = x_strdup(key);
+  c->expires = timer_now() + (unsigned long long)req->ttl * 1000;
+  if (req->success)
+    c->result = x_strdup(req->reverse ? req->result
+                         : (req->all ? req->addrs : req->ip));
+
+  c->chain = dnscache[hash & (DNS_CACHE_BUCKETS - 1)];
+  dnscache[hash & (DNS_CACHE_BUCKETS - 1)] = c;
+
+  c->next = dnscache_first;
+  if (dnscache_first) {
+    dnscache_first->prev = c;
+  } else {
+    dnscache_last = c;
+  }
+  dnscache_first = c;
+
+  dnsstats.entries++;
+  if (!c->result)
+    dnsstats.negentries++;
+  debug("Remembering DNS answer for '%s' for %lu seconds", key, req->ttl);
+
+  _dns_cachetrim(g.dns_cache_size);
 }
 
-/* Called to end a DNS request.  0 = Not handled, >0 = Ok, <0 = Error */
-int dns_endrequest(pid_t pid, int status) {
-  struct dnschild *lastchild, *child;
-  struct dnsresult result;
-  char *ip;
-  char *name;
-  size_t len;
+/* Forget the least recently used answers until there's no more than max */
+static void _dns_cachetrim(unsigned long max) {
+  while (dnscache_last && (dnsstats.entries > max)) {
+    struct dnscache *c, **l;
 
-  /* Check to see whether this was a DNS child */
-  child = dnschildren;
-  lastchild = 0;
-  while (child) {
-    if (child->pid == pid)
-      break;
+    c = dnscache_last;
+    l = &(dnscache[c->hash & (DNS_CACHE_BUCKETS - 1)]);
+    while (*l != c)
+      l = &((*l)->chain);
+    *l = c->chain;
+
+    _dns_cachefree(c);
+    dnsstats.evicted++;
+  }
+}
+
+/* Take an answer off the list of recently used ones and free it, it must
+   already be unhashed */
+static void _dns_cachefree(struct dnscache *c) {
+  if (c->prev) {
+    c->prev->next = c->next;
+  } else {
+    dnscache_first = c->next;
+  }
+  if (c->next) {
+    c->next->prev = c->prev;
+  } else {
+    dnscache_last = c->prev;
+  }
+
+  dnsstats.entries--;
+  if (!c->result)
+    dnsstats.negentries--;
 
-    lastchild = child;
-    child = child->next;
+  free(c->key);
+  free(c->result);
+  free(c);
+}
+
+/* Get the DNS cache statistics */
+void dns_getstats(struct dns_stats *stats) {
+  memcpy(stats, &dnsstats, sizeof(struct dns_stats));
+}
+
+#ifdef HAVE_PTHREAD
+/* Hand a request to the resolver threads.  Returns -1 if there aren't any,
+   otherwise it's been dealt with */
+static int _dns_threadsubmit(struct dnsrequest *req) {
+  struct dnsjob *job;
+  const char *query;
+
+  if (!dnsthreads_running)
+    return -1;
+
+  query = (req->reverse ? req->ip : req->name);
+  if (strlen(query) >= DNS_MAX_HOSTLEN) {
+    _dns_answer(req, 0);
+    return 0;
   }
-  if (!child)
+
+  job = (struct dnsjob *)malloc(sizeof(struct dnsjob));
+  memset(job, 0, sizeof(struct dnsjob));
+  job->reverse = req->reverse;
+  job->all = req->all;
+  strcpy(job->query, query);
+  job->req = req;
+
+  pthread_mutex_lock(&dnsjobs_lock);
+  if ((g.dns_queue_max > 0) && (dnsjobs_queued >= g.dns_queue_max)) {
+    pthread_mutex_unlock(&dnsjobs_lock);
+    free(job);
+
+    debug("Too many lookups waiting for a resolver thread, not looking up "
+          "'%s'", query);
+    _dns_answer(req, 0);
     return 0;
+  }
 
-  /* Remove it from the list */
-  if (lastchild) {
-    lastchild->next = child->next;
+  if (dnsjobs_last) {
+    dnsjobs_last->next = job;
   } else {
-    dnschildren = child->next;
+    dnsjobs_first = job;
   }
+  dnsjobs_last = job;
+  dnsjobs_queued++;
+  pthread_cond_signal(&dnsjobs_ready);
+  pthread_mutex_unlock(&dnsjobs_lock);
 
-  debug("%d: Was a DNS child, getting result", pid);
+  req->job = job;
+  dnsjobs_outstanding++;
+  _dns_threadwatch();
 
-  /* Parameters to call function with */
-  name = 0;
-  ip = 0;
-  
-  /* Read from pipe if child returned normally */
-  if (WIFEXITED(status)) {
-    if (!WEXITSTATUS(status)) {
-      len = read(child->pipe, (void *)&result, sizeof(struct dnsresult));
-      if (len != sizeof(struct dnsresult)) {
-        syscall_fail("read", 0, 0);
-      } else if (result.success) {
-        debug("%d: Got result", pid);
-
-        ip = result.ip;
-        name = result.name;
+  return 0;
+}
+
+/* A request has gone away; if its lookup hasn't been picked up yet it's
+   taken off the queue, otherwise the reply will be thrown away */
+static void _dns_threadcancel(struct dnsjob *job) {
+  struct dnsjob *j, *l;
+
+  job->req = 0;
+
+  pthread_mutex_lock(&dnsjobs_lock);
+  l = 0;
+  for (j = dnsjobs_first; j && (j != job); j = j->next)
+    l = j;
+
+  if (j) {
+    if (l) {
+      l->next = j->next;
+    } else {
+      dnsjobs_first = j->next;
+    }
+    if (dnsjobs_last == j)
+      dnsjobs_last = l;
+    dnsjobs_queued--;
+  }
+  pthread_mutex_unlock(&dnsjobs_lock);
+
+  if (j) {
+    free(job);
+    dnsjobs_outstanding--;
+    _dns_threadwatch();
+  }
+}
+
+/* Watch for replies only while some are due */
+static void _dns_threadwatch(void) {
+  if (dnsjobs_outstanding && (dnsreply_watch == -1)) {
+    dnsreply_watch = dup(dnsreply[0]);
+    if (dnsreply_watch == -1) {
+      syscall_fail("dup", "dns", 0);
+      return;
+    }
+
+    net_create(&dnsreply_watch);
+    net_hook(dnsreply_watch, SOCK_LISTENING, 0,
+             ACTIVITY_FUNCTION(_dns_threadreply), 0);
+
+  } else if (!dnsjobs_outstanding && (dnsreply_watch != -1)) {
+    net_close(&dnsreply_watch);
+  }
+}
+
+/* Replies from the resolver threads */
+static void _dns_threadreply(void *data, int sock) {
+  struct dnsresult result;
+
+  while (recv(dnsreply[0], &result, sizeof(struct dnsresult), 0)
+         == sizeof(struct dnsresult)) {
+    struct dnsrequest *req;
+
+    req = result.job->req;
+    free(result.job);
+    dnsjobs_outstanding--;
+    if (!req)
+      continue;
+
+    req->job = 0;
+    if (result.success) {
+      debug("Resolver thread says '%s' is '%s'",
+            (req->reverse ? req->ip : req->name),
+            (req->reverse ? result.name
+             : (req->all ? result.addrs : result.ip)));
+
+      if (req->reverse) {
+        req->result = x_strdup(result.name);
+      } else if (req->all) {
+        req->addrs = x_strdup(result.addrs);
       } else {
-        debug("%d: DNS lookup failed", pid);
+        strncpy(req->ip, result.ip, sizeof(req->ip));
+        req->ip[sizeof(req->ip) - 1] = '\0';
       }
-    } else {
-      debug("%d: DNS lookup returned %d", pid, WEXITSTATUS(status));
+      req->success = 1;
     }
-  } else if (WIFSIGNALED(status)) {
-    debug("%d: DNS lookup terminated with signal %d", pid, WTERMSIG(status));
-  } else {
-    debug("%d: DNS lookup terminated abnormally", pid);
+
+    _dns_finish(req);
   }
 
-  /* If DNS failed, but we were looking up an IP address, fill that */
-  if (!ip && child->ip) {
-    strcpy(result.ip, child->ip);
-    ip = result.ip;
+  _dns_threadwatch();
+}
+
+/* Stop the resolver threads, lookups they're in the middle of are waited
+   for but anything still queued is thrown away */
+static void _dns_threadstop(void) {
+  struct dnsresult result;
+  int i;
+
+  if (!dnsthreads_running)
+    return;
+
+  pthread_mutex_lock(&dnsjobs_lock);
+  dnsthreads_stopping = 1;
+  pthread_cond_broadcast(&dnsjobs_ready);
+  pthread_mutex_unlock(&dnsjobs_lock);
+
+  for (i = 0; i < dnsthreads_running; i++)
+    pthread_join(dnsthreads[i], NULL);
+  debug("Stopped %d resolver threads", dnsthreads_running);
+
+  while (dnsjobs_first) {
+    struct dnsjob *n;
+
+    n = dnsjobs_first->next;
+    free(dnsjobs_first);
+    dnsjobs_first = n;
   }
+  dnsjobs_last = 0;
+  dnsjobs_queued = 0;
 
-  /* If DNS failed but we have an IP, fill the name with the IP */
-  if (ip && (!name || !strlen(name))) {
-    strncpy(result.name, ip, sizeof(result.name));
-    result.name[sizeof(result.name) - 1] = '\0';
+  while (recv(dnsreply[0], &result, sizeof(struct dnsresult), 0)
+         == sizeof(struct dnsresult))
+    free(result.job);
+  dnsjobs_outstanding = 0;
+  _dns_threadwatch();
+
+  close(dnsreply[0]);
+  close(dnsreply[1]);
+  dnsreply[0] = dnsreply[1] = -1;
+  dnsthreads_running = dnsthreads_stopping = 0;
+}
+
+/* A resolver thread, looks up whatever's next in the queue with the
+   blocking functions and sends back the result */
+static void *_dns_threadmain(void *arg) {
+  while (1) {
+    struct dnsresult result;
+    struct dnsjob *job;
+
+    pthread_mutex_lock(&dnsjobs_lock);
+    while (!dnsjobs_first && !dnsthreads_stopping)
+      pthread_cond_wait(&dnsjobs_ready, &dnsjobs_lock);
+
+    if (dnsthreads_stopping) {
+      pthread_mutex_unlock(&dnsjobs_lock);
+      break;
+    }
+
+    job = dnsjobs_first;
+    dnsjobs_first = job->next;
+    if (!dnsjobs_first)
+      dnsjobs_last = 0;
+    dnsjobs_queued--;
+    pthread_mutex_unlock(&dnsjobs_lock);
+
+    memset(&result, 0, sizeof(struct dnsresult));
+    result.job = job;
+    if (job->reverse) {
+      result.success = dns_getname(job->query, result.name,
+                                   sizeof(result.name));
+    } else if (job->all) {
+      result.success = _dns_getaddrs(job->query, result.addrs,
+                                     sizeof(result.addrs));
+    } else {
+      result.success = dns_getip(job->query, result.ip);
+    }
 
-    debug("%d: Changed name to '%s'", pid, result.name);
-    name = result.name;
+    while ((send(dnsreply[1], &result, sizeof(struct dnsresult), 0) == -1)
+           && (errno == EINTR))
+      ;
   }
 
-  /* Call the function */
-  child->function(child->boundto, child->data, ip, name);
+  return NULL;
+}
 
-  /* Clean up */
-  close(child->pipe);
-  free(child);
+/* Blocking lookup of every address of a hostname, up to DNS_MAX_FAMILY_ADDRS
+   of each family are placed space-separated into addrs.  Returns 1 on
+   success */
+static int _dns_getaddrs(const char *name, char *addrs, size_t len) {
+#ifdef HAVE_IPV6
+  struct addrinfo *head, *ai, hints;
+  char ip[40];
+  int num4, num6;
 
-  return 1;
+  head = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(name, NULL, &hints, &head) || !head)
+    return 0;
+
+  addrs[0] = '\0';
+  num4 = num6 = 0;
+  for (ai = head; ai; ai = ai->ai_next) {
+    if ((ai->ai_family == AF_INET6) ? (num6 >= DNS_MAX_FAMILY_ADDRS)
+        : (num4 >= DNS_MAX_FAMILY_ADDRS))
+      continue;
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, ip, sizeof(ip), NULL,
+                    0, NI_NUMERICHOST))
+      continue;
+    if (strlen(addrs) + strlen(ip) + 2 > len)
+      break;
+
+    if (num4 + num6)
+      strcat(addrs, " ");
+    strcat(addrs, ip);
+    if (ai->ai_family == AF_INET6) {
+      num6++;
+    } else {
+      num4++;
+    }
+  }
+  freeaddrinfo(head);
+
+  return ((num4 + num6) ? 1 : 0);
+#else /* HAVE_IPV6 */
+  if (len < 16)
+    return 0;
+
+  return dns_getip(name, addrs);
+#endif /* HAVE_IPV6 */
+}
+
+/* Called in the child after a fork(), which doesn't get copies of the
+   resolver threads.  Anything queued is the parent's business */
+static void _dns_threadforked(void) {
+  if (!dnsthreads_running)
+    return;
+
+  pthread_mutex_init(&dnsjobs_lock, NULL);
+  pthread_cond_init(&dnsjobs_ready, NULL);
+#ifndef HAVE_IPV6
+  pthread_mutex_init(&dnsnetdb_lock, NULL);
+#endif /* !HAVE_IPV6 */
+
+  close(dnsreply[0]);
+  close(dnsreply[1]);
+  dnsreply[0] = dnsreply[1] = -1;
+  dnsthreads_running = dnsthreads_stopping = 0;
+
+  dnsjobs_first = dnsjobs_last = 0;
+  dnsjobs_queued = dnsjobs_outstanding = 0;
 }
+#endif /* HAVE_PTHREAD */
 
-/* Kill off any children associated with an ircproxy */
+/* Cancel any requests associated with an ircproxy */
 int dns_delall(void *b) {
-  struct dnschild *c, *l;
+  struct dnsrequest *r, *l;
   int numdone;
 
   l = 0;
-  c = dnschildren;
+  r = dnsrequests;
   numdone = 0;
-  
-  while (c) {
-    if (c->boundto == b) {
-      struct dnschild *n;
 
-      n = c->next;
-      debug("Killing DNS process %d", c->pid);
-      kill(c->pid, SIGKILL);
-      close(c->pipe);
-      free(c);
+  while (r) {
+    if (r->boundto == b) {
+      struct dnsrequest *n;
+
+      n = r->next;
+      debug("Cancelling DNS lookup of '%s'", (r->reverse ? r->ip : r->name));
+      _dns_free(r);
+      numdone++;
 
       if (l) {
-        c = l->next = n;
+        r = l->next = n;
       } else {
-        c = dnschildren = n;
+        r = dnsrequests = n;
       }
     } else {
-      l = c;
-      c = c->next;
+      l = r;
+      r = r->next;
     }
   }
 
   return numdone;
 }
 
-/* Kill off ALL dns children */
+/* Cancel ALL dns requests */
 void dns_flush(void) {
-  struct dnschild *c;
+  while (dnsrequests) {
+    struct dnsrequest *n;
+
+    n = dnsrequests->next;
+    _dns_free(dnsrequests);
+    dnsrequests = n;
+  }
+
+#ifdef HAVE_PTHREAD
+  _dns_threadstop();
+#endif /* HAVE_PTHREAD */
+  _dns_freeresolv();
+  _dns_freehosts();
+  _dns_cachetrim(0);
+}
+
+/* Start the resolver threads, if they're wanted, so that lookups go to the
+   system resolver library rather than being made here */
+int dns_start(void) {
+#ifdef HAVE_PTHREAD
+  sigset_t all, old;
+  long i;
 
-  c = dnschildren;
-  while (c) {
-    struct dnschild *n;
+  if (dnsthreads_running || (g.dns_threads <= 0))
+    return 0;
+
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, dnsreply)) {
+    syscall_fail("socketpair", "dns", 0);
+    return -1;
+  }
+  fcntl(dnsreply[0], F_SETFD, FD_CLOEXEC);
+  fcntl(dnsreply[1], F_SETFD, FD_CLOEXEC);
+  fcntl(dnsreply[0], F_SETFL, O_NONBLOCK);
+
+  if (!dnsthreads_atfork) {
+    pthread_atfork(NULL, NULL, _dns_threadforked);
+    dnsthreads_atfork = 1;
+  }
+
+  /* Signals are for the main thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (i = 0; (i < g.dns_threads) && (i < DNS_MAX_THREADS); i++) {
+    int ret;
+
+    ret = pthread_create(&(dnsthreads[i]), NULL, _dns_threadmain, NULL);
+    if (ret) {
+      errno = ret;
+      syscall_fail("pthread_create", "dns", 0);
+      break;
+    }
+    dnsthreads_running++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-    n = c->next;
-    debug("Killing DNS process %d", c->pid);
-    kill(c->pid, SIGKILL);
-    close(c->pipe);
-    free(c);
-    c = n;
+  if (!dnsthreads_running) {
+    close(dnsreply[0]);
+    close(dnsreply[1]);
+    dnsreply[0] = dnsreply[1] = -1;
+    return -1;
   }
 
-  dnschildren = 0;
+  debug("Started %d resolver threads", dnsthreads_running);
+#endif /* HAVE_PTHREAD */
+
+  return 0;
 }
 
 /* Returns the IP address of a hostname */
 int dns_addrfromhost(void *boundto, void *data, const char *name, dns_fun_t function) {
-  return _dns_startrequest(boundto, function, data, 0, name);
+  return _dns_startrequest(boundto, function, 0, data, 0, name);
 }
 
 /* Returns the hostname of an IP address */
 int dns_hostfromaddr(void *boundto, void *data, const char *ip, dns_fun_t function) {
-  return _dns_startrequest(boundto, function, data, ip, 0);
+  return _dns_startrequest(boundto, function, 0, data, ip, 0);
 }
 
-/* Fill a sockaddr_in from a hostname or hostname:port combo thing */
-int dns_filladdr(void *boundto, const char *name, const char *defaultport,
-                 SOCKADDR *result, dns_fun_t function) {
-  int ret = 0;
-  
-  char host[DNS_MAX_HOSTLEN];
+/* Returns every IP address of a hostname */
+int dns_addrsfromhost(void *boundto, void *data, const char *name,
+                      dns_addrs_fun_t function) {
+  return _dns_startrequest(boundto, 0, function, data, 0, name);
+}
+
+/* Split a hostname or hostname:port combo thing */
+static void _dns_splithost(const char *name, const char *defaultport,
+                           char *host, int *port) {
   char portbuf[32];
-  int port;
 
-  memset(result, 0, sizeof(SOCKADDR));
   host[0] = '\0';
   /* 1. IPv6 [addr]:port */
   if ((sscanf(name, "[%39[^]]]:%31s", host, portbuf) == 2) ||
       /* 2. host/ipv4:port */
       (sscanf(name, "%255[^:]:%31s", host, portbuf) == 2))
-    port = dns_portfromserv(portbuf);
+    *port = dns_portfromserv(portbuf);
   else {
     /* 3. just host name */
-    port = dns_portfromserv(defaultport);
-    strncpy(host, name, sizeof(host));
-    host[sizeof(host) - 1] = '\0';
+    *port = dns_portfromserv(defaultport);
+    strncpy(host, name, DNS_MAX_HOSTLEN - 1);
+    host[DNS_MAX_HOSTLEN - 1] = '\0';
   }
+}
 
-  ret = _dns_startrequest(boundto, function, (void*)port, 0, host);
+/* Look up every address of a hostname or hostname:port combo thing,
+   the port is passed to the function as its data */
+int dns_filladdrs(void *boundto, const char *name, const char *defaultport,
+                  dns_addrs_fun_t function) {
+  char host[DNS_MAX_HOSTLEN];
+  int port;
 
-  return ret;
+  _dns_splithost(name, defaultport, host, &port);
+  return _dns_startrequest(boundto, 0, function, (void*)port, 0, host);
 }
 
 /* Returns a network port number for a port as a string */
@@ -429,16 +2109,23 @@ int dns_getip(const char *name, char *ip) {
   
   return ret;
 #else
+  isip = 0;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&dnsnetdb_lock);
+#endif /* HAVE_PTHREAD */
   host = gethostbyname(name);
   if (host)
   {
     char *temp = inet_ntoa(*(struct in_addr *)host->h_addr);
     strcpy(ip, temp);
     
-    return 1;
+    isip = 1;
   }
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock(&dnsnetdb_lock);
+#endif /* HAVE_PTHREAD */
   
-  return 0;
+  return isip;
 #endif
 }
 
@@ -468,17 +2155,24 @@ int dns_getname(const char *ip, char *name, int len) {
 #else
   struct hostent *host;
   struct in_addr addr;
+  int ret = 0;
   
   if (inet_aton (ip, &addr)) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&dnsnetdb_lock);
+#endif /* HAVE_PTHREAD */
     host = gethostbyaddr((const char*)&addr, sizeof(addr), AF_INET);
     if (host) {
       strncpy(name, host->h_name, len);
       name[len - 1] = '\0';
 
-      return 1;
+      ret = 1;
     }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&dnsnetdb_lock);
+#endif /* HAVE_PTHREAD */
   }
   
-  return 0;
+  return ret;
 #endif
 }
@@ -30,15 +30,29 @@
 #define DNS_MAX_HOSTLEN 256
 
 typedef void (*dns_fun_t)(void *, void *, const char *, const char *);
+typedef void (*dns_addrs_fun_t)(void *, void *, const char **, const char *);
+
+/* DNS cache statistics */
+struct dns_stats {
+  unsigned long lookups;     /* lookups that could be cached */
+  unsigned long hits;        /* answered from the cache */
+  unsigned long neghits;     /* of those, answered with "doesn't exist" */
+  unsigned long expired;     /* answers dropped when too old */
+  unsigned long evicted;     /* answers dropped to make room */
+  unsigned long queries;     /* queries sent to nameservers */
+  unsigned long entries;     /* answers in the cache now */
+  unsigned long negentries;  /* of those, "doesn't exist" answers */
+};
 
 /* functions */
-extern int dns_endrequest(pid_t, int);
 extern int dns_delall(void *);
 extern void dns_flush(void);
+extern int dns_start(void);
+extern void dns_getstats(struct dns_stats *);
 extern int dns_addrfromhost(void *, void *, const char *, dns_fun_t);
 extern int dns_hostfromaddr(void *, void *, const char *, dns_fun_t);
-extern int dns_filladdr(void *, const char *, const char *,
-                        SOCKADDR *, dns_fun_t);
+extern int dns_addrsfromhost(void *, void *, const char *, dns_addrs_fun_t);
+extern int dns_filladdrs(void *, const char *, const char *, dns_addrs_fun_t);
 extern int dns_portfromserv(const char *);
 extern char *dns_servfromport(int);
 
@@ -0,0 +1,623 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ *
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ *
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ *
+ *
+ * dnstest.c
+ *  - tests of the resolver in dns.c against a nameserver of our own
+ *
+ * dns.c is included here rather than linked, with the resolver
+ * configuration, hosts file and nameserver port pointed at ones made by
+ * the test.  The nameserver runs in a child process on 127.0.0.1, by UDP
+ * and TCP, and answers a few names in awkward ways.  Run by "make check".
+ * --
+ * This file is distributed according to the GNU General Public
+ * License.  For full details, read the top of 'main.c' or the
+ * file called COPYING that was distributed with this code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Where the resolver looks, filled in before it's used */
+static char dnstest_resolvconf[256];
+static char dnstest_hostsfile[256];
+static unsigned short dnstest_port;
+
+#define DNS_RESOLV_CONF dnstest_resolvconf
+#define DNS_HOSTS_FILE dnstest_hostsfile
+#define DNS_PORT dnstest_port
+#include "dns.c"
+
+/* Longest any lookup should take; a nameserver timeout is longer, so
+   taking this long means a reply was wrongly ignored */
+#define DNSTEST_MAX_WAIT 1500
+
+/* Nameserver timeout given in resolv.conf, in seconds, and how long a
+   lookup nobody answers should take: each of the two nameservers once */
+#define DNSTEST_NS_TIMEOUT 2
+#define DNSTEST_NO_ANSWER (2 * DNSTEST_NS_TIMEOUT * 1000)
+
+/* Kinds of lookup */
+#define DNSTEST_ADDR  0
+#define DNSTEST_ADDRS 1
+#define DNSTEST_NAME  2
+
+/* A lookup to make, what it should find and how long it should take */
+struct dnstest {
+  const char *what;
+  int kind;
+  const char *query;
+  const char *expect;
+  unsigned long least, most;
+};
+
+/* What a lookup found */
+struct testresult {
+  const struct dnstest *test;
+  int done;
+  char got[128];
+};
+
+static struct dnstest tests[] = {
+  { "name that doesn't exist", DNSTEST_ADDR, "nx.test", 0,
+    0, DNSTEST_MAX_WAIT },
+  { "server failure, next nameserver", DNSTEST_ADDR, "flaky.test",
+    "10.0.0.2", 0, DNSTEST_MAX_WAIT },
+  { "truncated reply, again by TCP", DNSTEST_ADDR, "big.test", "10.0.0.3",
+    0, DNSTEST_MAX_WAIT },
+  { "chain of aliases", DNSTEST_ADDR, "alias.test", "10.0.0.4",
+    0, DNSTEST_MAX_WAIT },
+  { "name from the search list", DNSTEST_ADDR, "short", "10.0.0.5",
+    0, DNSTEST_MAX_WAIT },
+  { "replies to other questions ignored", DNSTEST_ADDR, "spoof.test",
+    "10.0.0.6", 0, DNSTEST_MAX_WAIT },
+#ifdef HAVE_IPV6
+  { "name with only an IPv6 address", DNSTEST_ADDR, "v6only.test",
+    "2001:db8::7", 0, DNSTEST_MAX_WAIT },
+  { "every address, IPv6 first", DNSTEST_ADDRS, "dual.test",
+    "2001:db8::8 10.0.0.8", 0, DNSTEST_MAX_WAIT },
+#else /* HAVE_IPV6 */
+  { "name with only an IPv6 address", DNSTEST_ADDR, "v6only.test", 0,
+    0, DNSTEST_MAX_WAIT },
+  { "every address, IPv4 only", DNSTEST_ADDRS, "dual.test", "10.0.0.8",
+    0, DNSTEST_MAX_WAIT },
+#endif /* HAVE_IPV6 */
+  { "name of an address", DNSTEST_NAME, "10.0.0.9", "ptr.test",
+    0, DNSTEST_MAX_WAIT },
+  { "address without a name", DNSTEST_NAME, "10.0.0.99", "10.0.0.99",
+    0, DNSTEST_MAX_WAIT },
+  { "name from the hosts file, IPv4 preferred", DNSTEST_ADDR, "hosts.test",
+    "10.0.0.10", 0, DNSTEST_MAX_WAIT },
+  { "address from the hosts file", DNSTEST_NAME, "10.0.0.10", "hosts.test",
+    0, DNSTEST_MAX_WAIT },
+  { "nameservers that don't answer", DNSTEST_ADDR, "silent.test", 0,
+    DNSTEST_NO_ANSWER - 500, DNSTEST_NO_ANSWER + DNSTEST_MAX_WAIT },
+  { 0, 0, 0, 0, 0, 0 }
+};
+
+/* How many times the nameserver has been asked about each name */
+struct nsname {
+  char name[DNS_MAX_HOSTLEN];
+  int count;
+};
+
+static struct nsname nsnames[16];
+
+/* forward declarations */
+static int _ns_count(const char *);
+static size_t _ns_putname(unsigned char *, size_t, const char *);
+static size_t _ns_putrr(unsigned char *, size_t, const char *, int,
+                        const unsigned char *, size_t);
+static size_t _ns_putaddr(unsigned char *, size_t, const char *,
+                          const char *);
+static size_t _ns_reply(unsigned char *, const unsigned char *, size_t,
+                        unsigned int, int);
+static int _ns_answer(int, const unsigned char *, size_t, int,
+                      const struct sockaddr *, socklen_t);
+static void _ns_serve(int, int);
+static int _ns_start(int *, int *);
+static void _test_answer(void *, void *, const char *, const char *);
+static void _test_addrs(void *, void *, const char **, const char *);
+static int _test_run(struct dnstest *);
+
+/* Bits of the real program dns.c needs */
+struct globalvars g;
+
+int syscall_fail(const char *function, const char *arg, const char *message) {
+  fprintf(stderr, "# %s(%s) failed: %s\n", function, (arg ? arg : ""),
+          (message ? message : strerror(errno)));
+  return 0;
+}
+
+int error(const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  fprintf(stderr, "# ");
+  vfprintf(stderr, format, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  return 0;
+}
+
+int debug(const char *format, ...) {
+  va_list ap;
+
+  if (!getenv("DNSTEST_DEBUG"))
+    return 0;
+
+  va_start(ap, format);
+  fprintf(stderr, "# ");
+  vfprintf(stderr, format, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  return 0;
+}
+
+/* Count a question about a name, returning how many there have been */
+static int _ns_count(const char *name) {
+  int i;
+
+  for (i = 0; (i < (int)(sizeof(nsnames) / sizeof(struct nsname)))
+              && nsnames[i].count; i++) {
+    if (!strcmp(nsnames[i].name, name))
+      return ++nsnames[i].count;
+  }
+
+  if (i < (int)(sizeof(nsnames) / sizeof(struct nsname))) {
+    snprintf(nsnames[i].name, sizeof(nsnames[i].name), "%s", name);
+    nsnames[i].count = 1;
+  }
+
+  return 1;
+}
+
+/* Put a name into a message, uncompressed */
+static size_t _ns_putname(unsigned char *buf, size_t pos, const char *name) {
+  const char *dot;
+
+  while (*name) {
+    dot = strchr(name, '.');
+    if (!dot)
+      dot = name + strlen(name);
+
+    buf[pos++] = dot - name;
+    memcpy(buf + pos, name, dot - name);
+    pos += dot - name;
+    name = (*dot ? dot + 1 : dot);
+  }
+  buf[pos++] = 0;
+
+  return pos;
+}
+
+/* Put a resource record into a message */
+static size_t _ns_putrr(unsigned char *buf, size_t pos, const char *name,
+                        int type, const unsigned char *data, size_t len) {
+  pos = _ns_putname(buf, pos, name);
+  buf[pos++] = type >> 8;
+  buf[pos++] = type & 0xff;
+  buf[pos++] = DNS_CLASS_IN >> 8;
+  buf[pos++] = DNS_CLASS_IN & 0xff;
+  buf[pos++] = 0;
+  buf[pos++] = 0;
+  buf[pos++] = 0x0e;
+  buf[pos++] = 0x10;
+  buf[pos++] = len >> 8;
+  buf[pos++] = len & 0xff;
+  memcpy(buf + pos, data, len);
+
+  return pos + len;
+}
+
+/* Put an A or AAAA record into a message */
+static size_t _ns_putaddr(unsigned char *buf, size_t pos, const char *name,
+                          const char *ip) {
+  unsigned char addr[16];
+
+  if (strchr(ip, ':')) {
+    inet_pton(AF_INET6, ip, addr);
+    return _ns_putrr(buf, pos, name, DNS_TYPE_AAAA, addr, 16);
+  }
+
+  inet_pton(AF_INET, ip, addr);
+  return _ns_putrr(buf, pos, name, DNS_TYPE_A, addr, 4);
+}
+
+/* Start a reply to a query with the question copied from it, returning
+   where the answers go */
+static size_t _ns_reply(unsigned char *buf, const unsigned char *query,
+                        size_t qend, unsigned int flags, int answers) {
+  memcpy(buf, query, qend);
+  flags |= DNS_FLAG_QR | 0x0180;
+  buf[2] = flags >> 8;
+  buf[3] = flags & 0xff;
+  buf[6] = 0;
+  buf[7] = answers;
+  buf[8] = buf[9] = buf[10] = buf[11] = 0;
+
+  return qend;
+}
+
+/* Answer a query, by UDP to the address given or by TCP.  Returns 0 when
+   done, -1 if it didn't make sense */
+static int _ns_answer(int sock, const unsigned char *query, size_t len,
+                      int tcp, const struct sockaddr *to, socklen_t tolen) {
+  unsigned char msgs[4][DNS_UDP_MAX];
+  size_t lens[4], pos, qend;
+  char name[DNS_MAX_HOSTLEN], *c;
+  int n, i, count, qtype;
+
+  pos = DNS_HEADER_LEN;
+  if ((len < DNS_HEADER_LEN)
+      || _dns_readname(query, len, &pos, name, sizeof(name))
+      || (pos + 4 > len))
+    return -1;
+  qtype = (query[pos] << 8) | query[pos + 1];
+  qend = pos + 4;
+  for (c = name; *c; c++)
+    *c = tolower(*c);
+  count = _ns_count(name);
+
+  n = 1;
+  if (!strcmp(name, "flaky.test") && (count == 1)) {
+    lens[0] = _ns_reply(msgs[0], query, qend, 2, 0);
+
+  } else if (!strcmp(name, "flaky.test")) {
+    pos = _ns_reply(msgs[0], query, qend, 0, 1);
+    lens[0] = _ns_putaddr(msgs[0], pos, name, "10.0.0.2");
+
+  } else if (!strcmp(name, "big.test") && !tcp) {
+    lens[0] = _ns_reply(msgs[0], query, qend, DNS_FLAG_TC, 0);
+
+  } else if (!strcmp(name, "big.test")) {
+    pos = _ns_reply(msgs[0], query, qend, 0, 1);
+    lens[0] = _ns_putaddr(msgs[0], pos, name, "10.0.0.3");
+
+  } else if (!strcmp(name, "alias.test")) {
+    unsigned char target[DNS_MAX_HOSTLEN];
+
+    pos = _ns_reply(msgs[0], query, qend, 0, 3);
+    pos = _ns_putrr(msgs[0], pos, "alias.test", 5, target,
+                    _ns_putname(target, 0, "alias2.test"));
+    pos = _ns_putrr(msgs[0], pos, "alias2.test", 5, target,
+                    _ns_putname(target, 0, "real.test"));
+    lens[0] = _ns_putaddr(msgs[0], pos, "real.test", "10.0.0.4");
+
+  } else if (!strcmp(name, "short.search.test")) {
+    pos = _ns_reply(msgs[0], query, qend, 0, 1);
+    lens[0] = _ns_putaddr(msgs[0], pos, name, "10.0.0.5");
+
+  } else if (!strcmp(name, "spoof.test")) {
+    /* Wrong ID, wrong name, wrong class, then the real answer */
+    for (i = 0; i < 4; i++) {
+      pos = _ns_reply(msgs[i], query, qend, 0, 1);
+      lens[i] = _ns_putaddr(msgs[i], pos, name,
+                            (i < 3 ? "10.6.6.6" : "10.0.0.6"));
+    }
+    msgs[0][1] ^= 1;
+    msgs[1][DNS_HEADER_LEN + 1] = 'x';
+    msgs[2][qend - 1] = 3;
+    n = 4;
+
+  } else if (!strcmp(name, "v6only.test") && (qtype == DNS_TYPE_AAAA)) {
+    pos = _ns_reply(msgs[0], query, qend, 0, 1);
+    lens[0] = _ns_putaddr(msgs[0], pos, name, "2001:db8::7");
+
+  } else if (!strcmp(name, "v6only.test")) {
+    /* Name exists, but has nothing of that type */
+    lens[0] = _ns_reply(msgs[0], query, qend, 0, 0);
+
+  } else if (!strcmp(name, "dual.test")) {
+    pos = _ns_reply(msgs[0], query, qend, 0, 1);
+    lens[0] = _ns_putaddr(msgs[0], pos, name,
+                          (qtype == DNS_TYPE_AAAA ? "2001:db8::8"
+                                                  : "10.0.0.8"));
+
+  } else if (!strcmp(name, "9.0.0.10.in-addr.arpa")
+             && (qtype == DNS_TYPE_PTR)) {
+    unsigned char target[DNS_MAX_HOSTLEN];
+
+    pos = _ns_reply(msgs[0], query, qend, 0, 1);
+    lens[0] = _ns_putrr(msgs[0], pos, name, DNS_TYPE_PTR, target,
+                        _ns_putname(target, 0, "ptr.test"));
+
+  } else if (!strcmp(name, "hosts.test")
+             || !strcmp(name, "10.0.0.10.in-addr.arpa")) {
+    /* Should have come from the hosts file; a wrong answer if not */
+    pos = _ns_reply(msgs[0], query, qend, 0, 1);
+    lens[0] = _ns_putaddr(msgs[0], pos, name, "10.6.6.6");
+
+  } else if (!strcmp(name, "silent.test")) {
+    /* Never answer */
+    n = 0;
+
+  } else {
+    /* Nothing else exists */
+    lens[0] = _ns_reply(msgs[0], query, qend, DNS_RCODE_NXDOMAIN, 0);
+  }
+
+  for (i = 0; i < n; i++) {
+    if (tcp) {
+      unsigned char lenbuf[2];
+
+      lenbuf[0] = lens[i] >> 8;
+      lenbuf[1] = lens[i] & 0xff;
+      if ((write(sock, lenbuf, 2) != 2)
+          || (write(sock, msgs[i], lens[i]) != (ssize_t)lens[i]))
+        return -1;
+    } else {
+      sendto(sock, msgs[i], lens[i], 0, to, tolen);
+    }
+  }
+
+  return 0;
+}
+
+/* Be the nameserver until killed */
+static void _ns_serve(int udp, int tcp) {
+  struct pollfd fds[2];
+
+  /* Don't outlive the tests if they go wrong */
+  alarm(60);
+
+  fds[0].fd = udp;
+  fds[0].events = POLLIN;
+  fds[1].fd = tcp;
+  fds[1].events = POLLIN;
+  while (poll(fds, 2, -1) >= 0) {
+    unsigned char buf[DNS_PACKET_MAX];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    ssize_t len;
+
+    if (fds[0].revents & POLLIN) {
+      fromlen = sizeof(from);
+      len = recvfrom(udp, buf, sizeof(buf), 0, (struct sockaddr *)&from,
+                     &fromlen);
+      if (len > 0)
+        _ns_answer(udp, buf, len, 0, (struct sockaddr *)&from, fromlen);
+    }
+
+    if (fds[1].revents & POLLIN) {
+      size_t got, want;
+      int sock;
+
+      sock = accept(tcp, 0, 0);
+      if (sock == -1)
+        continue;
+
+      got = 0;
+      want = 2;
+      while (got < want) {
+        len = read(sock, buf + got, want - got);
+        if (len <= 0)
+          break;
+        got += len;
+        if (got == 2)
+          want = 2 + ((buf[0] << 8) | buf[1]);
+      }
+      if (got == want)
+        _ns_answer(sock, buf + 2, want - 2, 1, 0, 0);
+      close(sock);
+    }
+  }
+
+  exit(0);
+}
+
+/* Make the nameserver's sockets, both on the same port.  Returns 0 on
+   success */
+static int _ns_start(int *udp, int *tcp) {
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  int tries, on;
+
+  for (tries = 0; tries < 20; tries++) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addrlen = sizeof(addr);
+
+    *udp = socket(AF_INET, SOCK_DGRAM, 0);
+    if ((*udp == -1) || bind(*udp, (struct sockaddr *)&addr, sizeof(addr))
+        || getsockname(*udp, (struct sockaddr *)&addr, &addrlen))
+      return -1;
+
+    on = 1;
+    *tcp = socket(AF_INET, SOCK_STREAM, 0);
+    if (*tcp == -1)
+      return -1;
+    setsockopt(*tcp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (!bind(*tcp, (struct sockaddr *)&addr, sizeof(addr))
+        && !listen(*tcp, 5)) {
+      dnstest_port = ntohs(addr.sin_port);
+      return 0;
+    }
+
+    /* Something has the TCP port, try another */
+    close(*udp);
+    close(*tcp);
+  }
+
+  return -1;
+}
+
+/* Called with the answer to a lookup of one address, or of a name (which
+   is the address again if it has none) */
+static void _test_answer(void *boundto, void *data, const char *ip,
+                         const char *name) {
+  struct testresult *result = (struct testresult *)data;
+  const char *got;
+
+  got = (result->test->kind == DNSTEST_NAME ? name : ip);
+  result->done = 1;
+  snprintf(result->got, sizeof(result->got), "%s", (got ? got : ""));
+}
+
+/* Called with the answer to a lookup of every address */
+static void _test_addrs(void *boundto, void *data, const char **addrs,
+                        const char *name) {
+  struct testresult *result = (struct testresult *)data;
+  size_t len;
+
+  result->done = 1;
+  result->got[0] = '\0';
+  for (len = 0; addrs && *addrs; addrs++) {
+    snprintf(result->got + len, sizeof(result->got) - len, "%s%s",
+             (len ? " " : ""), *addrs);
+    len = strlen(result->got);
+  }
+}
+
+/* Make a lookup and check its answer.  Returns 0 if it was right */
+static int _test_run(struct dnstest *test) {
+  unsigned long long start, took;
+  struct testresult result;
+
+  memset(&result, 0, sizeof(result));
+  result.test = test;
+  start = timer_now();
+  switch (test->kind) {
+    case DNSTEST_ADDR:
+      dns_addrfromhost(&tests, &result, test->query, _test_answer);
+      break;
+    case DNSTEST_ADDRS:
+      dns_addrsfromhost(&tests, &result, test->query, _test_addrs);
+      break;
+    case DNSTEST_NAME:
+      dns_hostfromaddr(&tests, &result, test->query, _test_answer);
+      break;
+  }
+  while (!result.done && (timer_now() - start < test->most)) {
+    net_poll();
+    timer_poll();
+  }
+  took = timer_now() - start;
+
+  if (!result.done) {
+    printf("# no answer about '%s' in time\n", test->query);
+    dns_delall(&tests);
+    return -1;
+  } else if (strcmp(result.got, (test->expect ? test->expect : ""))) {
+    printf("# '%s' is '%s', expected '%s'\n", test->query, result.got,
+           (test->expect ? test->expect : ""));
+    return -1;
+  } else if (took < test->least) {
+    printf("# answer about '%s' took %llums, expected at least %lums\n",
+           test->query, took, test->least);
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char dir[128];
+  const char *tmpdir;
+  FILE *fd;
+  pid_t ns;
+  int udp, tcp, i, failed;
+
+  tmpdir = getenv("TMPDIR");
+  snprintf(dir, sizeof(dir), "%s/dnstest.XXXXXX", (tmpdir ? tmpdir : "/tmp"));
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  /* The same nameserver twice, so it can fail once and be asked again */
+  snprintf(dnstest_resolvconf, sizeof(dnstest_resolvconf), "%s/resolv.conf",
+           dir);
+  snprintf(dnstest_hostsfile, sizeof(dnstest_hostsfile), "%s/hosts", dir);
+  fd = fopen(dnstest_resolvconf, "w");
+  if (!fd) {
+    perror(dnstest_resolvconf);
+    rmdir(dir);
+    return 1;
+  }
+  fprintf(fd, "nameserver 127.0.0.1\n"
+              "nameserver 127.0.0.1\n"
+              "search search.test\n"
+              "options timeout:%d attempts:1\n", DNSTEST_NS_TIMEOUT);
+  fclose(fd);
+
+  /* An IPv6 address first, so preferring IPv4 is tested where it matters */
+  fd = fopen(dnstest_hostsfile, "w");
+  if (!fd) {
+    perror(dnstest_hostsfile);
+    unlink(dnstest_resolvconf);
+    rmdir(dir);
+    return 1;
+  }
+  fprintf(fd, "# written by dnstest\n"
+              "2001:db8::10\thosts.test\n"
+              "10.0.0.10\thosts.test other.test\n");
+  fclose(fd);
+
+  if (_ns_start(&udp, &tcp)) {
+    perror("nameserver");
+    unlink(dnstest_hostsfile);
+    unlink(dnstest_resolvconf);
+    rmdir(dir);
+    return 1;
+  }
+
+  fflush(stdout);
+  ns = fork();
+  if (ns == -1) {
+    perror("fork");
+    return 1;
+  } else if (!ns) {
+    _ns_serve(udp, tcp);
+  }
+  close(udp);
+  close(tcp);
+
+  memset(&g, 0, sizeof(g));
+  g.dns_timeout = 20;
+  dns_start();
+
+  for (i = 0; tests[i].what; i++)
+    ;
+  printf("1..%d\n", i);
+
+  failed = 0;
+  for (i = 0; tests[i].what; i++) {
+    if (_test_run(&tests[i])) {
+      printf("not ok %d - %s\n", i + 1, tests[i].what);
+      failed++;
+    } else {
+      printf("ok %d - %s\n", i + 1, tests[i].what);
+    }
+  }
+
+  dns_flush();
+  timer_flush();
+  net_closeall();
+
+  kill(ns, SIGTERM);
+  waitpid(ns, 0, 0);
+  unlink(dnstest_hostsfile);
+  unlink(dnstest_resolvconf);
+  rmdir(dir);
+
+  return (failed ? 1 : 0);
+}
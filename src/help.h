@@ -97,6 +97,13 @@ static char *help_recall[] = {
   "can specify the number of lines to recall and an optional",
   "starting point in the file, or you can specify ALL to",
   "recall all log messages",
+  "",
+  "/DIRCPROXY RECALL <channel|nickname|SERVER> SINCE <time>",
+  "/DIRCPROXY RECALL <channel|nickname|SERVER> BETWEEN <time> <time>",
+  "recalls log messages logged since a time, or between two",
+  "times.  A time can be an amount of time ago (30m, 2h, 3d),",
+  "a time of day (18:00), a day (today, yesterday, friday,",
+  "2009-03-27) or a day and time of day (friday/18:00)",
   0
 };
 
@@ -258,4 +265,26 @@ static char *help_set[] = {
    0
 };
 
+/* help search */
+static char *help_search[] = {
+  "/DIRCPROXY SEARCH <word|nick:<nickname>|event:<type>>...",
+  "/DIRCPROXY SEARCH in:<channel|nickname|SERVER> <terms>...",
+  "recalls log messages that match all of the search terms",
+  "given.  A word matches lines containing it, nick: matches",
+  "lines from a nickname and event: lines of a type (as used",
+  "for log_events, e.g. join or message).  All the log files",
+  "are searched unless one is picked with in:, though only",
+  "the most recent 20000 lines of each",
+  0
+};
+
+/* help dnsstats */
+static char *help_dnsstats[] = {
+  "/DIRCPROXY DNSSTATS",
+  "displays how many DNS lookups have been answered from",
+  "the cache of remembered answers, rather than by asking",
+  "the nameservers again",
+  0
+};
+
 #endif /* __DIRCPROXY_HELP_H */
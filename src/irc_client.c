@@ -39,6 +39,7 @@
 #include "dns.h"
 #include "timers.h"
 #include "dcc_net.h"
+#include "diskio.h"
 #include "irc_log.h"
 #include "irc_net.h"
 #include "irc_prot.h"
@@ -48,12 +49,15 @@
 #include "logo.h"
 
 /* forward declarations */
-static void _ircclient_connected2(struct ircproxy *, void *, const char *,
-                                  const char *);
+static int _ircclient_needhost(void);
+static int _ircclient_hostmask(const char *);
+static void _ircclient_gothost(struct ircproxy *, void *, const char *,
+                               const char *);
 static void _ircclient_data(struct ircproxy *, int);
 static void _ircclient_error(struct ircproxy *, int, int);
 static int _ircclient_detach(struct ircproxy *, const char *);
 static int _ircclient_gotmsg(struct ircproxy *, const char *);
+static void _ircclient_proceed(struct ircproxy *);
 static int _ircclient_authenticate(struct ircproxy *, const char *);
 static void _ircclient_resetnick(struct ircproxy *, void *);
 static int _ircclient_got_details(struct ircproxy *, const char *,
@@ -64,11 +68,13 @@ static int _ircclient_send_dccreject(struct ircproxy *, const char *,
                                      const char *);
 int  _ircclient_handle_privmsg(struct ircproxy *, struct ircmessage);
 void _ircclient_handle_recall(struct ircproxy *, struct ircmessage);
+void _ircclient_handle_search(struct ircproxy *, struct ircmessage);
 void _ircclient_handle_users(struct ircproxy *, struct ircmessage);
 void _ircclient_handle_kill(struct ircproxy *, struct ircmessage);
 void _ircclient_handle_notify(struct ircproxy *, struct ircmessage);
 int  _ircclient_handle_jump(struct ircproxy *, struct ircmessage);
 void _ircclient_handle_status(struct ircproxy *, struct ircmessage);
+void _ircclient_handle_dnsstats(struct ircproxy *, struct ircmessage);
 void _ircclient_handle_help(struct ircproxy *, struct ircmessage);
 
 /* New user mode bits */
@@ -87,21 +93,19 @@ void _ircclient_handle_help(struct ircproxy *, struct ircmessage);
 int ircclient_connected(struct ircproxy *p) {
   char ip[DNS_MAX_HOSTLEN];
 
-  ircclient_send_notice(p, "Looking up your hostname...");
-
+  /* They're known by their address until we find out otherwise */
   net_ntop(&p->client_addr, ip, sizeof(ip));
-  dns_hostfromaddr(p, 0, ip, (dns_fun_t) _ircclient_connected2);
-
-  return 0;
-}
-
-/* Called once a client DNS lookup has completed */
-static void _ircclient_connected2(struct ircproxy *p, void *data,
-                                  const char *ip, const char *name) {
-  p->client_host = x_strdup(name);
+  p->client_host = x_strdup(ip);
   if (!p->hostname)
-    p->hostname = x_strdup(name);
-  ircclient_send_notice(p, "Got your hostname.");
+    p->hostname = x_strdup(ip);
+
+  /* Their hostname only matters if a connection class could be chosen
+     by it, and there's no reason to make them wait for it otherwise */
+  if (g.client_lookup && _ircclient_needhost()) {
+    ircclient_send_notice(p, "Looking up your hostname...");
+    p->client_resolving = 1;
+    dns_hostfromaddr(p, 0, ip, (dns_fun_t) _ircclient_gothost);
+  }
 
   p->client_status |= IRC_CLIENT_CONNECTED;
   net_hook(p->client_sock, SOCK_NORMAL, (void *)p,
@@ -110,8 +114,58 @@ static void _ircclient_connected2(struct ircproxy *p, void *data,
 
   debug("Client connected from %s", p->client_host);
 
-  timer_new((void *)p, "client_auth", g.client_timeout,
+  timer_set(&(p->client_auth_timer), (void *)p, "client_auth",
+            TIMER_SECONDS(g.client_timeout),
             TIMER_FUNCTION(_ircclient_timedout), (void *)0);
+
+  return 0;
+}
+
+/* Does any connection class have a from mask that's a hostname? */
+static int _ircclient_needhost(void) {
+  struct ircconnclass *cc;
+  struct strlist *m;
+
+  for (cc = connclasses; cc; cc = cc->next)
+    for (m = cc->masklist; m; m = m->next)
+      if (_ircclient_hostmask(m->str))
+        return 1;
+
+  return 0;
+}
+
+/* Whether a from mask can only match a hostname, rather than an address */
+static int _ircclient_hostmask(const char *mask) {
+  if (strchr(mask, ':'))
+    return 0;
+
+  return (strspn(mask, "0123456789.*?") != strlen(mask));
+}
+
+/* Called once a client DNS lookup has completed */
+static void _ircclient_gothost(struct ircproxy *p, void *data,
+                               const char *ip, const char *name) {
+  p->client_resolving = 0;
+  if (name && strcmp(name, p->client_host)) {
+    debug("Client %s is %s", p->client_host, name);
+
+    if (p->hostname && !strcmp(p->hostname, p->client_host)) {
+      free(p->hostname);
+      p->hostname = x_strdup(name);
+    }
+    free(p->client_host);
+    p->client_host = x_strdup(name);
+  }
+
+  /* Nothing more to do if they've already got in, or gone */
+  if (p->dead || !(p->client_status & IRC_CLIENT_CONNECTED)
+      || (p->client_status & IRC_CLIENT_AUTHED))
+    return;
+
+  ircclient_send_notice(p, "Got your hostname.");
+
+  /* Might have been waiting for this to authenticate them */
+  _ircclient_proceed(p);
 }
 
 /* Called when a client sends us stuff. */
@@ -172,9 +226,11 @@ static int _ircclient_detach(struct ircproxy *p, const char *message) {
 
   } else {
     debug("Detaching proxy");
-    if (p->client_status == IRC_CLIENT_ACTIVE)
+    if (p->client_status == IRC_CLIENT_ACTIVE) {
       irclog_log(p, IRC_LOG_CLIENT, IRC_LOGFILE_ALL, PACKAGE,
                  "You disconnected");
+      irclog_markread(p);
+    }
 
     /* Drop modes */
     if ((p->client_status == IRC_CLIENT_ACTIVE)
@@ -492,6 +548,9 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
         if (!irc_strcasecmp(msg.params[0], "RECALL")) {
           _ircclient_handle_recall(p, msg);
 
+        } else if (!irc_strcasecmp(msg.params[0], "SEARCH")) {
+          _ircclient_handle_search(p, msg);
+
         } else if (p->conn_class->allow_persist
                    && !irc_strcasecmp(msg.params[0], "PERSIST")) {
           /* User wants a die_on_close proxy to persist */
@@ -637,6 +696,9 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
         } else if (!irc_strcasecmp(msg.params[0], "STATUS")) {
           _ircclient_handle_status(p, msg);
 
+        } else if (!irc_strcasecmp(msg.params[0], "DNSSTATS")) {
+          _ircclient_handle_dnsstats(p, msg);
+
         } else if (!irc_strcasecmp(msg.params[0], "HELP")) {
           /* User needs a little help */
           _ircclient_handle_help(p, msg);
@@ -653,13 +715,25 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
     }
   }
 
+  _ircclient_proceed(p);
+
+  ircprot_freemsg(&msg);
+  return 0;
+}
+
+/* Authenticate the client and connect to a server, as soon as we have
+   enough information to do each */
+static void _ircclient_proceed(struct ircproxy *p) {
   /* Do we have enough information to authenticate them? */
   if (!(p->client_status & IRC_CLIENT_AUTHED)
       && (p->client_status & IRC_CLIENT_GOTPASS)
       && (p->client_status & IRC_CLIENT_GOTNICK)
       && (p->client_status & IRC_CLIENT_GOTUSER))
   {
-    _ircclient_authenticate(p, p->password);
+    /* Keep the password if we need their hostname to decide */
+    if (_ircclient_authenticate(p, p->password) > 0)
+      return;
+
     free(p->password);
     p->password = 0;
     p->client_status &= ~(IRC_CLIENT_GOTPASS);
@@ -677,8 +751,10 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
                                 "server");
 
           /* This won't delete an existing timer */
-          timer_new((void *)p, "client_connect", g.connect_timeout,
-                    TIMER_FUNCTION(_ircclient_timedout), (void *)1);
+          timer_set(&(p->client_connect_timer), (void *)p, "client_connect",
+                    TIMER_SECONDS(g.connect_timeout),
+                    TIMER_FUNCTION(_ircclient_timedout),
+                    (void *)1);
         }
       } else if (!IS_SERVER_READY(p)) {
         ircclient_send_notice(p, "Connection to server is in progress...");
@@ -687,12 +763,10 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
       ircclient_welcome(p);
     }
   }
-
-  ircprot_freemsg(&msg);
-  return 0;
 }
 
-/* Got a password */
+/* Got a password, returns 1 if we can't decide until we know their
+   hostname */
 static int _ircclient_authenticate(struct ircproxy *p, const char *password) {
   struct ircconnclass *cc;
 
@@ -711,13 +785,17 @@ static int _ircclient_authenticate(struct ircproxy *p, const char *password) {
         struct strlist *m;
         const char *ip;
         char buf[40];
+        int wait;
 
         ip = net_ntop(&p->client_addr, buf, sizeof(buf));
 
+        wait = 0;
         m = cc->masklist;
         while (m) {
           if (strcasematch(ip, m->str) || strcasematch(p->client_host, m->str))
             break;
+          if (p->client_resolving && _ircclient_hostmask(m->str))
+            wait = 1;
 
           m = m->next;
         }
@@ -725,6 +803,12 @@ static int _ircclient_authenticate(struct ircproxy *p, const char *password) {
         /* We got a matching masklist, so this one's ok */
         if (m)
           break;
+
+        /* Might match once we know their hostname */
+        if (wait) {
+          debug("Waiting for hostname to authenticate");
+          return 1;
+        }
       } else {
         break;
       }
@@ -992,8 +1076,10 @@ int ircclient_setnickname(struct ircproxy *p) {
 int ircclient_checknickname(struct ircproxy *p) {
   if (p->conn_class && p->conn_class->nick_keep
       && strcmp(p->nickname, p->setnickname))
-    timer_new((void *)p, "client_resetnick", NICK_GUARD_TIME,
-              TIMER_FUNCTION(_ircclient_resetnick), (void *)0);
+    timer_set(&(p->client_resetnick_timer), (void *)p, "client_resetnick",
+              TIMER_SECONDS(NICK_GUARD_TIME),
+              TIMER_FUNCTION(_ircclient_resetnick),
+              (void *)0);
 
   return 0;
 }
@@ -1165,8 +1251,9 @@ int ircclient_change_mode(struct ircproxy *p, const char *change) {
 
 /* Close the client socket */
 int ircclient_close(struct ircproxy *p) {
-  timer_del((void *)p, "client_auth");
-  timer_del((void *)p, "client_connect");
+  timer_clear(&(p->client_auth_timer));
+  timer_clear(&(p->client_connect_timer));
+  irclog_recall_cancel(p);
 
   net_close(&(p->client_sock));
   p->client_sock = -1;
@@ -1600,6 +1687,7 @@ static int _ircclient_send_dccreject(struct ircproxy *p, const char *msg,
 
   /* /DIRCPROXY STATUS handler */
 void _ircclient_handle_status(struct ircproxy *p, struct ircmessage msg) {
+  struct diskio_stats ds;
   struct ircchannel *c;
   struct strlist *s;
 
@@ -1643,6 +1731,14 @@ void _ircclient_handle_status(struct ircproxy *p, struct ircmessage msg) {
     if (p->server_status & IRC_SERVER_GOTWELCOME)
       ircclient_send_notice(p, "-   Have been welcomed");
   }
+  if (p->server_connect_timer)
+    ircclient_send_notice(p, "-   Waiting %ld ms for a turn to connect",
+                          timer_left(p->server_connect_timer));
+  if (p->server_recon_timer)
+    ircclient_send_notice(p, "-   Retrying in %ld ms (backed off to %lu ms "
+                          "after %lu failures)",
+                          timer_left(p->server_recon_timer),
+                          p->server_backoff, p->server_failures);
   ircclient_send_notice(p, "-");
 
   ircclient_send_notice(p,  "- Servers.  Current marked by '->'");
@@ -1676,6 +1772,13 @@ void _ircclient_handle_status(struct ircproxy *p, struct ircmessage msg) {
   ircclient_send_notice(p, "-   Expecting NICK count: %d",
                         p->expecting_nick);
 
+  diskio_getstats(&ds);
+  ircclient_send_notice(p, "-   Disk writes: %lu done (%lu failed), "
+                        "%lu queued", ds.done, ds.failed, ds.pending);
+  ircclient_send_notice(p, "-   Disk queue wait: %lu us average, %lu us most",
+                        (ds.done ? ds.wait_total / ds.done : 0),
+                        ds.wait_max);
+
   if (p->squelch_modes)
     ircclient_send_notice(p, "-   Squelching mode changes:");
   s = p->squelch_modes;
@@ -1685,6 +1788,24 @@ void _ircclient_handle_status(struct ircproxy *p, struct ircmessage msg) {
   }
 }
 
+  /* /DIRCPROXY DNSSTATS handler */
+void _ircclient_handle_dnsstats(struct ircproxy *p, struct ircmessage msg) {
+  struct dns_stats ds;
+
+  dns_getstats(&ds);
+  ircclient_send_notice(p, "%s %s DNS statistics:", PACKAGE, VERSION);
+  ircclient_send_notice(p, "- Cache: %lu answers (%lu negative), room for %ld",
+                        ds.entries, ds.negentries, g.dns_cache_size);
+  ircclient_send_notice(p, "- Lookups: %lu, answered from cache: %lu "
+                        "(%lu%%)", ds.lookups, ds.hits,
+                        (ds.lookups ? ds.hits * 100 / ds.lookups : 0));
+  ircclient_send_notice(p, "-   Of those, answered \"doesn't exist\": %lu",
+                        ds.neghits);
+  ircclient_send_notice(p, "- Forgotten: %lu expired, %lu to make room",
+                        ds.expired, ds.evicted);
+  ircclient_send_notice(p, "- Queries sent to nameservers: %lu", ds.queries);
+}
+
   /* /DIRCPROXY JUMP handler */
 int _ircclient_handle_jump(struct ircproxy *p, struct ircmessage msg) {
   struct strlist *server;
@@ -1892,13 +2013,45 @@ void _ircclient_handle_users(struct ircproxy *p, struct ircmessage msg) {
 void _ircclient_handle_recall(struct ircproxy *p, struct ircmessage msg) {
   char *src, *filter;
   long start, lines;
+  time_t since, until;
+  int range;
 
   /* User wants to recall stuff from log files */
   src = filter = 0;
   start = -1;
   lines = 0;
+  since = until = 0;
+  range = 0;
 
-  if (msg.numparams >= 4) {
+  if ((msg.numparams >= 4) && !irc_strcasecmp(msg.params[2], "SINCE")) {
+    src = msg.params[1];
+    range = 1;
+    if (irclog_strtotime(p, msg.params[3], &since)) {
+      ircclient_send_notice(p, "Don't understand the time '%s'",
+                            msg.params[3]);
+      return;
+    }
+  } else if ((msg.numparams >= 3)
+             && (!irc_strcasecmp(msg.params[2], "SINCE")
+                 || (!irc_strcasecmp(msg.params[2], "BETWEEN")
+                     && (msg.numparams < 5)))) {
+    /* Missing the time, or the second one */
+    ircclient_send_numeric(p, 461, ":Not enough parameters");
+    return;
+  } else if ((msg.numparams >= 5)
+             && !irc_strcasecmp(msg.params[2], "BETWEEN")) {
+    src = msg.params[1];
+    range = 1;
+    if (irclog_strtotime(p, msg.params[3], &since)) {
+      ircclient_send_notice(p, "Don't understand the time '%s'",
+                            msg.params[3]);
+      return;
+    } else if (irclog_strtotime(p, msg.params[4], &until)) {
+      ircclient_send_notice(p, "Don't understand the time '%s'",
+                            msg.params[4]);
+      return;
+    }
+  } else if (msg.numparams >= 4) {
     src = msg.params[1];
     start = atol(msg.params[2]);
     lines = atol(msg.params[3]);
@@ -1938,7 +2091,43 @@ void _ircclient_handle_recall(struct ircproxy *p, struct ircmessage msg) {
     src = p->nickname;
   }
 
-  irclog_recall(p, src, start, lines, filter);
+  if (range) {
+    irclog_recall_range(p, src, since, until, filter);
+  } else {
+    irclog_recall(p, src, start, lines, filter);
+  }
+}
+
+  /* /DIRCPROXY SEARCH handler */
+void _ircclient_handle_search(struct ircproxy *p, struct ircmessage msg) {
+  unsigned long nfound;
+  char **terms, *src;
+  int i, nterms;
+
+  /* User wants to find stuff in the log files, in:<log> picks one */
+  src = IRC_LOGFILE_ALL;
+  terms = (char **)malloc(sizeof(char *) * msg.numparams);
+  nterms = 0;
+
+  for (i = 1; i < msg.numparams; i++) {
+    if (!strncasecmp(msg.params[i], "in:", 3)) {
+      src = msg.params[i] + 3;
+      if (!irc_strcasecmp(src, "SERVER"))
+        src = IRC_LOGFILE_SERVER;
+    } else {
+      terms[nterms++] = msg.params[i];
+    }
+  }
+
+  if (nterms) {
+    nfound = irclog_search(p, src, terms, nterms);
+    ircclient_send_notice(p, "Found %lu matching line%s", nfound,
+                          (nfound == 1 ? "" : "s"));
+  } else {
+    ircclient_send_numeric(p, 461, ":Not enough parameters");
+  }
+
+  free(terms);
 }
 
   /* PRIVMSG handler */
@@ -2141,6 +2330,8 @@ void _ircclient_handle_help(struct ircproxy *p, struct ircmessage msg) {
   if ((msg.numparams >= 2) && strlen(msg.params[1])) {
     if (!irc_strcasecmp(msg.params[1], "RECALL")) {
       help_page = command_help[I_HELP_RECALL];
+    } else if (!irc_strcasecmp(msg.params[1], "SEARCH")) {
+      help_page = command_help[I_HELP_SEARCH];
     } else if (p->conn_class->allow_persist
                && !irc_strcasecmp(msg.params[1], "PERSIST")) {
       help_page = command_help[I_HELP_PERSIST];
@@ -2166,6 +2357,8 @@ void _ircclient_handle_help(struct ircproxy *p, struct ircmessage msg) {
       help_page = command_help[I_HELP_HOST];
     } else if (!irc_strcasecmp(msg.params[1], "STATUS")) {
       help_page = command_help[I_HELP_STATUS];
+    } else if (!irc_strcasecmp(msg.params[1], "DNSSTATS")) {
+      help_page = command_help[I_HELP_DNSSTATS];
     } else if (!irc_strcasecmp(msg.params[1], "USERS")) {
       help_page = command_help[I_HELP_USERS];
     } else if (!irc_strcasecmp(msg.params[1], "KILL")) {
@@ -2199,8 +2392,12 @@ void _ircclient_handle_help(struct ircproxy *p, struct ircmessage msg) {
                            "(show dircproxy message of the day)");
       ircclient_send_notice(p, "-     STATUS    "
                             "(show dircproxy status information)");
+      ircclient_send_notice(p, "-     DNSSTATS  "
+                            "(show how well DNS answers are cached)");
       ircclient_send_notice(p, "-     RECALL    "
                             "(recall text from log files)");
+      ircclient_send_notice(p, "-     SEARCH    "
+                            "(find text in log files)");
       ircclient_send_notice(p, "-     GET    "
 			    "(Get the value of a configuration item)");
       ircclient_send_notice(p, "-     SET    "
@@ -40,7 +40,9 @@ static char * client_commands[] = {
   "STATUS",
   "NOTIFY",
   "GET",
-  "SET"
+  "SET",
+  "SEARCH",
+  "DNSSTATS"
 };
 
 #define I_HELP_INDEX     0
@@ -63,6 +65,8 @@ static char * client_commands[] = {
 #define I_HELP_NOTIFY    17
 #define I_HELP_GET       18
 #define I_HELP_SET       19
+#define I_HELP_SEARCH    20
+#define I_HELP_DNSSTATS  21
 
 static char ** command_help[] = {
   help_index,
@@ -84,7 +88,9 @@ static char ** command_help[] = {
   help_status,
   help_notify,
   help_get,
-  help_set
+  help_set,
+  help_search,
+  help_dnsstats
 };
 
 /* functions */
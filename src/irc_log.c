@@ -36,6 +36,9 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif /* HAVE_MMAP */
 
 #include <pwd.h>
 #include <unistd.h>
@@ -52,11 +55,16 @@
 #include <time.h>
 
 #include "net.h"
+#include "diskio.h"
 #include "irc_prot.h"
 #include "irc_client.h"
 #include "irc_string.h"
+#include "stringex.h"
 
 #include "irc_log.h"
+#include "irc_logindex.h"
+#include "irc_logblock.h"
+#include "irc_logdb.h"
 
 
 /* Log time format for strftime(3) */
@@ -68,6 +76,39 @@
 /* Log time/date format for strftime(3) */
 #define LOG_TIMEDATE_FORMAT "%a, %d %b %Y %H:%M:%S %z"
 
+/* First line of the header kept alongside each persistent log file */
+#define LOG_HEADER_MAGIC "dircproxy-log 1\n"
+
+/* Number of lines between each mark in the sparse timestamp index, to
+ * begin with; it's doubled whenever there'd be more than LOG_MARK_MAX */
+#define LOG_MARK_INTERVAL 64
+#define LOG_MARK_MAX 4096
+
+/* Only this many of the most recent lines of a log are kept in its search
+ * index; the rest of a long log would take too much memory, and too long to
+ * read back in when a persistent one is picked up */
+#define LOG_SEARCH_LINES 20000
+
+/* Uncompressed size at which records being compressed are cut into a new
+ * block; recall uncompresses a whole block to get at any line in it */
+#define LOG_BLOCK_SIZE 65536
+
+/* Where an event is to be written, from a log file's policy */
+#define LOG_TO_INTERNAL 0x01
+#define LOG_TO_USER	0x02
+#define LOG_TO_PIPE	0x04
+
+/* Name of the database in the log directory that logs kept in SQLite share */
+#define LOG_DB_NAME "logs.db"
+
+/* Recall sends this many lines at a time, then waits until the client's
+ * output buffer is below the low water mark (or immediately, if it's below
+ * the high water mark) before sending more.
+ */
+#define LOG_RECALL_BATCH  128
+#define LOG_RECALL_HIWAT  32768
+#define LOG_RECALL_LOWAT  8192
+
 /* Define MIN() */
 #ifndef MIN
 # define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -89,22 +130,159 @@ typedef struct _flag_info {
 	int   value;
 } FlagInfo;
 
+/* A log event formatted ready for writing to one or more log files */
+typedef struct _log_record {
+	time_t	    when;
+	int	    event;
+	const char *from;
+	const char *text;
+
+	char	   *head;	/* "<time> <event> " */
+	char	   *tail;	/* " <from> <text>\n" */
+	char	   *userline;	/* Human-readable line for log_dir, or NULL */
+} LogRecord;
+
+/* A record read back from an internal log file */
+typedef struct _log_entry {
+	time_t	when;
+	int	event;
+	char   *dest;
+	char   *from;
+	char   *text;
+
+	char   *buf;		/* Storage the strings above point into */
+	size_t	bufsz;
+} LogEntry;
+
+/* An internal log file being read back.  The cold blocks are read and
+ * uncompressed one at a time, then the uncompressed part is read either
+ * mapped into memory or, failing that, through stdio.
+ */
+typedef struct _log_reader {
+	int		format;
+
+	int		coldfd;		/* Cold blocks, or -1 */
+	off_t		coldnext;	/* Where the next block starts */
+	off_t		coldend;	/* Where they ended when we started */
+	char	       *block;		/* The current block, uncompressed */
+	size_t		blocksz;
+
+	FILE	       *file;		/* Uncompressed part, if not mapped */
+	const char     *hot;		/* Uncompressed part, if mapped */
+	size_t		hotsize;
+
+	int		incold;		/* Reading a block rather than hot? */
+	const char     *map;		/* Whichever's being read, in memory */
+	size_t		size;
+	size_t		pos;
+
+	unsigned long	line;		/* Line number of the next record */
+	unsigned long	blockend;	/* Line number after the block */
+
+	LogDBCursor    *cursor;		/* Query, if kept in SQLite */
+} LogReader;
+
+/* A recall being sent to the client a batch at a time */
+typedef struct logrecall {
+	LogReader	 *reader;
+	char		 *to;
+	char		 *from;		/* Nickname filter, or NULL */
+
+	unsigned long	  lines;	/* Most lines left to send */
+	time_t		  since, until;	/* Time range, or zero */
+
+	int		  skip;		/* Events left out... */
+	unsigned long	  skipfrom;	/* ...from this line on */
+	struct logdigest  digest;	/* Summary to send first */
+
+	struct logrecall *next;
+} LogRecall;
+
 
 /* Forward prototypes for internal functions */
+static int	_log_makedir(const char *);
 static char *	_safe_name(char *);
 static LogFile *_logfile_get(IRCProxy *, const char *);
+static LogDB *	_log_opendb(IRCProxy *, int);
+static void	_logfile_policy(IRCProxy *, LogFile *, const char *);
+static int	_logpolicy_dests(const struct logpolicy *, int);
+static char *	_logfile_sidename(const LogFile *, const char *);
+static int	_logfile_readheader(const LogFile *);
+static int	_logfile_writeheader(const LogFile *);
+static void	_logfile_reopen(LogFile *);
+static int	_logfile_scan(LogFile *);
+static void	_logfile_coldscan(LogFile *);
+static void	_logfile_indexline(LogFile *, unsigned long, int,
+				   const char *, const char *);
+static int	_logfile_dbscan(LogFile *);
+static int	_logfile_coldopen(LogFile *);
+static void	_logfile_coldreset(LogFile *, int);
+static void	_logfile_addblock(LogFile *, const struct logblock *);
+static int	_logfile_seal(LogFile *);
+static int	_logfile_create(LogFile *);
 static void	_logfile_close(LogFile *);
-static FILE *	_open_user_log(IRCProxy *, const char *);
-static char *	_log_read(FILE *);
-static void	_log_printf(FILE *, const char *, ...);
-static int	_logfile_write(LogFile *, const char *, ...);
+static char *	_user_log_name(IRCProxy *, const char *);
+static long	_log_readline(FILE *, char **, size_t *);
+static void	_log_putvarint(FILE *, unsigned long);
+static int	_log_getvarint(FILE *, unsigned long *);
+static void	_log_putentry(FILE *, time_t, int, const char *, const char *,
+			      const char *);
+static int	_log_readentry(int, FILE *, LogEntry *);
+static int	_log_parseline(LogEntry *);
+static int	_log_skipentry(int, FILE *);
+static void	_log_freeentry(LogEntry *);
+static void	_logrecord_init(IRCProxy *, LogRecord *, int, const char *,
+				const char *, int);
+static void	_logrecord_free(LogRecord *);
+static int	_logfile_write(LogFile *, const LogRecord *, const char *);
+static int	_logfile_dbwrite(LogFile *, const LogRecord *, const char *);
+static int	_user_log_write(IRCProxy *, LogFile *, const char *,
+				const LogRecord *);
 static int	_log_pipe(IRCProxy *, int, const char *, const char *,
 			  const char *);
-static int	_logfile_writetext(IRCProxy *, LogFile *, int, const char *,
-				   const char *, const char *);
-
-static int _irclog_recall(struct ircproxy *, struct logfile *, unsigned long,
-                          unsigned long, const char *, const char *);
+static int	_logfile_writetext(IRCProxy *, LogFile *, const char *,
+				   const LogRecord *);
+static void	_logdigest_add(LogFile *, const LogRecord *);
+static char *	_logdigest_count(char *, unsigned long, const char *,
+				 const char *);
+static char *	_logdigest_text(const struct logdigest *);
+
+static void	_logmark_add(LogFile *, time_t, long);
+static void	_logmark_reset(LogFile *);
+static void	_logmark_seek(LogFile *, LogReader *, time_t);
+static LogReader *_logreader_open(IRCProxy *, LogFile *);
+static LogReader *_logreader_new(LogFile *);
+static void	_logreader_close(LogReader *);
+static void	_logreader_seek(LogReader *, long);
+static void	_logreader_seekblock(LogReader *, const struct logblock *);
+static void	_logreader_seekline(LogReader *, LogFile *, unsigned long);
+static void	_logreader_seektime(LogReader *, LogFile *, time_t);
+static void	_logreader_fill(LogReader *);
+static int	_logreader_ready(LogReader *);
+static int	_logreader_getvarint(LogReader *, unsigned long *);
+static int	_logreader_readentry(LogReader *, LogEntry *);
+static int	_logreader_skipentry(LogReader *);
+static int	_logreader_getentry(LogReader *, LogEntry *);
+static int	_logreader_passentry(LogReader *);
+static int	_logreader_dbentry(LogReader *, LogEntry *);
+static int	_log_sendentry(IRCProxy *, time_t, const LogEntry *,
+			       const char *, const char *);
+static int	_irclog_recall(IRCProxy *, LogFile *, unsigned long,
+			       unsigned long, const char *, const char *,
+			       const struct logdigest *);
+static int	_irclog_recall_range(IRCProxy *, LogFile *, time_t, time_t,
+				     const char *, const char *);
+static void	_logrecall_queue(IRCProxy *, LogReader *, const char *,
+				 const char *, unsigned long, time_t, time_t,
+				 const struct logdigest *);
+static void	_logrecall_run(IRCProxy *, int);
+static void	_logrecall_digest(IRCProxy *, time_t, LogRecall *);
+static void	_logrecall_free(LogRecall *);
+static int	_irclog_recall_lines(IRCProxy *, LogFile *,
+				     const unsigned long *, size_t,
+				     const char *);
+static unsigned long _irclog_search(IRCProxy *, LogFile *, char **, int,
+				    const char *);
 
 
 /* The translation table between our #defines and string event types */
@@ -133,19 +311,40 @@ static FlagInfo flag_table[] = {
  * ID of this dircproxy and a static counter for each time we're called.
  * The temp directory can be changed with either the TMPDIR or TEMP environment
  * variables.
+ *
+ * If the connection class has a log_state_dir, the log files are kept in a
+ * directory under that instead, named after the class, so they're still
+ * there the next time the proxy is created.
  */
 int
 irclog_maketempdir(IRCProxy *p)
 {
 	static unsigned int  counter = 0;
 	struct passwd       *pw;
-	struct stat	     statinfo;
 	const char	    *tmpdir, *uname;
 
 	/* Don't allow ourselves to be called twice on the same proxy */
 	if (p->temp_logdir)
 		return 0;
 
+	if (p->conn_class->log_state_dir) {
+		if (_log_makedir(p->conn_class->log_state_dir))
+			return -1;
+
+		p->temp_logdir = x_sprintf("%s/%s",
+					   p->conn_class->log_state_dir,
+					   p->conn_class->name);
+		debug("Log state directory = '%s'", p->temp_logdir);
+		if (_log_makedir(p->temp_logdir)) {
+			free(p->temp_logdir);
+			p->temp_logdir = 0;
+			return -1;
+		}
+
+		p->persist_logdir = 1;
+		return 0;
+	}
+
 	/* Find a temporary directory */
 	tmpdir = getenv("TMPDIR");
 	if (tmpdir == NULL)
@@ -172,25 +371,37 @@ irclog_maketempdir(IRCProxy *p)
 				   uname, getpid(), counter++);
 	debug("Log temp directory = '%s'", p->temp_logdir);
 
-	/* Make sure this is a safe directory to use */
-	if (lstat(p->temp_logdir, &statinfo)) {
+	if (_log_makedir(p->temp_logdir)) {
+		free(p->temp_logdir);
+		p->temp_logdir = 0;
+		return -1;
+	}
+
+	p->persist_logdir = 0;
+	return 0;
+}
+
+/* _log_makedir
+ * Make sure a directory to keep log files in is safe to use, creating it
+ * if it doesn't exist.  Returns 0 if it's fine, -1 if not.
+ */
+static int
+_log_makedir(const char *dir)
+{
+	struct stat statinfo;
+
+	if (lstat(dir, &statinfo)) {
 		if (errno != ENOENT) {
-			syscall_fail("lstat", p->temp_logdir, 0);
-			free(p->temp_logdir);
-			p->temp_logdir = 0;
+			syscall_fail("lstat", dir, 0);
 			return -1;
 
-		} else if (mkdir(p->temp_logdir, 0700)) {
-			syscall_fail("mkdir", p->temp_logdir, 0);
-			free(p->temp_logdir);
-			p->temp_logdir = 0;
+		} else if (mkdir(dir, 0700)) {
+			syscall_fail("mkdir", dir, 0);
 			return -1;
 		}
 
 	} else if (!S_ISDIR(statinfo.st_mode)) {
 		debug("Existed, but not directory");
-		free(p->temp_logdir);
-		p->temp_logdir = 0;
 		return -1;
 	}
 
@@ -261,6 +472,10 @@ irclog_init(IRCProxy *p, const char *to)
 	if (!(log = _logfile_get(p, to)))
 		return -1;
 
+	/* Events still go to the user's copy and log program even if
+	 * there's no internal log */
+	_logfile_policy(p, log, to);
+
 	if (!p->temp_logdir)
 		return -1;
 
@@ -287,735 +502,2858 @@ irclog_init(IRCProxy *p, const char *to)
 		log->always = p->conn_class->chan_log_always;
 	}
 
+	log->format = p->conn_class->log_format;
+	log->persist = p->persist_logdir;
+
+	/* Logs kept in SQLite share a database with the proxy's other logs.
+	 * A persistent log may have been kept in it last time, whatever
+	 * log_format says now, so it's opened if it's there.
+	 */
+	log->db = _log_opendb(p, log->format == IRC_LOGFORMAT_SQLITE);
+	if ((log->format == IRC_LOGFORMAT_SQLITE) && !log->db) {
+		error("Unable to keep log '%s' in SQLite, using text instead",
+		      filename);
+		log->format = IRC_LOGFORMAT_TEXT;
+	}
+	if (log->dbname)
+		free(log->dbname);
+	log->dbname = x_strdup(filename);
+
+	/* Only log files without a maximum size are compressed, the others
+	 * don't grow without end anyway */
+	log->sealsize = 0;
+	if (!log->maxlines && (log->format != IRC_LOGFORMAT_SQLITE)
+	    && logblock_available())
+		log->sealsize = p->conn_class->log_compress_size * 1024;
+
 	/* Store the filename in the LogFile */
 	if (log->filename)
 		free(log->filename);
-	log->filename = x_sprintf("%s/%s", p->temp_logdir, filename);
+	if (log->persist) {
+		log->filename = x_sprintf("%s/%s.log", p->temp_logdir,
+					  filename);
+	} else {
+		log->filename = x_sprintf("%s/%s", p->temp_logdir, filename);
+	}
 	debug("Log filename = '%s'", log->filename);
 	log->made = 0;
 
+	/* Pick up where an earlier run left off */
+	if (log->persist)
+		_logfile_reopen(log);
+
 	free(filename);
 	return 0;
 }
 
-/* irclog_open
- * Open a previously initialised log file
+/* _logfile_policy
+ * Work out what's done with events logged to a log file, which depends on
+ * whether it's open and on the config.  This has to be done again whenever
+ * either changes.  The proxy keeps the events taken by any of its log files,
+ * which only grows until irclog_policy() works it out afresh; that's enough
+ * to throw most unwanted events away without looking for their log file.
  */
-int
-irclog_open(IRCProxy *p, const char *to)
+static void
+_logfile_policy(IRCProxy *p, LogFile *log, const char *to)
 {
-	LogFile *log;
-
-	log = _logfile_get(p, to);
-	if (!log || !log->filename)
-		return -1;
-	if (log->open)
-		return 0;
+	struct logpolicy *policy;
+	int		  events;
 
-	/* Unlink first for security */
-	if (unlink(log->filename) && (errno != ENOENT)) {
-		syscall_fail("unlink", log->filename, 0);
-		free(log->filename);
-		log->filename = 0;
-		return -1;
-	}
+	policy = &(log->policy);
+	free(policy->userfile);
+	memset(policy, 0, sizeof(struct logpolicy));
 
-	/* Open for reading and writing */
-	log->file = fopen(log->filename, "w+");
-	if (log->file == NULL) {
-		syscall_fail("fopen", log->filename, 0);
-		free(log->filename);
-		log->filename = 0;
-		return -1;
+	events = p->conn_class->log_events;
+	if (log->open)
+		policy->internal = events;
+	if (p->conn_class->log_program)
+		policy->pipe = events;
+
+	/* Private messages go to a file for each nickname */
+	if (p->conn_class->log_dir) {
+		policy->user = events;
+		if (!IS_PRIVATE_LOG(p, log))
+			policy->userfile = _user_log_name(p, to);
 	}
 
-	/* Try to remove world and group read/write */
-	if (fchmod(fileno(log->file), 0600))
-		syscall_fail("fchmod", log->filename, 0);
-  
-	log->open = log->made = 1;
-	log->nlines = 0;
-	return 0;
+	policy->events = policy->internal | policy->user | policy->pipe;
+	p->log_events |= policy->events;
 }
 
-/* _logfile_close
- * Close the filehandle associated with a LogFile structure
+/* _logpolicy_dests
+ * Find out where an event is to be written under a log file's policy.
  */
-static void
-_logfile_close(LogFile *log)
+static int
+_logpolicy_dests(const struct logpolicy *policy, int event)
 {
-	if (!log->open)
-		return;
-
-	debug("Closing log file '%s'", log->filename);
-	fclose(log->file);
-	log->open = 0;
+	return (((policy->internal & event) ? LOG_TO_INTERNAL : 0)
+		| ((policy->user & event) ? LOG_TO_USER : 0)
+		| ((policy->pipe & event) ? LOG_TO_PIPE : 0));
 }
 
-/* irclog_close
- * Close a log file, don't log anything more to it for now.  This doesn't
- * unlink the file or free the information, it just indicates that logging
- * has concluded.  The file and information remains so we can reopen it to
- * recall things.
+/* irclog_policy
+ * Work out again what's done with events logged to each of a proxy's log
+ * files, called when it's been given a new connection class.
  */
 void
-irclog_close(IRCProxy *p, const char *to)
+irclog_policy(IRCProxy *p)
 {
-	LogFile *log;
+	IRCChannel *c;
 
-	if (!(log = _logfile_get(p, to)))
-		return;
-	_logfile_close(log);
+	p->log_events = 0;
+	_logfile_policy(p, &(p->server_log), IRC_LOGFILE_SERVER);
+	_logfile_policy(p, &(p->private_log), p->nickname);
+
+	for (c = p->channels; c; c = c->next)
+		_logfile_policy(p, &(c->log), c->name);
 }
 
-/* irclog_free
- * Close a log file and free up all of it's information.  Once this is called
- * the log file will need to be reinitialised before it can be used, and
- * nothing will be able to be recalled.
+/* _log_opendb
+ * Get the database the proxy's logs are kept in, opening it if it isn't
+ * already.  Unless create is given, it's only opened if it's been left by
+ * an earlier run.  Returns NULL if there isn't one.
  */
-void
-irclog_free(LogFile *log)
+static LogDB *
+_log_opendb(IRCProxy *p, int create)
 {
-	if (!log->filename)
-		return;
+	struct stat  statinfo;
+	char	    *filename;
 
-	/* Close it if necessary */
-	if (log->open)
-		_logfile_close(log);
+	if (p->logdb || !logdb_available())
+		return p->logdb;
 
-	/* Unlink the file, and free up the space used by the filename */
-	debug("Freeing up log file '%s'", log->filename);
-	unlink(log->filename);
-	free(log->filename);
-	log->nlines = 0;
-	log->made = 0;
+	filename = x_sprintf("%s/%s", p->temp_logdir, LOG_DB_NAME);
+	if (create || (p->persist_logdir && !lstat(filename, &statinfo)))
+		p->logdb = logdb_open(filename, p->persist_logdir);
+	free(filename);
+
+	return p->logdb;
 }
 
-/* irclog_closetempdir
- * Remove the temporary directory and free up the space in the IRCProxy
- * structure.  This should only be called once all log files have been closed.
+/* _logfile_sidename
+ * Work out the name of a file kept alongside a persistent log file, such
+ * as its header, by replacing the .log suffix of its name with another.
+ * Log files are named after channels, which can contain dots, so the new
+ * suffix mustn't end in .log or it could be another channel's log file.
  */
-void
-irclog_closetempdir(IRCProxy *p)
+static char *
+_logfile_sidename(const LogFile *log, const char *suffix)
 {
-	if (!p->temp_logdir)
-		return;
+	size_t	 len;
+	char	*name;
 
-	debug("Freeing log temp directory '%s'", p->temp_logdir);
-	rmdir(p->temp_logdir);
-	free(p->temp_logdir);
-	p->temp_logdir = 0;
+	len = strlen(log->filename) - 4;
+	name = (char *)malloc(len + strlen(suffix) + 1);
+	memcpy(name, log->filename, len);
+	strcpy(name + len, suffix);
+
+	return name;
 }
 
-/* _open_use_log
- * Open a file to which we append log messages in a human-readable format.
- * This file should be closed once you've finished with it, it'll be opened
- * again next time (to allow the user to wipe it while we're running).
+/* _logfile_readheader
+ * Read the header kept alongside a persistent log file.  Returns the
+ * format the log was written in, or -1 if there's no header or it can't
+ * be made sense of.
  */
-static FILE *
-_open_user_log(IRCProxy *p, const char *to)
+static int
+_logfile_readheader(const LogFile *log)
 {
-	struct stat  statinfo;
-	char	    *filename, *userfile;
-	FILE	    *log;
-
-	if (!p->conn_class->log_dir)
-		return NULL;
+	char  buf[64], *hdrname;
+	FILE *hdr;
+	int   format;
+
+	hdrname = _logfile_sidename(log, ".hdr");
+	hdr = fopen(hdrname, "r");
+	free(hdrname);
+	if (!hdr)
+		return -1;
 
-	/* Work out the filename, because we don't have a LogFile structure
-	 * we simply accept whatever we're given.
-	 */
-	if (to == IRC_LOGFILE_SERVER) {
-		filename = x_strdup("Server");
-	
-	} else {
-		filename = x_strdup(to);
-		irc_strlwr(_safe_name((char*)to));
+	format = -1;
+	if (fgets(buf, sizeof(buf), hdr) && !strcmp(buf, LOG_HEADER_MAGIC)
+	    && fgets(buf, sizeof(buf), hdr)) {
+		if (!strcmp(buf, "format text\n")) {
+			format = IRC_LOGFORMAT_TEXT;
+		} else if (!strcmp(buf, "format binary\n")) {
+			format = IRC_LOGFORMAT_BINARY;
+		} else if (!strcmp(buf, "format sqlite\n")) {
+			format = IRC_LOGFORMAT_SQLITE;
+		}
 	}
+	fclose(hdr);
 
-	/* The filename is under the user's log_dir */
-	userfile = x_sprintf("%s/%s.log", p->conn_class->log_dir, filename);
-	debug("User log file = '%s'", userfile);
-	free(filename);
+	return format;
+}
 
-	/* Make sure it's safe to use */
-	if (lstat(userfile, &statinfo)) {
-		if (errno != ENOENT) {
-			syscall_fail("lstat", userfile, 0);
-			free(userfile);
-			return NULL;
+/* _logfile_writeheader
+ * Write the header for a persistent log file, which is done before the
+ * log itself is created.  It's written to a temporary file, synced and
+ * renamed into place so it's either all there or not there at all.
+ */
+static int
+_logfile_writeheader(const LogFile *log)
+{
+	char *hdrname, *tmpname;
+	FILE *hdr;
+	int   ret;
+
+	hdrname = _logfile_sidename(log, ".hdr");
+	tmpname = _logfile_sidename(log, ".tmp");
+
+	ret = -1;
+	if (!(hdr = fopen(tmpname, "w"))) {
+		syscall_fail("fopen", tmpname, 0);
+	} else {
+		fchmod(fileno(hdr), 0600);
+		fprintf(hdr, "%sformat %s\n", LOG_HEADER_MAGIC,
+			(log->format == IRC_LOGFORMAT_SQLITE ? "sqlite"
+			 : (log->format == IRC_LOGFORMAT_BINARY
+			    ? "binary" : "text")));
+
+		if (fflush(hdr) || fsync(fileno(hdr))) {
+			syscall_fail("fsync", tmpname, 0);
+			fclose(hdr);
+		} else if (fclose(hdr)) {
+			syscall_fail("fclose", tmpname, 0);
+		} else if (rename(tmpname, hdrname)) {
+			syscall_fail("rename", tmpname, 0);
+		} else {
+			ret = 0;
 		}
-	} else if (!S_ISREG(statinfo.st_mode)) {
-		debug("File existed, but wasn't a file");
-		free(userfile);
-		return NULL;
 	}
 
-	/* Open the file for appending */
-	if (!(log = fopen(userfile, "a")))
-		syscall_fail("fopen", userfile, 0);
-	free(userfile);
-
-	return log;
-}
-
-/* Read a line from the log FIXME */
-static char *_log_read(FILE *file) {
-  char buff[512], *line;
-
-  line = 0;
-  while (1) {
-    if (!fgets(buff, 512, file)) {
-      free(line);
-      return 0;
-    } else if (!strlen(buff)) {
-      free(line);
-      return 0;
-    } else {
-      char *ptr;
-
-      if (line) {
-        char *new;
-
-        new = x_sprintf("%s%s", line, buff);
-        free(line);
-        line = new;
-      } else {
-        line = x_strdup(buff);
-      }
-
-      ptr = line + strlen(line) - 1;
-      if (*ptr == '\n') {
-        while ((ptr >= line) && (!ptr || strchr(" \t\r\n", *ptr))) *(ptr--) = 0;
-        break;
-      }
-    }
-  }
-
-  return line;
+	free(tmpname);
+	free(hdrname);
+	return ret;
 }
 
-/* _log_printf
- * Seek to the end of the file, write a line then flush the file so it
- * appears immediately.
+/* _logfile_reopen
+ * Pick up a persistent log file left by an earlier run, if there is one
+ * with a header we understand.  The log keeps the format it was written in,
+ * whatever log_format now says.  This is only done when the proxy the log
+ * belongs to is created, not at startup, so having lots of them doesn't
+ * slow that down.
  */
 static void
-_log_printf(FILE *fd, const char *format, ...)
+_logfile_reopen(LogFile *log)
 {
-	va_list  ap;
-	char	*msg;
+	struct stat statinfo;
+	int	    format;
 
-	/* Slurp the arguments in like printf */
-	va_start(ap, format);
-	msg = x_vsprintf(format, ap);
-	va_end(ap);
+	if ((format = _logfile_readheader(log)) < 0)
+		return;
 
-	/* Write the line at the end of the file, then flush */
-	fseek(fd, 0, SEEK_END);
-	fputs(msg, fd);
-	fflush(fd);
-
-	free(msg);
-}
-
-/* Write a line to the log FIXME don't just roll by line counts now? */
-static int _logfile_write(struct logfile *log, const char *format, ...) {
-  va_list ap;
-  char *msg;
-
-  va_start(ap, format);
-  msg = x_vsprintf(format, ap);
-  va_end(ap);
-
-  if (log->open && log->maxlines && (log->nlines >= log->maxlines)) {
-    FILE *fout;
-    char *l;
-
-    /* We can't simply add .tmp or something on the end, because there is
-       always a possibility that might be a channel name.  Besides using
-       temporary files always looks icky to me.  This "Sick Puppy" way of
-       reading from an unlinked file sits with me much better (says a lot
-       about me, that) */
-    fseek(log->file, 0, SEEK_SET);
-    unlink(log->filename);
-
-    /* This *really* shouldn't happen */
-    fout = fopen(log->filename, "w+");
-    if (!fout) {
-      syscall_fail("fopen", log->filename, 0);
-      return -1;
-    }
-
-    /* Make sure it's got the right permissions */
-    if (fchmod( fileno(fout), 0600))
-      syscall_fail("fchmod", log->filename, 0);
-
-    /* Eat from the start */
-    while ((log->nlines >= log->maxlines) && (l = _log_read(log->file))) {
-      free(l);
-      log->nlines--;
-    }
-
-    /* Write the rest */
-    while ((l = _log_read(log->file))) {
-      fprintf(fout, "%s\n", l);
-      free(l);
-    }
-
-    /* Close the input file, thereby *whoosh*ing it */
-    fclose(log->file);
-    log->file = fout;
-  }
+	/* Kept in the database rather than a file of its own */
+	if (format == IRC_LOGFORMAT_SQLITE) {
+		if (!log->db)
+			return;
 
-  /* Write to the log file */
-  if (log->open) {
-    _log_printf(log->file, "%s\n", msg);
-    log->nlines++;
-  }
+		log->format = format;
+		if (!_logfile_dbscan(log))
+			log->made = 1;
+		return;
+	}
 
-  free(msg);
-  return 0;
+	if (lstat(log->filename, &statinfo) || !S_ISREG(statinfo.st_mode))
+		return;
+
+	log->format = format;
+	if (!_logfile_scan(log))
+		log->made = 1;
 }
 
-/* _log_pipe
- * Call a program with the log type, source and destination information as
- * arguments, providing the message to log on its standard input.
+/* _logfile_dbscan
+ * Pick up a persistent log kept in the database, finding out which lines
+ * are still in it and rebuilding the search index.
  */
 static int
-_log_pipe(IRCProxy *p, int event, const char *to, const char *from,
-	  const char *text)
+_logfile_dbscan(LogFile *log)
 {
-	int   pfd[2], pid;
-	FILE *fd;
-
-	if (!p->conn_class->log_program)
-		return 1;
+	struct logdbrow  row;
+	LogDBCursor	*cursor;
+	unsigned long	 first, end;
 
-	/* Prepare a pipe */
-	if (pipe(pfd)) {
-		syscall_fail("pipe", 0, 0);
-		return 1;
-	}
-
-	/* Do the fork() thing */
-	switch (pid = fork()) {
-	case -1:
-		/* Failed :( */
-		syscall_fail("fork", 0, 0);
+	if (logdb_range(log->db, log->dbname, &first, &end))
+		return -1;
+	if (!(cursor = logdb_cursor(log->db, log->dbname)))
 		return -1;
 
-	case 0:
-		/* Child process, close the write end of the pipe */
-		close(pfd[1]);
+	_logmark_reset(log);
+	logindex_free(log->index);
+	log->index = logindex_new();
+	log->firstline = first;
+	log->nlines = end - first;
+
+	if (log->nlines > LOG_SEARCH_LINES)
+		logdb_seekline(cursor, end - LOG_SEARCH_LINES);
+	while (!logdb_next(cursor, &row))
+		_logfile_indexline(log, row.line, row.event, row.from,
+				   row.text);
+	logdb_endcursor(cursor);
+
+	debug("Reopened log '%s' from database with %lu lines", log->dbname,
+	      log->nlines);
+	return 0;
+}
 
-		/* Copy read end to STDIN */
-		if (dup2(pfd[0], STDIN_FILENO) != STDIN_FILENO) {
-			syscall_fail("dup2", 0, 0);
-			close(pfd[0]);
-			return 1;
-		}
-		close(pfd[0]);
-		
-		/* Run the log program with the appropriate arguments.
-		 * Use current environment and search the PATH if necessary.
-		 */
-		execlp(p->conn_class->log_program, p->conn_class->log_program,
-		       irclog_flagtostr(event), to, from, NULL);
+/* _logfile_scan
+ * Read through a persistent log file counting the lines and rebuilding the
+ * block index, sparse timestamp index and the search index.  If we died
+ * part way through writing the last record, what there is of it is cut
+ * off.
+ */
+static int
+_logfile_scan(LogFile *log)
+{
+	LogEntry  ent;
+	FILE	 *file;
+	time_t	  when;
+	long	  offset, good, size;
+	int	  r;
 
-		/* Uh-oh!  Where's the kaboom?
-		 * There was supposed to be an earth-shattering kaboom! 
-		 */
-		syscall_fail("execlp", p->conn_class->log_program, 0);
-		exit(10);
+	if (!(file = fopen(log->filename, "r"))) {
+		syscall_fail("fopen", log->filename, 0);
+		return -1;
+	}
 
-	default:
-		/* Parent process, close the read end of the pipe */
-		close(pfd[0]);
+	_logmark_reset(log);
+	logindex_free(log->index);
+	log->index = logindex_new();
+	log->firstline = log->nlines = 0;
+
+	memset(&ent, 0, sizeof(LogEntry));
+	when = 0;
+	good = 0;
+	_logfile_coldscan(log);
+	if (log->nblocks)
+		when = log->blocks[log->nblocks - 1].last;
+	log->nlines = log->coldlines;
+
+	for (;;) {
+		offset = ftell(file);
+		if ((r = _log_readentry(log->format, file, &ent)) < 0)
+			break;
+		good = ftell(file);
+
+		/* Lines we can't make sense of still count */
+		if (!r)
+			when = ent.when;
+		if (!((log->nlines - log->coldlines) % log->markevery))
+			_logmark_add(log, when, offset);
+		if (!r)
+			_logfile_indexline(log, log->nlines, ent.event,
+					   ent.from, ent.text);
+		log->nlines++;
+	}
+	_log_freeentry(&ent);
 
-		/* Open the write end as a FILE * */
-		if (!(fd = fdopen(pfd[1], "w"))) {
-			syscall_fail("fdopen", 0, 0);
-			close(pfd[1]);
-			return -1;
-		}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fclose(file);
 
-		/* Write the log message to the new FILE * and close */
-		fprintf(fd, "%s\n", text);
-		fflush(fd);
-		fclose(fd);
+	if (size > good) {
+		debug("Cutting off partial record at end of '%s'",
+		      log->filename);
+		if (truncate(log->filename, good))
+			syscall_fail("truncate", log->filename, 0);
 	}
 
+	debug("Reopened log file '%s' with %lu lines", log->filename,
+	      log->nlines);
 	return 0;
 }
 
-/* Write some text to a log file */
-static int _logfile_writetext(struct ircproxy *p, struct logfile *log, int event, const char *to, const char *from, const char *text) {
-  const char *dest;
-  FILE *user_log;
-  time_t now;
-
-  if (to == IRC_LOGFILE_ALL) {
+/* _logfile_coldscan
+ * Pick up the cold file of a persistent log, rebuilding the block index
+ * from the blocks' headers and adding their lines to the search index.  A
+ * block we died part way through writing is cut off.
+ */
+static void
+_logfile_coldscan(LogFile *log)
+{
+	struct logblock  block;
+	LogReader	*reader;
+	LogEntry	 ent;
+	unsigned long	 unreadable;
+	char		*coldname;
+	off_t		 offset, size;
+	int		 fd, r;
+
+	_logfile_coldreset(log, 0);
+
+	coldname = _logfile_sidename(log, ".cold");
+	fd = open(coldname, O_RDWR);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			syscall_fail("open", coldname, 0);
+		free(coldname);
+		return;
+	}
+
+	size = lseek(fd, 0, SEEK_END);
+	offset = 0;
+	unreadable = 0;
+	while (!logblock_readheader(fd, offset, size, &block)) {
+		if (!logblock_readable(&block))
+			unreadable++;
+
+		block.firstline = log->coldlines;
+		_logfile_addblock(log, &block);
+		offset += block.hdrlen + block.clen;
+	}
+
+	/* Kept so the line numbers stay right, but they can't be recalled */
+	if (unreadable)
+		error("%lu blocks of '%s' were compressed with something this "
+		      "dircproxy wasn't built with, their lines can't be "
+		      "recalled", unreadable, coldname);
+
+	if (offset < size) {
+		debug("Cutting off partial block at end of '%s'", coldname);
+		if (ftruncate(fd, offset))
+			syscall_fail("ftruncate", coldname, 0);
+	}
+	free(coldname);
+
+	log->cold = 1;
+	log->coldfd = fd;
+	log->coldsize = offset;
+	if (!log->coldlines)
+		return;
+
+	/* Only the search index needs the lines themselves, and only as
+	 * many as it keeps, so most of the blocks needn't be uncompressed */
+	if (!(reader = _logreader_new(log)))
+		return;
+	if (log->coldlines > LOG_SEARCH_LINES)
+		_logreader_seekline(reader, log,
+				    log->coldlines - LOG_SEARCH_LINES);
+
+	memset(&ent, 0, sizeof(LogEntry));
+	while ((reader->line < log->coldlines)
+	       && ((r = _logreader_readentry(reader, &ent)) >= 0)) {
+		if (!r)
+			_logfile_indexline(log, reader->line - 1, ent.event,
+					   ent.from, ent.text);
+	}
+	_log_freeentry(&ent);
+	_logreader_close(reader);
+
+	debug("Reopened cold log file for '%s' with %lu lines in %lu blocks",
+	      log->filename, log->coldlines, (unsigned long)log->nblocks);
+}
+
+/* _logfile_coldopen
+ * Start a cold file for a log, to compress its older lines into.  Those of
+ * persistent logs sit alongside them; others are unlinked as soon as
+ * they're made, and only exist as long as they're open.
+ */
+static int
+_logfile_coldopen(LogFile *log)
+{
+	char *coldname;
+	int   fd;
+
+	if (log->persist) {
+		coldname = _logfile_sidename(log, ".cold");
+		fd = open(coldname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd == -1)
+			syscall_fail("open", coldname, 0);
+	} else {
+		coldname = x_sprintf("%s.XXXXXX", log->filename);
+		fd = mkstemp(coldname);
+		if (fd == -1) {
+			syscall_fail("mkstemp", coldname, 0);
+		} else if (unlink(coldname)) {
+			syscall_fail("unlink", coldname, 0);
+		}
+	}
+	free(coldname);
+
+	if (fd == -1)
+		return -1;
+
+	log->cold = 1;
+	log->coldfd = fd;
+	log->coldsize = 0;
+	return 0;
+}
+
+/* _logfile_coldreset
+ * Throw away the cold blocks of a log, and if asked to, the file they're
+ * kept in.  Recall jobs still reading them have their own handle.
+ */
+static void
+_logfile_coldreset(LogFile *log, int remove)
+{
+	char *coldname;
+
+	if (log->cold) {
+		close(log->coldfd);
+		log->cold = 0;
+	}
+
+	if (remove && log->persist) {
+		coldname = _logfile_sidename(log, ".cold");
+		if (unlink(coldname) && (errno != ENOENT))
+			syscall_fail("unlink", coldname, 0);
+		free(coldname);
+	}
+
+	free(log->blocks);
+	log->blocks = NULL;
+	log->nblocks = log->blocks_sz = 0;
+	log->coldsize = 0;
+	log->coldlines = 0;
+}
+
+/* _logfile_addblock
+ * Add a block to the end of the block index of a log.
+ */
+static void
+_logfile_addblock(LogFile *log, const struct logblock *block)
+{
+	if (log->nblocks >= log->blocks_sz) {
+		log->blocks_sz = (log->blocks_sz ? log->blocks_sz * 2 : 16);
+		log->blocks = (struct logblock *)realloc(log->blocks,
+			sizeof(struct logblock) * log->blocks_sz);
+	}
+
+	memcpy(&log->blocks[log->nblocks++], block, sizeof(struct logblock));
+	log->coldlines += block->nlines;
+}
+
+/* _logfile_seal
+ * Compress everything in the uncompressed part of a log into blocks at the
+ * end of its cold file, then start the uncompressed part afresh.  Blocks
+ * are cut at record boundaries once they're LOG_BLOCK_SIZE long.
+ */
+static int
+_logfile_seal(LogFile *log)
+{
+	struct logblock	 block;
+	LogEntry	 ent;
+	FILE		*fout;
+	off_t		 oldsize;
+	size_t		 oldblocks;
+	unsigned long	 oldlines;
+	long		 start, good;
+	char		*buf, *outname;
+	int		 r, fd, failed;
+
+	if (!log->cold && _logfile_coldopen(log))
+		return -1;
+
+	/* The new, empty, uncompressed part is made first, and renamed over
+	 * the old one at the end; it's not truncated, as recall jobs may
+	 * have it mapped */
+	if (log->persist) {
+		outname = _logfile_sidename(log, ".new");
+		fout = fopen(outname, "w+");
+	} else {
+		outname = x_sprintf("%s.XXXXXX", log->filename);
+		fout = (((fd = mkstemp(outname)) != -1)
+			? fdopen(fd, "w+") : NULL);
+	}
+	if (!fout) {
+		syscall_fail("fopen", outname, 0);
+		free(outname);
+		return -1;
+	}
+	if (fchmod(fileno(fout), 0600))
+		syscall_fail("fchmod", outname, 0);
+
+	oldsize = log->coldsize;
+	oldblocks = log->nblocks;
+	oldlines = log->coldlines;
+
+	fflush(log->file);
+	fseek(log->file, 0, SEEK_SET);
+	memset(&ent, 0, sizeof(LogEntry));
+	memset(&block, 0, sizeof(struct logblock));
+	buf = NULL;
+	start = good = 0;
+	failed = 0;
+
+	for (;;) {
+		r = _log_readentry(log->format, log->file, &ent);
+		if (r >= 0) {
+			good = ftell(log->file);
+
+			/* Lines we can't make sense of still count */
+			if (!r) {
+				if (!block.nlines)
+					block.first = ent.when;
+				block.last = ent.when;
+			}
+			block.nlines++;
+		}
+
+		if (block.nlines && ((r < 0)
+				     || (good - start >= LOG_BLOCK_SIZE))) {
+			buf = (char *)realloc(buf, good - start);
+			block.firstline = log->coldlines;
+			if ((pread(fileno(log->file), buf, good - start, start)
+			     != good - start)
+			    || logblock_write(log->coldfd, log->coldsize, buf,
+					      good - start, &block)) {
+				syscall_fail("logblock_write", log->filename,
+					     0);
+				failed = 1;
+				break;
+			}
+
+			_logfile_addblock(log, &block);
+			log->coldsize += block.hdrlen + block.clen;
+
+			start = good;
+			block.nlines = 0;
+			block.first = block.last;
+		}
+
+		if (r < 0)
+			break;
+	}
+	_log_freeentry(&ent);
+	free(buf);
+
+	/* Make sure the blocks are there before the lines in them go */
+	if (!failed && log->persist && fsync(log->coldfd)) {
+		syscall_fail("fsync", log->filename, 0);
+		failed = 1;
+	}
+
+	if (!failed && rename(outname, log->filename)) {
+		syscall_fail("rename", outname, 0);
+		failed = 1;
+	}
+
+	if (failed) {
+		if (ftruncate(log->coldfd, oldsize))
+			syscall_fail("ftruncate", log->filename, 0);
+		log->coldsize = oldsize;
+		log->nblocks = oldblocks;
+		log->coldlines = oldlines;
+		fseek(log->file, 0, SEEK_END);
+
+		unlink(outname);
+		fclose(fout);
+		free(outname);
+		return -1;
+	}
+
+	debug("Compressed %lu lines of '%s' into %lu blocks, now %lu bytes",
+	      log->coldlines - oldlines, log->filename,
+	      (unsigned long)(log->nblocks - oldblocks),
+	      (unsigned long)(log->coldsize - oldsize));
+	free(outname);
+
+	fclose(log->file);
+	log->file = fout;
+	_logmark_reset(log);
+	return 0;
+}
+
+/* irclog_open
+ * Open a previously initialised log file
+ */
+int
+irclog_open(IRCProxy *p, const char *to)
+{
+	LogFile *log;
+
+	log = _logfile_get(p, to);
+	if (!log || !log->filename)
+		return -1;
+	if (log->open)
+		return 0;
+
+	/* Persistent logs carry on where they left off */
+	if (log->persist && log->made) {
+		if (log->format != IRC_LOGFORMAT_SQLITE) {
+			log->file = fopen(log->filename, "a+");
+			if (log->file == NULL) {
+				syscall_fail("fopen", log->filename, 0);
+				free(log->filename);
+				log->filename = 0;
+				return -1;
+			}
+		}
+
+		log->open = 1;
+		_logfile_policy(p, log, to);
+		return 0;
+	}
+
+	/* The header goes first, so a log file without one is never
+	 * mistaken for a good one.
+	 */
+	if (log->persist)
+		_logfile_writeheader(log);
+
+	if (log->format == IRC_LOGFORMAT_SQLITE) {
+		/* Start afresh in the database */
+		if (logdb_clear(log->db, log->dbname)) {
+			free(log->filename);
+			log->filename = 0;
+			return -1;
+		}
+	} else if (_logfile_create(log)) {
+		return -1;
+	}
+
+	log->open = log->made = 1;
+	log->nlines = 0;
+	_logmark_reset(log);
+
+	/* Start a fresh search index */
+	logindex_free(log->index);
+	log->index = logindex_new();
+	log->firstline = 0;
+
+	memset(&(log->digest), 0, sizeof(struct logdigest));
+	log->seen = 0;
+
+	_logfile_policy(p, log, to);
+	return 0;
+}
+
+/* _logfile_create
+ * Create a new empty log file, replacing any that's there.
+ */
+static int
+_logfile_create(LogFile *log)
+{
+	_logfile_coldreset(log, 1);
+
+	/* Unlink first for security */
+	if (unlink(log->filename) && (errno != ENOENT)) {
+		syscall_fail("unlink", log->filename, 0);
+		free(log->filename);
+		log->filename = 0;
+		return -1;
+	}
+
+	/* Open for reading and writing */
+	log->file = fopen(log->filename, "w+");
+	if (log->file == NULL) {
+		syscall_fail("fopen", log->filename, 0);
+		free(log->filename);
+		log->filename = 0;
+		return -1;
+	}
+
+	/* Try to remove world and group read/write */
+	if (fchmod(fileno(log->file), 0600))
+		syscall_fail("fchmod", log->filename, 0);
+
+	return 0;
+}
+
+/* _logfile_close
+ * Close the filehandle associated with a LogFile structure
+ */
+static void
+_logfile_close(LogFile *log)
+{
+	if (!log->open)
+		return;
+
+	debug("Closing log file '%s'", log->filename);
+	if (log->file)
+		fclose(log->file);
+	log->file = NULL;
+	log->open = 0;
+}
+
+/* irclog_close
+ * Close a log file, don't log anything more to it for now.  This doesn't
+ * unlink the file or free the information, it just indicates that logging
+ * has concluded.  The file and information remains so we can reopen it to
+ * recall things.
+ */
+void
+irclog_close(IRCProxy *p, const char *to)
+{
+	LogFile *log;
+
+	if (!(log = _logfile_get(p, to)))
+		return;
+	_logfile_close(log);
+	_logfile_policy(p, log, to);
+}
+
+/* irclog_free
+ * Close a log file and free up all of it's information.  Once this is called
+ * the log file will need to be reinitialised before it can be used, and
+ * nothing will be able to be recalled.
+ */
+void
+irclog_free(LogFile *log)
+{
+	if (!log->filename)
+		return;
+
+	/* Close it if necessary */
+	if (log->open)
+		_logfile_close(log);
+
+	/* Unlink the file, unless it's to be kept for next time, and free up
+	 * the space used by the filename
+	 */
+	debug("Freeing up log file '%s'", log->filename);
+	if (log->persist) {
+		/* Keep it */
+	} else if (log->format == IRC_LOGFORMAT_SQLITE) {
+		logdb_clear(log->db, log->dbname);
+	} else {
+		unlink(log->filename);
+	}
+	free(log->filename);
+	free(log->dbname);
+	log->dbname = NULL;
+	log->db = NULL;
+	log->nlines = 0;
+	log->made = 0;
+
+	free(log->marks);
+	log->marks = NULL;
+	log->nmarks = log->marks_sz = 0;
+
+	logindex_free(log->index);
+	log->index = NULL;
+	memset(&(log->digest), 0, sizeof(struct logdigest));
+	log->seen = 0;
+
+	free(log->policy.userfile);
+	memset(&(log->policy), 0, sizeof(struct logpolicy));
+
+	_logfile_coldreset(log, 0);
+}
+
+/* irclog_markread
+ * Remember where each log file ends as the client detaches, it's seen
+ * everything up to there so it needn't be recalled again.  Logs that are
+ * started afresh on detach begin with nothing read.
+ */
+void
+irclog_markread(IRCProxy *p)
+{
+	IRCChannel *c;
+
+	p->server_log.seen = p->server_log.firstline + p->server_log.nlines;
+	p->private_log.seen = p->private_log.firstline
+		+ p->private_log.nlines;
+
+	for (c = p->channels; c; c = c->next)
+		c->log.seen = c->log.firstline + c->log.nlines;
+}
+
+/* irclog_closetempdir
+ * Remove the temporary directory and free up the space in the IRCProxy
+ * structure.  This should only be called once all log files have been closed.
+ */
+void
+irclog_closetempdir(IRCProxy *p)
+{
+	if (!p->temp_logdir)
+		return;
+
+	/* The database goes first, it's the only thing left in there */
+	if (p->logdb) {
+		logdb_close(p->logdb);
+		p->logdb = NULL;
+
+		if (!p->persist_logdir) {
+			char *filename;
+
+			filename = x_sprintf("%s/%s", p->temp_logdir,
+					     LOG_DB_NAME);
+			unlink(filename);
+			free(filename);
+		}
+	}
+
+	debug("Freeing log temp directory '%s'", p->temp_logdir);
+	if (!p->persist_logdir)
+		rmdir(p->temp_logdir);
+	free(p->temp_logdir);
+	p->temp_logdir = 0;
+}
+
+/* _user_log_name
+ * Work out the name of the file to which we append log messages in a
+ * human-readable format.  The file is opened afresh for every line, so the
+ * user can wipe it while we're running.
+ */
+static char *
+_user_log_name(IRCProxy *p, const char *to)
+{
+	char *filename, *userfile;
+
+	if (!p->conn_class->log_dir)
+		return NULL;
+
+	/* Work out the filename, because we don't have a LogFile structure
+	 * we simply accept whatever we're given.
+	 */
+	if (to == IRC_LOGFILE_SERVER) {
+		filename = x_strdup("Server");
+	
+	} else {
+		filename = x_strdup(to);
+		irc_strlwr(_safe_name(filename));
+	}
+
+	/* The filename is under the user's log_dir */
+	userfile = x_sprintf("%s/%s.log", p->conn_class->log_dir, filename);
+	debug("User log file = '%s'", userfile);
+	free(filename);
+
+	return userfile;
+}
+
+/* _log_readline
+ * Read a line from a text log into a buffer that's grown as needed and
+ * reused between calls, stripping the newline and any trailing space.
+ * Returns the length of the line, or -1 at the end of the file.
+ */
+static long
+_log_readline(FILE *file, char **buf, size_t *bufsz)
+{
+	size_t len;
+
+	len = 0;
+	for (;;) {
+		if (len + 2 > *bufsz) {
+			*bufsz = (*bufsz ? *bufsz * 2 : 512);
+			*buf = (char *)realloc(*buf, *bufsz);
+		}
+
+		if (!fgets(*buf + len, *bufsz - len, file)) {
+			if (!len)
+				return -1;
+			break;
+		}
+
+		len += strlen(*buf + len);
+		if (len && ((*buf)[len - 1] == '\n'))
+			break;
+	}
+
+	while (len && strchr(" \t\r\n", (*buf)[len - 1]))
+		len--;
+	(*buf)[len] = '\0';
+
+	return len;
+}
+
+/* _log_putvarint
+ * Write an unsigned value to a binary log as a little-endian base-128
+ * varint, seven bits to the byte with the top bit set on all but the last.
+ */
+static void
+_log_putvarint(FILE *file, unsigned long val)
+{
+	while (val >= 0x80) {
+		putc((int)((val & 0x7f) | 0x80), file);
+		val >>= 7;
+	}
+	putc((int)val, file);
+}
+
+/* _log_getvarint
+ * Read a varint written by _log_putvarint.  Returns 0 on success, -1 at the
+ * end of the file or if the value is too big.
+ */
+static int
+_log_getvarint(FILE *file, unsigned long *val)
+{
+	unsigned int shift;
+	int	     c;
+
+	*val = 0;
+	shift = 0;
+	do {
+		if ((c = getc(file)) == EOF)
+			return -1;
+		if (shift >= sizeof(unsigned long) * 8)
+			return -1;
+
+		*val |= (unsigned long)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+/* _log_putentry
+ * Append a record to a binary log: varint timestamp, one byte event code
+ * (the bit number of the IRC_LOG_* flag), then the destination, source and
+ * text each as a varint length followed by that many bytes.
+ */
+static void
+_log_putentry(FILE *file, time_t when, int event, const char *dest,
+	      const char *from, const char *text)
+{
+	const char *str[3];
+	size_t	    len;
+	int	    code, i;
+
+	for (code = 0; (code < 16) && !(event & (1 << code)); code++)
+		;
+
+	_log_putvarint(file, (unsigned long)when);
+	putc(code, file);
+
+	str[0] = dest;
+	str[1] = from;
+	str[2] = text;
+	for (i = 0; i < 3; i++) {
+		len = strlen(str[i]);
+		_log_putvarint(file, len);
+		fwrite(str[i], 1, len, file);
+	}
+}
+
+/* _log_readentry
+ * Read the next record from an internal log file into a LogEntry, whose
+ * buffer is reused between calls.  Returns 0 on success, 1 if the record
+ * couldn't be made sense of and should be skipped, or -1 at the end of
+ * the file.
+ */
+static int
+_log_readentry(int format, FILE *file, LogEntry *ent)
+{
+	int i;
+
+	if (format == IRC_LOGFORMAT_BINARY) {
+		unsigned long when, len;
+		size_t	      offs[3], used;
+		int	      code;
+
+		if (_log_getvarint(file, &when))
+			return -1;
+		if ((code = getc(file)) == EOF)
+			return -1;
+
+		used = 0;
+		for (i = 0; i < 3; i++) {
+			if (_log_getvarint(file, &len))
+				return -1;
+
+			if (used + len + 1 > ent->bufsz) {
+				ent->bufsz = used + len + 1 + 256;
+				ent->buf = (char *)realloc(ent->buf,
+							   ent->bufsz);
+			}
+
+			if (len && (fread(ent->buf + used, 1, len, file)
+				    != len))
+				return -1;
+			ent->buf[used + len] = '\0';
+
+			offs[i] = used;
+			used += len + 1;
+		}
+
+		ent->when = (time_t)when;
+		ent->event = (code < 16 ? 1 << code : IRC_LOG_NONE);
+		ent->dest = ent->buf + offs[0];
+		ent->from = ent->buf + offs[1];
+		ent->text = ent->buf + offs[2];
+		return 0;
+	}
+
+	if (_log_readline(file, &ent->buf, &ent->bufsz) < 0)
+		return -1;
+
+	return _log_parseline(ent);
+}
+
+/* _log_parseline
+ * Split a line read from a text log, in the entry's buffer, into its
+ * fields.  Returns 0 on success or 1 if it couldn't be made sense of.
+ */
+static int
+_log_parseline(LogEntry *ent)
+{
+	char *field[4], *ptr;
+	int   i;
+
+	/* Text lines look like this:
+	 *   1079304950 client #dircproxy dircproxy You connected
+	 *   1079305143 message #dircproxy bear!~bear@pa.comcast.net lah
+	 */
+	ptr = ent->buf;
+	for (i = 0; i < 4; i++) {
+		field[i] = ptr;
+		if (!*ptr || !(ptr = strchr(ptr, ' ')))
+			return 1;
+		*(ptr++) = 0;
+	}
+
+	ent->when = strtoul(field[0], (char **)NULL, 10);
+	ent->event = irclog_strtoflag(field[1]);
+	ent->dest = field[2];
+	ent->from = field[3];
+	ent->text = ptr;
+	return 0;
+}
+
+/* _log_skipentry
+ * Skip over the next record in an internal log file.  Returns 0 on success
+ * or -1 at the end of the file.
+ */
+static int
+_log_skipentry(int format, FILE *file)
+{
+	LogEntry ent;
+	int	 c, ret;
+
+	if (format == IRC_LOGFORMAT_BINARY) {
+		memset(&ent, 0, sizeof(LogEntry));
+		ret = _log_readentry(format, file, &ent);
+		_log_freeentry(&ent);
+
+		return (ret < 0 ? -1 : 0);
+	}
+
+	/* There's no need to keep a text line to skip it */
+	if ((c = getc(file)) == EOF)
+		return -1;
+	while ((c != '\n') && (c != EOF))
+		c = getc(file);
+
+	return 0;
+}
+
+/* _log_freeentry
+ * Free the buffer used by a LogEntry.
+ */
+static void
+_log_freeentry(LogEntry *ent)
+{
+	free(ent->buf);
+	ent->buf = NULL;
+	ent->bufsz = 0;
+}
+
+/* _logrecord_init
+ * Format a log event once, so that it can be written to any number of log
+ * files without doing the work again.  The internal log line is split
+ * either side of the destination, which is the only part that differs
+ * between the files an IRC_LOGFILE_ALL event is written to.
+ */
+static void
+_logrecord_init(IRCProxy *p, LogRecord *rec, int event, const char *from,
+		const char *text, int dests)
+{
+	time_t now;
+
+	time(&now);
+	rec->when = now - (p->conn_class->log_timeoffset * 60);
+
+	rec->event = event;
+	rec->from = from;
+	rec->text = text;
+
+	/* Only bother with the internal log line if it'll be used */
+	rec->head = rec->tail = NULL;
+	if (dests & LOG_TO_INTERNAL) {
+		rec->head = x_sprintf("%lu %s ", rec->when,
+				      irclog_flagtostr(event));
+		rec->tail = x_sprintf(" %s %s\n", from, text);
+	}
+
+	/* Or the human-readable version */
+	rec->userline = NULL;
+	if (dests & LOG_TO_USER) {
+		const char *tbuf;
+
+		if (p->conn_class->log_timestamp) {
+			tbuf = strtime(LOG_USER_TIME_FORMAT, now,
+				       p->conn_class->log_timeoffset);
+		} else {
+			tbuf = "";
+		}
+
+		if (event & IRC_LOG_MSG) {
+			rec->userline = x_sprintf("%s<%s> %s\n", tbuf,
+						  from, text);
+		} else if (event & IRC_LOG_NOTICE) {
+			rec->userline = x_sprintf("%s-%s- %s\n", tbuf,
+						  from, text);
+		} else if (event & IRC_LOG_ACTION) {
+			char *nick, *ptr;
+
+			nick = x_strdup(from);
+			ptr = strchr(nick, '!');
+			if (ptr)
+				*ptr = 0;
+
+			rec->userline = x_sprintf("%s* %s %s\n", tbuf,
+						  nick, text);
+			free(nick);
+		} else if (event & IRC_LOG_CTCP) {
+			rec->userline = x_sprintf("%s[%s] %s\n", tbuf,
+						  from, text);
+		} else if (event & IRC_LOG_JOIN) {
+			rec->userline = x_sprintf("%s--> %s\n", tbuf, text);
+		} else if (event & (IRC_LOG_PART | IRC_LOG_KICK
+				    | IRC_LOG_QUIT)) {
+			rec->userline = x_sprintf("%s<-- %s\n", tbuf, text);
+		} else if (event & (IRC_LOG_NICK | IRC_LOG_MODE
+				    | IRC_LOG_TOPIC)) {
+			rec->userline = x_sprintf("%s--- %s\n", tbuf, text);
+		} else if (event & (IRC_LOG_CLIENT | IRC_LOG_SERVER
+				    | IRC_LOG_ERROR)) {
+			rec->userline = x_sprintf("%s*** %s\n", tbuf, text);
+		}
+	}
+}
+
+/* _logrecord_free
+ * Free the formatted parts of a log record.
+ */
+static void
+_logrecord_free(LogRecord *rec)
+{
+	free(rec->head);
+	free(rec->tail);
+	free(rec->userline);
+}
+
+/* _logfile_write
+ * Append a formatted record to an internal log file, rolling the file
+ * first if it has reached its maximum size.  FIXME don't just roll by
+ * line counts now?
+ */
+static int
+_logfile_write(LogFile *log, const LogRecord *rec, const char *dest)
+{
+	if (!log->open)
+		return 0;
+	if (log->format == IRC_LOGFORMAT_SQLITE)
+		return _logfile_dbwrite(log, rec, dest);
+
+	if (log->maxlines && (log->nlines >= log->maxlines)) {
+		unsigned long  n, keep;
+		FILE	      *fout;
+		char	      *l, *outname;
+
+		/* A persistent log compressed while it had no maximum size
+		 * loses its compressed lines first, as they're the oldest */
+		if (log->cold) {
+			log->firstline += log->coldlines;
+			log->nlines -= log->coldlines;
+			_logfile_coldreset(log, 1);
+		}
+
+		/* We can't simply add .tmp or something on the end, because
+		 * there is always a possibility that might be a channel name.
+		 * Besides using temporary files always looks icky to me.
+		 * This "Sick Puppy" way of reading from an unlinked file
+		 * sits with me much better (says a lot about me, that)
+		 */
+		fseek(log->file, 0, SEEK_SET);
+		if (log->persist) {
+			/* Except for logs we keep between runs, which are
+			 * renamed over the old one, so if we die part way
+			 * through there's still a whole log.
+			 */
+			outname = _logfile_sidename(log, ".new");
+		} else {
+			unlink(log->filename);
+			outname = x_strdup(log->filename);
+		}
+
+		/* This *really* shouldn't happen */
+		fout = fopen(outname, "w+");
+		if (!fout) {
+			syscall_fail("fopen", outname, 0);
+			free(outname);
+			return -1;
+		}
+
+		/* Make sure it's got the right permissions */
+		if (fchmod(fileno(fout), 0600))
+			syscall_fail("fchmod", outname, 0);
+
+		/* Eat from the start, down to three quarters full so that
+		 * a full log isn't rewritten (and synced) for every line */
+		keep = log->maxlines - log->maxlines / 4 - 1;
+		while ((log->nlines > keep)
+		       && !_log_skipentry(log->format, log->file)) {
+			log->nlines--;
+			log->firstline++;
+		}
+		logindex_expire(log->index, log->firstline);
+
+		/* Write the rest, rebuilding the index as we go */
+		_logmark_reset(log);
+		n = 0;
+		if (log->format == IRC_LOGFORMAT_BINARY) {
+			LogEntry ent;
+			int	 r;
+
+			memset(&ent, 0, sizeof(LogEntry));
+			while ((r = _log_readentry(log->format, log->file,
+						   &ent)) >= 0) {
+				if (r)
+					continue;
+
+				if (!(n++ % log->markevery))
+					_logmark_add(log, ent.when,
+						     ftell(fout));
+				_log_putentry(fout, ent.when, ent.event,
+					      ent.dest, ent.from, ent.text);
+			}
+			_log_freeentry(&ent);
+		} else {
+			size_t lsz;
+
+			l = NULL;
+			lsz = 0;
+			while (_log_readline(log->file, &l, &lsz) >= 0) {
+				if (!(n++ % log->markevery))
+					_logmark_add(log, strtoul(l, NULL, 10),
+						     ftell(fout));
+				fprintf(fout, "%s\n", l);
+			}
+			free(l);
+		}
+		log->nlines = n;
+
+		/* The lines have to be on disk before the name is, or a
+		 * crash could leave an empty log where the old one was */
+		if (log->persist) {
+			if (fflush(fout) || fsync(fileno(fout))) {
+				syscall_fail("fsync", outname, 0);
+			} else if (rename(outname, log->filename)) {
+				syscall_fail("rename", outname, 0);
+			}
+		}
+		free(outname);
+
+		/* Close the input file, thereby *whoosh*ing it */
+		fclose(log->file);
+		log->file = fout;
+	}
+
+	/* Write the line at the end of the file, then flush */
+	fseek(log->file, 0, SEEK_END);
+	if (!((log->nlines - log->coldlines) % log->markevery))
+		_logmark_add(log, rec->when, ftell(log->file));
+	if (log->format == IRC_LOGFORMAT_BINARY) {
+		_log_putentry(log->file, rec->when, rec->event, dest,
+			      rec->from, rec->text);
+	} else {
+		fputs(rec->head, log->file);
+		fputs(dest, log->file);
+		fputs(rec->tail, log->file);
+	}
+	fflush(log->file);
+
+	_logfile_indexline(log, log->firstline + log->nlines, rec->event,
+			   rec->from, rec->text);
+	log->nlines++;
+
+	if (log->sealsize && (ftell(log->file) >= log->sealsize))
+		_logfile_seal(log);
+
+	return 0;
+}
+
+/* _logfile_dbwrite
+ * Write a record to a log kept in the database.  Rolling it is just a
+ * matter of deleting the oldest records.
+ */
+static int
+_logfile_dbwrite(LogFile *log, const LogRecord *rec, const char *dest)
+{
+	if (log->maxlines && (log->nlines >= log->maxlines)) {
+		unsigned long n;
+
+		n = log->nlines - log->maxlines + 1;
+		log->firstline += n;
+		log->nlines -= n;
+
+		logdb_expire(log->db, log->dbname, log->firstline);
+		logindex_expire(log->index, log->firstline);
+	}
+
+	if (logdb_append(log->db, log->dbname, log->firstline + log->nlines,
+			 rec->when, rec->event, dest, rec->from, rec->text))
+		return -1;
+
+	_logfile_indexline(log, log->firstline + log->nlines, rec->event,
+			   rec->from, rec->text);
+	log->nlines++;
+
+	return 0;
+}
+
+/* _logfile_indexline
+ * Add a line to the search index of a log, forgetting the line that's no
+ * longer one of the most recent LOG_SEARCH_LINES.
+ */
+static void
+_logfile_indexline(LogFile *log, unsigned long line, int event,
+		   const char *from, const char *text)
+{
+	logindex_add(log->index, line, irclog_flagtostr(event), from, text);
+	if (line >= LOG_SEARCH_LINES)
+		logindex_expire(log->index, line + 1 - LOG_SEARCH_LINES);
+}
+
+/* _user_log_write
+ * Queue the human-readable form of a record to be appended to the user's
+ * own copy of the log for the given destination, if they have one.
+ */
+static int
+_user_log_write(IRCProxy *p, LogFile *log, const char *to,
+		const LogRecord *rec)
+{
+	struct diskio_rotate  rotate;
+	const char	     *userfile;
+	char		     *name;
+	int		      ret;
+
+	if (!rec->userline)
+		return 0;
+
+	name = NULL;
+	if (!(userfile = log->policy.userfile))
+		userfile = name = _user_log_name(p, to);
+	if (!userfile)
+		return -1;
+
+	/* Checking the file is safe to use, rotating it and writing to it,
+	 * is left to the I/O thread so a slow disk doesn't hold everyone
+	 * else up.
+	 */
+	rotate.maxsize = p->conn_class->log_dir_maxsize * 1024;
+	rotate.daily = p->conn_class->log_dir_daily;
+	rotate.keep = p->conn_class->log_dir_keep;
+	rotate.compress = p->conn_class->log_dir_compress;
+
+	ret = diskio_append(userfile, x_strdup(rec->userline),
+			    strlen(rec->userline), &rotate);
+	free(name);
+	return ret;
+}
+
+/* _log_pipe
+ * Call a program with the log type, source and destination information as
+ * arguments, providing the message to log on its standard input.
+ */
+static int
+_log_pipe(IRCProxy *p, int event, const char *to, const char *from,
+	  const char *text)
+{
+	int   pfd[2], pid;
+	FILE *fd;
+
+	if (!p->conn_class->log_program)
+		return 1;
+
+	/* Prepare a pipe */
+	if (pipe(pfd)) {
+		syscall_fail("pipe", 0, 0);
+		return 1;
+	}
+
+	/* Do the fork() thing */
+	switch (pid = fork()) {
+	case -1:
+		/* Failed :( */
+		syscall_fail("fork", 0, 0);
+		return -1;
+
+	case 0:
+		/* Child process, close the write end of the pipe */
+		close(pfd[1]);
+
+		/* Copy read end to STDIN */
+		if (dup2(pfd[0], STDIN_FILENO) != STDIN_FILENO) {
+			syscall_fail("dup2", 0, 0);
+			close(pfd[0]);
+			return 1;
+		}
+		close(pfd[0]);
+		
+		/* Run the log program with the appropriate arguments.
+		 * Use current environment and search the PATH if necessary.
+		 */
+		execlp(p->conn_class->log_program, p->conn_class->log_program,
+		       irclog_flagtostr(event), to, from, NULL);
+
+		/* Uh-oh!  Where's the kaboom?
+		 * There was supposed to be an earth-shattering kaboom! 
+		 */
+		syscall_fail("execlp", p->conn_class->log_program, 0);
+		exit(10);
+
+	default:
+		/* Parent process, close the read end of the pipe */
+		close(pfd[0]);
+
+		/* Open the write end as a FILE * */
+		if (!(fd = fdopen(pfd[1], "w"))) {
+			syscall_fail("fdopen", 0, 0);
+			close(pfd[1]);
+			return -1;
+		}
+
+		/* Write the log message to the new FILE * and close */
+		fprintf(fd, "%s\n", text);
+		fflush(fd);
+		fclose(fd);
+	}
+
+	return 0;
+}
+
+/* _logfile_writetext
+ * Write a record to an internal log file, the user's copy of it and the
+ * log program.
+ */
+static int
+_logfile_writetext(IRCProxy *p, LogFile *log, const char *to,
+		   const LogRecord *rec)
+{
+	const char *dest;
+
+	if (to == IRC_LOGFILE_ALL) {
+		return -1;
+	} else if (to == IRC_LOGFILE_SERVER) {
+		dest = "SERVER";
+	} else {
+		dest = to;
+	}
+
+	/* Count membership changes while detached, so they can be summed up
+	 * for the client when it comes back rather than all recalled */
+	if (log->policy.internal & rec->event) {
+		if (p->conn_class->log_digest && (rec->event & IRC_LOG_DIGEST)
+		    && (p->client_status != IRC_CLIENT_ACTIVE))
+			_logdigest_add(log, rec);
+
+		_logfile_write(log, rec, dest);
+	}
+	if (log->policy.user & rec->event)
+		_user_log_write(p, log, to, rec);
+	if (log->policy.pipe & rec->event)
+		_log_pipe(p, rec->event, dest, rec->from, rec->text);
+
+	return 0;
+}
+
+/* _logdigest_add
+ * Count a membership change in a log file's digest, which is about to be
+ * written to it.
+ */
+static void
+_logdigest_add(LogFile *log, const LogRecord *rec)
+{
+	struct logdigest *digest = &(log->digest);
+
+	switch (rec->event) {
+	case IRC_LOG_JOIN:
+		digest->joins++;
+		break;
+	case IRC_LOG_PART:
+		digest->parts++;
+		break;
+	case IRC_LOG_QUIT:
+		digest->quits++;
+		break;
+	case IRC_LOG_NICK:
+		digest->nicks++;
+		break;
+	case IRC_LOG_MODE:
+		digest->modes++;
+		break;
+	default:
+		return;
+	}
+
+	if (!digest->first) {
+		digest->first = rec->when;
+		digest->line = log->firstline + log->nlines;
+	}
+}
+
+/* _logdigest_count
+ * Add a count to the end of a digest summary being built, if it's not zero.
+ * Returns the new summary, text is freed.
+ */
+static char *
+_logdigest_count(char *text, unsigned long count, const char *one,
+		 const char *many)
+{
+	char *str;
+
+	if (!count)
+		return text;
+
+	str = x_sprintf("%s%s%lu %s", (text ? text : ""), (text ? ", " : ""),
+			count, (count == 1 ? one : many));
+	free(text);
+	return str;
+}
+
+/* _logdigest_text
+ * Describe the membership changes counted in a digest, returns NULL if there
+ * weren't any.  The return value must be freed.
+ */
+static char *
+_logdigest_text(const struct logdigest *digest)
+{
+	char *text, *str;
+
+	text = _logdigest_count(NULL, digest->joins, "join", "joins");
+	text = _logdigest_count(text, digest->parts, "part", "parts");
+	text = _logdigest_count(text, digest->quits, "quit", "quits");
+	text = _logdigest_count(text, digest->nicks, "nick change",
+				"nick changes");
+	text = _logdigest_count(text, digest->modes, "mode change",
+				"mode changes");
+	if (!text)
+		return NULL;
+
+	str = x_sprintf("While you were away: %s", text);
+	free(text);
+	return str;
+}
+
+/* irclog_log
+ * Write a message to log file(s).  IRC_LOGFILE_ALL writes to the server log
+ * and every channel log; the record is only formatted once, and the log
+ * program only run once (as for the server log), whatever the number of
+ * channels.
+ */
+int
+irclog_log(IRCProxy *p, int event, const char *to, const char *from,
+	   const char *format, ...)
+{
+	IRCChannel *c;
+	LogRecord   rec;
+	LogFile	   *log;
+	va_list	    ap;
+	char	   *text;
+	int	    dests;
+
+	if (!(p->log_events & event))
+		return 0;
+
+	/* Find out where it's going before going to the trouble of
+	 * formatting it, often that's nowhere at all */
+	if (to != IRC_LOGFILE_ALL) {
+		if (!(log = _logfile_get(p, to))
+		    || !(log->policy.events & event))
+			return 0;
+
+		dests = _logpolicy_dests(&(log->policy), event);
+	} else {
+		log = NULL;
+		dests = _logpolicy_dests(&(p->server_log.policy), event);
+		for (c = p->channels; c; c = c->next)
+			dests |= _logpolicy_dests(&(c->log.policy), event);
+		if (!dests)
+			return 0;
+	}
+
+	va_start(ap, format);
+	text = x_vsprintf(format, ap);
+	va_end(ap);
+
+	_logrecord_init(p, &rec, event, from, text, dests);
+
+	if (log) {
+		/* Write to one file */
+		_logfile_writetext(p, log, to, &rec);
+	} else {
+		/* Write to all files except the private one */
+		if (p->server_log.policy.internal & event)
+			_logfile_write(&(p->server_log), &rec, "SERVER");
+		if (p->server_log.policy.user & event)
+			_user_log_write(p, &(p->server_log),
+					IRC_LOGFILE_SERVER, &rec);
+
+		for (c = p->channels; c; c = c->next) {
+			if (c->log.policy.internal & event)
+				_logfile_write(&(c->log), &rec, c->name);
+			if (c->log.policy.user & event)
+				_user_log_write(p, &(c->log), c->name, &rec);
+		}
+
+		if (dests & LOG_TO_PIPE)
+			_log_pipe(p, event, "SERVER", from, text);
+	}
+
+	_logrecord_free(&rec);
+	free(text);
+	return 0;
+}
+
+  
+/* Called to automatically recall stuff FIXME */
+int irclog_autorecall(struct ircproxy *p, const char *to) {
+  unsigned long recall, start, lines;
+  struct logdigest digest;
+  struct logfile *log;
+
+  log = _logfile_get(p, to);
+  if (!log)
     return -1;
-  } else if (to == IRC_LOGFILE_SERVER) {
-    dest = "SERVER";
+
+  if (log == &(p->server_log)) {
+    recall = p->conn_class->server_log_recall;
+  } else if (log == &(p->private_log)) {
+    recall = p->conn_class->private_log_recall;
   } else {
-    dest = to;
+    recall = p->conn_class->chan_log_recall;
   }
- 
-  time(&now);
-  if (p->conn_class->log_timeoffset)
-    now -= (p->conn_class->log_timeoffset * 60);
+
+  /* Membership changes are summed up instead of recalled, the digest is
+     only ever given out once, even if nothing is recalled */
+  digest = log->digest;
+  memset(&(log->digest), 0, sizeof(struct logdigest));
+
+  /* Don't recall anything */
+  if (!recall)
+    return 0;
   
-  _logfile_write(log, "%lu %s %s %s %s",
-                now, irclog_flagtostr(event), dest, from, text);
-
-  /* Write to the user's copy */
-  user_log = _open_user_log(p, to);
-  if (user_log) {
-    char tbuf[40];
-    
-    if (p->conn_class->log_timestamp) {
-      strftime(tbuf, sizeof(tbuf), LOG_USER_TIME_FORMAT, localtime(&now));
-    } else {
-      tbuf[0] = '0';
-    }
-
-    /* Print a nicely formatted entry to the log file */
-    if (event & IRC_LOG_MSG) {
-      _log_printf(user_log, "%s<%s> %s\n", tbuf, from, text);
-    } else if (event & IRC_LOG_NOTICE) {
-      _log_printf(user_log, "%s-%s- %s\n", tbuf, from, text);
-    } else if (event & IRC_LOG_ACTION) {
-      char *nick, *ptr;
-
-      nick = x_strdup(from);
-      ptr = strchr(nick, '!');
-      if (ptr)
-        *ptr = 0;
-
-      _log_printf(user_log, "%s* %s %s\n", tbuf, nick, text);
-      free(nick);
-    } else if (event & IRC_LOG_CTCP) {
-      _log_printf(user_log, "%s[%s] %s\n", tbuf, from, text);
-    } else if (event & IRC_LOG_JOIN) {
-      _log_printf(user_log, "%s--> %s\n", tbuf, text);
-    } else if (event & IRC_LOG_PART) {
-      _log_printf(user_log, "%s<-- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_KICK) {
-      _log_printf(user_log, "%s<-- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_QUIT) {
-      _log_printf(user_log, "%s<-- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_NICK) {
-      _log_printf(user_log, "%s--- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_MODE) {
-      _log_printf(user_log, "%s--- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_TOPIC) {
-      _log_printf(user_log, "%s--- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_CLIENT) {
-      _log_printf(user_log, "%s*** %s\n", tbuf, text);
-    } else if (event & IRC_LOG_SERVER) {
-      _log_printf(user_log, "%s*** %s\n", tbuf, text);
-    } else if (event & IRC_LOG_ERROR) {
-      _log_printf(user_log, "%s*** %s\n", tbuf, text);
-    }
-      
-    fclose(user_log);
+  /* Recall everything */
+  if (recall == -1) {
+    start = 0;
+  } else {
+    start = (recall > log->nlines ? 0 : log->nlines - recall);
+  }
+
+  /* Don't recall what the client saw before it detached */
+  if (p->conn_class->log_recall_unread
+      && (log->seen > log->firstline + start))
+    start = MIN(log->seen - log->firstline, log->nlines);
+  lines = log->nlines - start;
+
+  return _irclog_recall(p, log, start, lines, to, 0,
+                        (digest.first ? &digest : 0));
+}
+
+/* Called to manually recall stuff FIXME */
+int irclog_recall(struct ircproxy *p, const char *to,
+                  long start, long lines, const char *from) {
+  struct logfile *log;
+
+  log = _logfile_get(p, to);
+  if (!log)
+    return -1;
+
+  /* Recall everything */
+  if (lines == -1) {
+    start = 0;
+    lines = log->nlines;
   }
 
-  /* Write to the pipe */
-  _log_pipe(p, event, dest, from, text); 
+  /* Recall recent */
+  if (start == -1)
+    start = (lines > log->nlines ? 0 : log->nlines - lines);
+
+  return _irclog_recall(p, log, start, lines, to, from, 0);
+}
+
+/* irclog_search
+ * Search the log files for lines matching every one of the search terms, and
+ * recall them.  IRC_LOGFILE_ALL searches the server, private and all channel
+ * logs, otherwise just the log file for to is searched.  Returns the number
+ * of lines found.
+ */
+unsigned long
+irclog_search(IRCProxy *p, const char *to, char **terms, int nterms)
+{
+	IRCChannel    *c;
+	unsigned long  nfound;
+	LogFile	      *log;
+
+	if (to != IRC_LOGFILE_ALL) {
+		if (!(log = _logfile_get(p, to)))
+			return 0;
+		if (IS_PRIVATE_LOG(p, log))
+			to = p->nickname;
+
+		return _irclog_search(p, log, terms, nterms, to);
+	}
+
+	nfound = _irclog_search(p, &(p->server_log), terms, nterms, NULL);
+	nfound += _irclog_search(p, &(p->private_log), terms, nterms,
+				 p->nickname);
+	for (c = p->channels; c; c = c->next)
+		nfound += _irclog_search(p, &(c->log), terms, nterms, c->name);
+
+	return nfound;
+}
+
+/* irclog_recall_range
+ * Recall everything logged to a log file between two times, since and
+ * until.  An until of zero means up to now.
+ */
+int
+irclog_recall_range(IRCProxy *p, const char *to, time_t since, time_t until,
+		    const char *from)
+{
+	LogFile *log;
+
+	if (!(log = _logfile_get(p, to)))
+		return -1;
+
+	return _irclog_recall_range(p, log, since, until, to, from);
+}
+
+/* _logmark_add
+ * Add a mark to the sparse timestamp index of a log file.  Marks are added
+ * for every markevery lines, recording when the line was logged and where
+ * it starts in the file.  A log with no maximum size would grow the index
+ * forever, so once it's full every other mark is thrown away and they're
+ * added half as often.
+ */
+static void
+_logmark_add(LogFile *log, time_t when, long offset)
+{
+	size_t i;
+
+	if (log->nmarks >= LOG_MARK_MAX) {
+		for (i = 0; i * 2 < log->nmarks; i++)
+			log->marks[i] = log->marks[i * 2];
+		log->nmarks = i;
+		log->markevery *= 2;
+	}
+
+	if (log->nmarks >= log->marks_sz) {
+		log->marks_sz = (log->marks_sz ? log->marks_sz * 2 : 16);
+		log->marks = (struct logmark *)realloc(log->marks,
+			sizeof(struct logmark) * log->marks_sz);
+	}
+
+	log->marks[log->nmarks].when = when;
+	log->marks[log->nmarks].offset = offset;
+	log->nmarks++;
+}
+
+/* _logmark_reset
+ * Forget the sparse timestamp index of a log file, keeping the memory for
+ * when it's rebuilt.
+ */
+static void
+_logmark_reset(LogFile *log)
+{
+	log->nmarks = 0;
+	log->markevery = LOG_MARK_INTERVAL;
+}
+
+/* _logmark_seek
+ * Position reader at the last mark in the index before since, so only the
+ * lines after it need be read to find those logged at or after since.
+ * Lines are logged in time order, so a binary search will do.
+ */
+static void
+_logmark_seek(LogFile *log, LogReader *reader, time_t since)
+{
+	size_t lo, hi, mid;
+
+	/* Find the first mark at or after since */
+	lo = 0;
+	hi = log->nmarks;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (log->marks[mid].when < since) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	/* Everything before the one before it is too early */
+	_logreader_seek(reader, (lo ? log->marks[lo - 1].offset : 0));
+	reader->line = log->coldlines + (lo ? (lo - 1) * log->markevery : 0);
+}
+
+/* _logreader_open
+ * Open an internal log file to be read back, telling the client if it
+ * can't be.  Returns NULL if there's nothing to read.
+ */
+static LogReader *
+_logreader_open(IRCProxy *p, LogFile *log)
+{
+	LogReader *reader;
+
+	if (!log->filename || !log->made)
+		return NULL;
+
+	if (!(reader = _logreader_new(log)))
+		ircclient_send_notice(p, "Couldn't open log file %s",
+				      log->filename);
+
+	return reader;
+}
+
+/* _logreader_new
+ * Open an internal log file to be read back from the start, cold blocks
+ * first.  Where we can, the uncompressed part as it is now is mapped into
+ * memory and read from there, so lines logged afterwards aren't seen;
+ * otherwise it's read through stdio.  Either way the reader has handles
+ * of its own, so it keeps its place while more lines are logged, the log
+ * is rolled or compressed, or even freed.
+ */
+static LogReader *
+_logreader_new(LogFile *log)
+{
+	LogReader *reader;
+	FILE	  *file;
+
+	/* Logs kept in the database are read with a query of their own */
+	if (log->format == IRC_LOGFORMAT_SQLITE) {
+		LogDBCursor *cursor;
+
+		if (!(cursor = logdb_cursor(log->db, log->dbname)))
+			return NULL;
+
+		reader = (LogReader *)malloc(sizeof(LogReader));
+		memset(reader, 0, sizeof(LogReader));
+		reader->format = log->format;
+		reader->coldfd = -1;
+		reader->cursor = cursor;
+		return reader;
+	}
+
+	if (!(file = fopen(log->filename, "r"))) {
+		syscall_fail("fopen", log->filename, 0);
+		return NULL;
+	}
+
+	reader = (LogReader *)malloc(sizeof(LogReader));
+	memset(reader, 0, sizeof(LogReader));
+	reader->format = log->format;
+	reader->file = file;
+	reader->coldfd = -1;
+
+#ifdef HAVE_MMAP
+	{
+		struct stat  statinfo;
+		void	    *map;
+
+		/* An empty file can't be mapped, but there's nothing to
+		 * read from it anyway */
+		if (fstat(fileno(file), &statinfo)) {
+			syscall_fail("fstat", log->filename, 0);
+		} else if ((statinfo.st_size > 0)
+			   && ((size_t)statinfo.st_size == statinfo.st_size)) {
+			map = mmap(NULL, statinfo.st_size, PROT_READ,
+				   MAP_PRIVATE, fileno(file), 0);
+			if (map == MAP_FAILED) {
+				syscall_fail("mmap", log->filename, 0);
+			} else {
+				reader->hot = (const char *)map;
+				reader->hotsize = statinfo.st_size;
+
+				fclose(file);
+				reader->file = NULL;
+			}
+		}
+	}
+#endif /* HAVE_MMAP */
+
+	/* Blocks are only ever added to the end of the cold file, so we
+	 * can share it and stop at the end as it is now */
+	if (log->cold && log->coldsize) {
+		reader->coldfd = dup(log->coldfd);
+		if (reader->coldfd == -1)
+			syscall_fail("dup", log->filename, 0);
+		reader->coldend = log->coldsize;
+	}
+
+	if (reader->coldfd != -1) {
+		reader->incold = 1;
+	} else {
+		_logreader_seek(reader, 0);
+	}
+
+	return reader;
+}
+
+/* _logreader_close
+ * Finish reading back a log file.
+ */
+static void
+_logreader_close(LogReader *reader)
+{
+#ifdef HAVE_MMAP
+	if (reader->hot)
+		munmap((void *)reader->hot, reader->hotsize);
+#endif /* HAVE_MMAP */
+	if (reader->file)
+		fclose(reader->file);
+	if (reader->coldfd != -1)
+		close(reader->coldfd);
+	if (reader->cursor)
+		logdb_endcursor(reader->cursor);
+	free(reader->block);
+	free(reader);
+}
+
+/* _logreader_seek
+ * Move to a position in the uncompressed part of the log file, usually one
+ * from a mark.
+ */
+static void
+_logreader_seek(LogReader *reader, long offset)
+{
+	reader->incold = 0;
+	if (reader->file) {
+		reader->map = NULL;
+		reader->size = reader->pos = 0;
+		fseek(reader->file, offset, SEEK_SET);
+	} else {
+		reader->map = reader->hot;
+		reader->size = reader->hotsize;
+		reader->pos = MIN((size_t)offset, reader->size);
+	}
+}
+
+/* _logreader_seekblock
+ * Move to the start of a cold block, which is only read once something's
+ * wanted from it.
+ */
+static void
+_logreader_seekblock(LogReader *reader, const struct logblock *block)
+{
+	reader->incold = 1;
+	reader->coldnext = block->offset;
+	reader->line = reader->blockend = block->firstline;
+	reader->map = NULL;
+	reader->size = reader->pos = 0;
+}
+
+/* _logreader_seekline
+ * Move to a line, counting from the first still in the log file.  The
+ * log's block index and marks are used to get close, so this must be done
+ * before anything more is logged to it.
+ */
+static void
+_logreader_seekline(LogReader *reader, LogFile *log, unsigned long line)
+{
+	unsigned long mark;
+	size_t	      lo, hi, mid;
+
+	/* The database finds the line itself */
+	if (reader->cursor) {
+		if (line != reader->line)
+			logdb_seekline(reader->cursor, log->firstline + line);
+		reader->line = line;
+		return;
+	}
+
+	/* Reading on is quicker if it's close, or in the same block */
+	if ((line >= reader->line)
+	    && ((line - reader->line < log->markevery)
+		|| (reader->incold && (line < reader->blockend)))) {
+		/* Nothing to do */
+
+	} else if ((line < log->coldlines) && (reader->coldfd != -1)) {
+		/* Find the last block starting at or before it */
+		lo = 0;
+		hi = log->nblocks;
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo) / 2;
+			if (log->blocks[mid].firstline <= line) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+		_logreader_seekblock(reader, &log->blocks[lo]);
+
+	} else {
+		mark = (line - MIN(line, log->coldlines)) / log->markevery;
+		if (mark < log->nmarks) {
+			_logreader_seek(reader, log->marks[mark].offset);
+			reader->line = log->coldlines
+				+ mark * log->markevery;
+		} else {
+			_logreader_seek(reader, 0);
+			reader->line = log->coldlines;
+		}
+	}
+
+	while ((reader->line < line) && !_logreader_skipentry(reader))
+		;
+}
+
+/* _logreader_seektime
+ * Move to somewhere before the first line logged at or after since, using
+ * the block index if it's in a cold block and the marks if not.
+ */
+static void
+_logreader_seektime(LogReader *reader, LogFile *log, time_t since)
+{
+	size_t lo, hi, mid;
+
+	if (reader->cursor) {
+		logdb_seektime(reader->cursor, since);
+		return;
+	}
+
+	if ((reader->coldfd == -1) || !log->nblocks
+	    || (since > log->blocks[log->nblocks - 1].last)) {
+		_logmark_seek(log, reader, since);
+		return;
+	}
+
+	/* Find the first block with anything at or after since */
+	lo = 0;
+	hi = log->nblocks - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (log->blocks[mid].last < since) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	_logreader_seekblock(reader, &log->blocks[lo]);
+}
+
+/* _logreader_fill
+ * Called when the cold block being read is used up, to read and uncompress
+ * the next one.  Blocks that can't be read are skipped, and at the end of
+ * the cold file we go on to the uncompressed part.
+ */
+static void
+_logreader_fill(LogReader *reader)
+{
+	struct logblock block;
+
+	while (reader->incold) {
+		if (logblock_readheader(reader->coldfd, reader->coldnext,
+					reader->coldend, &block)) {
+			reader->line = reader->blockend;
+			_logreader_seek(reader, 0);
+			return;
+		}
+
+		reader->coldnext = block.offset + block.hdrlen + block.clen;
+		reader->line = reader->blockend;
+		reader->blockend += block.nlines;
+
+		if (!logblock_read(reader->coldfd, &block, &reader->block,
+				   &reader->blocksz)) {
+			reader->map = reader->block;
+			reader->size = block.rawlen;
+			reader->pos = 0;
+			return;
+		}
 
-  return 0;
+		syscall_fail("logblock_read", 0, 0);
+	}
 }
 
-/* Write a message to log file(s) */
-int irclog_log(struct ircproxy *p, int event, const char *to, const char *from,
-               const char *format, ...) {
-  char *text;
-  va_list ap;
+/* _logreader_ready
+ * Make sure there's something to read.  Returns 0 if it's in memory, 1 if
+ * it's to be read through stdio, or -1 at the end of the file.
+ */
+static int
+_logreader_ready(LogReader *reader)
+{
+	while (reader->incold && (reader->pos >= reader->size))
+		_logreader_fill(reader);
 
-  if (!(p->conn_class->log_events & event))
-    return 0;
+	if (!reader->incold && reader->file)
+		return 1;
 
-  va_start(ap, format);
-  text = x_vsprintf(format, ap);
+	return (reader->pos < reader->size ? 0 : -1);
+}
 
-  if (to != IRC_LOGFILE_ALL) {
-    struct logfile *log;
-    
-    /* Write to one file */
-    log = _logfile_get(p, to);
-    if (!log)
-      return -1;
+/* _logreader_getvarint
+ * Read a varint from a mapped binary log.  Returns 0 on success, -1 at the
+ * end of the file or if the value is too big.
+ */
+static int
+_logreader_getvarint(LogReader *reader, unsigned long *val)
+{
+	unsigned int shift;
+	int	     c;
 
-    _logfile_writetext(p, log, event, to, from, text);
-  } else {
-    struct ircchannel *c;
-
-    /* Write to all files except the private one */
-    _logfile_writetext(p, &(p->server_log), event, IRC_LOGFILE_SERVER,
-                      from, text);
-    c = p->channels;
-    while (c) {
-	    _logfile_writetext(p, &(c->log), event, c->name, from, text);
-      c = c->next;
-    }
-  }
+	*val = 0;
+	shift = 0;
+	do {
+		if (reader->pos >= reader->size)
+			return -1;
+		if (shift >= sizeof(unsigned long) * 8)
+			return -1;
 
-  free(text);
-  va_end(ap);
+		c = (unsigned char)reader->map[reader->pos++];
+		*val |= (unsigned long)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
 
-  return 0;
+	return 0;
 }
 
+/* _logreader_readentry
+ * Read the next record into a LogEntry, like _log_readentry does.
+ */
+static int
+_logreader_readentry(LogReader *reader, LogEntry *ent)
+{
+	int r;
+
+	if (reader->cursor) {
+		r = _logreader_dbentry(reader, ent);
+	} else if ((r = _logreader_ready(reader)) > 0) {
+		r = _log_readentry(reader->format, reader->file, ent);
+	} else if (!r) {
+		r = _logreader_getentry(reader, ent);
+	}
 
-  
-/* Called to automatically recall stuff FIXME */
-int irclog_autorecall(struct ircproxy *p, const char *to) {
-  unsigned long recall, start, lines;
-  struct logfile *log;
+	if (r >= 0)
+		reader->line++;
+	return r;
+}
 
-  log = _logfile_get(p, to);
-  if (!log)
-    return -1;
+/* _logreader_skipentry
+ * Skip over the next record.  Returns 0 on success or -1 at the end of the
+ * file.
+ */
+static int
+_logreader_skipentry(LogReader *reader)
+{
+	struct logdbrow row;
+	int		r;
+
+	if (reader->cursor) {
+		r = logdb_next(reader->cursor, &row);
+	} else if ((r = _logreader_ready(reader)) > 0) {
+		r = _log_skipentry(reader->format, reader->file);
+	} else if (!r) {
+		r = _logreader_passentry(reader);
+	}
 
-  if (log == &(p->server_log)) {
-    recall = p->conn_class->server_log_recall;
-  } else if (log == &(p->private_log)) {
-    recall = p->conn_class->private_log_recall;
-  } else {
-    recall = p->conn_class->chan_log_recall;
-  }
+	if (r >= 0)
+		reader->line++;
+	return r;
+}
 
-  /* Don't recall anything */
-  if (!recall)
-    return 0;
-  
-  /* Recall everything */
-  if (recall == -1) {
-    start = 0;
-  } else {
-    start = (recall > log->nlines ? 0 : log->nlines - recall);
-  }
-  lines = log->nlines - start;
+/* _logreader_getentry
+ * Read the next record from memory into a LogEntry.  Text lines are found
+ * with memchr() and only the one line is copied out.
+ */
+static int
+_logreader_getentry(LogReader *reader, LogEntry *ent)
+{
+	const char *start, *end;
+	size_t	    len;
+
+	if (reader->format == IRC_LOGFORMAT_BINARY) {
+		unsigned long when, slen;
+		size_t	      offs[3], used;
+		int	      code, i;
+
+		if (_logreader_getvarint(reader, &when)
+		    || (reader->pos >= reader->size))
+			return -1;
+		code = (unsigned char)reader->map[reader->pos++];
+
+		used = 0;
+		for (i = 0; i < 3; i++) {
+			if (_logreader_getvarint(reader, &slen)
+			    || (slen > reader->size - reader->pos))
+				return -1;
+
+			if (used + slen + 1 > ent->bufsz) {
+				ent->bufsz = used + slen + 1 + 256;
+				ent->buf = (char *)realloc(ent->buf,
+							   ent->bufsz);
+			}
+
+			memcpy(ent->buf + used, reader->map + reader->pos,
+			       slen);
+			ent->buf[used + slen] = '\0';
+			reader->pos += slen;
+
+			offs[i] = used;
+			used += slen + 1;
+		}
+
+		ent->when = (time_t)when;
+		ent->event = (code < 16 ? 1 << code : IRC_LOG_NONE);
+		ent->dest = ent->buf + offs[0];
+		ent->from = ent->buf + offs[1];
+		ent->text = ent->buf + offs[2];
+		return 0;
+	}
+
+	if (reader->pos >= reader->size)
+		return -1;
+
+	start = reader->map + reader->pos;
+	end = memchr(start, '\n', reader->size - reader->pos);
+	len = (end ? (size_t)(end - start) : reader->size - reader->pos);
+	reader->pos += len + (end ? 1 : 0);
 
-  return _irclog_recall(p, log, start, lines, to, 0);
+	if (len + 1 > ent->bufsz) {
+		ent->bufsz = len + 1 + 256;
+		ent->buf = (char *)realloc(ent->buf, ent->bufsz);
+	}
+	memcpy(ent->buf, start, len);
+	while (len && strchr(" \t\r", ent->buf[len - 1]))
+		len--;
+	ent->buf[len] = '\0';
+
+	return _log_parseline(ent);
 }
 
-/* Called to manually recall stuff FIXME */
-int irclog_recall(struct ircproxy *p, const char *to,
-                  long start, long lines, const char *from) {
-  struct logfile *log;
+/* _logreader_passentry
+ * Skip over the next record in memory without copying anything out of it.
+ * Returns 0 on success or -1 at the end of the buffer.
+ */
+static int
+_logreader_passentry(LogReader *reader)
+{
+	const char    *end;
+	unsigned long  val;
+	int	       i;
 
-  log = _logfile_get(p, to);
-  if (!log)
-    return -1;
+	if (reader->format == IRC_LOGFORMAT_BINARY) {
+		if (_logreader_getvarint(reader, &val)
+		    || (reader->pos >= reader->size))
+			return -1;
+		reader->pos++;
 
-  /* Recall everything */
-  if (lines == -1) {
-    start = 0;
-    lines = log->nlines;
-  }
+		for (i = 0; i < 3; i++) {
+			if (_logreader_getvarint(reader, &val)
+			    || (val > reader->size - reader->pos))
+				return -1;
+			reader->pos += val;
+		}
+		return 0;
+	}
 
-  /* Recall recent */
-  if (start == -1)
-    start = (lines > log->nlines ? 0 : log->nlines - lines);
+	if (reader->pos >= reader->size)
+		return -1;
 
-  return _irclog_recall(p, log, start, lines, to, from);
-}
-
-/* Called to do the recall from a log file FIXME */
-static int _irclog_recall(struct ircproxy *p, struct logfile *log,
-                          unsigned long start, unsigned long lines,
-                          const char *to, const char *from) {
-  FILE *file;
-  int close;
-
-  /* If the file isn't open, we have to open it and remember to close it
-     later */
-  if (log->open) {
-    file = log->file;
-    close = 0;
-  } else if (log->filename && log->made) {
-    file = fopen(log->filename, "r");
-    if (!file) {
-      ircclient_send_notice(p, "Couldn't open log file %s", log->filename);
-      syscall_fail("fopen", log->filename, 0);
-      return -1;
-    }
-    close = 1;
-  } else {
-    return -1;
-  }
+	end = memchr(reader->map + reader->pos, '\n',
+		     reader->size - reader->pos);
+	reader->pos = (end ? (size_t)(end - reader->map) + 1 : reader->size);
+	return 0;
+}
 
-  debug("recalling log [%s]\r\n", log->filename);
-
-  /* If to is 0, then we're recalling from the server_log, and need to send
-   * it to the nickname */
-  if (!to)
-    to = p->nickname ? p->nickname : "";
-
-  /* Jump to the beginning */
-  fseek(file, 0, SEEK_SET);
-
-  if (start < log->nlines) {
-    char *msg;
-
-    /* Skip start lines */
-    while (start && (msg = _log_read(file))) {
-      free(msg);
-      start--;
-    }
-
-    /* Make lines sensible */
-    lines = MIN(lines, log->nlines - start);
-
-    /* Recall lines */
-    while (lines && (msg = _log_read(file))) {
-      time_t when = 0;
-      char *ll;
-      int event;
-      char *src, *frm, *eventtext;
-      char *work, *rest;
-      time_t now, diff;
-      char tbuf[40];
-
-      tbuf[0] = 0;
-     
-      debug("log: [%s]\r\n", msg);
-
-       /*
-	* 1079304950 client #dircproxy dircproxy You connected
-	* 1079304951 join #dircproxy niven.freenode.net You joined the channel
-	* 1079305132 client #dircproxy dircproxy You disconnected
-	* 1079305143 message #dircproxy bear!~bear@pa.comcast.net lah
-	* 1079305150 action #dircproxy bear!~bear@pa.comcast.net moons the channel
-	*/
-
-      ll   = msg;
-      work = msg;
-      if (!*work) {                             /* Timestamp is first value now */
-        free(ll);
-        continue;
-      }
-  
-      rest = strchr(msg, ' ');                  /* parse to the space */
-      if (!rest) {
-        free(ll);
-        continue;
-      }
-
-      *(rest++) = 0;                            /* delete the space */
-      msg = rest;
-  
-      when = strtoul(work, (char **)NULL, 10);  /* Obtain the timestamp */
-
-      eventtext = msg;                          /* store the event text */
-      if (!*eventtext) {
-        free(ll);
-        continue;
-      }
-      
-      rest = strchr(msg, ' ');                  /* Message continues after a space */
-      if (!rest) {
-        free(ll);
-        continue;
-      }
-      
-      *(rest++) = 0;                            /* Delete the space */
-      msg = rest;
-
-      event = irclog_strtoflag(eventtext);      /* determine the event code */
-      src   = msg;                              /* log source */
-      
-      rest = strchr(msg, ' ');                  /* Message continues after a space */
-      if (!rest) {
-        free(ll);
-        continue;
-      }
-  
-      *(rest++) = 0;                            /* Delete the space */
-      msg = rest;
-  
-      frm = msg;                                /* where the entry is from */
-      
-      rest = strchr(msg, ' ');                  /* Message continues after a space */
-      if (!rest) {
-        free(ll);
-        continue;
-      }
-      
-      *(rest++) = 0;                             /* Delete the space */
-      msg = rest;
-  
-      debug("timestamp: %d event: %d src: [%s] frm: [%s] log: [%s]\r\n", when, event, src, frm, msg);
-
-      /* If the log_timestamp option is on, format the timestamp */
-      if (when && p->conn_class->log_timestamp) {
-        if (p->conn_class->log_relativetime) {
-          time(&now);
-          diff = now - when;
-
-          if (diff < 82800L) {                /* Within 23 hours [hh:mm] */
-            strftime(tbuf, sizeof(tbuf), "[%H:%M] ", localtime(&when));
-          } else if (diff < 518400L) {        /* Within 6 days [day hh:mm] */
-            strftime(tbuf, sizeof(tbuf), "[%a %H:%M] ", localtime(&when));
-          } else if (diff < 25920000L) {      /* Within 300 days [d mon] */
-            strftime(tbuf, sizeof(tbuf), "[%d %b] ", localtime(&when));
-          } else {                            /* Otherwise [d mon yyyy] */
-            strftime(tbuf, sizeof(tbuf), "[%d %b %Y] ", localtime(&when));
-          }
-        } else {
-          strftime(tbuf, sizeof(tbuf), LOG_TIME_FORMAT, localtime(&when));
-        }
-      }
-
-      /* Message or Notice lines, these require a bit of parsing */
-      if ((event == IRC_LOG_NOTICE) || (event == IRC_LOG_MSG) || (event == IRC_LOG_ACTION)) {
-        /* Do filtering */
-        if (from) {
-          char *comp, *ptr;
-
-          /* We just check the nickname, so strip off anything after the ! */
-          comp = x_strdup(src);
-          if ((ptr = strchr(comp, '!')))
-            *ptr = 0;
-
-            /* Check the nicknames are the same */
-          if (irc_strcasecmp(comp, from)) {
-            free(comp);
-            free(ll);
-            continue;
-          }
-          free(comp);
-        }
-      }
-      
-        /* Send the line */
-      if (event == IRC_LOG_MSG) {
-        net_send(p->client_sock, ":%s PRIVMSG %s :%s%s\r\n", frm, to, tbuf, msg);
-      } else if (event == IRC_LOG_ACTION) {
-        net_send(p->client_sock, ":%s PRIVMSG %s :\001ACTION %s%s\001\r\n", frm, to, tbuf, msg);
-      } else if (event == IRC_LOG_CTCP) {
-        net_send(p->client_sock, ":%s PRIVMSG %s :\001%s %s%s%s\001\r\n", src, to, eventtext, tbuf, (strlen(msg) ? " " : ""), msg);
-      } else if (event == IRC_LOG_NOTICE) {
-        ircclient_send_notice(p, "%s", msg);
-      } else {
-        net_send(p->client_sock, ":%s PRIVMSG %s :%s%s\r\n", src, to, tbuf, msg);
-      }
-
-      free(ll);
-      lines--;
-    }
-  }
+/* _logreader_dbentry
+ * Read the next record from the database into a LogEntry.
+ */
+static int
+_logreader_dbentry(LogReader *reader, LogEntry *ent)
+{
+	struct logdbrow row;
+	size_t		destlen, fromlen, textlen;
 
-    /* Either close, or skip back to the end */
-  if (close) {
-    fclose(file);
-  } else {
-    fseek(file, 0, SEEK_END);
-  }
-  return 0;
+	if (logdb_next(reader->cursor, &row))
+		return -1;
+	if (!row.dest || !row.from || !row.text)
+		return 1;
+
+	destlen = strlen(row.dest) + 1;
+	fromlen = strlen(row.from) + 1;
+	textlen = strlen(row.text) + 1;
+	if (destlen + fromlen + textlen > ent->bufsz) {
+		ent->bufsz = destlen + fromlen + textlen + 256;
+		ent->buf = (char *)realloc(ent->buf, ent->bufsz);
+	}
+
+	ent->when = row.when;
+	ent->event = row.event;
+	ent->dest = memcpy(ent->buf, row.dest, destlen);
+	ent->from = memcpy(ent->buf + destlen, row.from, fromlen);
+	ent->text = memcpy(ent->buf + destlen + fromlen, row.text, textlen);
+	return 0;
+}
+
+/* _log_sendentry
+ * Send a single recalled log entry to the client, as if it came from
+ * wherever it originally did.  If from is given then messages, notices and
+ * actions not sent by that nickname are skipped.  Relative timestamps are
+ * worked out from now.  Returns 1 if the entry was sent, 0 if it was
+ * filtered out.
+ */
+static int
+_log_sendentry(IRCProxy *p, time_t now, const LogEntry *ent, const char *to,
+	       const char *from)
+{
+	const char *tbuf;
+
+	debug("timestamp: %lu event: %d src: [%s] frm: [%s] log: [%s]\r\n",
+	      (unsigned long)ent->when, ent->event, ent->dest, ent->from,
+	      ent->text);
+
+	/* Message or Notice lines, these require a bit of parsing */
+	if (from && ((ent->event == IRC_LOG_NOTICE)
+		     || (ent->event == IRC_LOG_MSG)
+		     || (ent->event == IRC_LOG_ACTION))) {
+		char *comp, *ptr;
+
+		/* We just check the nickname, so strip off anything after
+		 * the !
+		 */
+		comp = x_strdup(ent->dest);
+		if ((ptr = strchr(comp, '!')))
+			*ptr = 0;
+
+		/* Check the nicknames are the same */
+		if (irc_strcasecmp(comp, from)) {
+			free(comp);
+			return 0;
+		}
+		free(comp);
+	}
+
+	/* If the log_timestamp option is on, format the timestamp */
+	tbuf = "";
+	if (ent->when && p->conn_class->log_timestamp) {
+		if (p->conn_class->log_relativetime) {
+			time_t diff;
+
+			diff = now - ent->when;
+
+			if (diff < 82800L) {
+				/* Within 23 hours [hh:mm] */
+				tbuf = strtime("[%H:%M] ", ent->when, 0);
+			} else if (diff < 518400L) {
+				/* Within 6 days [day hh:mm] */
+				tbuf = strtime("[%a %H:%M] ", ent->when, 0);
+			} else if (diff < 25920000L) {
+				/* Within 300 days [d mon] */
+				tbuf = strtime("[%d %b] ", ent->when, 0);
+			} else {
+				/* Otherwise [d mon yyyy] */
+				tbuf = strtime("[%d %b %Y] ", ent->when, 0);
+			}
+		} else {
+			tbuf = strtime(LOG_TIME_FORMAT, ent->when, 0);
+		}
+	}
+
+	/* Send the line */
+	if (ent->event == IRC_LOG_MSG) {
+		net_send(p->client_sock, ":%s PRIVMSG %s :%s%s\r\n",
+			 ent->from, to, tbuf, ent->text);
+	} else if (ent->event == IRC_LOG_ACTION) {
+		net_send(p->client_sock,
+			 ":%s PRIVMSG %s :\001ACTION %s%s\001\r\n",
+			 ent->from, to, tbuf, ent->text);
+	} else if (ent->event == IRC_LOG_CTCP) {
+		net_send(p->client_sock, ":%s PRIVMSG %s :\001%s %s%s%s\001\r\n",
+			 ent->dest, to, irclog_flagtostr(ent->event), tbuf,
+			 (strlen(ent->text) ? " " : ""), ent->text);
+	} else if (ent->event == IRC_LOG_NOTICE) {
+		ircclient_send_notice(p, "%s", ent->text);
+	} else {
+		net_send(p->client_sock, ":%s PRIVMSG %s :%s%s\r\n",
+			 ent->dest, to, tbuf, ent->text);
+	}
+
+	return 1;
+}
+
+/* _irclog_recall
+ * Recall lines from a log file by position, skipping the first start lines
+ * and sending at most lines after that.  The block index and sparse index
+ * are used to seek near the start line, so only the cold blocks covering
+ * the recall are uncompressed, and the lines themselves are sent by a
+ * recall job.
+ */
+static int
+_irclog_recall(IRCProxy *p, LogFile *log, unsigned long start,
+	       unsigned long lines, const char *to, const char *from,
+	       const struct logdigest *digest)
+{
+	struct logdigest  skip;
+	LogReader	 *reader;
+
+	if (!lines || (start >= log->nlines))
+		return 0;
+
+	/* The recall job counts lines from the start of the file */
+	if (digest) {
+		skip = *digest;
+		skip.line = (skip.line > log->firstline
+			     ? skip.line - log->firstline : 0);
+		digest = &skip;
+	}
+
+	if (!(reader = _logreader_open(p, log)))
+		return -1;
+
+	debug("recalling log [%s]\r\n", log->filename);
+
+	/* Make lines sensible */
+	lines = MIN(lines, log->nlines - start);
+
+	/* Skip to the start line */
+	_logreader_seekline(reader, log, start);
+
+	_logrecall_queue(p, reader, to, from, lines, 0, 0, digest);
+	return 0;
+}
+
+/* _irclog_recall_range
+ * Recall lines from a log file logged at or after since, and at or before
+ * until if that's non-zero.  The sparse index is used to skip straight to
+ * the right part of the file, and the lines are sent by a recall job.
+ */
+static int
+_irclog_recall_range(IRCProxy *p, LogFile *log, time_t since, time_t until,
+		     const char *to, const char *from)
+{
+	LogReader *reader;
+
+	if (!(reader = _logreader_open(p, log)))
+		return -1;
+
+	debug("recalling log [%s] from %lu to %lu\r\n", log->filename,
+	      (unsigned long)since, (unsigned long)until);
+
+	_logreader_seektime(reader, log, since);
+	_logrecall_queue(p, reader, to, from, log->nlines, since, until, 0);
+	return 0;
+}
+
+/* _logrecall_queue
+ * Add a job to the end of the proxy's queue of recalls, and start sending
+ * it if there's nothing ahead of it.  The job reads from reader, which
+ * should already be positioned at the first line, and sends at most lines lines
+ * (not counting those filtered out).  Lines logged before since or after
+ * until (if non-zero) are skipped.  If digest is given, membership changes
+ * from the line it started counting at are skipped too, and it's sent in
+ * their place ahead of the other lines.
+ */
+static void
+_logrecall_queue(IRCProxy *p, LogReader *reader, const char *to,
+		 const char *from, unsigned long lines, time_t since,
+		 time_t until, const struct logdigest *digest)
+{
+	LogRecall *job, **l;
+
+	/* If to is 0, then we're recalling from the server_log, and need to
+	 * send it to the nickname
+	 */
+	if (!to)
+		to = p->nickname ? p->nickname : "";
+
+	job = (LogRecall *)malloc(sizeof(LogRecall));
+	memset(job, 0, sizeof(LogRecall));
+	job->reader = reader;
+	job->to = x_strdup(to);
+	job->from = (from ? x_strdup(from) : NULL);
+	job->lines = lines;
+	job->since = since;
+	job->until = until;
+	if (digest) {
+		job->skip = IRC_LOG_DIGEST;
+		job->skipfrom = digest->line;
+		job->digest = *digest;
+	}
+
+	for (l = &(p->recalls); *l; l = &((*l)->next))
+		;
+	*l = job;
+
+	if (p->recalls == job)
+		_logrecall_run(p, p->client_sock);
+}
+
+/* _logrecall_run
+ * Send the next batch of lines from the proxy's recall jobs.  This stops
+ * once a batch has been sent or the client's output buffer is full enough,
+ * and asks to be called again when the buffer has drained, so a large
+ * recall doesn't hold up everything else.
+ */
+static void
+_logrecall_run(IRCProxy *p, int sock)
+{
+	LogRecall *job;
+	LogEntry   ent;
+	time_t	   now;
+	int	   n, r;
+
+	memset(&ent, 0, sizeof(LogEntry));
+	time(&now);
+	n = 0;
+
+	while ((job = p->recalls) && (n < LOG_RECALL_BATCH)
+	       && (net_pending(p->client_sock) < LOG_RECALL_HIWAT)) {
+		/* The digest goes before anything else */
+		if (job->digest.first) {
+			_logrecall_digest(p, now, job);
+			n++;
+			continue;
+		}
+
+		r = (job->lines ? _logreader_readentry(job->reader, &ent) : -1);
+		n++;
+
+		/* Skip anything we can't make sense of, that's too early, or
+		 * that the digest has summed up; the line just read is the
+		 * one before the reader's */
+		if ((r > 0) || (!r && ((ent.when < job->since)
+				       || ((ent.event & job->skip)
+					   && (job->reader->line
+					       > job->skipfrom)))))
+			continue;
+
+		if (!r && (!job->until || (ent.when <= job->until))) {
+			if (_log_sendentry(p, now, &ent, job->to, job->from))
+				job->lines--;
+			continue;
+		}
+
+		/* Finished with this one */
+		p->recalls = job->next;
+		_logrecall_free(job);
+	}
+
+	_log_freeentry(&ent);
+
+	if (p->recalls)
+		net_drain(p->client_sock, LOG_RECALL_LOWAT,
+			  ACTIVITY_FUNCTION(_logrecall_run));
+}
+
+/* _logrecall_digest
+ * Send a recall job's digest to the client as though it were a logged line,
+ * timestamped with the first change it covers.
+ */
+static void
+_logrecall_digest(IRCProxy *p, time_t now, LogRecall *job)
+{
+	LogEntry  ent;
+	char	 *text;
+
+	if ((text = _logdigest_text(&(job->digest)))) {
+		memset(&ent, 0, sizeof(LogEntry));
+		ent.when = job->digest.first;
+		ent.event = IRC_LOG_CLIENT;
+		ent.dest = PACKAGE;
+		ent.from = PACKAGE;
+		ent.text = text;
+
+		_log_sendentry(p, now, &ent, job->to, NULL);
+		free(text);
+	}
+
+	memset(&(job->digest), 0, sizeof(struct logdigest));
+}
+
+/* _logrecall_free
+ * Free a recall job, closing its file.
+ */
+static void
+_logrecall_free(LogRecall *job)
+{
+	_logreader_close(job->reader);
+	free(job->to);
+	free(job->from);
+	free(job);
+}
+
+/* irclog_recall_cancel
+ * Abandon any recalls in progress, called when the client goes away.
+ */
+void
+irclog_recall_cancel(IRCProxy *p)
+{
+	LogRecall *job;
+
+	if (p->recalls && (p->client_sock != -1))
+		net_drain(p->client_sock, 0, NULL);
+
+	while ((job = p->recalls)) {
+		p->recalls = job->next;
+		_logrecall_free(job);
+	}
+}
+
+/* _irclog_recall_lines
+ * Recall particular lines from a log file, given as an ascending list of
+ * line numbers since the log was opened.  The block index and sparse index
+ * are used to seek near each line rather than reading the file from the
+ * start.
+ */
+static int
+_irclog_recall_lines(IRCProxy *p, LogFile *log, const unsigned long *lines,
+		     size_t nlines, const char *to)
+{
+	unsigned long  line;
+	LogEntry       ent;
+	LogReader     *reader;
+	time_t	       now;
+	size_t	       i;
+
+	if (!(reader = _logreader_open(p, log)))
+		return -1;
+
+	if (!to)
+		to = p->nickname ? p->nickname : "";
+
+	memset(&ent, 0, sizeof(LogEntry));
+	time(&now);
+
+	for (i = 0; i < nlines; i++) {
+		if ((lines[i] < log->firstline)
+		    || (lines[i] - log->firstline >= log->nlines))
+			continue;
+		line = lines[i] - log->firstline;
+
+		_logreader_seekline(reader, log, line);
+		if (reader->line != line)
+			break;
+
+		if (!_logreader_readentry(reader, &ent))
+			_log_sendentry(p, now, &ent, to, NULL);
+	}
+
+	_log_freeentry(&ent);
+	_logreader_close(reader);
+	return 0;
+}
+
+/* _irclog_search
+ * Look up a set of search terms in the index of a log file, and recall the
+ * lines that match.  Returns the number of lines found.
+ */
+static unsigned long
+_irclog_search(IRCProxy *p, LogFile *log, char **terms, int nterms,
+	       const char *to)
+{
+	unsigned long *lines, first;
+	size_t	       nfound;
+
+	if (!log->index)
+		return 0;
+
+	/* Older lines may not have been expired from the index yet */
+	first = log->firstline;
+	if (log->nlines > LOG_SEARCH_LINES)
+		first += log->nlines - LOG_SEARCH_LINES;
+
+	nfound = logindex_search(log->index, terms, nterms, first, &lines);
+	if (nfound)
+		_irclog_recall_lines(p, log, lines, nfound, to);
+
+	free(lines);
+	return nfound;
+}
+
+/* irclog_strtotime
+ * Convert a time given to a RECALL command into the time_t it refers to in
+ * the log files.  Accepts a relative time ago ("90m", "2h", "3d"), a time
+ * of day ("18:00", the most recent one), a day ("today", "yesterday",
+ * "friday", "2009-03-27", meaning midnight at the start of it) or a day and
+ * time of day together ("friday/18:00").  Returns 0 on success, -1 if the
+ * string couldn't be understood.
+ */
+int
+irclog_strtotime(IRCProxy *p, const char *str, time_t *when)
+{
+	static const char *days[] = { "sunday", "monday", "tuesday",
+				      "wednesday", "thursday", "friday",
+				      "saturday" };
+	struct tm   tm;
+	const char *clock;
+	char	   *end, *day;
+	time_t	    now;
+	long	    val;
+	int	    hour, min, i;
+
+	/* Everything is measured in log time, which is offset, so that what
+	   the user types matches the times they see in recalls */
+	now = time(NULL) - (p->conn_class->log_timeoffset * 60);
+
+	val = strtol(str, &end, 10);
+	if ((end != str) && *end && !end[1] && (val >= 0)) {
+		switch (*end) {
+		case 's': break;
+		case 'm': val *= 60L; break;
+		case 'h': val *= 3600L; break;
+		case 'd': val *= 86400L; break;
+		default:  return -1;
+		}
+
+		*when = now - val;
+		return 0;
+	}
+
+	/* Split into the day and time of day */
+	if ((clock = strchr(str, '/'))) {
+		day = x_strdup(str);
+		day[clock - str] = 0;
+		clock++;
+	} else if (strchr(str, ':')) {
+		day = NULL;
+		clock = str;
+	} else {
+		day = x_strdup(str);
+		clock = NULL;
+	}
+
+	hour = min = 0;
+	if (clock && ((sscanf(clock, "%d:%d", &hour, &min) != 2)
+		      || (hour < 0) || (hour > 23) || (min < 0) || (min > 59))) {
+		free(day);
+		return -1;
+	}
+
+	memcpy(&tm, localtime(&now), sizeof(struct tm));
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+
+	if (!day) {
+		/* Time of day on its own is the most recent one */
+		if (mktime(&tm) > now)
+			tm.tm_mday--;
+
+	} else if (!strcasecmp(day, "today")) {
+		/* Nothing to do */
+
+	} else if (!strcasecmp(day, "yesterday")) {
+		tm.tm_mday--;
+
+	} else if (sscanf(day, "%d-%d-%d", &tm.tm_year, &tm.tm_mon,
+			  &tm.tm_mday) == 3) {
+		tm.tm_year -= 1900;
+		tm.tm_mon--;
+
+	} else {
+		/* Day names match the most recent such day, or today */
+		for (i = 0; i < 7; i++)
+			if ((strlen(day) >= 3)
+			    && !strncasecmp(day, days[i], strlen(day)))
+				break;
+
+		if (i == 7) {
+			free(day);
+			return -1;
+		}
+
+		tm.tm_mday -= (tm.tm_wday - i + 7) % 7;
+	}
+
+	free(day);
+	if ((*when = mktime(&tm)) == (time_t)-1)
+		return -1;
+
+	return 0;
 }
 
 /* irclog_strtoflag
@@ -56,6 +56,15 @@
 #define IRC_LOG_ERROR  0x2000
 #define IRC_LOG_ALL    0x3fff
 
+/* Events summarised by log_digest instead of being recalled */
+#define IRC_LOG_DIGEST (IRC_LOG_JOIN | IRC_LOG_PART | IRC_LOG_QUIT \
+                        | IRC_LOG_NICK | IRC_LOG_MODE)
+
+/* Formats of internal log file */
+#define IRC_LOGFORMAT_TEXT   0
+#define IRC_LOGFORMAT_BINARY 1
+#define IRC_LOGFORMAT_SQLITE 2
+
 /* Functions to initialise internal logging */
 int irclog_maketempdir(IRCProxy *);
 int irclog_init(IRCProxy *, const char *);
@@ -66,6 +75,12 @@ void irclog_close(IRCProxy *, const char *);
 void irclog_free(LogFile *);
 void irclog_closetempdir(IRCProxy *);
 
+/* Work out again what's done with events logged, after a config reload */
+void irclog_policy(IRCProxy *);
+
+/* Remember how much of the logs the client has seen */
+void irclog_markread(IRCProxy *);
+
 /* Log a message */
 int irclog_log(IRCProxy *, int, const char *, const char *, const char *, ...);
 
@@ -73,9 +88,16 @@ int irclog_log(IRCProxy *, int, const char *, const char *, const char *, ...);
 extern int irclog_autorecall(struct ircproxy *, const char *);
 extern int irclog_recall(struct ircproxy *, const char *, long, long,
                          const char *);
+extern int irclog_recall_range(IRCProxy *, const char *, time_t, time_t,
+                               const char *);
+extern unsigned long irclog_search(IRCProxy *, const char *, char **, int);
+extern void irclog_recall_cancel(IRCProxy *);
 
 /* Convert numeric flags to string names and back again */
 int	    irclog_strtoflag(const char *);
 const char *irclog_flagtostr(int);
 
+/* Convert a time given to the RECALL command */
+int	    irclog_strtotime(IRCProxy *, const char *, time_t *);
+
 #endif /* !DIRCPROXY_IRC_LOG_H */
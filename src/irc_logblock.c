@@ -0,0 +1,453 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ *
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ *
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ *
+ *
+ * irc_logblock.c
+ *  - Compressing blocks of sealed log records
+ *  - Reading them back
+ * --
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include "dircproxy.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif /* HAVE_ZSTD */
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
+#include "irc_logblock.h"
+
+
+/* Each block starts with this byte, then one giving the codec, then the
+ * uncompressed length, compressed length, number of records and the times
+ * of the first and last as varints.
+ */
+#define LOGBLOCK_MAGIC 0xdb
+#define LOGBLOCK_MAXHDR 64
+
+/* Codecs a block can be compressed with */
+#define LOGBLOCK_NONE    0
+#define LOGBLOCK_DEFLATE 1
+#define LOGBLOCK_LZ4     2
+#define LOGBLOCK_ZSTD    3
+
+/* The one we write with, the fastest we were built with; blocks written
+ * with any of the others we were built with can still be read back */
+#if defined(HAVE_ZSTD)
+# define LOGBLOCK_CODEC LOGBLOCK_ZSTD
+#elif defined(HAVE_LZ4)
+# define LOGBLOCK_CODEC LOGBLOCK_LZ4
+#elif defined(HAVE_ZLIB)
+# define LOGBLOCK_CODEC LOGBLOCK_DEFLATE
+#else
+# define LOGBLOCK_CODEC LOGBLOCK_NONE
+#endif
+
+/* Define MIN() */
+#ifndef MIN
+# define MIN(x, y) ((x) < (y) ? (x) : (y))
+#endif /* !MIN */
+
+
+/* Forward prototypes for internal functions */
+static size_t _logblock_putvarint(unsigned char *, unsigned long);
+static int    _logblock_getvarint(const unsigned char *, size_t, size_t *,
+				  unsigned long *);
+static size_t _logblock_bound(size_t);
+static int    _logblock_compress(const char *, size_t, char *, size_t *);
+static int    _logblock_uncompress(int, const char *, size_t, char *,
+				   size_t);
+static int    _logblock_pwriteall(int, const char *, size_t, off_t);
+
+
+/* logblock_available
+ * Check whether we were built with something to compress blocks with.
+ */
+int
+logblock_available(void)
+{
+	return (LOGBLOCK_CODEC != LOGBLOCK_NONE);
+}
+
+/* logblock_codecname
+ * Name of what we compress blocks with, for the user's benefit.
+ */
+const char *
+logblock_codecname(void)
+{
+	switch (LOGBLOCK_CODEC) {
+	case LOGBLOCK_ZSTD:
+		return "zstd";
+	case LOGBLOCK_LZ4:
+		return "lz4";
+	case LOGBLOCK_DEFLATE:
+		return "deflate";
+	default:
+		return "none";
+	}
+}
+
+/* logblock_readable
+ * Check whether we were built with what a block was compressed with, and
+ * so can read it back.
+ */
+int
+logblock_readable(const struct logblock *block)
+{
+	switch (block->codec) {
+#ifdef HAVE_ZSTD
+	case LOGBLOCK_ZSTD:
+		return 1;
+#endif /* HAVE_ZSTD */
+#ifdef HAVE_LZ4
+	case LOGBLOCK_LZ4:
+		return 1;
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZLIB
+	case LOGBLOCK_DEFLATE:
+		return 1;
+#endif /* HAVE_ZLIB */
+	default:
+		return 0;
+	}
+}
+
+/* logblock_write
+ * Compress some log records and write them as a block at offset in a cold
+ * log file.  The number of records and their times must already be filled
+ * in; the rest of the block's description is filled in here.  Returns 0 on
+ * success, or -1 with errno set.
+ */
+int
+logblock_write(int fd, off_t offset, const char *data, size_t len,
+	       struct logblock *block)
+{
+	unsigned char *hdr;
+	size_t	       clen;
+	char	      *buf;
+	int	       ret;
+
+	if (LOGBLOCK_CODEC == LOGBLOCK_NONE) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	clen = _logblock_bound(len);
+	buf = (char *)malloc(LOGBLOCK_MAXHDR + clen);
+	if (_logblock_compress(data, len, buf + LOGBLOCK_MAXHDR, &clen)) {
+		free(buf);
+		errno = EINVAL;
+		return -1;
+	}
+
+	block->offset = offset;
+	block->clen = clen;
+	block->rawlen = len;
+	block->codec = LOGBLOCK_CODEC;
+
+	/* Build the header into the space left in front of the data, then
+	 * move the data up behind it */
+	hdr = (unsigned char *)buf;
+	hdr[0] = LOGBLOCK_MAGIC;
+	hdr[1] = block->codec;
+	block->hdrlen = 2;
+	block->hdrlen += _logblock_putvarint(hdr + block->hdrlen, len);
+	block->hdrlen += _logblock_putvarint(hdr + block->hdrlen, clen);
+	block->hdrlen += _logblock_putvarint(hdr + block->hdrlen,
+					     block->nlines);
+	block->hdrlen += _logblock_putvarint(hdr + block->hdrlen,
+					     (unsigned long)block->first);
+	block->hdrlen += _logblock_putvarint(hdr + block->hdrlen,
+					     (unsigned long)block->last);
+	memmove(buf + block->hdrlen, buf + LOGBLOCK_MAXHDR, clen);
+
+	ret = _logblock_pwriteall(fd, buf, block->hdrlen + clen, offset);
+	free(buf);
+	return ret;
+}
+
+/* logblock_readheader
+ * Read the header of the block at offset in a cold log file, which is
+ * only good up to end.  Returns 0 on success, or -1 if there isn't a whole
+ * block there.
+ */
+int
+logblock_readheader(int fd, off_t offset, off_t end, struct logblock *block)
+{
+	unsigned char hdr[LOGBLOCK_MAXHDR];
+	unsigned long val[5];
+	ssize_t	      len;
+	size_t	      pos;
+	int	      i;
+
+	if (offset >= end)
+		return -1;
+
+	len = pread(fd, hdr, (size_t)MIN(end - offset, LOGBLOCK_MAXHDR),
+		    offset);
+	if ((len < 2) || (hdr[0] != LOGBLOCK_MAGIC))
+		return -1;
+
+	pos = 2;
+	for (i = 0; i < 5; i++)
+		if (_logblock_getvarint(hdr, (size_t)len, &pos, &val[i]))
+			return -1;
+
+	block->offset = offset;
+	block->hdrlen = pos;
+	block->codec = hdr[1];
+	block->rawlen = val[0];
+	block->clen = val[1];
+	block->nlines = val[2];
+	block->first = (time_t)val[3];
+	block->last = (time_t)val[4];
+
+	if ((off_t)(block->clen + block->hdrlen) > end - offset)
+		return -1;
+
+	return 0;
+}
+
+/* logblock_read
+ * Read a block back and uncompress it into a buffer that's grown as needed
+ * and can be reused between calls.  Returns 0 on success, or -1 with errno
+ * set if it can't be read or made sense of, including when it was written
+ * with a codec we weren't built with.
+ */
+int
+logblock_read(int fd, const struct logblock *block, char **buf,
+	      size_t *bufsz)
+{
+	ssize_t  len;
+	char	*cbuf;
+	int	 ret;
+
+	if (!logblock_readable(block)) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	if (block->rawlen + 1 > *bufsz) {
+		*bufsz = block->rawlen + 1;
+		*buf = (char *)realloc(*buf, *bufsz);
+	}
+
+	cbuf = (char *)malloc(block->clen + 1);
+	len = pread(fd, cbuf, block->clen, block->offset + block->hdrlen);
+	if (len != (ssize_t)block->clen) {
+		if (len >= 0)
+			errno = EIO;
+		free(cbuf);
+		return -1;
+	}
+
+	ret = _logblock_uncompress(block->codec, cbuf, block->clen, *buf,
+				   block->rawlen);
+	free(cbuf);
+	if (ret)
+		errno = EINVAL;
+
+	return ret;
+}
+
+
+/* _logblock_putvarint
+ * Encode a value as a little-endian base-128 varint, as the binary log
+ * format does.  Returns the number of bytes used.
+ */
+static size_t
+_logblock_putvarint(unsigned char *buf, unsigned long val)
+{
+	size_t len;
+
+	len = 0;
+	while (val >= 0x80) {
+		buf[len++] = (unsigned char)((val & 0x7f) | 0x80);
+		val >>= 7;
+	}
+	buf[len++] = (unsigned char)val;
+
+	return len;
+}
+
+/* _logblock_getvarint
+ * Decode a varint from a buffer of len bytes, starting at *pos and moving
+ * it on past.  Returns 0 on success or -1 if it runs off the end.
+ */
+static int
+_logblock_getvarint(const unsigned char *buf, size_t len, size_t *pos,
+		    unsigned long *val)
+{
+	unsigned int shift;
+	int	     c;
+
+	*val = 0;
+	shift = 0;
+	do {
+		if (*pos >= len)
+			return -1;
+		if (shift >= sizeof(unsigned long) * 8)
+			return -1;
+
+		c = buf[(*pos)++];
+		*val |= (unsigned long)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+/* _logblock_bound
+ * Most space compressing len bytes could take.
+ */
+static size_t
+_logblock_bound(size_t len)
+{
+#if defined(HAVE_ZSTD)
+	return ZSTD_compressBound(len);
+#elif defined(HAVE_LZ4)
+	return (size_t)LZ4_compressBound((int)len);
+#elif defined(HAVE_ZLIB)
+	return (size_t)compressBound((uLong)len);
+#else
+	return len;
+#endif
+}
+
+/* _logblock_compress
+ * Compress len bytes of data into buf, which has room for *clen bytes and
+ * is set to how many were used.  Returns 0 on success, -1 on failure.
+ */
+static int
+_logblock_compress(const char *data, size_t len, char *buf, size_t *clen)
+{
+#if defined(HAVE_ZSTD)
+	size_t ret;
+
+	ret = ZSTD_compress(buf, *clen, data, len, 1);
+	if (ZSTD_isError(ret))
+		return -1;
+
+	*clen = ret;
+	return 0;
+#elif defined(HAVE_LZ4)
+	int ret;
+
+	ret = LZ4_compress_default(data, buf, (int)len, (int)*clen);
+	if (ret <= 0)
+		return -1;
+
+	*clen = (size_t)ret;
+	return 0;
+#elif defined(HAVE_ZLIB)
+	uLongf dlen;
+
+	dlen = (uLongf)*clen;
+	if (compress2((Bytef *)buf, &dlen, (const Bytef *)data, (uLong)len,
+		      Z_BEST_SPEED) != Z_OK)
+		return -1;
+
+	*clen = (size_t)dlen;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/* _logblock_uncompress
+ * Uncompress clen bytes of data, compressed with codec, into buf, which
+ * must come to exactly len bytes.  Returns 0 on success, -1 on failure.
+ */
+static int
+_logblock_uncompress(int codec, const char *data, size_t clen, char *buf,
+		     size_t len)
+{
+#ifdef HAVE_ZSTD
+	size_t zret;
+#endif /* HAVE_ZSTD */
+#ifdef HAVE_LZ4
+	int    lret;
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZLIB
+	uLongf dlen;
+#endif /* HAVE_ZLIB */
+
+	switch (codec) {
+#ifdef HAVE_ZSTD
+	case LOGBLOCK_ZSTD:
+		zret = ZSTD_decompress(buf, len, data, clen);
+		return ((ZSTD_isError(zret) || (zret != len)) ? -1 : 0);
+#endif /* HAVE_ZSTD */
+#ifdef HAVE_LZ4
+	case LOGBLOCK_LZ4:
+		lret = LZ4_decompress_safe(data, buf, (int)clen, (int)len);
+		return (((lret < 0) || ((size_t)lret != len)) ? -1 : 0);
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZLIB
+	case LOGBLOCK_DEFLATE:
+		dlen = (uLongf)len;
+		if (uncompress((Bytef *)buf, &dlen, (const Bytef *)data,
+			       (uLong)clen) != Z_OK)
+			return -1;
+
+		return ((size_t)dlen != len ? -1 : 0);
+#endif /* HAVE_ZLIB */
+	default:
+		return -1;
+	}
+}
+
+/* _logblock_pwriteall
+ * Write the whole of a buffer at an offset in a file.
+ */
+static int
+_logblock_pwriteall(int fd, const char *data, size_t len, off_t offset)
+{
+	ssize_t written;
+
+	while (len) {
+		written = pwrite(fd, data, len, offset);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		data += written;
+		len -= written;
+		offset += written;
+	}
+
+	return 0;
+}
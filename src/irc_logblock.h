@@ -0,0 +1,59 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ *
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ *
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ *
+ *
+ * irc_logblock.h
+ * --
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DIRCPROXY_IRC_LOGBLOCK_H
+#define DIRCPROXY_IRC_LOGBLOCK_H
+
+/* Required includes */
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* A block of log records compressed together in a cold log file */
+struct logblock {
+	off_t		offset;		/* Where its header starts */
+	size_t		hdrlen;		/* Length of its header */
+	size_t		clen;		/* Length compressed */
+	size_t		rawlen;		/* Length uncompressed */
+	int		codec;		/* How it was compressed */
+
+	unsigned long	firstline;	/* Line number of its first record */
+	unsigned long	nlines;		/* Number of records in it */
+	time_t		first, last;	/* When they were logged */
+};
+
+/* Functions to find out whether, and how, blocks can be compressed */
+int	    logblock_available(void);
+const char *logblock_codecname(void);
+
+/* Functions to write and read back blocks */
+int	    logblock_write(int, off_t, const char *, size_t,
+			   struct logblock *);
+int	    logblock_readheader(int, off_t, off_t, struct logblock *);
+int	    logblock_readable(const struct logblock *);
+int	    logblock_read(int, const struct logblock *, char **, size_t *);
+
+#endif /* !DIRCPROXY_IRC_LOGBLOCK_H */
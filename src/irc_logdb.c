@@ -0,0 +1,625 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ *
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ *
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ *
+ *
+ * irc_logdb.c
+ *  - Keeping internal logs in an SQLite database
+ *  - Reading them back with indexed queries
+ * --
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include "dircproxy.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif /* HAVE_SQLITE3 */
+
+#include "sprintf.h"
+#include "timers.h"
+#include "irc_logdb.h"
+
+#ifdef HAVE_SQLITE3
+
+/* Records are written in batches, each a transaction.  A batch is committed
+ * once it has this many records in it, or this many milliseconds after it
+ * was started, whichever comes first.
+ */
+#define LOGDB_BATCH  256
+#define LOGDB_COMMIT 1000
+
+/* Every log kept in the database shares the one table, each record keyed on
+ * the name of its log and line number; lines can also be found by when they
+ * were logged.
+ */
+#define LOGDB_SCHEMA \
+	"CREATE TABLE IF NOT EXISTS log (" \
+	"  log TEXT NOT NULL," \
+	"  line INTEGER NOT NULL," \
+	"  time INTEGER NOT NULL," \
+	"  event INTEGER NOT NULL," \
+	"  dest TEXT NOT NULL," \
+	"  src TEXT NOT NULL," \
+	"  text TEXT NOT NULL," \
+	"  PRIMARY KEY (log, line)" \
+	") WITHOUT ROWID;" \
+	"CREATE INDEX IF NOT EXISTS log_time ON log (log, time);"
+
+#define LOGDB_COLUMNS "line, time, event, dest, src, text"
+
+/* A database internal logs are kept in */
+struct logdb {
+	sqlite3		*db;
+	char		*filename;
+	int		 refs;		/* The owner, and any cursors */
+	sqlite3		*spare;		/* Read connection a cursor finished with */
+
+	sqlite3_stmt	*append;
+	sqlite3_stmt	*expire;
+	sqlite3_stmt	*clear;
+
+	int		 intrans;	/* Is there a batch open? */
+	unsigned long	 pending;	/* Records in it */
+	struct timer	*commit;	/* Commits it if it doesn't fill up */
+};
+
+/* A query reading a log back from a database, either from a line or from a
+ * time.  It keeps a reference to the database, so it can outlive the log
+ * or even the proxy.  Each reads through a read-only connection of its own,
+ * so it sees the log as it was when it was sought, whatever's been written
+ * or deleted since; in WAL mode that doesn't hold up the writer.
+ */
+struct logdbcursor {
+	LogDB		*db;
+	sqlite3		*conn;
+	char		*log;
+
+	sqlite3_stmt	*byline;
+	sqlite3_stmt	*bytime;
+	sqlite3_stmt	*stmt;		/* Whichever is being read */
+};
+
+
+/* Forward prototypes for internal functions */
+static int	     _logdb_exec(LogDB *, const char *);
+static sqlite3_stmt *_logdb_prepare(LogDB *, sqlite3 *, const char *);
+static int	     _logdb_step(LogDB *, sqlite3_stmt *);
+static int	     _logdb_begin(LogDB *);
+static int	     _logdb_commit(LogDB *);
+static void	     _logdb_timedout(LogDB *, void *);
+static void	     _logdb_unref(LogDB *);
+static int	     _logdb_getline(LogDB *, const char *, const char *,
+				    unsigned long *);
+
+
+/* logdb_available
+ * Check whether we were built with SQLite.
+ */
+int
+logdb_available(void)
+{
+	return 1;
+}
+
+/* logdb_open
+ * Open the database at filename, creating it if it isn't there.  Databases
+ * that are to be kept between runs are synced when batches are committed,
+ * others aren't.  Returns NULL if it couldn't be opened.
+ */
+LogDB *
+logdb_open(const char *filename, int persist)
+{
+	LogDB *db;
+	int    fd;
+
+	/* SQLite would create it readable by anyone, as would it the files
+	 * it keeps alongside, which copy its permissions */
+	if ((fd = open(filename, O_RDWR | O_CREAT, 0600)) == -1) {
+		syscall_fail("open", filename, 0);
+		return NULL;
+	}
+	close(fd);
+
+	db = (LogDB *)malloc(sizeof(LogDB));
+	memset(db, 0, sizeof(LogDB));
+	db->filename = x_strdup(filename);
+	db->refs = 1;
+
+	if (sqlite3_open_v2(filename, &db->db,
+			    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+			    NULL) != SQLITE_OK) {
+		syscall_fail("sqlite3_open_v2", filename,
+			     (db->db ? sqlite3_errmsg(db->db) : NULL));
+		_logdb_unref(db);
+		return NULL;
+	}
+
+	if (_logdb_exec(db, "PRAGMA journal_mode=WAL")
+	    || _logdb_exec(db, (persist ? "PRAGMA synchronous=NORMAL"
+				: "PRAGMA synchronous=OFF"))
+	    || _logdb_exec(db, LOGDB_SCHEMA)
+	    || !(db->append = _logdb_prepare(db, db->db,
+			"INSERT OR REPLACE INTO log (log, " LOGDB_COLUMNS ")"
+			" VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7)"))
+	    || !(db->expire = _logdb_prepare(db, db->db,
+			"DELETE FROM log WHERE log = ?1 AND line < ?2"))
+	    || !(db->clear = _logdb_prepare(db, db->db,
+			"DELETE FROM log WHERE log = ?1"))) {
+		_logdb_unref(db);
+		return NULL;
+	}
+
+	debug("Opened log database '%s'", filename);
+	return db;
+}
+
+/* logdb_close
+ * Commit anything still waiting to be written and close the database, or
+ * leave that to the last cursor still reading from it.
+ */
+void
+logdb_close(LogDB *db)
+{
+	_logdb_commit(db);
+	timer_delall((void *)db);
+	_logdb_unref(db);
+}
+
+/* _logdb_unref
+ * Drop a reference to a database, freeing it once nothing's using it.
+ */
+static void
+_logdb_unref(LogDB *db)
+{
+	if (--db->refs > 0)
+		return;
+
+	sqlite3_finalize(db->append);
+	sqlite3_finalize(db->expire);
+	sqlite3_finalize(db->clear);
+	if (db->spare && (sqlite3_close(db->spare) != SQLITE_OK))
+		syscall_fail("sqlite3_close", db->filename,
+			     sqlite3_errmsg(db->spare));
+	if (db->db && (sqlite3_close(db->db) != SQLITE_OK))
+		syscall_fail("sqlite3_close", db->filename,
+			     sqlite3_errmsg(db->db));
+
+	free(db->filename);
+	free(db);
+}
+
+/* logdb_append
+ * Add a record to the end of a log.  It's written as part of the current
+ * batch, so it's not on disk until that's committed; seeking a cursor
+ * commits it, so it can be read back straight away though.
+ */
+int
+logdb_append(LogDB *db, const char *log, unsigned long line, time_t when,
+	     int event, const char *dest, const char *from, const char *text)
+{
+	if (_logdb_begin(db))
+		return -1;
+
+	sqlite3_bind_text(db->append, 1, log, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(db->append, 2, (sqlite3_int64)line);
+	sqlite3_bind_int64(db->append, 3, (sqlite3_int64)when);
+	sqlite3_bind_int(db->append, 4, event);
+	sqlite3_bind_text(db->append, 5, dest, -1, SQLITE_STATIC);
+	sqlite3_bind_text(db->append, 6, from, -1, SQLITE_STATIC);
+	sqlite3_bind_text(db->append, 7, text, -1, SQLITE_STATIC);
+	if (_logdb_step(db, db->append) != SQLITE_DONE)
+		return -1;
+
+	if (++db->pending >= LOGDB_BATCH)
+		_logdb_commit(db);
+	return 0;
+}
+
+/* logdb_expire
+ * Remove the records of a log before the given line.  Cursors reading it
+ * carry on from what they've already sought.
+ */
+int
+logdb_expire(LogDB *db, const char *log, unsigned long firstline)
+{
+	if (_logdb_begin(db))
+		return -1;
+
+	sqlite3_bind_text(db->expire, 1, log, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(db->expire, 2, (sqlite3_int64)firstline);
+	return (_logdb_step(db, db->expire) == SQLITE_DONE ? 0 : -1);
+}
+
+/* logdb_clear
+ * Remove every record of a log.
+ */
+int
+logdb_clear(LogDB *db, const char *log)
+{
+	if (_logdb_begin(db))
+		return -1;
+
+	sqlite3_bind_text(db->clear, 1, log, -1, SQLITE_STATIC);
+	return (_logdb_step(db, db->clear) == SQLITE_DONE ? 0 : -1);
+}
+
+/* logdb_range
+ * Find the line numbers of the first record of a log and of the one after
+ * its last, used to pick up a log left by an earlier run.  Both are zero if
+ * there's nothing in it.  Returns 0 on success, -1 on error.
+ */
+int
+logdb_range(LogDB *db, const char *log, unsigned long *first,
+	    unsigned long *end)
+{
+	int r;
+
+	*first = *end = 0;
+	r = _logdb_getline(db, "SELECT line FROM log WHERE log = ?1"
+			   " ORDER BY line LIMIT 1", log, first);
+	if (r)
+		return (r > 0 ? 0 : -1);
+
+	if (_logdb_getline(db, "SELECT line FROM log WHERE log = ?1"
+			   " ORDER BY line DESC LIMIT 1", log, end))
+		return -1;
+
+	(*end)++;
+	return 0;
+}
+
+/* _logdb_getline
+ * Run a query for a line number of a log.  Returns 0 if one was found, 1 if
+ * not, or -1 on error.
+ */
+static int
+_logdb_getline(LogDB *db, const char *sql, const char *log,
+	       unsigned long *line)
+{
+	sqlite3_stmt *stmt;
+	int	      r;
+
+	if (!(stmt = _logdb_prepare(db, db->db, sql)))
+		return -1;
+
+	sqlite3_bind_text(stmt, 1, log, -1, SQLITE_STATIC);
+	r = _logdb_step(db, stmt);
+	if (r == SQLITE_ROW)
+		*line = (unsigned long)sqlite3_column_int64(stmt, 0);
+
+	sqlite3_finalize(stmt);
+	return (r == SQLITE_ROW ? 0 : (r == SQLITE_DONE ? 1 : -1));
+}
+
+/* logdb_cursor
+ * Start reading a log back, from its first record until another place is
+ * sought.  Returns NULL on error.
+ */
+LogDBCursor *
+logdb_cursor(LogDB *db, const char *log)
+{
+	LogDBCursor *cursor;
+
+	cursor = (LogDBCursor *)malloc(sizeof(LogDBCursor));
+	memset(cursor, 0, sizeof(LogDBCursor));
+	cursor->db = db;
+	cursor->log = x_strdup(log);
+	db->refs++;
+
+	/* Opening a connection costs as much as a short recall, so the last
+	 * one is kept for the next */
+	if (db->spare) {
+		cursor->conn = db->spare;
+		db->spare = NULL;
+	} else if (sqlite3_open_v2(db->filename, &cursor->conn,
+				   SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		syscall_fail("sqlite3_open_v2", db->filename,
+			     (cursor->conn ? sqlite3_errmsg(cursor->conn)
+			      : NULL));
+		logdb_endcursor(cursor);
+		return NULL;
+	}
+
+	if (logdb_seekline(cursor, 0)) {
+		logdb_endcursor(cursor);
+		return NULL;
+	}
+
+	return cursor;
+}
+
+/* logdb_seekline
+ * Move a cursor to the first record of its log at or after a line.  Returns
+ * 0 on success, -1 on error.
+ */
+int
+logdb_seekline(LogDBCursor *cursor, unsigned long line)
+{
+	if (!cursor->byline && !(cursor->byline = _logdb_prepare(cursor->db,
+			cursor->conn,
+			"SELECT " LOGDB_COLUMNS " FROM log"
+			" WHERE log = ?1 AND line >= ?2 ORDER BY line")))
+		return -1;
+
+	/* Whatever's been logged so far should be read back too */
+	_logdb_commit(cursor->db);
+	if (cursor->stmt)
+		sqlite3_reset(cursor->stmt);
+	cursor->stmt = cursor->byline;
+
+	sqlite3_bind_text(cursor->stmt, 1, cursor->log, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(cursor->stmt, 2, (sqlite3_int64)line);
+	return 0;
+}
+
+/* logdb_seektime
+ * Move a cursor to the first record of its log logged at or after since.
+ * Returns 0 on success, -1 on error.
+ */
+int
+logdb_seektime(LogDBCursor *cursor, time_t since)
+{
+	if (!cursor->bytime && !(cursor->bytime = _logdb_prepare(cursor->db,
+			cursor->conn,
+			"SELECT " LOGDB_COLUMNS " FROM log"
+			" WHERE log = ?1 AND time >= ?2 ORDER BY time, line")))
+		return -1;
+
+	/* Whatever's been logged so far should be read back too */
+	_logdb_commit(cursor->db);
+	if (cursor->stmt)
+		sqlite3_reset(cursor->stmt);
+	cursor->stmt = cursor->bytime;
+
+	sqlite3_bind_text(cursor->stmt, 1, cursor->log, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(cursor->stmt, 2, (sqlite3_int64)since);
+	return 0;
+}
+
+/* logdb_next
+ * Read the next record from a cursor.  Returns 0 on success or -1 at the
+ * end of the log, or on error.
+ */
+int
+logdb_next(LogDBCursor *cursor, struct logdbrow *row)
+{
+	sqlite3_stmt *stmt;
+
+	if (!(stmt = cursor->stmt))
+		return -1;
+
+	if (_logdb_step(cursor->db, stmt) != SQLITE_ROW) {
+		cursor->stmt = NULL;
+		return -1;
+	}
+
+	row->line = (unsigned long)sqlite3_column_int64(stmt, 0);
+	row->when = (time_t)sqlite3_column_int64(stmt, 1);
+	row->event = sqlite3_column_int(stmt, 2);
+	row->dest = (const char *)sqlite3_column_text(stmt, 3);
+	row->from = (const char *)sqlite3_column_text(stmt, 4);
+	row->text = (const char *)sqlite3_column_text(stmt, 5);
+	return 0;
+}
+
+/* logdb_endcursor
+ * Finish reading a log back.
+ */
+void
+logdb_endcursor(LogDBCursor *cursor)
+{
+	sqlite3_finalize(cursor->byline);
+	sqlite3_finalize(cursor->bytime);
+	if (cursor->conn && !cursor->db->spare) {
+		cursor->db->spare = cursor->conn;
+	} else if (cursor->conn && (sqlite3_close(cursor->conn) != SQLITE_OK)) {
+		syscall_fail("sqlite3_close", cursor->db->filename,
+			     sqlite3_errmsg(cursor->conn));
+	}
+	_logdb_unref(cursor->db);
+	free(cursor->log);
+	free(cursor);
+}
+
+/* _logdb_exec
+ * Run some SQL that doesn't return anything.  Returns 0 on success, -1 on
+ * error.
+ */
+static int
+_logdb_exec(LogDB *db, const char *sql)
+{
+	char *errmsg;
+
+	errmsg = NULL;
+	if (sqlite3_exec(db->db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+		syscall_fail("sqlite3_exec", db->filename, errmsg);
+		sqlite3_free(errmsg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* _logdb_prepare
+ * Compile a statement on one of the database's connections.  Returns NULL
+ * on error.
+ */
+static sqlite3_stmt *
+_logdb_prepare(LogDB *db, sqlite3 *conn, const char *sql)
+{
+	sqlite3_stmt *stmt;
+
+	if (sqlite3_prepare_v2(conn, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		syscall_fail("sqlite3_prepare_v2", db->filename,
+			     sqlite3_errmsg(conn));
+		return NULL;
+	}
+
+	return stmt;
+}
+
+/* _logdb_step
+ * Step a statement, resetting it once it's done with so it can be run
+ * again.  Returns what sqlite3_step() did.
+ */
+static int
+_logdb_step(LogDB *db, sqlite3_stmt *stmt)
+{
+	int r;
+
+	r = sqlite3_step(stmt);
+	if (r == SQLITE_ROW)
+		return r;
+
+	if (r != SQLITE_DONE)
+		syscall_fail("sqlite3_step", db->filename,
+			     sqlite3_errmsg(sqlite3_db_handle(stmt)));
+	sqlite3_reset(stmt);
+	return r;
+}
+
+/* _logdb_begin
+ * Make sure there's a batch open for records to be written in, committing
+ * it in a second if it doesn't fill up first.
+ */
+static int
+_logdb_begin(LogDB *db)
+{
+	if (db->intrans)
+		return 0;
+
+	if (_logdb_exec(db, "BEGIN"))
+		return -1;
+
+	db->intrans = 1;
+	db->pending = 0;
+	timer_set(&(db->commit), (void *)db, "logdb_commit", LOGDB_COMMIT,
+		  TIMER_FUNCTION(_logdb_timedout), NULL);
+	return 0;
+}
+
+/* _logdb_commit
+ * Commit the open batch, if there is one.
+ */
+static int
+_logdb_commit(LogDB *db)
+{
+	if (!db->intrans)
+		return 0;
+
+	timer_clear(&(db->commit));
+	db->intrans = 0;
+	db->pending = 0;
+	return _logdb_exec(db, "COMMIT");
+}
+
+/* _logdb_timedout
+ * Called when a batch has been open long enough.
+ */
+static void
+_logdb_timedout(LogDB *db, void *data)
+{
+	_logdb_commit(db);
+}
+
+#else /* HAVE_SQLITE3 */
+
+/* Without SQLite, there are no databases to open */
+int
+logdb_available(void)
+{
+	return 0;
+}
+
+LogDB *
+logdb_open(const char *filename, int persist)
+{
+	return NULL;
+}
+
+void
+logdb_close(LogDB *db)
+{
+}
+
+int
+logdb_append(LogDB *db, const char *log, unsigned long line, time_t when,
+	     int event, const char *dest, const char *from, const char *text)
+{
+	return -1;
+}
+
+int
+logdb_expire(LogDB *db, const char *log, unsigned long firstline)
+{
+	return -1;
+}
+
+int
+logdb_clear(LogDB *db, const char *log)
+{
+	return -1;
+}
+
+int
+logdb_range(LogDB *db, const char *log, unsigned long *first,
+	    unsigned long *end)
+{
+	return -1;
+}
+
+LogDBCursor *
+logdb_cursor(LogDB *db, const char *log)
+{
+	return NULL;
+}
+
+int
+logdb_seekline(LogDBCursor *cursor, unsigned long line)
+{
+	return -1;
+}
+
+int
+logdb_seektime(LogDBCursor *cursor, time_t since)
+{
+	return -1;
+}
+
+int
+logdb_next(LogDBCursor *cursor, struct logdbrow *row)
+{
+	return -1;
+}
+
+void
+logdb_endcursor(LogDBCursor *cursor)
+{
+}
+
+#endif /* HAVE_SQLITE3 */
@@ -0,0 +1,68 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ *
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ *
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ *
+ *
+ * irc_logdb.h
+ * --
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DIRCPROXY_IRC_LOGDB_H
+#define DIRCPROXY_IRC_LOGDB_H
+
+/* Required includes */
+#include <time.h>
+
+/* A database internal logs are kept in, and a query reading one back */
+typedef struct logdb LogDB;
+typedef struct logdbcursor LogDBCursor;
+
+/* A record read back from a database, the strings are only good until the
+ * next is read */
+struct logdbrow {
+	unsigned long	 line;
+	time_t		 when;
+	int		 event;
+	const char	*dest;
+	const char	*from;
+	const char	*text;
+};
+
+/* Functions to open and close a database */
+int	      logdb_available(void);
+LogDB *	      logdb_open(const char *, int);
+void	      logdb_close(LogDB *);
+
+/* Functions to change the records of a log in the database */
+int	      logdb_append(LogDB *, const char *, unsigned long, time_t, int,
+			   const char *, const char *, const char *);
+int	      logdb_expire(LogDB *, const char *, unsigned long);
+int	      logdb_clear(LogDB *, const char *);
+int	      logdb_range(LogDB *, const char *, unsigned long *,
+			  unsigned long *);
+
+/* Functions to read a log back from the database */
+LogDBCursor * logdb_cursor(LogDB *, const char *);
+int	      logdb_seekline(LogDBCursor *, unsigned long);
+int	      logdb_seektime(LogDBCursor *, time_t);
+int	      logdb_next(LogDBCursor *, struct logdbrow *);
+void	      logdb_endcursor(LogDBCursor *);
+
+#endif /* !DIRCPROXY_IRC_LOGDB_H */
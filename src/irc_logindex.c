@@ -0,0 +1,509 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ *
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ *
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ *
+ *
+ * irc_logindex.c
+ *  - Inverted index of the words, nicknames and events in a log file
+ *  - Searching the index
+ * --
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include "dircproxy.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "sprintf.h"
+#include "irc_string.h"
+
+#include "irc_logindex.h"
+
+
+/* Words shorter than this aren't worth indexing */
+#define LOGINDEX_MIN_WORD 2
+
+/* Words longer than this are truncated */
+#define LOGINDEX_MAX_WORD 32
+
+/* Initial number of hash buckets, always a power of two */
+#define LOGINDEX_BUCKETS 256
+
+/* Keys are a single type character followed by the lower-case token */
+#define LOGINDEX_WORD  'w'
+#define LOGINDEX_NICK  'n'
+#define LOGINDEX_EVENT 'e'
+
+
+/* A token and the list of lines it appears on, in ascending order.  Lines
+ * before off have been expired and are waiting to be compacted away.
+ */
+typedef struct _log_token {
+	char		  *key;
+	unsigned long	   hash;
+
+	unsigned long	  *lines;
+	size_t		   off, nlines, lines_sz;
+
+	struct _log_token *next;
+} LogToken;
+
+/* The index itself, a hash table of tokens */
+struct logindex {
+	LogToken      **buckets;
+	size_t		nbuckets, ntokens;
+
+	unsigned long	expired;	/* First line at the last expire */
+	unsigned long	posted;		/* Lines added to tokens since a sweep */
+};
+
+
+/* Forward prototypes for internal functions */
+static char *	      _logindex_key(char, const char *);
+static unsigned long _logindex_hash(const char *);
+static LogToken *     _logindex_find(LogIndex *, const char *, unsigned long);
+static void	      _logindex_grow(LogIndex *);
+static void	      _logindex_post(LogIndex *, const char *, unsigned long);
+static int	      _logindex_words(LogIndex *, const char *, unsigned long,
+				      char ***);
+static int	      _logindex_has(const LogToken *, unsigned long);
+
+
+/* logindex_new
+ * Create a new, empty, index.
+ */
+LogIndex *
+logindex_new(void)
+{
+	LogIndex *idx;
+
+	idx = (LogIndex *)malloc(sizeof(LogIndex));
+	idx->nbuckets = LOGINDEX_BUCKETS;
+	idx->buckets = (LogToken **)malloc(sizeof(LogToken *) * idx->nbuckets);
+	memset(idx->buckets, 0, sizeof(LogToken *) * idx->nbuckets);
+	idx->ntokens = 0;
+	idx->expired = 0;
+	idx->posted = 0;
+
+	return idx;
+}
+
+/* logindex_free
+ * Free an index and everything in it.
+ */
+void
+logindex_free(LogIndex *idx)
+{
+	LogToken *t, *next;
+	size_t	  i;
+
+	if (!idx)
+		return;
+
+	for (i = 0; i < idx->nbuckets; i++) {
+		for (t = idx->buckets[i]; t; t = next) {
+			next = t->next;
+			free(t->key);
+			free(t->lines);
+			free(t);
+		}
+	}
+
+	free(idx->buckets);
+	free(idx);
+}
+
+/* logindex_add
+ * Index a line of a log file, given its line number (which must be higher
+ * than any already added), the name of its event, who it was from and the
+ * text.  Every word in the text, the nickname part of the source and the
+ * event name become tokens that can be searched for.
+ */
+void
+logindex_add(LogIndex *idx, unsigned long line, const char *event,
+	     const char *from, const char *text)
+{
+	char *key, *ptr;
+
+	key = _logindex_key(LOGINDEX_EVENT, event);
+	_logindex_post(idx, key, line);
+	free(key);
+
+	key = _logindex_key(LOGINDEX_NICK, from);
+	if ((ptr = strchr(key, '!')))
+		*ptr = '\0';
+	irc_strlwr(key + 1);
+	_logindex_post(idx, key, line);
+	free(key);
+
+	_logindex_words(idx, text, line, NULL);
+}
+
+/* logindex_expire
+ * Forget about lines before first, which have been rolled off the start of
+ * the log file or out of the part of it that's indexed.  Lines are dropped
+ * from a token's list whenever it's next added to, so this only sweeps the
+ * whole table once enough has been added since the last sweep to pay for
+ * it, catching tokens that are no longer being used.
+ */
+void
+logindex_expire(LogIndex *idx, unsigned long first)
+{
+	LogToken **t, *dead;
+	size_t	   i;
+
+	if (first > idx->expired)
+		idx->expired = first;
+	if (idx->posted < idx->ntokens)
+		return;
+	idx->posted = 0;
+	first = idx->expired;
+
+	for (i = 0; i < idx->nbuckets; i++) {
+		t = &(idx->buckets[i]);
+		while (*t) {
+			while (((*t)->off < (*t)->nlines)
+			       && ((*t)->lines[(*t)->off] < first))
+				(*t)->off++;
+
+			if ((*t)->off < (*t)->nlines) {
+				t = &((*t)->next);
+				continue;
+			}
+
+			dead = *t;
+			*t = dead->next;
+			free(dead->key);
+			free(dead->lines);
+			free(dead);
+			idx->ntokens--;
+		}
+	}
+}
+
+/* logindex_search
+ * Find the lines, at or after first, that match every one of the search
+ * terms given.  A term of the form "nick:<nickname>" matches lines from that
+ * nickname, "event:<name>" matches lines of that event type, and anything
+ * else matches lines containing all of the words in it.  The matching line
+ * numbers are returned in ascending order in a newly allocated array, along
+ * with their count.
+ */
+size_t
+logindex_search(LogIndex *idx, char **terms, int nterms, unsigned long first,
+		unsigned long **result)
+{
+	LogToken      **tokens, *shortest;
+	char	      **keys;
+	size_t		nfound, i;
+	int		ntokens, nkeys, j, k;
+
+	*result = NULL;
+	if (!nterms)
+		return 0;
+
+	/* Turn the terms into a list of keys */
+	keys = NULL;
+	nkeys = 0;
+	for (j = 0; j < nterms; j++) {
+		char *key;
+
+		if (!strncasecmp(terms[j], "nick:", 5)) {
+			key = _logindex_key(LOGINDEX_NICK, terms[j] + 5);
+			irc_strlwr(key + 1);
+		} else if (!strncasecmp(terms[j], "event:", 6)) {
+			key = _logindex_key(LOGINDEX_EVENT, terms[j] + 6);
+			for (k = 1; key[k]; k++)
+				key[k] = tolower((unsigned char)key[k]);
+		} else {
+			char **words;
+			int    nwords;
+
+			nwords = _logindex_words(idx, terms[j], 0, &words);
+			if (nwords) {
+				keys = (char **)realloc(keys, sizeof(char *)
+							* (nkeys + nwords));
+				memcpy(keys + nkeys, words,
+				       sizeof(char *) * nwords);
+				nkeys += nwords;
+				free(words);
+			}
+			continue;
+		}
+
+		keys = (char **)realloc(keys, sizeof(char *) * (nkeys + 1));
+		keys[nkeys++] = key;
+	}
+
+	/* Look up each key, any that isn't there means nothing can match */
+	tokens = (LogToken **)malloc(sizeof(LogToken *) * (nkeys + 1));
+	shortest = NULL;
+	ntokens = 0;
+	for (j = 0; j < nkeys; j++) {
+		LogToken *t;
+
+		t = _logindex_find(idx, keys[j], _logindex_hash(keys[j]));
+		if (!t) {
+			ntokens = 0;
+			break;
+		}
+
+		tokens[ntokens++] = t;
+		if (!shortest || ((t->nlines - t->off)
+				  < (shortest->nlines - shortest->off)))
+			shortest = t;
+	}
+
+	for (j = 0; j < nkeys; j++)
+		free(keys[j]);
+	free(keys);
+
+	/* Walk the shortest list, keeping lines found in all the others */
+	nfound = 0;
+	if (ntokens) {
+		*result = (unsigned long *)malloc(sizeof(unsigned long)
+						  * (shortest->nlines
+						     - shortest->off));
+
+		for (i = shortest->off; i < shortest->nlines; i++) {
+			if (shortest->lines[i] < first)
+				continue;
+
+			for (j = 0; j < ntokens; j++)
+				if ((tokens[j] != shortest)
+				    && !_logindex_has(tokens[j],
+						      shortest->lines[i]))
+					break;
+
+			if (j == ntokens)
+				(*result)[nfound++] = shortest->lines[i];
+		}
+
+		if (!nfound) {
+			free(*result);
+			*result = NULL;
+		}
+	}
+
+	free(tokens);
+	return nfound;
+}
+
+/* _logindex_key
+ * Make a newly allocated key from a type character and a token.
+ */
+static char *
+_logindex_key(char type, const char *token)
+{
+	char *key;
+
+	key = (char *)malloc(strlen(token) + 2);
+	key[0] = type;
+	strcpy(key + 1, token);
+
+	return key;
+}
+
+/* _logindex_hash
+ * FNV-1a hash of a key.
+ */
+static unsigned long
+_logindex_hash(const char *key)
+{
+	unsigned long hash;
+
+	hash = 2166136261UL;
+	while (*key) {
+		hash ^= (unsigned char)*(key++);
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+/* _logindex_find
+ * Find the token with the given key and hash, or NULL if there isn't one.
+ */
+static LogToken *
+_logindex_find(LogIndex *idx, const char *key, unsigned long hash)
+{
+	LogToken *t;
+
+	for (t = idx->buckets[hash & (idx->nbuckets - 1)]; t; t = t->next)
+		if ((t->hash == hash) && !strcmp(t->key, key))
+			return t;
+
+	return NULL;
+}
+
+/* _logindex_grow
+ * Double the number of buckets in the hash table.
+ */
+static void
+_logindex_grow(LogIndex *idx)
+{
+	LogToken **buckets, *t, *next;
+	size_t	   nbuckets, i;
+
+	nbuckets = idx->nbuckets * 2;
+	buckets = (LogToken **)malloc(sizeof(LogToken *) * nbuckets);
+	memset(buckets, 0, sizeof(LogToken *) * nbuckets);
+
+	for (i = 0; i < idx->nbuckets; i++) {
+		for (t = idx->buckets[i]; t; t = next) {
+			next = t->next;
+			t->next = buckets[t->hash & (nbuckets - 1)];
+			buckets[t->hash & (nbuckets - 1)] = t;
+		}
+	}
+
+	free(idx->buckets);
+	idx->buckets = buckets;
+	idx->nbuckets = nbuckets;
+}
+
+/* _logindex_post
+ * Record that the token with the given key appears on a line, creating the
+ * token if this is the first time it's been seen.
+ */
+static void
+_logindex_post(LogIndex *idx, const char *key, unsigned long line)
+{
+	unsigned long  hash;
+	LogToken      *t;
+
+	hash = _logindex_hash(key);
+	if (!(t = _logindex_find(idx, key, hash))) {
+		if (idx->ntokens >= idx->nbuckets * 2)
+			_logindex_grow(idx);
+
+		t = (LogToken *)malloc(sizeof(LogToken));
+		memset(t, 0, sizeof(LogToken));
+		t->key = x_strdup(key);
+		t->hash = hash;
+
+		t->next = idx->buckets[hash & (idx->nbuckets - 1)];
+		idx->buckets[hash & (idx->nbuckets - 1)] = t;
+		idx->ntokens++;
+	}
+
+	/* Words can appear more than once on a line */
+	if ((t->nlines > t->off) && (t->lines[t->nlines - 1] == line))
+		return;
+
+	/* Drop expired lines from the front before growing */
+	while ((t->off < t->nlines) && (t->lines[t->off] < idx->expired))
+		t->off++;
+	if (t->off && (t->nlines == t->lines_sz)) {
+		memmove(t->lines, t->lines + t->off,
+			sizeof(unsigned long) * (t->nlines - t->off));
+		t->nlines -= t->off;
+		t->off = 0;
+	}
+
+	if (t->nlines == t->lines_sz) {
+		t->lines_sz = (t->lines_sz ? t->lines_sz * 2 : 4);
+		t->lines = (unsigned long *)realloc(t->lines,
+			sizeof(unsigned long) * t->lines_sz);
+	}
+
+	t->lines[t->nlines++] = line;
+	idx->posted++;
+}
+
+/* _logindex_words
+ * Split text into lower-case words, runs of letters and digits (and any
+ * non-ASCII bytes so UTF-8 text survives).  If keys is NULL each word is
+ * added to the index against line, otherwise a newly allocated array of the
+ * word keys is returned in it.  Returns the number of words.
+ */
+static int
+_logindex_words(LogIndex *idx, const char *text, unsigned long line,
+		char ***keys)
+{
+	char	    word[LOGINDEX_MAX_WORD + 2];
+	const char *c;
+	size_t	    len;
+	int	    nwords;
+
+	if (keys)
+		*keys = NULL;
+	nwords = 0;
+	len = 0;
+	word[0] = LOGINDEX_WORD;
+
+	for (c = text; ; c++) {
+		unsigned char ch;
+
+		ch = (unsigned char)*c;
+		if (ch && (isalnum(ch) || (ch >= 0x80))) {
+			if (len < LOGINDEX_MAX_WORD)
+				word[1 + len++] = tolower(ch);
+			continue;
+		}
+
+		if (len >= LOGINDEX_MIN_WORD) {
+			word[1 + len] = '\0';
+
+			if (keys) {
+				*keys = (char **)realloc(*keys, sizeof(char *)
+							 * (nwords + 1));
+				(*keys)[nwords] = x_strdup(word);
+			} else {
+				_logindex_post(idx, word, line);
+			}
+			nwords++;
+		}
+		len = 0;
+
+		if (!ch)
+			break;
+	}
+
+	return nwords;
+}
+
+/* _logindex_has
+ * Binary search a token's list of lines for a line.
+ */
+static int
+_logindex_has(const LogToken *t, unsigned long line)
+{
+	size_t lo, hi, mid;
+
+	lo = t->off;
+	hi = t->nlines;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (t->lines[mid] == line) {
+			return 1;
+		} else if (t->lines[mid] < line) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return 0;
+}
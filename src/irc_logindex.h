@@ -0,0 +1,49 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ *
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ *
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ *
+ *
+ * irc_logindex.h
+ * --
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DIRCPROXY_IRC_LOGINDEX_H
+#define DIRCPROXY_IRC_LOGINDEX_H
+
+/* Required includes */
+#include <stdlib.h>
+
+/* An inverted index of the words, nicknames and events in a log file */
+typedef struct logindex LogIndex;
+
+/* Functions to create and destroy an index */
+LogIndex *logindex_new(void);
+void	  logindex_free(LogIndex *);
+
+/* Add a line to the index, and forget lines that have gone */
+void	  logindex_add(LogIndex *, unsigned long, const char *, const char *,
+		       const char *);
+void	  logindex_expire(LogIndex *, unsigned long);
+
+/* Find the lines that match every one of a set of search terms */
+size_t	  logindex_search(LogIndex *, char **, int, unsigned long,
+			  unsigned long **);
+
+#endif /* !DIRCPROXY_IRC_LOGINDEX_H */
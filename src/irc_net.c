@@ -140,6 +140,7 @@ static struct ircproxy *_ircnet_newircproxy(void) {
 
   p = (struct ircproxy *)malloc(sizeof(struct ircproxy));
   memset(p, 0, sizeof(struct ircproxy));
+  p->server_sock = -1;
 
   return p;
 }
@@ -377,8 +378,8 @@ static void _ircnet_freeproxy(struct ircproxy *p) {
     ircserver_send_command(p, "QUIT",
                            ":Terminated with extreme prejudice - %s %s",
                            PACKAGE, VERSION);
-    ircserver_close_sock(p);
   }
+  ircserver_close_sock(p);
 
   if (p->client_status & IRC_CLIENT_CONNECTED) {
     ircclient_send_error(p, "dircproxy going bye-bye");
@@ -429,6 +430,7 @@ static void _ircnet_freeproxy(struct ircproxy *p) {
     }
   }
 
+  irclog_recall_cancel(p);
   irclog_free(&(p->private_log));
   irclog_free(&(p->server_log));
   irclog_closetempdir(p);
@@ -509,7 +511,9 @@ void ircnet_freeconnclass(struct ircconnclass *class) {
   free(class->detach_message);
   free(class->detach_nickname);
   free(class->log_dir);
+  free(class->log_dir_compress);
   free(class->log_program);
+  free(class->log_state_dir);
   free(class->dcc_proxy_ports);
   free(class->dcc_capture_directory);
   free(class->dcc_tunnel_incoming);
@@ -519,6 +523,7 @@ void ircnet_freeconnclass(struct ircconnclass *class) {
 
   free(class->orig_local_address);
   free(class->nickserv_password);
+  free(class->name);
   free(class->password);
   s = class->servers;
   while (s) {
@@ -584,7 +589,8 @@ int ircnet_rejoin(struct ircproxy *p, const char *name) {
     _ircnet_rejoin(p, (void *)str);
   } else if (p->conn_class->channel_rejoin > 0) {
     debug("Will rejoin '%s' in %d seconds", str, p->conn_class->channel_rejoin);
-    timer_new((void *)p, 0, p->conn_class->channel_rejoin,
+    timer_set(0, (void *)p, "channel_rejoin",
+              TIMER_SECONDS(p->conn_class->channel_rejoin),
               TIMER_FUNCTION(_ircnet_rejoin), (void *)str);
   } 
 
@@ -30,6 +30,38 @@
 #include "irc_prot.h"
 #include "stringex.h"
 #include "net.h"
+#include "timers.h"
+
+/* a point in a log file, recorded every so many lines to find times quickly */
+struct logmark {
+  time_t when;
+  long offset;
+};
+
+/* what's done with events logged to a log file, worked out in advance so
+   that events nobody wants can be thrown away before they're formatted */
+struct logpolicy {
+  int events;           /* events that go anywhere at all */
+  int internal;         /* events written to the internal log */
+  int user;             /* events written to the user's copy in log_dir */
+  int pipe;             /* events given to the log_program */
+  char *userfile;       /* the user's copy, unless it depends on the nick */
+};
+
+/* a connection to one of a server's addresses, racing the others */
+struct serverattempt {
+  int sock;
+  SOCKADDR addr;
+
+  struct serverattempt *next;
+};
+
+/* membership changes logged while detached, summarised rather than recalled */
+struct logdigest {
+  unsigned long joins, parts, quits, nicks, modes;
+  time_t first;
+  unsigned long line;   /* line counting started at */
+};
 
 /* a log file - there are good reasons why this isn't defined in irc_log.h */
 typedef struct logfile {
@@ -38,17 +70,43 @@ typedef struct logfile {
   FILE *file;
 
   unsigned long nlines, maxlines;
+  struct logmark *marks;
+  size_t nmarks, marks_sz;
+  unsigned long markevery;
+
+  unsigned long firstline;
+  struct logindex *index;
+
+  int cold, coldfd;
+  off_t coldsize;
+  unsigned long coldlines;
+  struct logblock *blocks;
+  size_t nblocks, blocks_sz;
+  long sealsize;
+
+  struct logdb *db;
+  char *dbname;
+
+  struct logdigest digest;
+  unsigned long seen;
+
+  struct logpolicy policy;
 
   int always;
+  int format;
+  int persist;
 } LogFile;
 
 /* a description of an authorised connction */
 typedef struct ircconnclass {
   char *server_port;
   long server_retry;
+  long server_retry_max;
+  long server_retry_jitter;
   long server_dnsretry;
   long server_maxattempts;
   long server_maxinitattempts;
+  long server_attempt_delay;
   int server_keepalive;
   long server_pingtimeout;
   long *server_throttle;
@@ -83,10 +141,19 @@ typedef struct ircconnclass {
 
   long log_timeoffset;
   int log_events;
+  int log_digest;
+  int log_recall_unread;
   int log_timestamp;
   int log_relativetime;
   char *log_dir;
+  long log_dir_maxsize;
+  int log_dir_daily;
+  long log_dir_keep;
+  char *log_dir_compress;
   char *log_program;
+  int log_format;
+  char *log_state_dir;
+  long log_compress_size;
 
   int chan_log_enabled;
   int chan_log_always;
@@ -135,6 +202,7 @@ typedef struct ircconnclass {
   int allow_kill;
   int allow_notify;
    
+  char *name;
   char *password;
   struct strlist *servers, *next_server;
   struct strlist *masklist;
@@ -178,11 +246,30 @@ typedef struct ircproxy {
   int client_status;
   SOCKADDR client_addr;
   char *client_host;
+  int client_resolving;
+  struct timer *client_auth_timer;
+  struct timer *client_connect_timer;
+  struct timer *client_resetnick_timer;
 
   int server_sock;
   int server_status;
   SOCKADDR server_addr;
   long server_attempts;
+  struct timer *server_heartbeat_timer;
+  unsigned long long server_ping_due;
+  unsigned long long server_stoned_due;
+  unsigned long long server_antiidle_due;
+  struct timer *server_recon_timer;
+  struct timer *server_connect_timer;
+  char *server_connect_host;
+  unsigned long long server_connect_turn;
+  struct timer *server_attempt_timer;
+  struct serverattempt *server_racing;
+  struct strlist *server_addrs;
+  unsigned short server_port;
+  char *server_bindip, *server_bindhost;
+  unsigned long server_failures;
+  unsigned long server_backoff;
 
   char *nickname;
   char *setnickname;
@@ -213,7 +300,11 @@ typedef struct ircproxy {
   struct ircchannel *channels;
 
   char *temp_logdir;
+  int persist_logdir;
+  struct logdb *logdb;
   struct logfile private_log, server_log;
+  int log_events;       /* events any of those or the channel logs take */
+  struct logrecall *recalls;
 
   struct ircproxy *next;
 } IRCProxy;
@@ -232,6 +323,7 @@ struct dcc_resume {
    uint32_t size;
 #endif   
   struct in_addr r_addr;
+  struct timer *timer;
   struct dcc_resume *next; 
 };
  
@@ -48,12 +48,30 @@
 #include "irc_client.h"
 #include "irc_server.h"
 
+/* when each server host is next free for another connection attempt */
+struct connslot {
+  char *host;
+  unsigned long long free;
+
+  struct connslot *next;
+};
+
 /* forward declarations */
 static void _ircserver_reconnect(struct ircproxy *, void *);
-static void _ircserver_connect2(struct ircproxy *, void *, const char *,
+static void _ircserver_retry(struct ircproxy *);
+static char *_ircserver_hostname(const char *);
+static unsigned long _ircserver_connectwait(const char *, unsigned long long *);
+static void _ircserver_connectturn(struct ircproxy *, void *);
+static void _ircserver_releaseturn(struct ircproxy *);
+static int _ircserver_lookup(struct ircproxy *);
+static void _ircserver_connect2(struct ircproxy *, void *, const char **,
                                 const char *);
 static void _ircserver_connect3(struct ircproxy *, void *, const char *,
                                 const char *);
+static void _ircserver_nextattempt(struct ircproxy *, void *);
+static int _ircserver_attempt(struct ircproxy *, struct serverattempt *);
+static struct serverattempt *_ircserver_takeattempt(struct ircproxy *, int);
+static void _ircserver_freeattempts(struct ircproxy *);
 static void _ircserver_connected(struct ircproxy *, int);
 static void _ircserver_connected2(struct ircproxy *, void *, const char *,
                                   const char *);
@@ -63,15 +81,17 @@ static void _ircserver_error(struct ircproxy *, int, int);
 static int _ircserver_gotmsg(struct ircproxy *, const char *);
 static int _ircserver_close(struct ircproxy *);
 static int _ircserver_lost(struct ircproxy *);
-static void _ircserver_ping(struct ircproxy *, void *);
-static void _ircserver_stoned(struct ircproxy *, void *);
-static void _ircserver_antiidle(struct ircproxy *, void *);
+static void _ircserver_heartbeat(struct ircproxy *, void *);
+static void _ircserver_nextbeat(struct ircproxy *);
 static int _ircserver_forclient(struct ircproxy *, struct ircmessage *);
 static int _ircserver_send_dccreject(struct ircproxy *, const char *, const char *);
 static int _ircserver_dccresume_timeout(struct ircproxy *, struct dcc_resume *);
 
 struct dcc_resume *dcc_resume_list=NULL;
 
+/* server hosts that have been connected to in the last server_connect_gap */
+static struct connslot *connslots = 0;
+
 
 /* Time/date format for strftime(3) */
 #define CTCP_TIMEDATE_FORMAT "%a, %d %b %Y %H:%M:%S %z"
@@ -124,19 +144,182 @@ static void _ircserver_reconnect(struct ircproxy *p, void *data) {
   }
 }
 
+/* Schedule another attempt at connecting to the server.  Each failure in a
+   row doubles the wait, and it's moved randomly either way so that proxies
+   that lost the same server don't all come back at once */
+static void _ircserver_retry(struct ircproxy *p) {
+  unsigned long delay, max, spread, i;
+  long jitter;
+
+  delay = TIMER_SECONDS(p->conn_class->server_retry);
+  max = TIMER_SECONDS(p->conn_class->server_retry_max);
+  if (max > delay) {
+    for (i = 0; (i < p->server_failures) && (delay < max); i++)
+      delay *= 2;
+    if (delay > max)
+      delay = max;
+  }
+
+  jitter = p->conn_class->server_retry_jitter;
+  jitter = (jitter < 0 ? 0 : (jitter > 100 ? 100 : jitter));
+  spread = delay / 100 * jitter;
+  if (spread)
+    delay = delay - spread + (unsigned long)random() % (spread * 2 + 1);
+
+  p->server_failures++;
+  p->server_backoff = delay;
+
+  debug("Retrying in %lu ms, failed %lu times", delay, p->server_failures);
+  timer_set(&(p->server_recon_timer), (void *)p, "server_recon", delay,
+            TIMER_FUNCTION(_ircserver_reconnect), (void *)0);
+}
+
 /* Called to initiate a connection to a server */
 int ircserver_connect(struct ircproxy *p) {
-  char *server;
+  unsigned long wait;
+  char *host;
 
   debug("Connecting to server (stage 1)");
 
-  if (timer_exists((void *)p, "server_recon")) {
+  if (p->server_recon_timer || p->server_connect_timer) {
     debug("Connection already in progress");
     if (IS_CLIENT_READY(p))
       ircclient_send_notice(p, "Connection already in progress...");
     return 0;
   }
 
+  /* Take our turn at the server host, so lots of proxies connecting at
+     once don't look like a flood */
+  host = _ircserver_hostname(p->conn_class->next_server->str);
+  wait = _ircserver_connectwait(host, &(p->server_connect_turn));
+  if (wait) {
+    debug("Waiting %lu ms for a turn to connect to %s", wait, host);
+    if (IS_CLIENT_READY(p))
+      ircclient_send_notice(p, "Waiting for a turn to connect to %s...",
+                            host);
+
+    timer_set(&(p->server_connect_timer), (void *)p, "server_connect", wait,
+              TIMER_FUNCTION(_ircserver_connectturn), (void *)0);
+    p->server_connect_host = host;
+    return 0;
+  }
+
+  free(host);
+  return _ircserver_lookup(p);
+}
+
+/* Get the host part of a server string, which is what tells servers apart
+   for connection turns */
+static char *_ircserver_hostname(const char *str) {
+  char *host, *ptr;
+
+  if (*str == '[') {
+    host = x_strdup(str + 1);
+    ptr = strchr(host, ']');
+  } else {
+    host = x_strdup(str);
+    ptr = strchr(host, ':');
+  }
+  if (ptr)
+    *ptr = 0;
+
+  return irc_strlwr(host);
+}
+
+/* Book the next turn at connecting to a server host, returning how many
+   milliseconds there are to wait for it and filling in when it is */
+static unsigned long _ircserver_connectwait(const char *host,
+                                            unsigned long long *turn) {
+  struct connslot *s, *l;
+  unsigned long long now;
+
+  now = timer_now();
+  *turn = now;
+  if (g.server_connect_gap <= 0)
+    return 0;
+
+  l = 0;
+  s = connslots;
+  while (s) {
+    struct connslot *n;
+
+    n = s->next;
+    if (!strcmp(s->host, host)) {
+      unsigned long wait;
+
+      wait = (s->free > now ? (unsigned long)(s->free - now) : 0);
+      *turn = now + wait;
+      s->free = *turn + g.server_connect_gap;
+      return wait;
+
+    } else if (s->free <= now) {
+      /* Nobody's waiting for this host any more */
+      if (l) {
+        l->next = n;
+      } else {
+        connslots = n;
+      }
+      free(s->host);
+      free(s);
+
+    } else {
+      l = s;
+    }
+
+    s = n;
+  }
+
+  s = (struct connslot *)malloc(sizeof(struct connslot));
+  s->host = x_strdup(host);
+  s->free = now + g.server_connect_gap;
+  s->next = connslots;
+  connslots = s;
+
+  return 0;
+}
+
+/* hook for timer code when it's our turn to connect to a server */
+static void _ircserver_connectturn(struct ircproxy *p, void *data) {
+  free(p->server_connect_host);
+  p->server_connect_host = 0;
+
+  _ircserver_lookup(p);
+}
+
+/* Give back a turn at connecting to a server host that won't be used now.
+   Only the last turn booked can be given back; if there's one after it,
+   that already has its time, so nobody is held up by the unused one */
+static void _ircserver_releaseturn(struct ircproxy *p) {
+  struct connslot *s;
+
+  for (s = connslots; s; s = s->next) {
+    if (!strcmp(s->host, p->server_connect_host)) {
+      if (s->free == p->server_connect_turn + g.server_connect_gap)
+        s->free = p->server_connect_turn;
+      break;
+    }
+  }
+
+  free(p->server_connect_host);
+  p->server_connect_host = 0;
+}
+
+/* Forget which server hosts have been connected to */
+void ircserver_flush(void) {
+  while (connslots) {
+    struct connslot *n;
+
+    n = connslots->next;
+    free(connslots->host);
+    free(connslots);
+    connslots = n;
+  }
+}
+
+/* Look up the server we're going to connect to */
+static int _ircserver_lookup(struct ircproxy *p) {
+  char *server;
+
   server = x_strdup(p->conn_class->next_server->str);
   if (strchr(server, ':') != strrchr(server, ':')) {
     /* More than one :, second denotes password */
@@ -153,19 +336,21 @@ int ircserver_connect(struct ircproxy *p) {
     ircclient_send_notice(p, "Looking up %s...", server);
 
   /* DNS lookup the server */
-  dns_filladdr((void *)p, server, p->conn_class->server_port,
-               &(p->server_addr), (dns_fun_t) _ircserver_connect2);
+  dns_filladdrs((void *)p, server, p->conn_class->server_port,
+                (dns_addrs_fun_t) _ircserver_connect2);
   free(server);
   return 0;
 }
 
 /* Called to initiate a connection to a server once its been looked up */
 static void _ircserver_connect2(struct ircproxy *p, void *data,
-                                const char *ip, const char *host) {
-  if (!host || !ip) {
+                                const char **ips, const char *host) {
+  struct strlist **l;
+  int i;
+
+  if (!host || !ips) {
     debug("DNS failure, retrying");
-    timer_new((void *)p, "server_recon", p->conn_class->server_retry,
-              TIMER_FUNCTION(_ircserver_reconnect), (void *)0);
+    _ircserver_retry(p);
     free(p->serverpassword);
     p->serverpassword = 0;
     return;
@@ -173,10 +358,20 @@ static void _ircserver_connect2(struct ircproxy *p, void *data,
 
   debug("Resolved server");
 
-  /* Copy the found information into p */
+  /* Copy the found information into p, the addresses are tried in the
+     order we got them */
   free(p->servername);
   p->servername = x_strdup(host);
-  net_filladdr(&p->server_addr, ip, (unsigned short)data);
+  p->server_port = (unsigned short)data;
+
+  _ircserver_freeattempts(p);
+  l = &(p->server_addrs);
+  for (i = 0; ips[i]; i++) {
+    *l = (struct strlist *)malloc(sizeof(struct strlist));
+    (*l)->str = x_strdup(ips[i]);
+    (*l)->next = 0;
+    l = &((*l)->next);
+  }
   
   if (p->conn_class->local_address) {
     dns_addrfromhost((void *)p, 0, p->conn_class->local_address,
@@ -190,19 +385,90 @@ static void _ircserver_connect2(struct ircproxy *p, void *data,
    and the local_host has been looked up */
 static void _ircserver_connect3(struct ircproxy *p, void *data,
                                 const char *ip, const char *host) {
-  int ret;
+  debug("Connecting to %s port %d", p->servername, ntohs(p->server_port));
+
+  if (IS_CLIENT_READY(p))
+    ircclient_send_notice(p, "Connecting to %s port %d",
+                          p->servername, ntohs(p->server_port));
+
+  if (p->conn_class->local_address) {
+    if (ip) {
+      p->server_bindip = x_strdup(ip);
+      p->server_bindhost = (host ? x_strdup(host) : 0);
+    } else {
+      if (IS_CLIENT_READY(p))
+        ircclient_send_notice(p, "(warning) Couldn't find address for %s",
+                              p->conn_class->local_address);
+    }
+  }
+
+  _ircserver_nextattempt(p, 0);
+}
+
+/* Start connecting to the next of the server's addresses, leaving any
+   connections already in progress to carry on; whichever finishes first
+   wins (RFC 8305) */
+static void _ircserver_nextattempt(struct ircproxy *p, void *data) {
+  struct serverattempt *a;
+  struct strlist *s;
+
+  a = 0;
+  while (!a && p->server_addrs) {
+    s = p->server_addrs;
+    p->server_addrs = s->next;
+
+    a = (struct serverattempt *)malloc(sizeof(struct serverattempt));
+    memset(a, 0, sizeof(struct serverattempt));
+    net_filladdr(&(a->addr), s->str, p->server_port);
+    debug("Trying %s port %d", s->str, ntohs(p->server_port));
+    free(s->str);
+    free(s);
+
+    if (_ircserver_attempt(p, a)) {
+      free(a);
+      a = 0;
+    }
+  }
+
+  if (a) {
+    a->next = p->server_racing;
+    p->server_racing = a;
+    p->server_status |= IRC_SERVER_CREATED;
+    debug("Connection in progress");
+
+    /* Don't wait forever for this one before trying another */
+    if (p->server_addrs && p->conn_class->server_attempt_delay) {
+      timer_reset(&(p->server_attempt_timer), (void *)p, "server_attempt",
+                  p->conn_class->server_attempt_delay,
+                  TIMER_FUNCTION(_ircserver_nextattempt), (void *)0);
+    } else {
+      timer_clear(&(p->server_attempt_timer));
+    }
+
+  } else if (!p->server_racing) {
+    int err = errno;
+
+    if (IS_CLIENT_READY(p))
+      ircclient_send_notice(p, "Connection failed: %s", strerror(err));
+    debug("Connection failed: %s", strerror(err));
+
+    _ircserver_freeattempts(p);
+    p->server_status &= ~(IRC_SERVER_CREATED);
+    _ircserver_retry(p);
+
+    free(p->serverpassword);
+    p->serverpassword = 0;
+  }
+}
+
+/* Create a socket and begin connecting it to an address.  Returns 0 if
+   the connection is in progress */
+static int _ircserver_attempt(struct ircproxy *p, struct serverattempt *a) {
 #ifdef HAVE_SETEUID
   int switched = 0;
   pid_t old_euid;
 #endif /* HAVE_SETEUID */
 
-  debug("Connecting to %s port %d", p->servername,
-        ntohs(SOCKADDR_PORT(&p->server_addr)));
-
-  if (IS_CLIENT_READY(p))
-    ircclient_send_notice(p, "Connecting to %s port %d",
-                          p->servername, ntohs(SOCKADDR_PORT(&p->server_addr)));
-
 #ifdef HAVE_SETEUID
   old_euid = geteuid();
 
@@ -244,7 +510,7 @@ static void _ircserver_connect3(struct ircproxy *p, void *data,
   }
 #endif /* HAVE_SETEUID */
 
-  p->server_sock = net_socket(SOCKADDR_FAMILY(&p->server_addr));
+  a->sock = net_socket(SOCKADDR_FAMILY(&(a->addr)));
 
 #ifdef HAVE_SETEUID
   /* Switch back to our original euid */
@@ -257,74 +523,108 @@ static void _ircserver_connect3(struct ircproxy *p, void *data,
   }
 #endif /* HAVE_SETEUID */
 
-  if (p->server_sock == -1) {
-    ret = -1;
+  if (a->sock == -1)
+    return -1;
 
-  } else {
-    if (p->conn_class->server_keepalive)
-      net_keepalive(p->server_sock);
+  if (p->conn_class->server_keepalive)
+    net_keepalive(a->sock);
 
-    if (p->conn_class->local_address) {
-      if (ip) {
-        SOCKADDR local_addr;
+  /* The local address can only be used for connections of its own family */
+  if (p->server_bindip) {
+    SOCKADDR local_addr;
 
-        net_filladdr(&local_addr, ip, 0);
-        if (bind(p->server_sock, (struct sockaddr *)&local_addr, SOCKADDR_LEN(&local_addr))) {
-          if (IS_CLIENT_READY(p))
-            ircclient_send_notice(p, "(warning) Couldn't use local address %s",
-                                  host);
-        } else {
-          free(p->hostname);
-          p->hostname = (host ? x_strdup(host) : p->conn_class->local_address);
-        }
-      } else {
-        if (IS_CLIENT_READY(p))
-          ircclient_send_notice(p, "(warning) Couldn't find address for %s",
-                                p->conn_class->local_address);
-      }
+    net_filladdr(&local_addr, p->server_bindip, 0);
+    if (SOCKADDR_FAMILY(&local_addr) != SOCKADDR_FAMILY(&(a->addr))) {
+      debug("Local address %s isn't the right family", p->server_bindip);
+    } else if (bind(a->sock, (struct sockaddr *)&local_addr,
+                    SOCKADDR_LEN(&local_addr))) {
+      if (IS_CLIENT_READY(p))
+        ircclient_send_notice(p, "(warning) Couldn't use local address %s",
+                              p->server_bindhost);
+    } else {
+      free(p->hostname);
+      p->hostname = x_strdup(p->server_bindhost ? p->server_bindhost
+                             : p->conn_class->local_address);
     }
+  }
 
-    if (connect(p->server_sock, (struct sockaddr *)&(p->server_addr),
-                SOCKADDR_LEN(&p->server_addr))
-        && (errno != EINPROGRESS)) {
-      syscall_fail("connect", p->servername, 0);
-      net_close(&(p->server_sock));
-      ret = -1;
-    } else {
-      ret = 0;
+  if (connect(a->sock, (struct sockaddr *)&(a->addr), SOCKADDR_LEN(&(a->addr)))
+      && (errno != EINPROGRESS)) {
+    int err = errno;
+
+    syscall_fail("connect", p->servername, 0);
+    net_close(&(a->sock));
+    errno = err;
+    return -1;
+  }
+
+  net_hook(a->sock, SOCK_CONNECTING, (void *)p,
+           ACTIVITY_FUNCTION(_ircserver_connected),
+           ERROR_FUNCTION(_ircserver_connectfailed));
+  return 0;
+}
+
+/* Take a connection attempt off the list, returns 0 if it isn't ours */
+static struct serverattempt *_ircserver_takeattempt(struct ircproxy *p,
+                                                    int sock) {
+  struct serverattempt *a, **l;
+
+  for (l = &(p->server_racing); *l; l = &((*l)->next)) {
+    if ((*l)->sock == sock) {
+      a = *l;
+      *l = a->next;
+      return a;
     }
   }
 
-  if (ret) {
-    if (IS_CLIENT_READY(p))
-      ircclient_send_notice(p, "Connection failed: %s", strerror(errno));
-    debug("Connection failed: %s", strerror(errno));
+  return 0;
+}
 
-    net_close(&(p->server_sock));
-    timer_new((void *)p, "server_recon", p->conn_class->server_retry,
-              TIMER_FUNCTION(_ircserver_reconnect), (void *)0);
+/* Abandon the connection attempts still in progress and forget the
+   addresses we didn't get to */
+static void _ircserver_freeattempts(struct ircproxy *p) {
+  timer_clear(&(p->server_attempt_timer));
 
-    free(p->serverpassword);
-    p->serverpassword = 0;
+  while (p->server_racing) {
+    struct serverattempt *a;
 
-  } else {
-    p->server_status |= IRC_SERVER_CREATED;
-    net_hook(p->server_sock, SOCK_CONNECTING, (void *)p,
-             ACTIVITY_FUNCTION(_ircserver_connected),
-             ERROR_FUNCTION(_ircserver_connectfailed));
-    debug("Connection in progress");
+    a = p->server_racing;
+    p->server_racing = a->next;
+    net_close(&(a->sock));
+    free(a);
+  }
+
+  while (p->server_addrs) {
+    struct strlist *s;
+
+    s = p->server_addrs;
+    p->server_addrs = s->next;
+    free(s->str);
+    free(s);
   }
+
+  free(p->server_bindip);
+  free(p->server_bindhost);
+  p->server_bindip = p->server_bindhost = 0;
 }
 
 /* Called when a new server has connected */
 static void _ircserver_connected(struct ircproxy *p, int sock) {
-  if (sock != p->server_sock) {
-    error("Unexpected socket %d in _ircserver_connected, expected %d", sock,
-          p->server_sock);
+  struct serverattempt *a;
+
+  a = _ircserver_takeattempt(p, sock);
+  if (!a) {
+    error("Unexpected socket %d in _ircserver_connected", sock);
     net_close(&sock);
     return;
   }
 
+  /* This one won, the others can go */
+  p->server_sock = a->sock;
+  memcpy(&(p->server_addr), &(a->addr), sizeof(SOCKADDR));
+  free(a);
+  _ircserver_freeattempts(p);
+
   debug("Connection succeeded");
   p->server_status |= IRC_SERVER_CONNECTED;
   net_hook(p->server_sock, SOCK_NORMAL, (void *)p,
@@ -389,38 +689,40 @@ static void _ircserver_connected2(struct ircproxy *p, void *data,
 
   /* Begin stoned server checking */
   if (p->conn_class->server_pingtimeout) {
-    timer_new((void *)p, "server_ping",
-              (int)(p->conn_class->server_pingtimeout / 2),
-              TIMER_FUNCTION(_ircserver_ping), (void *)0);
-    timer_new((void *)p, "server_stoned", p->conn_class->server_pingtimeout,
-              TIMER_FUNCTION(_ircserver_stoned), (void *)0);
+    p->server_ping_due = timer_now()
+                         + TIMER_SECONDS(p->conn_class->server_pingtimeout) / 2;
+    p->server_stoned_due = timer_now()
+                           + TIMER_SECONDS(p->conn_class->server_pingtimeout);
   }
 
   /* Begin anti-idle */
   if (p->conn_class->idle_maxtime)
-    timer_new((void *)p, "server_antiidle", p->conn_class->idle_maxtime,
-              TIMER_FUNCTION(_ircserver_antiidle), (void *)0);
+    p->server_antiidle_due = timer_now()
+                             + TIMER_SECONDS(p->conn_class->idle_maxtime);
+
+  _ircserver_nextbeat(p);
 }
 
 /* Called when a connection fails */
 static void _ircserver_connectfailed(struct ircproxy *p, int sock, int bad) {
-  if (sock != p->server_sock) {
-    error("Unexpected socket %d in _ircserver_connectfailed, expected %d", sock,
-          p->server_sock);
+  struct serverattempt *a;
+  int err = errno;
+
+  a = _ircserver_takeattempt(p, sock);
+  if (!a) {
+    error("Unexpected socket %d in _ircserver_connectfailed", sock);
     net_close(&sock);
     return;
   }
 
-  debug("Connection failed");
+  debug("Connection failed: %s", strerror(err));
+  net_close(&(a->sock));
+  free(a);
 
-  if (IS_CLIENT_READY(p))
-    ircclient_send_notice(p, "Connection failed: %s", strerror(errno));
-
-  net_close(&(p->server_sock));
-  p->server_status &= ~(IRC_SERVER_CREATED);
-
-  timer_new((void *)p, "server_recon", p->conn_class->server_retry,
-            TIMER_FUNCTION(_ircserver_reconnect), (void *)0);
+  /* Don't wait to try the next address, if it was the last one and
+     nothing else is still going this gives up */
+  errno = err;
+  _ircserver_nextattempt(p, 0);
 }
 
 /* Called when a server sends us stuff. */
@@ -518,6 +820,7 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
       p->server_status |= IRC_SERVER_GOTWELCOME | IRC_SERVER_SEEN;
       p->server_attempts = 0;
+      p->server_failures = 0;
 
       if (IS_CLIENT_READY(p) && !(p->client_status & IRC_CLIENT_SENTWELCOME))
         ircclient_welcome(p);
@@ -868,10 +1171,10 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
     if (p->allow_pong)
       squelch = 0;
 
-    if (p->conn_class->server_pingtimeout) {
-      timer_del((void *)p, "server_stoned");
-      timer_new((void *)p, "server_stoned", p->conn_class->server_pingtimeout,
-                TIMER_FUNCTION(_ircserver_stoned), (void *)0);
+    /* This only ever moves it later, so the heartbeat needn't change */
+    if (p->conn_class->server_pingtimeout && p->server_stoned_due) {
+      p->server_stoned_due = timer_now()
+                             + TIMER_SECONDS(p->conn_class->server_pingtimeout);
       p->allow_pong = 0;
     }
 
@@ -1188,7 +1491,7 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 		if (!strcmp(currptr->id, id)) {
 		   
 		   /* Remove timer */
-		   timer_del((void *)p, currptr->id);
+		   timer_clear(&(currptr->timer));
 		   
 		   /* Make connection */
 		   if (!dccnet_new(DCC_SEND_CAPTURE, p->conn_class->dcc_proxy_timeout,
@@ -1363,7 +1666,9 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 					 cmsg.params[1], cmsg.params[3], file_stat.st_size);
 		  
 		  /* Set timer */
-		  timer_new((void *)p, currptr->id, p->conn_class->server_retry,
+		  currptr->timer = NULL;
+		  timer_set(&(currptr->timer), (void *)p, "dcc_resume",
+			    TIMER_SECONDS(p->conn_class->server_retry),
 			    TIMER_FUNCTION(_ircserver_dccresume_timeout), currptr);
 	       }
 	    }
@@ -1577,15 +1882,20 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
 /* Close the server socket itself */
 int ircserver_close_sock(struct ircproxy *p) {
-  net_close(&(p->server_sock));
+  if (p->server_sock != -1)
+    net_close(&(p->server_sock));
+  _ircserver_freeattempts(p);
   p->server_status &= ~(IRC_SERVER_CREATED | IRC_SERVER_CONNECTED
                         | IRC_SERVER_INTRODUCED | IRC_SERVER_GOTWELCOME);
 
   /* Make sure these don't get triggered */
-  timer_del((void *)p, "server_ping");
-  timer_del((void *)p, "server_stoned");
-  timer_del((void *)p, "server_antiidle");
-  timer_del((void *)p, "server_recon");
+  timer_clear(&(p->server_heartbeat_timer));
+  p->server_ping_due = p->server_stoned_due = p->server_antiidle_due = 0;
+  timer_clear(&(p->server_recon_timer));
+  if (p->server_connect_timer) {
+    _ircserver_releaseturn(p);
+    timer_clear(&(p->server_connect_timer));
+  }
 
   return 0;
 }
@@ -1602,8 +1912,7 @@ static int _ircserver_close(struct ircproxy *p) {
   irclog_log(p, IRC_LOG_SERVER, IRC_LOGFILE_SERVER, PACKAGE,
              "Lost connection to server: %s", p->servername);
 
-  timer_new((void *)p, "server_recon", p->conn_class->server_retry,
-            TIMER_FUNCTION(_ircserver_reconnect), (void *)0);
+  _ircserver_retry(p);
 
   return 0;
 }
@@ -1643,6 +1952,7 @@ int ircserver_connectagain(struct ircproxy *p) {
   /* Reset seen so that we start with initattempts again */
   p->server_status &= ~(IRC_SERVER_SEEN);
   p->server_attempts = 0;
+  p->server_failures = 0;
 
   debug("Connecting again");
   ircserver_connect(p);
@@ -1650,48 +1960,88 @@ int ircserver_connectagain(struct ircproxy *p) {
   return 0;
 }
 
-/* hook for timer code to ping server */
-static void _ircserver_ping(struct ircproxy *p, void *data) {
-  /* Server might not be ready yet 8*/
-  if (IS_SERVER_READY(p)) {
-    debug("Pinging the server");
-    net_sendurgent(p->server_sock, "PING :%s\r\n", p->servername);
-    debug("=> 'PING :%s'", p->servername);
+/* hook for timer code to close the server if it's stoned, ping it and
+   send anti-idle messages, whichever of those are due */
+static void _ircserver_heartbeat(struct ircproxy *p, void *data) {
+  unsigned long long now;
+
+  now = timer_now();
+
+  if (p->server_stoned_due && (p->server_stoned_due <= now)) {
+    /* Server is, like, stoned.  Yeah man! */
+    if (IS_SERVER_READY(p)) {
+      p->server_stoned_due = 0;
+      debug("Server is stoned, reconnecting");
+      ircserver_send_command(p, "QUIT", ":Getting off stoned server - %s %s",
+                             PACKAGE, VERSION);
+      _ircserver_close(p);
+      return;
+    }
+
+    /* Still registering, give it longer rather than stop checking */
+    p->server_stoned_due = now
+                           + TIMER_SECONDS(p->conn_class->server_pingtimeout);
   }
 
-  timer_new((void *)p, "server_ping",
-            (int)(p->conn_class->server_pingtimeout / 2),
-            TIMER_FUNCTION(_ircserver_ping), (void *)0);
-}
+  if (p->server_ping_due && (p->server_ping_due <= now)) {
+    /* Server might not be ready yet */
+    if (IS_SERVER_READY(p)) {
+      debug("Pinging the server");
+      net_sendurgent(p->server_sock, "PING :%s\r\n", p->servername);
+      debug("=> 'PING :%s'", p->servername);
+    }
 
-/* hook for timer code to close a stoned server */
-static void _ircserver_stoned(struct ircproxy *p, void *data) {
-  /* Server is, like, stoned.  Yeah man! */
-  if (IS_SERVER_READY(p)) {
-    debug("Server is stoned, reconnecting");
-    ircserver_send_command(p, "QUIT", ":Getting off stoned server - %s %s",
-                           PACKAGE, VERSION);
-    _ircserver_close(p);
+    /* Keep to the same beat, unless we've fallen behind it */
+    p->server_ping_due += TIMER_SECONDS(p->conn_class->server_pingtimeout) / 2;
+    if (p->server_ping_due <= now)
+      p->server_ping_due = now
+                           + TIMER_SECONDS(p->conn_class->server_pingtimeout) / 2;
   }
+
+  if (p->server_antiidle_due && (p->server_antiidle_due <= now)) {
+    /* Send empty privmsg to prevent idling */
+    if (IS_SERVER_READY(p)) {
+      debug("Sending anti-idle");
+      p->squelch_411 = 1;
+      ircserver_send_command(p, "PRIVMSG", "");
+    }
+
+    p->server_antiidle_due = now + TIMER_SECONDS(p->conn_class->idle_maxtime);
+  }
+
+  _ircserver_nextbeat(p);
 }
 
-/* hook for timer code to send empty privmsg to prevent idling */
-static void _ircserver_antiidle(struct ircproxy *p, void *data) {
-  if (IS_SERVER_READY(p)) {
-    debug("Sending anti-idle");
-    p->squelch_411 = 1;
-    ircserver_send_command(p, "PRIVMSG", "");
+/* Set the heartbeat for when the first of its jobs is next due, rounded up
+   to a tick so that all the proxies' heartbeats happen together */
+static void _ircserver_nextbeat(struct ircproxy *p) {
+  unsigned long long due, now;
+
+  due = p->server_ping_due;
+  if (p->server_stoned_due && (!due || (p->server_stoned_due < due)))
+    due = p->server_stoned_due;
+  if (p->server_antiidle_due && (!due || (p->server_antiidle_due < due)))
+    due = p->server_antiidle_due;
+
+  if (!due) {
+    timer_clear(&(p->server_heartbeat_timer));
+    return;
   }
 
-  timer_new((void *)p, "server_antiidle", p->conn_class->idle_maxtime,
-            TIMER_FUNCTION(_ircserver_antiidle), (void *)0);
+  due = ((due + SERVER_HEARTBEAT_TICK - 1) / SERVER_HEARTBEAT_TICK)
+        * SERVER_HEARTBEAT_TICK;
+  now = timer_now();
+  timer_reset(&(p->server_heartbeat_timer), (void *)p, "server_heartbeat",
+              (unsigned long)(due > now ? due - now : 0),
+              TIMER_FUNCTION(_ircserver_heartbeat), (void *)0);
 }
 
-/* Reset idle timer */
+/* Reset idle timer, this only ever moves it later so the heartbeat needn't
+   change */
 void ircserver_resetidle(struct ircproxy *p) {
-  timer_del((void *)p, "server_antiidle");
-  timer_new((void *)p, "server_antiidle", p->conn_class->idle_maxtime,
-            TIMER_FUNCTION(_ircserver_antiidle), (void *)0);
+  if (p->server_antiidle_due)
+    p->server_antiidle_due = timer_now()
+                             + TIMER_SECONDS(p->conn_class->idle_maxtime);
 }
 
 /* Check if a message is bound for us, and if so check our username and
@@ -1765,7 +2115,7 @@ static int _ircserver_dccresume_timeout(struct ircproxy *p, struct dcc_resume *n
    int new, old, bytesread;
    char buffer[1024];
    
-   timer_del((void *)p, node->id);
+   timer_clear(&(node->timer));
    
    debug("DCC Resume ID %s timed out", node->id);
    
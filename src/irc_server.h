@@ -26,6 +26,7 @@
 extern int ircserver_connect(struct ircproxy *);
 extern int ircserver_close_sock(struct ircproxy *);
 extern int ircserver_connectagain(struct ircproxy *);
+extern void ircserver_flush(void);
 extern void ircserver_resetidle(struct ircproxy *);
 extern int ircserver_send_command(struct ircproxy *, const char *, const char *,
                                   ...);
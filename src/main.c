@@ -43,19 +43,26 @@
 #include <signal.h>
 #include <syslog.h>
 #include <errno.h>
+#include <time.h>
 
 #include <dircproxy.h>
 #include "getopt/getopt.h"
 #include "sprintf.h"
+#include "stringex.h"
 #include "cfgfile.h"
 #include "irc_net.h"
 #include "irc_client.h"
 #include "irc_server.h"
+#include "irc_log.h"
 #include "dcc_net.h"
 #include "timers.h"
 #include "dns.h"
+#include "diskio.h"
 #include "net.h"
 
+/* Time format for debugging output */
+#define DEBUG_TIME_FORMAT "%H:%M:%S"
+
 /* forward declarations */
 static void _sig_term(int);
 static void _sig_hup(int);
@@ -83,6 +90,9 @@ static int stop_poll = 0;
 /* set to 1 to reload the configuration file */
 static int reload_config = 0;
 
+/* signal that asked us to stop, if any */
+static int stop_signal = 0;
+
 /* Port we're listening on */
 static char *listen_port;
 
@@ -314,6 +324,12 @@ int main(int argc, char *argv[]) {
     }
   }
   
+  /* Retries are spread out randomly, so they mustn't be the same each run */
+  srandom((unsigned int)(time(NULL) ^ getpid()));
+
+  /* Resolver threads must be started after we've gone into the background */
+  dns_start();
+
   /* Main loop! */
   while (!stop_poll) {
     int ns, nt, status;
@@ -323,17 +339,16 @@ int main(int argc, char *argv[]) {
     dccnet_expunge_proxies();
     ns = net_poll();
     nt = timer_poll();
+    diskio_poll();
 
     /* Reap any children */
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
       debug("Reaped process %d, exit status %d", pid, status);
-      
-      /* Handle any DNS children */
-      dns_endrequest(pid, status);
     }
 
     /* Reload the configuration file? */
     if (reload_config) {
+      debug("Reloading configuration file");
       _reload_config();
       reload_config = 0;
     }
@@ -342,15 +357,20 @@ int main(int argc, char *argv[]) {
       break;
   }
 
+  if (stop_signal)
+    debug("Received signal %d to stop", stop_signal);
+
   if (pid_file) {
     unlink(pid_file);
   }
 
   /* Free up stuff */
   ircnet_flush();
+  ircserver_flush();
   dccnet_flush();
   dns_flush();
   timer_flush();
+  diskio_flush();
 
   /* Do a lingering close on all sockets */
   net_closeall();
@@ -372,13 +392,12 @@ int main(int argc, char *argv[]) {
 
 /* Signal to stop polling */
 static void _sig_term(int sig) {
-  debug("Received signal %d to stop", sig);
+  stop_signal = sig;
   stop();
 }
 
 /* Signal to reload configuration file */
 static void _sig_hup(int sig) {
-  debug("Received signal %d to reload config", sig);
   reload_config = 1;
 
   /* Restore the signal */
@@ -389,8 +408,6 @@ static void _sig_hup(int sig) {
  * whatever we're doing so we reach the waitpid loop in the main loop quicker
  */
 static void _sig_child(int sig) {
-  debug("Received signal %d to reap", sig);
-
   /* Restore the signal */
   signal(sig, _sig_child);
 }
@@ -460,8 +477,10 @@ static int _reload_config(void) {
         struct ircproxy *p;
 
         p = ircnet_fetchclass(o);
-        if (p)
+        if (p) {
           p->conn_class = c;
+          irclog_policy(p);
+        }
 
         break;
       }
@@ -605,10 +624,11 @@ int debug(const char *format, ...) {
 #endif /* DEBUG_MEMORY */
   va_end(ap);
  
+  /* syslog stamps its own messages */
   if (in_background) {
     syslog(LOG_DEBUG, "%s", msg);
   } else {
-    printf("%s\n", msg);
+    printf("%s %s\n", strtime(DEBUG_TIME_FORMAT, time(0), 0), msg);
   }
 
   free(msg);
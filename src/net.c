@@ -46,6 +46,7 @@
 #endif /* HAVE_POLL_H */
 
 #include "sprintf.h"
+#include "timers.h"
 #include "net.h"
 
 /* Sanity check */
@@ -72,6 +73,7 @@ struct sockinfo {
  
   struct sockbuff *in_buff, *in_buff_last;
   struct sockbuff *out_buff, *out_buff_last;
+  size_t out_len;
 
   int type;
   void *info;
@@ -83,6 +85,9 @@ struct sockinfo {
   time_t throtlast;
   long throtamt;
 
+  size_t drain_len;
+  void (*drain_func)(void *, int);
+
   struct sockinfo *next;
 };
 
@@ -361,6 +366,31 @@ int net_throttle(int sock, long bytes, long period) {
   }
 }
 
+/* Call a function, once, when a socket's output buffer drains to len bytes
+   or fewer.  This can be used to send large amounts of data a bit at a time
+   without holding everything up.  A NULL function cancels it. */
+int net_drain(int sock, size_t len, void (*drain_func)(void *, int)) {
+  struct sockinfo *sockinfo;
+
+  sockinfo = _net_fetch(sock);
+  if (sockinfo) {
+    sockinfo->drain_len = len;
+    sockinfo->drain_func = drain_func;
+    return 0;
+  } else {
+    syscall_fail("net_drain", 0, "bad socket provided");
+    return -1;
+  }
+}
+
+/* Return the number of bytes waiting to be sent on a socket */
+size_t net_pending(int sock) {
+  struct sockinfo *sockinfo;
+
+  sockinfo = _net_fetch(sock);
+  return (sockinfo ? sockinfo->out_len : 0);
+}
+
 /* Add lined data to the output socket (using formatting) */
 int net_send(int sock, const char *message, ...) {
   struct sockinfo *sockinfo;
@@ -443,6 +473,7 @@ static int _net_buffer(struct sockinfo *s, int buff, int mode,
     }
     memcpy(b->data, data, len);
     b->len = len;
+    s->out_len += len;
 
     /* We can't put it directly on the front if there's an incomplete line
        buffer on the front */
@@ -472,6 +503,8 @@ static int _net_buffer(struct sockinfo *s, int buff, int mode,
     memcpy((*l)->data + (*l)->len, data, len);
     (*l)->len += len;
     (*l)->linelen += len;
+    if (buff != SB_IN)
+      s->out_len += len;
 
   } else {
     struct sockbuff *b;
@@ -505,6 +538,7 @@ static int _net_buffer(struct sockinfo *s, int buff, int mode,
         s->out_buff = b;
       }
       s->out_buff_last = b;
+      s->out_len += len;
     }
   }
 
@@ -605,6 +639,8 @@ static int _net_unbuffer(struct sockinfo *s, int buff, void *data, int len) {
 
   /* Check whether there's any data left */
   b->len -= len;
+  if (buff != SB_IN)
+    s->out_len -= len;
   if (b->len) {
     void *tmp;
 
@@ -652,6 +688,7 @@ int net_poll(void) {
 #endif /* HAVE_POLL */
   struct sockinfo *s;
   int ns, nr, sn;
+  long wait;
   time_t now;
   char *func;
 
@@ -720,7 +757,7 @@ int net_poll(void) {
 #ifdef HAVE_POLL
     if (s->type == SOCK_CONNECTING) {
       ufds[sn].events |= POLLOUT;
-    } else if ((s->type != SOCK_LISTENING) && s->out_buff
+    } else if ((s->type != SOCK_LISTENING) && (s->out_buff || s->drain_func)
                && (!s->throtbytes || (s->throtamt < s->throtbytes))) {
       ufds[sn].events |= POLLOUT;
     }
@@ -728,7 +765,7 @@ int net_poll(void) {
 # ifdef HAVE_SELECT
     if (s->type == SOCK_CONNECTING) {
       FD_SET(s->sock, &writeset);
-    } else if ((s->type != SOCK_LISTENING) && s->out_buff
+    } else if ((s->type != SOCK_LISTENING) && (s->out_buff || s->drain_func)
                && (!s->throtbytes || (s->throtamt < s->throtbytes))) {
       FD_SET(s->sock, &writeset);
     }
@@ -739,15 +776,20 @@ int net_poll(void) {
     s = s->next;
   }
 
+  /* Wait no longer than a second, but not past when the next timer's due */
+  wait = timer_next();
+  if ((wait < 0) || (wait > 1000))
+    wait = 1000;
+
 #ifdef HAVE_POLL
   /* Do the poll itself */
-  nr = poll(ufds, ns, 1000);
+  nr = poll(ufds, ns, (int)wait);
   func = "poll";
 #else /* HAVE_POLL */
 # ifdef HAVE_SELECT
   /* Do the select itself */
-  timeout.tv_sec = 1;
-  timeout.tv_usec = 0;
+  timeout.tv_sec = wait / 1000;
+  timeout.tv_usec = (wait % 1000) * 1000;
   nr = select(hs + 1, &readset, &writeset, 0, &timeout);
   func = "select";
 # endif /* HAVE_SELECT */
@@ -803,6 +845,7 @@ int net_poll(void) {
               s->closed = 1;
             }
           } else if (error) {
+            errno = error;
             if (s->error_func) {
               s->error_func(s->info, s->sock, 1);
             } else {
@@ -854,6 +897,7 @@ int net_poll(void) {
               /* Make sure that it really closes */
               _net_freebuffers(s->out_buff);
               s->out_buff = 0;
+              s->out_len = 0;
 
               if (!s->closed && s->error_func) {
                 s->error_func(s->info, s->sock, baderror);
@@ -868,6 +912,7 @@ int net_poll(void) {
             /* Make sure that it really closes */
             _net_freebuffers(s->out_buff);
             s->out_buff = 0;
+            s->out_len = 0;
 
             if (!s->closed && s->error_func) {
               s->error_func(s->info, s->sock, 0);
@@ -915,6 +960,16 @@ int net_poll(void) {
           }
         }
 
+        /* If the output buffer has drained enough, call the drain function;
+           it's one-shot, so clear it first in case it wants to set it again */
+        if (!s->closed && s->drain_func && (s->out_len <= s->drain_len)) {
+          void (*drain_func)(void *, int);
+
+          drain_func = s->drain_func;
+          s->drain_func = 0;
+          drain_func(s->info, s->sock);
+        }
+
         /* If there's incoming data, call the activity function */
         if (!s->closed && s->in_buff && s->activity_func)
           s->activity_func(s->info, s->sock);
@@ -56,6 +56,8 @@ extern int net_flush(void);
 extern int net_hook(int, int, void *,
                     void(*)(void *, int), void(*)(void *, int, int));
 extern int net_throttle(int, long, long);
+extern int net_drain(int, size_t, void(*)(void *, int));
+extern size_t net_pending(int);
 extern int net_send(int, const char *, ...);
 extern int net_sendurgent(int, const char *, ...);
 extern int net_queue(int, void *, int);
@@ -18,10 +18,30 @@
  */
 
 #include <ctype.h>
+#include <string.h>
+#include <time.h>
 
 #include <dircproxy.h>
 #include "stringex.h"
 
+/* Number of formatted times to remember, and the longest one */
+#define STRTIME_SLOTS 8
+#define STRTIME_MAXLEN 64
+
+/* A remembered formatted time */
+struct strtime_slot {
+  const char *format;
+  time_t when;
+  long offset;
+  char str[STRTIME_MAXLEN];
+};
+
+/* Cache of formatted times, and of the last broken-down time */
+static struct strtime_slot strtime_slots[STRTIME_SLOTS];
+static int strtime_next = 0;
+static time_t strtime_tmwhen = -1;
+static struct tm strtime_tm;
+
 /* Changes the case of a string to lowercase */
 char *strlwr(char *str) {
   char *c;
@@ -48,3 +68,46 @@ char *strupr(char *str) {
   return str;
 }
 
+
+/* Formats a time with strftime(3), less offset minutes.  The same handful of
+   formats get asked for over and over, usually for the same second, so the
+   results (and the localtime(3) lookup they need) are remembered.  The
+   string returned is only good until the next call. */
+const char *strtime(const char *format, time_t when, long offset) {
+  struct strtime_slot *slot;
+  int i;
+
+  for (i = 0; i < STRTIME_SLOTS; i++) {
+    slot = &strtime_slots[i];
+    if (slot->format && (slot->when == when) && (slot->offset == offset)
+        && ((slot->format == format) || !strcmp(slot->format, format)))
+      return slot->str;
+  }
+
+  /* Replace the oldest; the format must be a constant string */
+  slot = &strtime_slots[strtime_next];
+  strtime_next = (strtime_next + 1) % STRTIME_SLOTS;
+
+  /* Zones only ever change on a minute boundary, so within the same minute
+     we can just adjust the seconds */
+  if (strtime_tmwhen != when - offset * 60) {
+    time_t t;
+
+    t = when - offset * 60;
+    if ((strtime_tmwhen >= 0) && (t >= 0)
+        && (t / 60 == strtime_tmwhen / 60)) {
+      strtime_tm.tm_sec += t - strtime_tmwhen;
+    } else {
+      memcpy(&strtime_tm, localtime(&t), sizeof(struct tm));
+    }
+    strtime_tmwhen = t;
+  }
+
+  slot->format = format;
+  slot->when = when;
+  slot->offset = offset;
+  if (!strftime(slot->str, sizeof(slot->str), format, &strtime_tm))
+    slot->str[0] = 0;
+
+  return slot->str;
+}
@@ -19,6 +19,9 @@
 #ifndef __DIRCPROXY_STRINGEX_H
 #define __DIRCPROXY_STRINGEX_H
 
+/* required includes */
+#include <time.h>
+
 /* structure to hold a list of strings */
 struct strlist {
   char *str;
@@ -29,5 +32,6 @@ struct strlist {
 /* functions */
 extern char *strlwr(char *);
 extern char *strupr(char *);
+extern const char *strtime(const char *, time_t, long);
 
 #endif /* __DIRCPROXY_STRINGEX_H */
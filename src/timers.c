@@ -18,131 +18,166 @@
  */
 
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/time.h>
 #include <time.h>
 
 #include <dircproxy.h>
-#include "sprintf.h"
 #include "timers.h"
 
 /* structure of a timer */
 struct timer {
-  char *id;
-  time_t time;
+  const char *name;
+  struct timer **handle;
+  unsigned long long time;
+  unsigned long seq;
   void (*function)(void *, void *);
   void *boundto;
   void *data;
-  
-  struct timer *next;
+
+  size_t heap;
+  struct timerowner *owner;
+  struct timer *prev, *next;
 };
 
-/* forward declarations */
-static int _timer_free(struct timer *);
+/* all the timers bound to one thing */
+struct timerowner {
+  void *boundto;
+  struct timer *timers;
 
-/* list of current timers */
-static struct timer *timers = 0;
+  struct timerowner *next;
+};
 
-/* next dynamic id */
-static unsigned long nexttimer = 0;
+/* forward declarations */
+static struct timerowner *_timer_owner(void *, int);
+static void _timer_ownergrow(void);
+static void _timer_ownerfree(struct timerowner *);
+static int _timer_before(const struct timer *, const struct timer *);
+static void _timer_heapset(size_t, struct timer *);
+static void _timer_heapup(size_t);
+static void _timer_heapdown(size_t);
+static void _timer_heapfix(size_t);
+static void _timer_unlink(struct timer *);
+static int _timer_free(struct timer *);
 
-/* Check if a timer exists */
-int timer_exists(void *b, const char *id) {
+/* hash a thing timers are bound to, they're all malloc()d so the low bits
+   carry nothing */
+#define TIMER_OWNERHASH(_B) ((((unsigned long)(_B)) >> 4) & (ownerbuckets - 1))
+
+/* heap of current timers, the one due first is at the top */
+static struct timer **heap = 0;
+static size_t heapsize = 0;
+static size_t heapalloc = 0;
+
+/* hash table of things timers are bound to */
+static struct timerowner **owners = 0;
+static size_t numowners = 0;
+static size_t ownerbuckets = 0;
+
+/* order that timers were added in */
+static unsigned long nextseq = 0;
+
+/* Start a new timer, the handle may be 0 if it'll never be deleted.
+   Returns -1 if the handle's timer is already pending, it isn't changed */
+int timer_set(struct timer **h, void *b, const char *name,
+              unsigned long interval, void (*func)(void *, void *),
+              void *data) {
+  struct timerowner *o;
   struct timer *t;
 
-  t = timers;
-  while (t) {
-    if ((b == t->boundto) && !strcmp(id, t->id))
-      return 1;
-    t = t->next;
+  if (h && *h)
+    return -1;
+
+  /* The name is only for debugging, it's not copied */
+  t = (struct timer *)malloc(sizeof(struct timer));
+  t->name = name;
+  t->handle = h;
+  t->time = timer_now() + interval;
+  t->seq = nextseq++;
+  t->function = func;
+  t->boundto = b;
+  t->data = data;
+  if (h)
+    *h = t;
+
+  /* Keep it with the owner's other timers */
+  o = _timer_owner(b, 1);
+  t->owner = o;
+  t->prev = 0;
+  t->next = o->timers;
+  if (o->timers)
+    o->timers->prev = t;
+  o->timers = t;
+
+  /* And put it in the heap */
+  if (heapsize == heapalloc) {
+    heapalloc = (heapalloc ? heapalloc * 2 : 64);
+    heap = (struct timer **)realloc(heap, sizeof(struct timer *) * heapalloc);
   }
+  _timer_heapset(heapsize++, t);
+  _timer_heapup(t->heap);
 
+  debug("Timer %s will be triggered in %lu ms", t->name, interval);
   return 0;
 }
 
-/* Add a new timer */
-char *timer_new(void *b, const char *id, unsigned long interval,
-                void (*func)(void *, void *), void *data) {
+/* Start a timer, or if it's already pending then move it where it is */
+int timer_reset(struct timer **h, void *b, const char *name,
+                unsigned long interval, void (*func)(void *, void *),
+                void *data) {
   struct timer *t;
 
-  if (id && timer_exists(b, id))
-    return 0;
+  t = *h;
+  if (!t)
+    return timer_set(h, b, name, interval, func, data);
 
-  t = (struct timer *)malloc(sizeof(struct timer));
-  if (id) {
-    t->id = x_strdup(id);
-  } else {
-    t->id = x_sprintf("timer%lu", nexttimer++);
-  }
-  t->time = (interval ? time(NULL) + interval : 0);
+  t->name = name;
+  t->time = timer_now() + interval;
+  t->seq = nextseq++;
   t->function = func;
-  t->boundto = b;
   t->data = data;
+  _timer_heapfix(t->heap);
 
-  t->next = timers;
-  timers = t;
-
-  debug("Timer %s will be triggered in %d seconds", t->id,
-        (t->time ? t->time - time(NULL) : 0));
-  return t->id;
+  return 0;
 }
 
-/* Delete a timer */
-int timer_del(void *b, char *id) {
-  struct timer *t, *l;
-
-  l = 0;
-  t = timers;
-
-  while (t) {
-    if ((b == t->boundto) && !strcmp(id, t->id)) {
-      if (l) {
-        l->next = t->next;
-      } else {
-        timers = t->next;
-      }
+/* Delete a timer, if it's still pending */
+int timer_clear(struct timer **h) {
+  struct timer *t;
 
-      debug("Timer %s will not be triggered (%d on the clock)", 
-            t->id, (t->time ? t->time - time(NULL) : 0));
-      _timer_free(t);
-      return 0;
-    } else {
-      l = t;
-      t = t->next;
-    }
-  }
+  t = *h;
+  if (!t)
+    return -1;
 
-  return -1;
+  debug("Timer %s will not be triggered (%ld ms on the clock)",
+        t->name, timer_left(t));
+  _timer_unlink(t);
+  _timer_free(t);
+  return 0;
 }
 
 /* Delete all timers with a certain ircproxy class */
 int timer_delall(void *b) {
-  struct timer *t, *l;
+  struct timerowner *o;
   int numdone;
 
-  l = 0;
-  t = timers;
+  o = _timer_owner(b, 0);
   numdone = 0;
 
-  while (t) {
-    if (t->boundto == b) {
-      struct timer *n;
-
-      n = t->next;
-      debug("Timer %s will not be triggered (%d on the clock)", 
-            t->id, (t->time ? t->time - time(NULL) : 0));
-      _timer_free(t);
-
-      if (l) {
-        t = l->next = n;
-      } else {
-        t = timers = n;
-      }
-
-      numdone++;
-    } else {
-      l = t;
-      t = t->next;
-    }
+  /* The owner goes away with its last timer */
+  while (o) {
+    struct timer *t;
+
+    t = o->timers;
+    if (!t->next)
+      o = 0;
+
+    debug("Timer %s will not be triggered (%ld ms on the clock)",
+          t->name, timer_left(t));
+    _timer_unlink(t);
+    _timer_free(t);
+    numdone++;
   }
 
   return numdone;
@@ -150,66 +185,266 @@ int timer_delall(void *b) {
 
 /* Poll the timers */
 int timer_poll(void) {
-  struct timer *t, *l;
-  time_t ctime;
-
-  l = 0;
-  t = timers;
-  ctime = time(NULL);
-
-  while (t) {
-
-    if (t->time <= ctime) {
-      void (*function)(void *, void *);
-      struct timer *n;
-      void *b, *data;
-
-      function = t->function;
-      b = t->boundto;
-      data = t->data;
-      n = t->next;
-      debug("Timer %s triggered", t->id);
-      _timer_free(t);
-
-      if (l) {
-        t = l->next = n;
-      } else {
-        t = timers = n;
-      }
-
-      if (function)
-        function(b, data);
-    } else {
-      l = t;
-      t = t->next;
+  unsigned long long ctime;
+  unsigned long limit;
+
+  ctime = timer_now();
+  limit = nextseq;
+
+  /* Timers added or reset by the functions we call wait until the next
+     poll, even if they're already due */
+  while (heapsize && (heap[0]->time <= ctime) && (heap[0]->seq < limit)) {
+    void (*function)(void *, void *);
+    struct timer *t;
+    void *b, *data;
+
+    t = heap[0];
+    function = t->function;
+    b = t->boundto;
+    data = t->data;
+    debug("Timer %s triggered", t->name);
+    _timer_unlink(t);
+    _timer_free(t);
+
+    if (function)
+      function(b, data);
+  }
+
+  return (heapsize ? 1 : 0);
+}
+
+/* How many milliseconds until the next timer is due, or -1 if there are
+   none */
+long timer_next(void) {
+  unsigned long long ctime;
+
+  if (!heapsize)
+    return -1;
+
+  ctime = timer_now();
+  if (heap[0]->time <= ctime)
+    return 0;
+  if (heap[0]->time - ctime > (unsigned long long)LONG_MAX)
+    return LONG_MAX;
+  return (long)(heap[0]->time - ctime);
+}
+
+/* Milliseconds on a clock that never goes backwards or jumps, so timers
+   aren't all triggered at once or held up when the time of day changes */
+unsigned long long timer_now(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+    return ((unsigned long long)ts.tv_sec * 1000ULL
+            + (unsigned long long)(ts.tv_nsec / 1000000L));
+#endif /* HAVE_CLOCK_GETTIME && CLOCK_MONOTONIC */
+#ifdef HAVE_GETTIMEOFDAY
+  {
+    struct timeval tv;
+
+    if (!gettimeofday(&tv, 0))
+      return ((unsigned long long)tv.tv_sec * 1000ULL
+              + (unsigned long long)(tv.tv_usec / 1000L));
+  }
+#endif /* HAVE_GETTIMEOFDAY */
+
+  return (unsigned long long)time(NULL) * 1000ULL;
+}
+
+/* How many milliseconds are left before a timer is due */
+long timer_left(const struct timer *t) {
+  unsigned long long ctime;
+
+  ctime = timer_now();
+  return (t->time > ctime ? (long)(t->time - ctime) : 0);
+}
+
+/* Find the record of timers bound to something, creating it if asked */
+static struct timerowner *_timer_owner(void *b, int create) {
+  struct timerowner *o;
+
+  if (ownerbuckets) {
+    o = owners[TIMER_OWNERHASH(b)];
+    while (o) {
+      if (o->boundto == b)
+        return o;
+      o = o->next;
     }
   }
 
-  return (timers ? 1 : 0);
+  if (!create)
+    return 0;
+
+  if (numowners >= ownerbuckets)
+    _timer_ownergrow();
+
+  o = (struct timerowner *)malloc(sizeof(struct timerowner));
+  o->boundto = b;
+  o->timers = 0;
+  o->next = owners[TIMER_OWNERHASH(b)];
+  owners[TIMER_OWNERHASH(b)] = o;
+  numowners++;
+
+  return o;
+}
+
+/* Double the size of the hash table of things timers are bound to */
+static void _timer_ownergrow(void) {
+  struct timerowner **old;
+  size_t oldbuckets, i;
+
+  old = owners;
+  oldbuckets = ownerbuckets;
+
+  ownerbuckets = (ownerbuckets ? ownerbuckets * 2 : 64);
+  owners = (struct timerowner **)malloc(sizeof(struct timerowner *)
+                                        * ownerbuckets);
+  memset(owners, 0, sizeof(struct timerowner *) * ownerbuckets);
+
+  for (i = 0; i < oldbuckets; i++) {
+    struct timerowner *o;
+
+    o = old[i];
+    while (o) {
+      struct timerowner *n;
+
+      n = o->next;
+      o->next = owners[TIMER_OWNERHASH(o->boundto)];
+      owners[TIMER_OWNERHASH(o->boundto)] = o;
+      o = n;
+    }
+  }
+
+  free(old);
+}
+
+/* Forget about something that no longer has any timers */
+static void _timer_ownerfree(struct timerowner *o) {
+  struct timerowner **l;
+
+  l = &(owners[TIMER_OWNERHASH(o->boundto)]);
+  while (*l != o)
+    l = &((*l)->next);
+  *l = o->next;
+
+  numowners--;
+  free(o);
+}
+
+/* Whether one timer is due before another, those due at the same time go
+   in the order they were added */
+static int _timer_before(const struct timer *a, const struct timer *b) {
+  if (a->time != b->time)
+    return (a->time < b->time);
+  return (a->seq < b->seq);
+}
+
+/* Put a timer at a position in the heap */
+static void _timer_heapset(size_t i, struct timer *t) {
+  heap[i] = t;
+  t->heap = i;
+}
+
+/* Move a timer up the heap until it's not due before its parent */
+static void _timer_heapup(size_t i) {
+  struct timer *t;
+
+  t = heap[i];
+  while (i) {
+    size_t parent;
+
+    parent = (i - 1) / 2;
+    if (!_timer_before(t, heap[parent]))
+      break;
+
+    _timer_heapset(i, heap[parent]);
+    i = parent;
+  }
+  _timer_heapset(i, t);
+}
+
+/* Move a timer down the heap until neither child is due before it */
+static void _timer_heapdown(size_t i) {
+  struct timer *t;
+
+  t = heap[i];
+  for (;;) {
+    size_t child;
+
+    child = i * 2 + 1;
+    if (child >= heapsize)
+      break;
+    if ((child + 1 < heapsize) && _timer_before(heap[child + 1], heap[child]))
+      child++;
+    if (!_timer_before(heap[child], t))
+      break;
+
+    _timer_heapset(i, heap[child]);
+    i = child;
+  }
+  _timer_heapset(i, t);
+}
+
+/* Move a timer that's been changed to where it now belongs in the heap */
+static void _timer_heapfix(size_t i) {
+  if (i && _timer_before(heap[i], heap[(i - 1) / 2])) {
+    _timer_heapup(i);
+  } else {
+    _timer_heapdown(i);
+  }
+}
+
+/* Take a timer out of the heap and its owner's list, and clear its handle */
+static void _timer_unlink(struct timer *t) {
+  struct timer *last;
+  size_t i;
+
+  i = t->heap;
+  last = heap[--heapsize];
+  if (last != t) {
+    _timer_heapset(i, last);
+    _timer_heapfix(i);
+  }
+
+  if (t->prev) {
+    t->prev->next = t->next;
+  } else {
+    t->owner->timers = t->next;
+  }
+  if (t->next)
+    t->next->prev = t->prev;
+
+  if (!t->owner->timers)
+    _timer_ownerfree(t->owner);
+
+  if (t->handle)
+    *(t->handle) = 0;
 }
 
 /* Free a timer */
 static int _timer_free(struct timer *t) {
-  free(t->id);
   free(t);
   return 0;
 }
 
 /* Get rid of all the proxies */
 void timer_flush(void) {
-  struct timer *t;
+  while (heapsize) {
+    struct timer *t;
 
-  t = timers;
-
-  while (t) {
-    struct timer *n;
-
-    n = t->next;
-    debug("Timer %s never triggered (%d on the clock)", 
-          t->id, (t->time ? t->time - time(NULL) : 0));
+    t = heap[heapsize - 1];
+    debug("Timer %s never triggered (%ld ms on the clock)",
+          t->name, timer_left(t));
+    _timer_unlink(t);
     _timer_free(t);
-    t = n;
   }
 
-  timers = 0;
+  free(heap);
+  heap = 0;
+  heapalloc = 0;
+
+  free(owners);
+  owners = 0;
+  ownerbuckets = 0;
 }
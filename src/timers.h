@@ -19,16 +19,25 @@
 #ifndef __DIRCPROXY_TIMERS_H
 #define __DIRCPROXY_TIMERS_H
 
-/* handy defines */
+/* a pending timer, whoever started it holds on to it and it's set back to
+   0 when the timer is triggered or deleted */
+struct timer;
+
+/* handy defines, timer intervals are in milliseconds */
 #define TIMER_FUNCTION(_FUNC) ((void (*)(void *, void *)) _FUNC)
+#define TIMER_SECONDS(_SECS) ((unsigned long)(_SECS) * 1000UL)
 
 /* functions */
-extern int timer_exists(void *, const char *);
-extern char *timer_new(void *, const char *, unsigned long,
+extern int timer_set(struct timer **, void *, const char *, unsigned long,
+                     void (*)(void *, void *), void *);
+extern int timer_reset(struct timer **, void *, const char *, unsigned long,
                        void (*)(void *, void *), void *);
-extern int timer_del(void *, char *);
+extern int timer_clear(struct timer **);
 extern int timer_delall(void *);
 extern int timer_poll(void);
+extern long timer_next(void);
+extern long timer_left(const struct timer *);
+extern unsigned long long timer_now(void);
 extern void timer_flush(void);
 
 #endif /* __DIRCPROXY_TIMERS_H */